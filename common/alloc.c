@@ -187,9 +187,8 @@ int sysnum_UserConnectToServer = -1;
 /* XXX: we used to have stats on #wraps and #flushes but no longer
  * since that's inside drwrap
  */
-uint num_mallocs;
 uint num_large_mallocs;
-uint num_frees;
+/* -replace_malloc arena lock acquisitions, and those skipped via thread caches */
 #endif
 
 /* points at the per-malloc API to use */
@@ -2386,13 +2385,39 @@ event_post_call_entry_added(app_pc postcall)
  * benchmarks (and there aren't substantially more lookups than
  * insertions and deletions), so sticking with a hashtable!
  */
+/* The table is split by address into stripes, each a hashtable with its
+ * own lock that resizes independently, so threads operating on different
+ * mallocs neither contend nor wait for each other's resizes.  Operations on
+ * one malloc lock only its stripe, while malloc_lock() and malloc_iterate()
+ * lock every stripe in order for a consistent view of the whole table, as a
+ * leak scan needs.  Code holding one stripe must not operate on a malloc in
+ * another stripe, but can take the whole table: e.g., reporting an invalid
+ * free, which looks up the neighboring mallocs, does so.
+ * alloc_ops.malloc_table_stripes of 0 or 1 gives a single stripe, for
+ * clients whose callbacks rely on being serialized.
+ */
 #define ALLOC_TABLE_HASH_BITS 12
-static hashtable_t malloc_table;
+#define MALLOC_STRIPE_BITS_MAX 6
+/* Mallocs are aligned to 8 but many are larger and we get fewer collisions
+ * w/ this shift
+ */
+#define MALLOC_HASH_SHIFT 5
+typedef struct _malloc_stripe_t {
+    hashtable_t table;
+    /* for self-recursion: see malloc_lock_owner */
+    thread_id_t owner;
+} malloc_stripe_t;
+static malloc_stripe_t malloc_stripes[1 << MALLOC_STRIPE_BITS_MAX];
+static uint malloc_stripe_bits;
+#define MALLOC_NUM_STRIPES (1U << malloc_stripe_bits)
 /* we could switch to a full-fledged known-owner lock, or a recursive lock.
  * xref i#129.
  */
 #define THREAD_ID_INVALID ((thread_id_t)0) /* invalid thread id on Linux+Windows */
+/* owner of the whole table, via malloc_lock() */
 static thread_id_t malloc_lock_owner = THREAD_ID_INVALID;
+/* stripes the owner held on its own before taking the whole table */
+static uint64 malloc_lock_resume_stripes;
 
 /* PR 525807: to handle malloc-based stacks we need an interval tree
  * for large mallocs.  Putting all mallocs in a tree instead of a table
@@ -2462,8 +2487,17 @@ malloc_hash(void *v)
 {
     uint hash = (uint)(ptr_uint_t) v;
     ASSERT(MALLOC_CHUNK_ALIGNMENT == 8, "update hash func please");
-    /* Many mallocs are larger than 8 and we get fewer collisions w/ >> 5 */
-    return (hash >> 5);
+    /* Many mallocs are larger than 8 and we get fewer collisions w/ >> 5.
+     * The bits above those select the stripe, so we drop them too.
+     */
+    return (hash >> (MALLOC_HASH_SHIFT + malloc_stripe_bits));
+}
+
+static inline malloc_stripe_t *
+malloc_stripe(app_pc start)
+{
+    return &malloc_stripes[((ptr_uint_t)start >> MALLOC_HASH_SHIFT) &
+                           (MALLOC_NUM_STRIPES - 1)];
 }
 
 /* If track_allocs is false, only callbacks and callback returns are tracked.
@@ -2522,16 +2556,25 @@ alloc_init(alloc_options_t *ops, size_t ops_size)
 
     if (alloc_ops.track_allocs) {
         hashtable_config_t hashconfig;
-        hashtable_init_ex(&malloc_table, ALLOC_TABLE_HASH_BITS, HASH_INTPTR,
-                          false/*!str_dup*/, false/*!synch*/, malloc_entry_free,
-                          malloc_hash, NULL);
+        uint i;
+        malloc_stripe_bits = 0;
+        while (malloc_stripe_bits < MALLOC_STRIPE_BITS_MAX &&
+               (1U << (malloc_stripe_bits + 1)) <= alloc_ops.malloc_table_stripes)
+            malloc_stripe_bits++;
         /* hash lookup can be a bottleneck so it's worth taking some extra space
          * to reduce the collision chains
          */
         hashconfig.size = sizeof(hashconfig);
         hashconfig.resizable = true;
         hashconfig.resize_threshold = 50; /* default is 75 */
-        hashtable_configure(&malloc_table, &hashconfig);
+        for (i = 0; i < MALLOC_NUM_STRIPES; i++) {
+            hashtable_init_ex(&malloc_stripes[i].table,
+                              ALLOC_TABLE_HASH_BITS - malloc_stripe_bits, HASH_INTPTR,
+                              false/*!str_dup*/, false/*!synch*/, malloc_entry_free,
+                              malloc_hash, NULL);
+            hashtable_configure(&malloc_stripes[i].table, &hashconfig);
+            malloc_stripes[i].owner = THREAD_ID_INVALID;
+        }
 
         large_malloc_tree = rb_tree_create(NULL);
         large_malloc_lock = dr_mutex_create();
@@ -2563,7 +2606,7 @@ alloc_exit(void)
      * FIXME: provide a hashtable iterator instead of breaking abstraction
      * barrier here.
      */
-    uint i;
+    uint i, j, entries = 0;
     if (!alloc_ops.track_allocs)
         return;
 
@@ -2573,24 +2616,31 @@ alloc_exit(void)
     hashtable_delete_with_stats(&alloc_routine_table, "alloc routine table");
     dr_mutex_destroy(alloc_routine_lock);
 
-    LOG(1, "final malloc table size: %u bits, %u entries\n",
-        malloc_table.table_bits, malloc_table.entries);
-    /* we can't hold malloc_table.lock b/c report_leak() acquires it
+    /* we can't hold the stripe locks b/c report_leak() acquires them
      * for malloc_get_caller()
      */
-    for (i = 0; i < HASHTABLE_SIZE(malloc_table.table_bits); i++) {
-        hash_entry_t *he;
-        for (he = malloc_table.table[i]; he != NULL; he = he->next) {
-            malloc_entry_t *e = (malloc_entry_t *) he->payload;
-            if (TEST(MALLOC_VALID, e->flags) && !malloc_entry_is_native(e)) {
-                client_exit_iter_chunk(e->start, e->end, TEST(MALLOC_PRE_US, e->flags),
-                                       e->flags, e->data);
+    for (j = 0; j < MALLOC_NUM_STRIPES; j++) {
+        hashtable_t *table = &malloc_stripes[j].table;
+        LOG(1, "final malloc table stripe %u size: %u bits, %u entries\n",
+            j, table->table_bits, table->entries);
+        entries += table->entries;
+        for (i = 0; i < HASHTABLE_SIZE(table->table_bits); i++) {
+            hash_entry_t *he;
+            for (he = table->table[i]; he != NULL; he = he->next) {
+                malloc_entry_t *e = (malloc_entry_t *) he->payload;
+                if (TEST(MALLOC_VALID, e->flags) && !malloc_entry_is_native(e)) {
+                    client_exit_iter_chunk(e->start, e->end,
+                                           TEST(MALLOC_PRE_US, e->flags),
+                                           e->flags, e->data);
+                }
             }
         }
     }
+    LOG(1, "final malloc table: %u stripes, %u entries\n", MALLOC_NUM_STRIPES, entries);
 
     if (alloc_ops.track_allocs) {
-        hashtable_delete(&malloc_table);
+        for (j = 0; j < MALLOC_NUM_STRIPES; j++)
+            hashtable_delete(&malloc_stripes[j].table);
         rb_tree_destroy(large_malloc_tree);
         dr_mutex_destroy(large_malloc_lock);
 #ifdef USE_DRSYMS
@@ -3202,32 +3252,64 @@ malloc_iterate(malloc_iter_cb_t cb, void *iter_data)
  * own or from within malloc_iterate(), so we need self-recursion support
  * of one level.  We do not need general recursion support.
  */
-static bool
-malloc_lock_held_by_self(void)
+static thread_id_t
+malloc_lock_self(void)
 {
-    /* reading this variable should be atomic */
     void *drcontext = dr_get_current_drcontext();
     if (drcontext == NULL) {
         ASSERT(false, "should always have dcontext w/ PR 536058");
-        return false;
+        return THREAD_ID_INVALID;
     }
-    return (dr_get_thread_id(drcontext) == malloc_lock_owner);
+    return dr_get_thread_id(drcontext);
+}
+
+static bool
+malloc_lock_held_by_self(void)
+{
+    /* reading this variable should be atomic */
+    thread_id_t self = malloc_lock_self();
+    return (self != THREAD_ID_INVALID && self == malloc_lock_owner);
 }
 
 static void
 malloc_lock_internal(void)
 {
-    void *drcontext = dr_get_current_drcontext();
-    hashtable_lock(&malloc_table);
-    if (drcontext != NULL) /* paranoid even w/ PR 536058 */
-        malloc_lock_owner = dr_get_thread_id(drcontext);
+    thread_id_t self = malloc_lock_self();
+    uint64 resume = 0;
+    uint i;
+    /* A thread that holds a stripe, such as one reporting an error in the
+     * middle of a free, drops it so that all stripes are acquired in order,
+     * which avoids deadlock with another thread taking the whole table.
+     * The stripe is not held across the gap, so the caller's view of its
+     * malloc can change here, just as for a racing free.
+     */
+    for (i = 0; self != THREAD_ID_INVALID && i < MALLOC_NUM_STRIPES; i++) {
+        if (malloc_stripes[i].owner == self) {
+            resume |= (1ULL << i);
+            malloc_stripes[i].owner = THREAD_ID_INVALID;
+            hashtable_unlock(&malloc_stripes[i].table);
+        }
+    }
+    for (i = 0; i < MALLOC_NUM_STRIPES; i++)
+        hashtable_lock(&malloc_stripes[i].table);
+    malloc_lock_owner = self;
+    malloc_lock_resume_stripes = resume;
 }
 
 static void
 malloc_unlock_internal(void)
 {
+    uint64 resume = malloc_lock_resume_stripes;
+    thread_id_t self = malloc_lock_owner;
+    uint i;
+    malloc_lock_resume_stripes = 0;
     malloc_lock_owner = THREAD_ID_INVALID;
-    hashtable_unlock(&malloc_table);
+    for (i = 0; i < MALLOC_NUM_STRIPES; i++) {
+        if (TEST(1ULL << i, resume))
+            malloc_stripes[i].owner = self;
+        else
+            hashtable_unlock(&malloc_stripes[i].table);
+    }
 }
 
 static bool
@@ -3246,6 +3328,30 @@ malloc_unlock_if_locked_by_me(bool by_me)
         malloc_unlock_internal();
 }
 
+/* Locks just one stripe, unless this thread already holds it or the whole
+ * table.  Returns whether the caller must unlock it.
+ */
+static bool
+malloc_stripe_lock_if_not_held_by_me(malloc_stripe_t *stripe)
+{
+    thread_id_t self = malloc_lock_self();
+    if (self != THREAD_ID_INVALID &&
+        (self == malloc_lock_owner || self == stripe->owner))
+        return false;
+    hashtable_lock(&stripe->table);
+    stripe->owner = self;
+    return true;
+}
+
+static void
+malloc_stripe_unlock_if_locked_by_me(malloc_stripe_t *stripe, bool by_me)
+{
+    if (by_me) {
+        stripe->owner = THREAD_ID_INVALID;
+        hashtable_unlock(&stripe->table);
+    }
+}
+
 static void
 malloc_wrap__lock(void)
 {
@@ -3272,6 +3378,7 @@ malloc_add_common(app_pc start, app_pc end, app_pc real_end,
 {
     malloc_entry_t *e = (malloc_entry_t *) global_alloc(sizeof(*e), HEAPSTAT_HASHTABLE);
     malloc_entry_t *old_e;
+    malloc_stripe_t *stripe = malloc_stripe(start);
     bool locked_by_me;
     ASSERT((alloc_ops.redzone_size > 0 && TEST(MALLOC_PRE_US, flags)) ||
            alloc_ops.record_allocs, 
@@ -3289,7 +3396,7 @@ malloc_add_common(app_pc start, app_pc end, app_pc real_end,
     LOG(3, "%s: type=%x\n", __FUNCTION__, alloc_type);
     e->flags |= (client_flags & MALLOC_POSSIBLE_CLIENT_FLAGS);
     /* grab lock around client call and hashtable operations */
-    locked_by_me = malloc_lock_if_not_held_by_me();
+    locked_by_me = malloc_stripe_lock_if_not_held_by_me(stripe);
 
     if (!malloc_entry_is_native(e)) { /* don't show internal allocs to client */
         e->data = client_add_malloc_pre(e->start, e->end, e->end + e->usable_extra,
@@ -3302,7 +3409,7 @@ malloc_add_common(app_pc start, app_pc end, app_pc real_end,
      * when the free succeeds, so a race can hit a conflict.
      * Update: we no longer do this but leaving code for now
      */
-    old_e = hashtable_add_replace(&malloc_table, (void *) start, (void *)e);
+    old_e = hashtable_add_replace(&stripe->table, (void *) start, (void *)e);
 
     if (!malloc_entry_is_native(e) && end - start >= LARGE_MALLOC_MIN_SIZE) {
         malloc_large_add(e->start, e->end - e->start);
@@ -3314,15 +3421,20 @@ malloc_add_common(app_pc start, app_pc end, app_pc real_end,
     }
 
 #ifdef STATISTICS
-    if (!malloc_entry_is_native(e))
-        STATS_INC(num_mallocs);
-    if (num_mallocs % 10000 == 0) {
-        hashtable_cluster_stats(&malloc_table, "malloc table");
-        LOG(1, "malloc table stats after %u malloc calls\n", num_mallocs);
+    if (!malloc_entry_is_native(e)) {
+        uint64 local_mallocs;
+        STATS_SHARD_INC(num_mallocs);
+        /* 0 for a thread with no shard, whose count goes to the global slot */
+        local_mallocs = STATS_SHARD_LOCAL(num_mallocs);
+        if (local_mallocs > 0 && local_mallocs % 10000 == 0) {
+            hashtable_cluster_stats(&stripe->table, "malloc table stripe");
+            LOG(1, "malloc table stats after "UINT64_FORMAT_STRING" malloc calls"
+                " on this thread\n", local_mallocs);
+        }
     }
 #endif
 
-    malloc_unlock_if_locked_by_me(locked_by_me);
+    malloc_stripe_unlock_if_locked_by_me(stripe, locked_by_me);
     if (old_e != NULL) {
         ASSERT(!TEST(MALLOC_VALID, old_e->flags), "internal error in malloc tracking");
         malloc_entry_free(old_e);
@@ -3342,11 +3454,11 @@ malloc_wrap__add(app_pc start, app_pc end, app_pc real_end,
                       client_flags, mc, post_call, 0);
 }
 
-/* up to caller to lock and unlock */
+/* up to caller to lock and unlock start's stripe */
 static malloc_entry_t *
 malloc_lookup(app_pc start)
 {
-    return hashtable_lookup(&malloc_table, (void *) start);
+    return hashtable_lookup(&malloc_stripe(start)->table, (void *) start);
 }
 
 /* Note that this also frees the entry.  Caller should be holding lock. */
@@ -3366,10 +3478,10 @@ malloc_entry_remove(malloc_entry_t *e)
             malloc_large_remove(e->start);
         }
     }
-    if (hashtable_remove(&malloc_table, e->start)) {
+    if (hashtable_remove(&malloc_stripe(e->start)->table, e->start)) {
 #ifdef STATISTICS
         if (!native)
-            STATS_INC(num_frees);
+            STATS_SHARD_INC(num_frees);
 #endif
     }
     if (!native) {
@@ -3383,11 +3495,12 @@ static void
 malloc_remove(app_pc start)
 {
     malloc_entry_t *e;
-    bool locked_by_me = malloc_lock_if_not_held_by_me();
+    malloc_stripe_t *stripe = malloc_stripe(start);
+    bool locked_by_me = malloc_stripe_lock_if_not_held_by_me(stripe);
     e = malloc_lookup(start);
     if (e != NULL)
         malloc_entry_remove(e);
-    malloc_unlock_if_locked_by_me(locked_by_me);
+    malloc_stripe_unlock_if_locked_by_me(stripe, locked_by_me);
 }
 #endif
 
@@ -3450,11 +3563,12 @@ static void
 malloc_set_valid(app_pc start, bool valid)
 {
     malloc_entry_t *e;
-    bool locked_by_me = malloc_lock_if_not_held_by_me();
-    e = (malloc_entry_t *) hashtable_lookup(&malloc_table, (void *) start);
+    malloc_stripe_t *stripe = malloc_stripe(start);
+    bool locked_by_me = malloc_stripe_lock_if_not_held_by_me(stripe);
+    e = malloc_lookup(start);
     if (e != NULL)
         malloc_entry_set_valid(e, valid);
-    malloc_unlock_if_locked_by_me(locked_by_me);
+    malloc_stripe_unlock_if_locked_by_me(stripe, locked_by_me);
 }
 
 static bool
@@ -3496,12 +3610,13 @@ static uint
 malloc_alloc_type(byte *start)
 {
     malloc_entry_t *e;
-    bool locked_by_me = malloc_lock_if_not_held_by_me();
+    malloc_stripe_t *stripe = malloc_stripe(start);
+    bool locked_by_me = malloc_stripe_lock_if_not_held_by_me(stripe);
     uint res = 0;
-    e = (malloc_entry_t *) hashtable_lookup(&malloc_table, (void *) start);
+    e = malloc_lookup(start);
     if (e != NULL)
         res = malloc_alloc_entry_type(e);
-    malloc_unlock_if_locked_by_me(locked_by_me);
+    malloc_stripe_unlock_if_locked_by_me(stripe, locked_by_me);
     return res;
 }
 
@@ -3510,11 +3625,12 @@ malloc_wrap__is_pre_us_ex(app_pc start, bool ok_if_invalid)
 {
     bool res = false;
     malloc_entry_t *e;
-    bool locked_by_me = malloc_lock_if_not_held_by_me();
-    e = (malloc_entry_t *) hashtable_lookup(&malloc_table, (void *) start);
+    malloc_stripe_t *stripe = malloc_stripe(start);
+    bool locked_by_me = malloc_stripe_lock_if_not_held_by_me(stripe);
+    e = malloc_lookup(start);
     if (e != NULL)
         res = malloc_entry_is_pre_us(e, ok_if_invalid);
-    malloc_unlock_if_locked_by_me(locked_by_me);
+    malloc_stripe_unlock_if_locked_by_me(stripe, locked_by_me);
     return res;
 }
 
@@ -3528,11 +3644,12 @@ static void
 malloc_set_pre_us(app_pc start)
 {
     malloc_entry_t *e;
-    bool locked_by_me = malloc_lock_if_not_held_by_me();
-    e = (malloc_entry_t *) hashtable_lookup(&malloc_table, (void *) start);
+    malloc_stripe_t *stripe = malloc_stripe(start);
+    bool locked_by_me = malloc_stripe_lock_if_not_held_by_me(stripe);
+    e = malloc_lookup(start);
     if (e != NULL)
         e->flags |= MALLOC_PRE_US;
-    malloc_unlock_if_locked_by_me(locked_by_me);
+    malloc_stripe_unlock_if_locked_by_me(stripe, locked_by_me);
 }
 
 /* Returns true if the malloc is ignored by us */
@@ -3560,10 +3677,11 @@ malloc_is_native(app_pc start, cls_alloc_t *pt, bool consider_being_freed)
 #ifdef WINDOWS
     bool res = false;
     malloc_entry_t *e;
-    bool locked_by_me = malloc_lock_if_not_held_by_me();
-    e = (malloc_entry_t *) hashtable_lookup(&malloc_table, (void *) start);
+    malloc_stripe_t *stripe = malloc_stripe(start);
+    bool locked_by_me = malloc_stripe_lock_if_not_held_by_me(stripe);
+    e = malloc_lookup(start);
     res = malloc_entry_is_native_ex(e, start, pt, consider_being_freed);
-    malloc_unlock_if_locked_by_me(locked_by_me);
+    malloc_stripe_unlock_if_locked_by_me(stripe, locked_by_me);
     return res;
 #else
     /* optimization: currently nothing in the table */
@@ -3578,7 +3696,7 @@ malloc_is_native(app_pc start, cls_alloc_t *pt, bool consider_being_freed)
 static bool
 malloc_entry_exists_racy_nolock(app_pc start)
 {
-    malloc_entry_t *e = (malloc_entry_t *) hashtable_lookup(&malloc_table, (void *) start);
+    malloc_entry_t *e = malloc_lookup(start);
     return (e != NULL && TEST(MALLOC_VALID, e->flags));
 }
 #endif
@@ -3588,11 +3706,12 @@ malloc_wrap__end(app_pc start)
 {
     app_pc end = NULL;
     malloc_entry_t *e;
-    bool locked_by_me = malloc_lock_if_not_held_by_me();
-    e = (malloc_entry_t *) hashtable_lookup(&malloc_table, (void *) start);
+    malloc_stripe_t *stripe = malloc_stripe(start);
+    bool locked_by_me = malloc_stripe_lock_if_not_held_by_me(stripe);
+    e = malloc_lookup(start);
     if (e != NULL && TEST(MALLOC_VALID, e->flags))
         end = e->end;
-    malloc_unlock_if_locked_by_me(locked_by_me);
+    malloc_stripe_unlock_if_locked_by_me(stripe, locked_by_me);
     return end;
 }
 
@@ -3602,11 +3721,12 @@ malloc_wrap__size(app_pc start)
 {
     ssize_t sz = -1;
     malloc_entry_t *e;
-    bool locked_by_me = malloc_lock_if_not_held_by_me();
-    e = (malloc_entry_t *) hashtable_lookup(&malloc_table, (void *) start);
+    malloc_stripe_t *stripe = malloc_stripe(start);
+    bool locked_by_me = malloc_stripe_lock_if_not_held_by_me(stripe);
+    e = malloc_lookup(start);
     if (e != NULL && TEST(MALLOC_VALID, e->flags))
         sz = (e->end - start);
-    malloc_unlock_if_locked_by_me(locked_by_me);
+    malloc_stripe_unlock_if_locked_by_me(stripe, locked_by_me);
     return sz;
 }
 
@@ -3616,11 +3736,12 @@ malloc_wrap__size_invalid_only(app_pc start)
 {
     ssize_t sz = -1;
     malloc_entry_t *e;
-    bool locked_by_me = malloc_lock_if_not_held_by_me();
-    e = (malloc_entry_t *) hashtable_lookup(&malloc_table, (void *) start);
+    malloc_stripe_t *stripe = malloc_stripe(start);
+    bool locked_by_me = malloc_stripe_lock_if_not_held_by_me(stripe);
+    e = malloc_lookup(start);
     if (e != NULL && !TEST(MALLOC_VALID, e->flags))
         sz = (e->end - start);
-    malloc_unlock_if_locked_by_me(locked_by_me);
+    malloc_stripe_unlock_if_locked_by_me(stripe, locked_by_me);
     return sz;
 }
 
@@ -3629,11 +3750,12 @@ malloc_wrap__get_client_data(app_pc start)
 {
     void *res = NULL;
     malloc_entry_t *e;
-    bool locked_by_me = malloc_lock_if_not_held_by_me();
-    e = (malloc_entry_t *) hashtable_lookup(&malloc_table, (void *) start);
+    malloc_stripe_t *stripe = malloc_stripe(start);
+    bool locked_by_me = malloc_stripe_lock_if_not_held_by_me(stripe);
+    e = malloc_lookup(start);
     if (e != NULL)
         res = e->data;
-    malloc_unlock_if_locked_by_me(locked_by_me);
+    malloc_stripe_unlock_if_locked_by_me(stripe, locked_by_me);
     return res;
 }
 
@@ -3642,11 +3764,12 @@ malloc_wrap__get_client_flags(app_pc start)
 {
     uint res = 0;
     malloc_entry_t *e;
-    bool locked_by_me = malloc_lock_if_not_held_by_me();
-    e = (malloc_entry_t *) hashtable_lookup(&malloc_table, (void *) start);
+    malloc_stripe_t *stripe = malloc_stripe(start);
+    bool locked_by_me = malloc_stripe_lock_if_not_held_by_me(stripe);
+    e = malloc_lookup(start);
     if (e != NULL)
         res = (e->flags & MALLOC_POSSIBLE_CLIENT_FLAGS);
-    malloc_unlock_if_locked_by_me(locked_by_me);
+    malloc_stripe_unlock_if_locked_by_me(stripe, locked_by_me);
     return res;
 }
 
@@ -3655,13 +3778,14 @@ malloc_wrap__set_client_flag(app_pc start, uint client_flag)
 {
     malloc_entry_t *e;
     bool found = false;
-    bool locked_by_me = malloc_lock_if_not_held_by_me();
-    e = (malloc_entry_t *) hashtable_lookup(&malloc_table, (void *) start);
+    malloc_stripe_t *stripe = malloc_stripe(start);
+    bool locked_by_me = malloc_stripe_lock_if_not_held_by_me(stripe);
+    e = malloc_lookup(start);
     if (e != NULL) {
         e->flags |= (client_flag & MALLOC_POSSIBLE_CLIENT_FLAGS);
         found = true;
     }
-    malloc_unlock_if_locked_by_me(locked_by_me);
+    malloc_stripe_unlock_if_locked_by_me(stripe, locked_by_me);
     return found;
 }
 
@@ -3670,38 +3794,42 @@ malloc_wrap__clear_client_flag(app_pc start, uint client_flag)
 {
     malloc_entry_t *e;
     bool found = false;
-    bool locked_by_me = malloc_lock_if_not_held_by_me();
-    e = (malloc_entry_t *) hashtable_lookup(&malloc_table, (void *) start);
+    malloc_stripe_t *stripe = malloc_stripe(start);
+    bool locked_by_me = malloc_stripe_lock_if_not_held_by_me(stripe);
+    e = malloc_lookup(start);
     if (e != NULL) {
         e->flags &= ~(client_flag & MALLOC_POSSIBLE_CLIENT_FLAGS);
         found = true;
     }
-    malloc_unlock_if_locked_by_me(locked_by_me);
+    malloc_stripe_unlock_if_locked_by_me(stripe, locked_by_me);
     return found;
 }
 
 static void
 malloc_iterate_internal(bool include_native, malloc_iter_cb_t cb, void *iter_data)
 {
-    uint i;
+    uint i, j;
     /* we do support being called while malloc lock is held but caller should
      * be careful that table is in a consistent state (staleness does this)
      */
     bool locked_by_me = malloc_lock_if_not_held_by_me();
-    for (i = 0; i < HASHTABLE_SIZE(malloc_table.table_bits); i++) {
-        hash_entry_t *he, *nxt;
-        for (he = malloc_table.table[i]; he != NULL; he = nxt) {
-            malloc_entry_t *e = (malloc_entry_t *) he->payload;
-            /* support malloc_remove() while iterating */
-            nxt = he->next;
-            if (TEST(MALLOC_VALID, e->flags) &&
-                (include_native || !malloc_entry_is_native(e))) {
-                if (!cb(e->start, e->end, e->end + e->usable_extra,
-                        TEST(MALLOC_PRE_US, e->flags),
-                        include_native ? e->flags :
-                        (e->flags & MALLOC_POSSIBLE_CLIENT_FLAGS),
-                        e->data, iter_data)) {
-                    goto malloc_iterate_done;
+    for (j = 0; j < MALLOC_NUM_STRIPES; j++) {
+        hashtable_t *table = &malloc_stripes[j].table;
+        for (i = 0; i < HASHTABLE_SIZE(table->table_bits); i++) {
+            hash_entry_t *he, *nxt;
+            for (he = table->table[i]; he != NULL; he = nxt) {
+                malloc_entry_t *e = (malloc_entry_t *) he->payload;
+                /* support malloc_remove() while iterating */
+                nxt = he->next;
+                if (TEST(MALLOC_VALID, e->flags) &&
+                    (include_native || !malloc_entry_is_native(e))) {
+                    if (!cb(e->start, e->end, e->end + e->usable_extra,
+                            TEST(MALLOC_PRE_US, e->flags),
+                            include_native ? e->flags :
+                            (e->flags & MALLOC_POSSIBLE_CLIENT_FLAGS),
+                            e->data, iter_data)) {
+                        goto malloc_iterate_done;
+                    }
                 }
             }
         }
@@ -4435,11 +4563,19 @@ check_valid_heap_block(bool known_invalid, byte *block, cls_alloc_t *pt, void *w
          * or other meta-objects for which we never saw the alloc (i#432)
          */
         IF_WINDOWS_ELSE(!pt->heap_tangent, true)) {
+        /* The report describes the neighboring mallocs, which can be in other
+         * stripes than block's, whose stripe free and realloc hold here.
+         * Taking a second stripe could deadlock with a thread doing the
+         * reverse, so we take the whole table, which drops and re-acquires
+         * any stripe we hold in order.
+         */
+        bool locked_by_me = malloc_lock_if_not_held_by_me();
         /* call_site for call;jmp will be jmp, so retaddr better even if post-call */
         client_invalid_heap_arg(drwrap_get_retaddr(wrapcxt),
                                 /* client_data not needed so not bothering */
                                 block, drwrap_get_mcontext_ex(wrapcxt, DR_MC_GPR),
                                 translate_routine_name(routine), is_free);
+        malloc_unlock_if_locked_by_me(locked_by_me);
         return false;
     }
     return true;
@@ -4750,6 +4886,8 @@ handle_free_pre(void *drcontext, cls_alloc_t *pt, void *wrapcxt,
     bool size_in_zone = (redzone_size(routine) > 0 && alloc_ops.size_in_redzone);
     size_t size = 0;
     malloc_entry_t *entry;
+    malloc_stripe_t *stripe;
+    bool locked_by_me;
 
     base = (app_pc)arg;
     real_base = base;
@@ -4780,9 +4918,11 @@ handle_free_pre(void *drcontext, cls_alloc_t *pt, void *wrapcxt,
      * we require user to fix invalid frees before trusting all later errors.
      */
     /* We must have synchronized access to avoid races and ensure we report
-     * an error on the 2nd free to the same base
+     * an error on the 2nd free to the same base.  Only base's stripe is
+     * needed, as all we do under the lock is on base's entry.
      */
-    malloc_lock();
+    stripe = malloc_stripe(base);
+    locked_by_me = malloc_stripe_lock_if_not_held_by_me(stripe);
     entry = malloc_lookup(base);
     if (entry != NULL &&
         (malloc_entry_is_native_ex(entry, base, pt, false)
@@ -4795,7 +4935,7 @@ handle_free_pre(void *drcontext, cls_alloc_t *pt, void *wrapcxt,
 #endif
          )) {
         malloc_entry_remove(entry);
-        malloc_unlock();
+        malloc_stripe_unlock_if_locked_by_me(stripe, locked_by_me);
         return;
     }
     if (pt->in_heap_routine == 1/*alread incremented, so outer*/) {
@@ -4920,7 +5060,7 @@ handle_free_pre(void *drcontext, cls_alloc_t *pt, void *wrapcxt,
 
         malloc_entry_remove(entry);
     }
-    malloc_unlock();
+    malloc_stripe_unlock_if_locked_by_me(stripe, locked_by_me);
 
     set_handling_heap_layer(pt, base, size);
 #ifdef WINDOWS
@@ -5355,6 +5495,8 @@ handle_realloc_pre(void *drcontext, cls_alloc_t *pt, void *wrapcxt,
     size_t size = (size_t) drwrap_get_arg(wrapcxt, ARGNUM_REALLOC_SIZE(type));
     app_pc base = (app_pc) drwrap_get_arg(wrapcxt, ARGNUM_REALLOC_PTR(type));
     malloc_entry_t *entry;
+    malloc_stripe_t *stripe;
+    bool locked_by_me;
     if (base == NULL) {
         /* realloc(NULL, size) == malloc(size) (PR 416535) */
         /* call_site for call;jmp will be jmp, so retaddr better even if post-call */
@@ -5371,11 +5513,13 @@ handle_realloc_pre(void *drcontext, cls_alloc_t *pt, void *wrapcxt,
         LOG(2, "realloc-pre "PFX" new size %d\n", base, pt->realloc_replace_size);
         return;
     }
-    malloc_lock();
+    /* as in handle_free_pre(), only base's stripe is needed */
+    stripe = malloc_stripe(base);
+    locked_by_me = malloc_stripe_lock_if_not_held_by_me(stripe);
     entry = malloc_lookup(base);
     if (entry != NULL && malloc_entry_is_native_ex(entry, base, pt, true)) {
         malloc_entry_remove(entry);
-        malloc_unlock();
+        malloc_stripe_unlock_if_locked_by_me(stripe, locked_by_me);
         return;
     }
 #ifdef WINDOWS
@@ -5385,7 +5529,7 @@ handle_realloc_pre(void *drcontext, cls_alloc_t *pt, void *wrapcxt,
 #endif
     if (check_recursive_same_sequence(drcontext, &pt, routine, pt->alloc_size,
                                       size - redzone_size(routine)*2)) {
-        malloc_unlock();
+        malloc_stripe_unlock_if_locked_by_me(stripe, locked_by_me);
         return;
     }
     set_handling_heap_layer(pt, base, size);
@@ -5397,7 +5541,7 @@ handle_realloc_pre(void *drcontext, cls_alloc_t *pt, void *wrapcxt,
     if (!check_valid_heap_block(entry == NULL, pt->alloc_base, pt, wrapcxt,
                                 routine->name, is_free_routine(type))) {
         pt->expect_lib_to_fail = true;
-        malloc_unlock();
+        malloc_stripe_unlock_if_locked_by_me(stripe, locked_by_me);
         return;
     }
     if (redzone_size(routine) > 0) {
@@ -5467,7 +5611,7 @@ handle_realloc_pre(void *drcontext, cls_alloc_t *pt, void *wrapcxt,
         pt->alloc_base, pt->realloc_old_size, pt->alloc_size);
     if (alloc_ops.record_allocs && !invalidated)
         malloc_entry_set_valid(entry, false);
-    malloc_unlock();
+    malloc_stripe_unlock_if_locked_by_me(stripe, locked_by_me);
 }
 
 static void
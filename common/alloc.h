@@ -69,6 +69,10 @@ typedef struct _alloc_options_t {
      * to worry about racy module unloads
      */
     bool conservative;
+    /* stripes of the malloc table when wrapping, rounded down to a power of 2.
+     * 0 or 1 serializes all table operations and client callbacks.
+     */
+    uint malloc_table_stripes;
 
     /* replace instead of wrap existing? */
     bool replace_malloc;
@@ -76,6 +80,8 @@ typedef struct _alloc_options_t {
     bool external_headers; /* headers in hashtable instead of inside redzone */
     uint delay_frees;
     uint delay_frees_maxsz;
+    /* chunks per batch for per-thread free list caches: 0 disables (i#948) */
+    uint thread_cache_batch;
 
     bool skip_msvc_importers;
 
@@ -119,9 +125,7 @@ extern int sysnum_RaiseException;
 #ifdef STATISTICS
 extern uint wrap_pre;
 extern uint wrap_post;
-extern uint num_mallocs;
 extern uint num_large_mallocs;
-extern uint num_frees;
 #endif
 
 /* caller should call drmgr_init() and drwrap_init() */
@@ -238,6 +242,11 @@ alloc_entering_replace_routine(app_pc pc);
 bool
 alloc_replace_in_cur_arena(byte *addr);
 
+#ifdef STATISTICS
+void
+alloc_replace_dump_stats(file_t f);
+#endif
+
 bool
 alloc_replace_overlaps_delayed_free(byte *start, byte *end,
                                     byte **free_start OUT,
@@ -62,12 +62,17 @@
  *
  * + arena->next_chunk always has a redzone + header space (if co-located, i.e.,
  *   !alloc_ops.external_headers) to its left
- * + free lists are kept in buckets by size.  larger is preferred over
- *   searching.  final bucket is var-sized and is always searched.
+ * + free lists are kept in segregated buckets by size, with a bitmap of
+ *   the non-empty buckets.  larger is preferred over searching.
  *   frees are appended to make the lists FIFO for better delaying
  *   (though worse alloc re-use), and searches start at the front and
  *   take the first fit.
- *   we can add fancier algorithms in the future.
+ *   the final bucket is var-sized and is kept in a treap ordered by
+ *   (size, free order) so it is searched for the best fit in logarithmic
+ *   time, taking the oldest of equal-sized chunks to remain FIFO.
+ * + before an arena grows, adjacent free chunks that are past the delay
+ *   limits are coalesced using boundary-tag flags in their headers, and
+ *   the interior pages of large coalesced chunks are reset.
  * + for alloc_ops.external_headers, free list entries use headers that
  *   are co-located with the chunk headers
  * + for !alloc_ops.external_headers, free list entry headers begin where
@@ -104,13 +109,25 @@
 /* we only support allocation sizes under 4GB */
 typedef uint heapsz_t;
 
-/* each free list bucket contains freed chunks of at least its bucket size
- * XXX: add stats on searches to help in tuning these
+/* each free list bucket contains freed chunks of at least its bucket size.
+ * the classes are 8 apart up to 64 and then 4 per power of 2, with the
+ * last one being the var-size bucket.  the search histograms in the
+ * statistics help in tuning these.
+ * there can be at most 32 buckets for the non-empty bitmap.
  */
 static const uint free_list_sizes[] = {
-    8, 16, 24, 32, 40, 64, 96, 128, 192, 256, 384, 512, 1024, 2048, 4096
+    8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256,
+    320, 384, 448, 512, 640, 768, 896, 1024, 1536, 2048, 3072, 4096
 };
 #define NUM_FREE_LISTS (sizeof(free_list_sizes)/sizeof(free_list_sizes[0]))
+#define VAR_FREE_LIST (NUM_FREE_LISTS - 1)
+#define FREE_LIST_BIT(bucket) (1U << (bucket))
+
+/* maps (aligned_size / CHUNK_ALIGNMENT) - 1 to the smallest bucket whose chunks
+ * are all at least that size, for sizes up to the largest fixed-size bucket
+ */
+#define MAX_FIXED_FREE_SIZE 3072
+static byte free_list_alloc_bucket[MAX_FIXED_FREE_SIZE / CHUNK_ALIGNMENT];
 
 /* Values stored in chunk header flags */
 enum {
@@ -118,9 +135,13 @@ enum {
     CHUNK_MMAP        = MALLOC_RESERVED_2,
     /* MALLOC_RESERVED_{3,4} are used for types */
     CHUNK_PRE_US      = MALLOC_RESERVED_5,
-    /* MALLOC_RESERVED_6 could be used to indicate presence of prev
-     * free chunk for coalescing (i#948)
-     */
+    /* the next three are only used on freed arena chunks (i#948) */
+    /* evicted from the delay queue by the current coalescing pass */
+    CHUNK_COALESCE    = MALLOC_RESERVED_6,
+    /* boundary tag: the preceding chunk is also CHUNK_COALESCE */
+    CHUNK_PREV_COALESCE = MALLOC_RESERVED_7,
+    /* the interior pages were handed back to the OS */
+    CHUNK_RESET       = MALLOC_RESERVED_8,
 };
 
 #define HEADER_MAGIC 0x5244 /* "DR" */
@@ -178,17 +199,45 @@ typedef struct _free_header_t {
     byte *chunk; /* only used for alloc_ops.external_headers */
 } free_header_t;
 
+/* The order in which a chunk entered the delay queue.  There is no room for it
+ * beyond the next pointer in a minimum-size x64 chunk, so there it uses the
+ * header padding, and elsewhere the chunk field, as coalescing is not
+ * supported with alloc_ops.external_headers.
+ */
+#ifdef X64
+# define FREE_SEQ(fh) ((fh)->head.pad)
+#else
+# define FREE_SEQ(fh) (*(uint *)&(fh)->chunk)
+#endif
+
+/* free list header for the var-size bucket, whose chunks are large enough
+ * to hold the treap links and a FIFO back pointer as well
+ */
+typedef struct _large_free_header_t {
+    free_header_t free;
+    struct _large_free_header_t *prev;
+    struct _large_free_header_t *left;
+    struct _large_free_header_t *right;
+} large_free_header_t;
+
 typedef struct _free_lists_t {
     /* a normal free list can be LIFO, but for more effective delayed frees
      * we want FIFO.  FIFO-per-bucket-size is sufficient.
+     * the var-size bucket is doubly-linked so best-fit can take from the
+     * middle, and is also indexed by large_root.
      */
     free_header_t *front[NUM_FREE_LISTS];
     free_header_t *last[NUM_FREE_LISTS];
+    /* bit per bucket, set iff the bucket is non-empty */
+    uint nonempty;
+    large_free_header_t *large_root;
 } free_lists_t;
 
 /* counters for delayed frees.  protected by malloc lock. */
 static uint delayed_chunks;
 static size_t delayed_bytes;
+/* sequence number for chunks entering the delay queue.  protected by malloc lock. */
+static uint free_seq;
 
 #ifdef LINUX
 /* we assume we're the sole users of the brk (after pre-us allocs) */
@@ -315,6 +364,7 @@ app_heap_lock(void *drcontext, void *recur_lock)
     dr_mark_safe_to_suspend(drcontext, true/*enter safe region*/);
     dr_recurlock_lock(recur_lock);
     dr_mark_safe_to_suspend(drcontext, false/*exit safe region*/);
+    STATS_SHARD_INC(heap_lock_acquires);
 }
 
 static void
@@ -395,6 +445,45 @@ os_large_alloc_extend(byte *map, size_t cur_commit_size, size_t new_commit_size
 #endif
 }
 
+#ifdef LINUX
+/* Resizes a mapping from os_large_alloc(), moving it if it cannot be resized
+ * in place.  Returns the new base, or NULL on failure.
+ */
+static byte *
+os_large_remap(byte *map, size_t cur_size, size_t new_size)
+{
+    byte *newmap;
+    ASSERT(ALIGNED(map, PAGE_SIZE), "invalid mmap base");
+    ASSERT(ALIGNED(cur_size, PAGE_SIZE), "must align to at least page size");
+    ASSERT(ALIGNED(new_size, PAGE_SIZE), "must align to at least page size");
+    newmap = (byte *) raw_syscall
+        (SYS_mremap, 4, (ptr_int_t)map, cur_size, new_size, MREMAP_MAYMOVE);
+    LOG(3, "%s "PFX" size="PIFX" new size="PIFX" => "PFX"\n",
+        __FUNCTION__, map, cur_size, new_size, newmap);
+    if ((ptr_int_t)newmap < 0 && (ptr_int_t)newmap > -PAGE_SIZE)
+        return NULL;
+    return newmap;
+}
+#endif
+
+/* Tells the OS that the contents of [start, start+size) are no longer needed,
+ * letting it reclaim the pages while leaving them accessible
+ */
+static void
+os_large_reset(byte *start, size_t size _IF_WINDOWS(uint prot))
+{
+    ASSERT(ALIGNED(start, PAGE_SIZE), "must align to at least page size");
+    ASSERT(ALIGNED(size, PAGE_SIZE), "must align to at least page size");
+    LOG(3, "%s "PFX" size="PIFX"\n",  __FUNCTION__, start, size);
+#ifdef LINUX
+    /* failure just leaves the pages in place */
+    raw_syscall(SYS_madvise, 3, (ptr_int_t)start, size, MADV_DONTNEED);
+#else
+    if (!virtual_alloc((void **)&start, size, MEM_RESET, prot))
+        LOG(2, "%s "PFX" size="PIFX" FAILED\n",  __FUNCTION__, start, size);
+#endif
+}
+
 /* For Windows, map_size is ignored and the whole allocation is freed */
 static bool
 os_large_free(byte *map, size_t map_size)
@@ -533,6 +622,23 @@ ptr_is_in_arena(byte *ptr, arena_header_t *arena)
 #endif
 }
 
+/* Returns the arena, among arena and the arenas chained to it, that has carved
+ * out ptr, or NULL if there is none.
+ */
+static inline arena_header_t *
+arena_containing(arena_header_t *arena, byte *ptr)
+{
+#ifdef WINDOWS
+    for (; arena != NULL; arena = arena->next_arena) {
+        if (ptr >= arena->start_chunk && ptr < arena->next_chunk)
+            return arena;
+    }
+    return NULL;
+#else
+    return (ptr >= arena->start_chunk && ptr < arena->next_chunk) ? arena : NULL;
+#endif
+}
+
 /* Returns true iff ptr is a live alloc inside arena.  Thus, will return
  * false for pre-us allocs from other arenas.
  */
@@ -613,14 +719,13 @@ arena_free(arena_header_t *arena)
         os_large_free((byte *)arena, arena->reserve_end - (byte *)arena);
 }
 
-/* either extends arena in-place and returns it, or allocates a new arena
- * and returns that.  returns NULL on failure to do either.
+/* extends arena's committed space in-place by at least add_size.
+ * returns false if there is no room to do so.
  */
-static arena_header_t *
-arena_extend(arena_header_t *arena, heapsz_t add_size)
+static bool
+arena_extend_in_place(arena_header_t *arena, heapsz_t add_size)
 {
     heapsz_t aligned_add = (heapsz_t) ALIGN_FORWARD(add_size, PAGE_SIZE);
-    arena_header_t *new_arena;
 #ifdef LINUX
     if (arena->commit_end == cur_brk) {
         byte *new_brk = set_brk(cur_brk + aligned_add);
@@ -629,7 +734,7 @@ arena_extend(arena_header_t *arena, heapsz_t add_size)
             cur_brk = new_brk;
             arena->commit_end = new_brk;
             heap_region_adjust((byte *)arena, new_brk);
-            return arena;
+            return true;
         } else
             LOG(1, "brk cannot expand: switching to mmap\n");
     } else
@@ -645,9 +750,21 @@ arena_extend(arena_header_t *arena, heapsz_t add_size)
 #ifdef LINUX /* windows already added whole reservation */
             heap_region_adjust((byte *)arena, (byte *)arena + new_size);
 #endif
-            return arena;
+            return true;
         }
     }
+    return false;
+}
+
+/* either extends arena in-place and returns it, or allocates a new arena
+ * and returns that.  returns NULL on failure to do either.
+ */
+static arena_header_t *
+arena_extend(arena_header_t *arena, heapsz_t add_size)
+{
+    arena_header_t *new_arena;
+    if (arena_extend_in_place(arena, add_size))
+        return arena;
 #ifdef WINDOWS
     if (!TEST(HEAP_GROWABLE, arena->flags))
         return NULL;
@@ -671,28 +788,318 @@ arena_extend(arena_header_t *arena, heapsz_t add_size)
     return new_arena;
 }
 
+/***************************************************************************
+ * free list buckets
+ */
+
+#ifdef STATISTICS
+/* histograms of the number of chunks examined per free list search, in
+ * power-of-2 bins: [0], [1], [2,3], [4,7], ... with the last bin open-ended
+ */
+# define SEARCH_HIST_BINS 10
+static uint fixed_search_hist[SEARCH_HIST_BINS];
+static uint large_search_hist[SEARCH_HIST_BINS];
+# define STATS_HIST_ADD(hist, len) search_hist_add(hist, len)
+
+static void
+search_hist_add(uint *hist, uint len)
+{
+    uint bin = 0;
+    while (len > 0 && bin < SEARCH_HIST_BINS - 1) {
+        len >>= 1;
+        bin++;
+    }
+    hist[bin]++;
+}
+#else
+# define STATS_HIST_ADD(hist, len) /* nothing */
+#endif
+
+static void
+free_list_bucket_init(void)
+{
+    uint bucket = 0, idx;
+    for (idx = 0; idx < BUFFER_SIZE_ELEMENTS(free_list_alloc_bucket); idx++) {
+        while ((idx + 1) * CHUNK_ALIGNMENT > free_list_sizes[bucket])
+            bucket++;
+        free_list_alloc_bucket[idx] = (byte) bucket;
+    }
+}
+
+/* Returns the smallest bucket whose chunks are all at least aligned_size */
+static inline uint
+free_list_bucket_for_alloc(heapsz_t aligned_size)
+{
+    ASSERT(aligned_size >= CHUNK_MIN_SIZE && ALIGNED(aligned_size, CHUNK_ALIGNMENT),
+           "invalid size");
+    if (aligned_size > MAX_FIXED_FREE_SIZE)
+        return VAR_FREE_LIST;
+    return free_list_alloc_bucket[aligned_size / CHUNK_ALIGNMENT - 1];
+}
+
+/* Returns the bucket a free chunk belongs in: the largest whose size it has */
+static inline uint
+free_list_bucket_for_free(heapsz_t alloc_size)
+{
+    uint bucket;
+    if (alloc_size >= free_list_sizes[VAR_FREE_LIST])
+        return VAR_FREE_LIST;
+    bucket = free_list_bucket_for_alloc(alloc_size);
+    if (free_list_sizes[bucket] > alloc_size)
+        bucket--;
+    ASSERT(alloc_size >= free_list_sizes[bucket], "bucket invariant violated");
+    return bucket;
+}
+
+/* Returns the first non-empty bucket at or above bucket, or NUM_FREE_LISTS */
+static inline uint
+free_list_next_nonempty(free_lists_t *lists, uint bucket)
+{
+    /* isolate the lowest set bit and map it to its index via a de Bruijn sequence */
+    static const byte debruijn_idx[32] = {
+        0, 1, 28, 2, 29, 14, 24, 3, 30, 22, 20, 15, 25, 17, 4, 8,
+        31, 27, 13, 23, 21, 19, 16, 7, 26, 12, 18, 6, 11, 5, 10, 9
+    };
+    uint bits = lists->nonempty & ~(FREE_LIST_BIT(bucket) - 1);
+    if (bits == 0)
+        return NUM_FREE_LISTS;
+    return debruijn_idx[((bits & (0 - bits)) * 0x077CB531U) >> 27];
+}
+
+static inline bool
+free_seq_older(uint a, uint b)
+{
+    return (int)(a - b) < 0;
+}
+
+/* appends the chain first..last of newly delayed chunks to the end of a
+ * fixed-size bucket
+ */
+static inline void
+free_list_append(free_lists_t *lists, uint bucket, free_header_t *first,
+                 free_header_t *last)
+{
+    free_header_t *cur;
+    ASSERT(bucket < VAR_FREE_LIST, "var-size bucket has its own routines");
+    for (cur = first; cur != last; cur = cur->next)
+        FREE_SEQ(cur) = free_seq++;
+    FREE_SEQ(last) = free_seq++;
+    last->next = NULL;
+    if (lists->last[bucket] == NULL) {
+        ASSERT(lists->front[bucket] == NULL, "inconsistent free list");
+        lists->front[bucket] = first;
+    } else
+        lists->last[bucket]->next = first;
+    lists->last[bucket] = last;
+    lists->nonempty |= FREE_LIST_BIT(bucket);
+}
+
+/* puts the chain first..last at the front of a fixed-size bucket */
+static inline void
+free_list_prepend(free_lists_t *lists, uint bucket, free_header_t *first,
+                  free_header_t *last)
+{
+    ASSERT(bucket < VAR_FREE_LIST, "var-size bucket has its own routines");
+    last->next = lists->front[bucket];
+    lists->front[bucket] = first;
+    if (lists->last[bucket] == NULL)
+        lists->last[bucket] = last;
+    lists->nonempty |= FREE_LIST_BIT(bucket);
+}
+
+/* unlinks cur, which follows prev (NULL if cur is the front), from a bucket */
+static inline void
+free_list_unlink(free_lists_t *lists, uint bucket, free_header_t *cur,
+                 free_header_t *prev)
+{
+    ASSERT(bucket < VAR_FREE_LIST, "var-size bucket has its own routines");
+    if (prev == NULL)
+        lists->front[bucket] = cur->next;
+    else
+        prev->next = cur->next;
+    if (cur == lists->last[bucket])
+        lists->last[bucket] = prev;
+    if (lists->front[bucket] == NULL)
+        lists->nonempty &= ~FREE_LIST_BIT(bucket);
+}
+
+/* The var-size bucket is a FIFO list that is also indexed by a treap: a binary
+ * search tree on (size, free order, address) that is also a heap on a priority
+ * hashed from the address, which keeps it balanced in expectation w/o storing
+ * any balance state.
+ */
+static inline uint
+large_free_priority(large_free_header_t *node)
+{
+    return (uint)(((ptr_uint_t)node >> 4) * 2654435761U);
+}
+
+static inline bool
+large_free_less(large_free_header_t *a, large_free_header_t *b)
+{
+    if (a->free.head.alloc_size != b->free.head.alloc_size)
+        return a->free.head.alloc_size < b->free.head.alloc_size;
+    if (FREE_SEQ(&a->free) != FREE_SEQ(&b->free))
+        return free_seq_older(FREE_SEQ(&a->free), FREE_SEQ(&b->free));
+    return a < b;
+}
+
+static large_free_header_t *
+large_free_insert(large_free_header_t *root, large_free_header_t *node)
+{
+    large_free_header_t *child;
+    if (root == NULL)
+        return node;
+    if (large_free_less(node, root)) {
+        child = large_free_insert(root->left, node);
+        root->left = child;
+        if (large_free_priority(child) > large_free_priority(root)) {
+            root->left = child->right;
+            child->right = root;
+            return child;
+        }
+    } else {
+        child = large_free_insert(root->right, node);
+        root->right = child;
+        if (large_free_priority(child) > large_free_priority(root)) {
+            root->right = child->left;
+            child->left = root;
+            return child;
+        }
+    }
+    return root;
+}
+
+static large_free_header_t *
+large_free_merge(large_free_header_t *left, large_free_header_t *right)
+{
+    if (left == NULL)
+        return right;
+    if (right == NULL)
+        return left;
+    if (large_free_priority(left) > large_free_priority(right)) {
+        left->right = large_free_merge(left->right, right);
+        return left;
+    } else {
+        right->left = large_free_merge(left, right->left);
+        return right;
+    }
+}
+
+static large_free_header_t *
+large_free_remove(large_free_header_t *root, large_free_header_t *node)
+{
+    ASSERT(root != NULL, "node not in var-size bucket");
+    if (root == node)
+        return large_free_merge(node->left, node->right);
+    if (large_free_less(node, root))
+        root->left = large_free_remove(root->left, node);
+    else
+        root->right = large_free_remove(root->right, node);
+    return root;
+}
+
+/* adds a chunk to the var-size bucket: at the end of the FIFO as a newly
+ * delayed chunk, or at the front keeping its sequence number if !delayed
+ */
+static void
+large_free_add(free_lists_t *lists, free_header_t *cur, bool delayed)
+{
+    large_free_header_t *node = (large_free_header_t *) cur;
+    ASSERT(cur->head.alloc_size >= sizeof(*node) - sizeof(chunk_header_t),
+           "var-size chunk too small for treap links");
+    if (delayed) {
+        FREE_SEQ(cur) = free_seq++;
+        node->free.next = NULL;
+        node->prev = (large_free_header_t *) lists->last[VAR_FREE_LIST];
+        if (node->prev == NULL)
+            lists->front[VAR_FREE_LIST] = cur;
+        else
+            node->prev->free.next = cur;
+        lists->last[VAR_FREE_LIST] = cur;
+    } else {
+        node->free.next = lists->front[VAR_FREE_LIST];
+        node->prev = NULL;
+        if (node->free.next == NULL)
+            lists->last[VAR_FREE_LIST] = cur;
+        else
+            ((large_free_header_t *)node->free.next)->prev = node;
+        lists->front[VAR_FREE_LIST] = cur;
+    }
+    node->left = NULL;
+    node->right = NULL;
+    lists->large_root = large_free_insert(lists->large_root, node);
+    lists->nonempty |= FREE_LIST_BIT(VAR_FREE_LIST);
+}
+
+/* removes a chunk from both the FIFO and the treap of the var-size bucket */
+static void
+large_free_unlink(free_lists_t *lists, large_free_header_t *node)
+{
+    if (node->prev == NULL)
+        lists->front[VAR_FREE_LIST] = node->free.next;
+    else
+        node->prev->free.next = node->free.next;
+    if (node->free.next == NULL)
+        lists->last[VAR_FREE_LIST] = (free_header_t *) node->prev;
+    else
+        ((large_free_header_t *)node->free.next)->prev = node->prev;
+    lists->large_root = large_free_remove(lists->large_root, node);
+    if (lists->large_root == NULL)
+        lists->nonempty &= ~FREE_LIST_BIT(VAR_FREE_LIST);
+}
+
+/* removes and returns the smallest, and of those the oldest, chunk in the
+ * var-size bucket that is at least aligned_size
+ */
+static chunk_header_t *
+large_free_take_best_fit(free_lists_t *lists, heapsz_t aligned_size)
+{
+    large_free_header_t *cur, *best = NULL;
+    uint visited = 0;
+    for (cur = lists->large_root; cur != NULL; visited++) {
+        if (cur->free.head.alloc_size >= aligned_size) {
+            best = cur;
+            cur = cur->left;
+        } else
+            cur = cur->right;
+    }
+    STATS_HIST_ADD(large_search_hist, visited);
+    if (best == NULL)
+        return NULL;
+    large_free_unlink(lists, best);
+    return (chunk_header_t *) best;
+}
+
+/* adds a freed chunk to the end of its bucket */
+static void
+free_list_add(free_lists_t *lists, free_header_t *cur, uint bucket)
+{
+    if (bucket == VAR_FREE_LIST)
+        large_free_add(lists, cur, true/*delayed*/);
+    else
+        free_list_append(lists, bucket, cur, cur);
+}
+
 static chunk_header_t *
 search_free_list_bucket(arena_header_t *arena, heapsz_t aligned_size, uint bucket)
 {
     /* search for large enough chunk */
     free_header_t *cur, *prev;
     chunk_header_t *head = NULL;
+    uint visited = 0;
 #ifdef LINUX
     /* On Windows we have HEAP_NO_SERIALIZE.  Not worth passing the flags in. */
     ASSERT(dr_recurlock_self_owns(arena->lock), "caller must hold lock");
 #endif
-    ASSERT(bucket < NUM_FREE_LISTS, "invalid param");
+    ASSERT(bucket < VAR_FREE_LIST, "invalid param");
     for (cur = arena->free_list->front[bucket], prev = NULL;
          cur != NULL && cur->head.alloc_size < aligned_size;
          prev = cur, cur = cur->next)
-        ; /* nothing */
+        visited++;
+    STATS_HIST_ADD(fixed_search_hist, visited);
     if (cur != NULL) {
-        if (prev == NULL)
-            arena->free_list->front[bucket] = cur->next;
-        else
-            prev->next = cur->next;
-        if (cur == arena->free_list->last[bucket])
-            arena->free_list->last[bucket] = prev;
+        free_list_unlink(arena->free_list, bucket, cur, prev);
         head = (chunk_header_t *) cur;
     }
     LOG(3, "arena "PFX" bucket %d free front="PFX" last="PFX"\n",
@@ -701,10 +1108,22 @@ search_free_list_bucket(arena_header_t *arena, heapsz_t aligned_size, uint bucke
     return head;
 }
 
+/* clears the freed state of a chunk being handed out again */
+static void
+prepare_free_chunk_for_reuse(chunk_header_t *head)
+{
+    if (head->user_data != NULL) {
+        client_malloc_data_free(head->user_data);
+        head->user_data = NULL;
+    }
+    head->flags &= ~(CHUNK_FREED | CHUNK_RESET | MALLOC_ALLOCATOR_FLAGS);
+}
+
 static chunk_header_t *
 find_free_list_entry(arena_header_t *arena, heapsz_t request_size, heapsz_t aligned_size)
 {
     chunk_header_t *head = NULL;
+    free_lists_t *lists = arena->free_list;
     uint bucket;
 #ifdef LINUX
     /* On Windows we have HEAP_NO_SERIALIZE.  Not worth passing the flags in. */
@@ -720,47 +1139,41 @@ find_free_list_entry(arena_header_t *arena, heapsz_t request_size, heapsz_t alig
      * thus we go for time over space and use the guaranteed-size bucket
      * before searching the maybe-big-enough bucket.
      */
-    for (bucket = 0;
-         bucket < NUM_FREE_LISTS - 1 && aligned_size > free_list_sizes[bucket];
-         bucket++)
-        ; /* nothing */
-    if (arena->free_list->front[bucket] == NULL && bucket > 0 &&
-        aligned_size < free_list_sizes[bucket]) {
+    bucket = free_list_bucket_for_alloc(aligned_size);
+    if (!TEST(FREE_LIST_BIT(bucket), lists->nonempty) && bucket > 0 &&
+        aligned_size < free_list_sizes[bucket] &&
+        TEST(FREE_LIST_BIT(bucket - 1), lists->nonempty)) {
         /* next-bigger is not avail: search maybe-big-enough bucket before
          * possibly going to even bigger buckets
          */
-        bucket--;
-        head = search_free_list_bucket(arena, aligned_size, bucket);
-        if (head == NULL)
-            bucket++;
+        head = search_free_list_bucket(arena, aligned_size, bucket - 1);
     }
-    
+
     /* if delay frees are piling up, use a larger bucket to avoid
      * delaying a ton of allocs of a certain size and never re-using
      * them for pathological app alloc sequences
      */
-    if (head == NULL && arena->free_list->front[bucket] == NULL &&
+    if (head == NULL && !TEST(FREE_LIST_BIT(bucket), lists->nonempty) &&
         (delayed_chunks >= 2*alloc_ops.delay_frees ||
          delayed_bytes >= 2*alloc_ops.delay_frees_maxsz)) {
+        uint larger = free_list_next_nonempty(lists, bucket);
         LOG(2, "\tallocating from larger bucket size to reduce delayed frees\n");
-        while (bucket < NUM_FREE_LISTS - 1 && arena->free_list->front[bucket] == NULL)
-            bucket++;
+        if (larger < NUM_FREE_LISTS)
+            bucket = larger;
     }
 
-    if (head == NULL && arena->free_list->front[bucket] != NULL) {
-        if (bucket == NUM_FREE_LISTS - 1) {
+    if (head == NULL && TEST(FREE_LIST_BIT(bucket), lists->nonempty)) {
+        if (bucket == VAR_FREE_LIST) {
             /* var-size bucket: have to search */
-            head = search_free_list_bucket(arena, aligned_size, bucket);
+            head = large_free_take_best_fit(lists, aligned_size);
         } else {
             /* guaranteed to be big enough so take from front */
             ASSERT(aligned_size <= free_list_sizes[bucket], "logic error");
-            head = (chunk_header_t *) arena->free_list->front[bucket];
-            arena->free_list->front[bucket] = arena->free_list->front[bucket]->next;
-            if (head == (chunk_header_t *) arena->free_list->last[bucket])
-                arena->free_list->last[bucket] = arena->free_list->front[bucket];
+            head = (chunk_header_t *) lists->front[bucket];
+            free_list_unlink(lists, bucket, lists->front[bucket], NULL);
+            STATS_HIST_ADD(fixed_search_hist, 0);
             LOG(3, "arena "PFX" bucket %d free front="PFX" last="PFX"\n",
-                arena, bucket, arena->free_list->front[bucket],
-                arena->free_list->last[bucket]);
+                arena, bucket, lists->front[bucket], lists->last[bucket]);
         }
     }
 
@@ -771,13 +1184,406 @@ find_free_list_entry(arena_header_t *arena, heapsz_t request_size, heapsz_t alig
         delayed_chunks--;
         ASSERT(delayed_bytes >= head->alloc_size, "delay bytes counter off");
         delayed_bytes -= head->alloc_size;
-        if (head->user_data != NULL) {
+        prepare_free_chunk_for_reuse(head);
+    }
+    return head;
+}
+
+/***************************************************************************
+ * coalescing
+ */
+
+/* i#948: chunks that overflow the delay queue are coalesced with adjacent
+ * chunks that have also left it, so fragmented free space can be re-used
+ * for larger requests instead of growing the arena.  This runs in passes
+ * when the arena would otherwise have to commit more memory:
+ * + the oldest chunks are evicted from the free lists for as long as the rest
+ *   still meet one of the delay limits, and marked with CHUNK_COALESCE.
+ * + each evicted chunk whose successor was also evicted sets the boundary tag
+ *   CHUNK_PREV_COALESCE in the successor's header.  Chunks w/o the tag start
+ *   a run, which absorbs its tagged successors into one chunk.  The absorbed
+ *   headers lose their magic so stale pointers into the run are invalid.
+ * + a run ending at the arena's next_chunk is handed back to the arena;
+ *   others go back to the front of the free lists in eviction order, keeping
+ *   the first chunk's sequence number, free callstack and request size, and
+ *   large ones have their interior pages reset.
+ * Only chunks on the shared free lists are marked, so chunks in thread caches,
+ * which other threads can touch w/o the lock, are never coalesced.
+ */
+
+/* minimum frees between passes, to amortize the eviction cost */
+#define COALESCE_MIN_FREES 256
+/* minimum bytes of whole pages to be worth handing back to the OS */
+#define COALESCE_RESET_MIN (64*1024)
+
+static uint coalesce_last_seq;
+static uint coalesce_last_evicted;
+
+#ifdef STATISTICS
+static uint coalesce_passes;
+static uint coalesce_evicted;
+static uint coalesce_absorbed;
+#endif
+
+static inline byte *
+chunk_successor(chunk_header_t *head)
+{
+    return ptr_from_header(head) + head->alloc_size + alloc_ops.redzone_size +
+        header_beyond_redzone;
+}
+
+/* removes and returns the oldest chunk on the free lists, if evicting it
+ * still leaves the delay queue at one of its limits
+ */
+static free_header_t *
+coalesce_evict_oldest(free_lists_t *lists)
+{
+    free_header_t *oldest = NULL;
+    uint bucket, oldest_bucket = 0;
+    for (bucket = free_list_next_nonempty(lists, 0); bucket < NUM_FREE_LISTS;
+         bucket = free_list_next_nonempty(lists, bucket + 1)) {
+        free_header_t *front = lists->front[bucket];
+        if (oldest == NULL || free_seq_older(FREE_SEQ(front), FREE_SEQ(oldest))) {
+            oldest = front;
+            oldest_bucket = bucket;
+        }
+    }
+    if (oldest == NULL ||
+        (delayed_chunks - 1 < alloc_ops.delay_frees &&
+         delayed_bytes - oldest->head.alloc_size < alloc_ops.delay_frees_maxsz))
+        return NULL;
+    if (oldest_bucket == VAR_FREE_LIST)
+        large_free_unlink(lists, (large_free_header_t *) oldest);
+    else
+        free_list_unlink(lists, oldest_bucket, oldest, NULL);
+    ASSERT(delayed_chunks > 0, "delay counter off");
+    delayed_chunks--;
+    ASSERT(delayed_bytes >= oldest->head.alloc_size, "delay bytes counter off");
+    delayed_bytes -= oldest->head.alloc_size;
+    return oldest;
+}
+
+/* merges the run starting at head with its tagged successors */
+static void
+coalesce_run(arena_header_t *arena, chunk_header_t *head)
+{
+    byte *ptr = ptr_from_header(head);
+    byte *next;
+    for (next = chunk_successor(head); next < arena->next_chunk;
+         next = chunk_successor(head)) {
+        free_header_t *absorb = (free_header_t *) header_from_ptr(next);
+        if (!TEST(CHUNK_PREV_COALESCE, absorb->head.flags))
+            break;
+        ASSERT(TEST(CHUNK_COALESCE, absorb->head.flags), "boundary tag w/o mark");
+        LOG(3, "\tcoalescing "PFX" into "PFX"\n", next, ptr);
+        if (absorb->head.user_data != NULL)
+            client_malloc_data_free(absorb->head.user_data);
+        absorb->head.user_data = NULL;
+        absorb->head.flags = 0;
+        absorb->head.magic = 0;
+        head->alloc_size = (heapsz_t) (next + absorb->head.alloc_size - ptr);
+        head->flags &= ~CHUNK_RESET; /* the absorbed part is not reset */
+        STATS_INC(coalesce_absorbed);
+    }
+}
+
+/* puts a coalesced chunk back on the free lists, or back into the arena's
+ * uncarved space if it is the arena's final chunk
+ */
+static void
+coalesce_release(arena_header_t *arena, free_lists_t *lists, chunk_header_t *head)
+{
+    byte *ptr = ptr_from_header(head);
+    arena_header_t *owner = arena_containing(arena, ptr);
+    byte *reset_start, *reset_end;
+    if (owner != NULL && chunk_successor(head) == owner->next_chunk) {
+        LOG(2, "\treturning coalesced "PFX"-"PFX" to arena "PFX"\n",
+            ptr, ptr + head->alloc_size, owner);
+        if (head->user_data != NULL)
             client_malloc_data_free(head->user_data);
-            head->user_data = NULL;
+        head->user_data = NULL;
+        head->magic = 0;
+        owner->next_chunk = ptr;
+        STATS_SHARD_ADD(coalesce_tail_bytes, head->alloc_size);
+        /* the uncarved space beyond ptr is all free */
+        reset_start = (byte *) ALIGN_FORWARD(ptr, PAGE_SIZE);
+        reset_end = (byte *) ALIGN_BACKWARD(owner->commit_end, PAGE_SIZE);
+    } else {
+        free_header_t *cur = (free_header_t *) head;
+        uint bucket = free_list_bucket_for_free(head->alloc_size);
+        head->flags &= ~(CHUNK_COALESCE | CHUNK_PREV_COALESCE);
+        if (bucket == VAR_FREE_LIST)
+            large_free_add(lists, cur, false/*front*/);
+        else
+            free_list_prepend(lists, bucket, cur, cur);
+        delayed_chunks++;
+        delayed_bytes += head->alloc_size;
+        if (TEST(CHUNK_RESET, head->flags))
+            return;
+        /* skip the free list header at the start */
+        reset_start = (byte *)
+            ALIGN_FORWARD(ptr + sizeof(large_free_header_t) - HEADER_SIZE, PAGE_SIZE);
+        reset_end = (byte *) ALIGN_BACKWARD(ptr + head->alloc_size, PAGE_SIZE);
+        head->flags |= CHUNK_RESET;
+    }
+    if (reset_end > reset_start && reset_end - reset_start >= COALESCE_RESET_MIN) {
+        os_large_reset(reset_start, reset_end - reset_start
+                       _IF_WINDOWS(arena_page_prot(arena->flags)));
+        STATS_SHARD_ADD(coalesce_reset_bytes, reset_end - reset_start);
+    }
+}
+
+/* Runs a coalescing pass over arena and the arenas chained to it, if enough
+ * chunks have been freed since the last one.  Returns whether any chunks were
+ * evicted from the delay queue.
+ */
+static bool
+arena_coalesce(arena_header_t *arena)
+{
+    free_lists_t *lists = arena->free_list;
+    free_header_t *evicted = NULL, *evicted_last = NULL, *cur, *next;
+    chunk_header_t *released = NULL;
+    uint count = 0;
+#ifdef LINUX
+    ASSERT(dr_recurlock_self_owns(arena->lock), "caller must hold lock");
+#endif
+    if (alloc_ops.external_headers ||
+        free_seq - coalesce_last_seq < MAX(COALESCE_MIN_FREES, coalesce_last_evicted))
+        return false;
+    coalesce_last_seq = free_seq;
+    STATS_INC(coalesce_passes);
+
+    /* evict and mark, linking the evicted chunks oldest first */
+    while ((cur = coalesce_evict_oldest(lists)) != NULL) {
+        cur->head.flags |= CHUNK_COALESCE;
+        cur->next = NULL;
+        if (evicted_last == NULL)
+            evicted = cur;
+        else
+            evicted_last->next = cur;
+        evicted_last = cur;
+        count++;
+    }
+    coalesce_last_evicted = count;
+    STATS_ADD(coalesce_evicted, count);
+    if (count == 0)
+        return false;
+    LOG(2, "coalescing %d chunks evicted from the delay queue\n", count);
+
+    /* tag successors that are also evicted */
+    for (cur = evicted; cur != NULL; cur = cur->next) {
+        arena_header_t *owner = arena_containing(arena, ptr_from_header(&cur->head));
+        byte *succ = chunk_successor(&cur->head);
+        if (owner != NULL && succ < owner->next_chunk) {
+            chunk_header_t *succ_head = header_from_ptr(succ);
+            if (TEST(CHUNK_COALESCE, succ_head->flags))
+                succ_head->flags |= CHUNK_PREV_COALESCE;
         }
-        head->flags &= ~(CHUNK_FREED | MALLOC_ALLOCATOR_FLAGS);
     }
-    return head;
+
+    /* merge each run into its first chunk.  we write only headers here, as the
+     * next pointers of absorbed chunks are still needed to walk the list.
+     */
+    for (cur = evicted; cur != NULL; cur = cur->next) {
+        if (TEST(CHUNK_COALESCE, cur->head.flags) &&
+            !TEST(CHUNK_PREV_COALESCE, cur->head.flags)) {
+            arena_header_t *owner = arena_containing(arena, ptr_from_header(&cur->head));
+            if (owner != NULL)
+                coalesce_run(owner, &cur->head);
+        }
+    }
+
+    /* collect the merged chunks, oldest on top, now that absorbed chunks'
+     * pointers are no longer needed
+     */
+    for (cur = evicted; cur != NULL; cur = next) {
+        next = cur->next;
+        if (TEST(CHUNK_COALESCE, cur->head.flags)) {
+            cur->next = (free_header_t *) released;
+            released = &cur->head;
+        }
+    }
+    /* released is now newest first, so prepending leaves the oldest in front */
+    while (released != NULL) {
+        chunk_header_t *head = released;
+        released = (chunk_header_t *) ((free_header_t *)head)->next;
+        coalesce_release(arena, lists, head);
+    }
+    return true;
+}
+
+/***************************************************************************
+ * per-thread free list caches
+ */
+
+/* i#948: to avoid the arena lock in the common case, each thread caches
+ * small chunks of cur_arena (those in the fixed-size buckets):
+ * + chunks freed by this thread are queued in per-bucket FIFO pending lists
+ *   and appended to the shared free lists in a batch.  They are not counted
+ *   as delayed until then, so they are delayed at least as long as w/o a cache.
+ * + when the thread holds the lock to allocate anyway, it takes a batch of
+ *   chunks from the front of the guaranteed-size bucket into a reuse list,
+ *   limited to the chunks the delay limits would have let it re-use.  Later
+ *   allocs of that size pop from the reuse list w/o the lock.
+ * Chunks in both lists keep CHUNK_FREED and their free callstack so they
+ * look like any other delayed free to alloc_iterate() and
+ * alloc_replace_overlaps_delayed_free().
+ */
+typedef struct _thread_cache_t {
+    free_header_t *pending_front[NUM_FREE_LISTS];
+    free_header_t *pending_last[NUM_FREE_LISTS];
+    uint pending_chunks;
+    size_t pending_bytes;
+    free_header_t *reuse[NUM_FREE_LISTS];
+} thread_cache_t;
+
+static int tls_idx_alloc_replace = -1;
+
+static thread_cache_t *
+thread_cache_get(void *drcontext, arena_header_t *arena, bool synch)
+{
+    /* we only cache for the default arena, and only when synchronizing,
+     * as w/o synch (HEAP_NO_SERIALIZE or the caller holds the lock) there
+     * is no lock to avoid
+     */
+    if (tls_idx_alloc_replace == -1 || !synch || arena != cur_arena)
+        return NULL;
+    return (thread_cache_t *) drmgr_get_tls_field(drcontext, tls_idx_alloc_replace);
+}
+
+/* Returns the bucket whose chunks are guaranteed to fit aligned_size, or
+ * NUM_FREE_LISTS if aligned_size is too large to be cached.
+ */
+static inline uint
+thread_cache_alloc_bucket(heapsz_t aligned_size)
+{
+    uint bucket = free_list_bucket_for_alloc(aligned_size);
+    return (bucket == VAR_FREE_LIST) ? NUM_FREE_LISTS : bucket;
+}
+
+static void
+thread_cache_add_pending(thread_cache_t *cache, free_header_t *cur, uint bucket)
+{
+    ASSERT(bucket < NUM_FREE_LISTS - 1, "var-size bucket is not cached");
+    cur->next = NULL;
+    if (cache->pending_last[bucket] == NULL)
+        cache->pending_front[bucket] = cur;
+    else
+        cache->pending_last[bucket]->next = cur;
+    cache->pending_last[bucket] = cur;
+    cache->pending_chunks++;
+    cache->pending_bytes += cur->head.alloc_size;
+}
+
+/* appends this thread's pending frees to the end of the shared free lists */
+static void
+thread_cache_flush_pending(arena_header_t *arena, thread_cache_t *cache)
+{
+    uint bucket;
+    ASSERT(dr_recurlock_self_owns(arena->lock), "caller must hold lock");
+    if (cache->pending_chunks == 0)
+        return;
+    for (bucket = 0; bucket < NUM_FREE_LISTS - 1; bucket++) {
+        if (cache->pending_front[bucket] == NULL)
+            continue;
+        free_list_append(arena->free_list, bucket, cache->pending_front[bucket],
+                         cache->pending_last[bucket]);
+        cache->pending_front[bucket] = NULL;
+        cache->pending_last[bucket] = NULL;
+    }
+    LOG(3, "arena "PFX" flushed %d pending frees of %d bytes\n",
+        arena, cache->pending_chunks, cache->pending_bytes);
+    delayed_chunks += cache->pending_chunks;
+    delayed_bytes += cache->pending_bytes;
+    cache->pending_chunks = 0;
+    cache->pending_bytes = 0;
+}
+
+/* Takes up to a batch of re-usable chunks plus one more from the front of
+ * bucket, obeying the same delay limits as find_free_list_entry().  Returns
+ * the extra one (not yet prepared for re-use), or NULL if none is available.
+ */
+static chunk_header_t *
+thread_cache_refill(arena_header_t *arena, thread_cache_t *cache, uint bucket)
+{
+    free_lists_t *lists = arena->free_list;
+    free_header_t *res = NULL, *tail = NULL;
+    uint count = 0;
+    ASSERT(dr_recurlock_self_owns(arena->lock), "caller must hold lock");
+    ASSERT(bucket < NUM_FREE_LISTS - 1 && cache->reuse[bucket] == NULL,
+           "only refill an empty fixed-size bucket");
+    while (lists->front[bucket] != NULL && count <= alloc_ops.thread_cache_batch &&
+           (delayed_chunks >= alloc_ops.delay_frees ||
+            delayed_bytes >= alloc_ops.delay_frees_maxsz)) {
+        free_header_t *cur = lists->front[bucket];
+        free_list_unlink(lists, bucket, cur, NULL);
+        ASSERT(delayed_chunks > 0, "delay counter off");
+        delayed_chunks--;
+        ASSERT(delayed_bytes >= cur->head.alloc_size, "delay bytes counter off");
+        delayed_bytes -= cur->head.alloc_size;
+        cur->next = NULL;
+        if (res == NULL)
+            res = cur;
+        else if (tail == NULL)
+            cache->reuse[bucket] = tail = cur;
+        else {
+            tail->next = cur;
+            tail = cur;
+        }
+        count++;
+    }
+    LOG(3, "arena "PFX" bucket %d moved %d chunks to thread cache\n",
+        arena, bucket, count);
+    return (chunk_header_t *) res;
+}
+
+/* puts this thread's unused re-usable chunks back at the front of the
+ * shared free lists, where they came from
+ */
+static void
+thread_cache_return_reuse(arena_header_t *arena, thread_cache_t *cache)
+{
+    uint bucket;
+    ASSERT(dr_recurlock_self_owns(arena->lock), "caller must hold lock");
+    for (bucket = 0; bucket < NUM_FREE_LISTS - 1; bucket++) {
+        free_header_t *cur, *tail = NULL;
+        if (cache->reuse[bucket] == NULL)
+            continue;
+        for (cur = cache->reuse[bucket]; cur != NULL; cur = cur->next) {
+            delayed_chunks++;
+            delayed_bytes += cur->head.alloc_size;
+            tail = cur;
+        }
+        free_list_prepend(arena->free_list, bucket, cache->reuse[bucket], tail);
+        cache->reuse[bucket] = NULL;
+    }
+}
+
+static void
+event_thread_init(void *drcontext)
+{
+    thread_cache_t *cache = (thread_cache_t *)
+        thread_alloc(drcontext, sizeof(*cache), HEAPSTAT_MISC);
+    memset(cache, 0, sizeof(*cache));
+    drmgr_set_tls_field(drcontext, tls_idx_alloc_replace, cache);
+}
+
+static void
+event_thread_exit(void *drcontext)
+{
+    thread_cache_t *cache = (thread_cache_t *)
+        drmgr_get_tls_field(drcontext, tls_idx_alloc_replace);
+    if (cache == NULL)
+        return;
+    /* We're not in app context here so we use the raw lock, like
+     * malloc_replace__lock()
+     */
+    dr_recurlock_lock(cur_arena->lock);
+    thread_cache_flush_pending(cur_arena, cache);
+    thread_cache_return_reuse(cur_arena, cache);
+    dr_recurlock_unlock(cur_arena->lock);
+    drmgr_set_tls_field(drcontext, tls_idx_alloc_replace, NULL);
+    thread_free(drcontext, cache, sizeof(*cache), HEAPSTAT_MISC);
 }
 
 static byte *
@@ -788,6 +1594,9 @@ replace_alloc_common(arena_header_t *arena, size_t request_size, bool synch, boo
     heapsz_t aligned_size;
     byte *res = NULL;
     chunk_header_t *head = NULL;
+    thread_cache_t *cache;
+    uint cache_bucket = NUM_FREE_LISTS;
+    bool locked = false;
     ASSERT((alloc_type & ~(MALLOC_ALLOCATOR_FLAGS)) == 0, "invalid type flags");
 
     if (request_size > UINT_MAX ||
@@ -807,15 +1616,32 @@ replace_alloc_common(arena_header_t *arena, size_t request_size, bool synch, boo
     if (aligned_size < CHUNK_MIN_SIZE)
         aligned_size = CHUNK_MIN_SIZE;
 
-    /* XXX i#948: use per-thread free lists to avoid lock in common case */
-    if (synch)
+    /* i#948: try this thread's cache first to avoid the lock */
+    cache = thread_cache_get(drcontext, arena, synch);
+    if (cache != NULL) {
+        cache_bucket = thread_cache_alloc_bucket(aligned_size);
+        if (cache_bucket < NUM_FREE_LISTS && cache->reuse[cache_bucket] != NULL) {
+            head = (chunk_header_t *) cache->reuse[cache_bucket];
+            cache->reuse[cache_bucket] = cache->reuse[cache_bucket]->next;
+            LOG(2, "\tusing thread cache size=%d for request=%d from bucket %d\n",
+                head->alloc_size, request_size, cache_bucket);
+            prepare_free_chunk_for_reuse(head);
+            STATS_SHARD_INC(heap_lock_avoided);
+        }
+    }
+
+    if (head == NULL && synch) {
         app_heap_lock(drcontext, arena->lock);
+        locked = true;
+    }
 
     /* for large requests we do direct mmap with own redzones.
      * we use the large malloc table to track them for iteration.
      * XXX: for simplicity, not delay-freeing these for now
      */
-    if (aligned_size + HEADER_SIZE >= CHUNK_MIN_MMAP) {
+    if (head != NULL) {
+        /* from thread cache: header is already set up */
+    } else if (aligned_size + HEADER_SIZE >= CHUNK_MIN_MMAP) {
         size_t map_size = (size_t)
             ALIGN_FORWARD(aligned_size + alloc_ops.redzone_size*2 +
                           header_beyond_redzone, PAGE_SIZE);
@@ -836,8 +1662,26 @@ replace_alloc_common(arena_header_t *arena, size_t request_size, bool synch, boo
         head->alloc_size = map_size - alloc_ops.redzone_size*2 - header_beyond_redzone;
         heap_region_add(map, map + map_size, HEAP_MMAP, mc);
     } else {
+        if (cache != NULL) {
+            /* we hold the lock anyway, so publish our pending frees */
+            thread_cache_flush_pending(arena, cache);
+            if (cache_bucket < NUM_FREE_LISTS) {
+                head = thread_cache_refill(arena, cache, cache_bucket);
+                if (head != NULL)
+                    prepare_free_chunk_for_reuse(head);
+            }
+        }
         /* look for free list entry */
-        head = find_free_list_entry(arena, request_size, aligned_size);
+        if (head == NULL)
+            head = find_free_list_entry(arena, request_size, aligned_size);
+        /* before growing the arena, see whether coalescing frees up room,
+         * either on the free lists or at the end of the arena
+         */
+        if (head == NULL &&
+            arena->next_chunk + aligned_size + alloc_ops.redzone_size +
+            header_beyond_redzone > arena->commit_end &&
+            arena_coalesce(arena))
+            head = find_free_list_entry(arena, request_size, aligned_size);
     }
 
     /* if no free list entry, get new memory */
@@ -866,6 +1710,8 @@ replace_alloc_common(arena_header_t *arena, size_t request_size, bool synch, boo
     ASSERT(head->magic == HEADER_MAGIC, "corrupted header");
     head->request_size = request_size;
     head->flags |= alloc_type;
+    if (!TEST(CHUNK_MMAP, head->flags))
+        STATS_SHARD_ADD(arena_bytes_alloced, head->alloc_size);
     res = ptr_from_header(head);
     LOG(2, "\treplace_alloc_common flags="PIFX" request=%d, alloc=%d => "PFX"\n",
         head->flags, head->request_size, head->alloc_size, res);
@@ -880,10 +1726,10 @@ replace_alloc_common(arena_header_t *arena, size_t request_size, bool synch, boo
     if (head->request_size >= LARGE_MALLOC_MIN_SIZE)
         malloc_large_add(res, request_size);
     else
-        STATS_INC(num_mallocs);
+        STATS_SHARD_INC(num_mallocs);
 
  replace_alloc_common_done:
-    if (synch)
+    if (locked)
         app_heap_unlock(drcontext, arena->lock);
 
     return res;
@@ -915,6 +1761,8 @@ replace_free_common(arena_header_t *arena, void *ptr, bool synch, void *drcontex
     chunk_header_t *head = header_from_ptr(ptr);
     free_header_t *cur;
     uint bucket;
+    thread_cache_t *cache;
+    bool locked = false;
 
     if (!is_live_alloc(ptr, arena, head)) { /* including NULL */
         /* w/o early inject, or w/ delayed instru, there are allocs in place
@@ -960,8 +1808,18 @@ replace_free_common(arena_header_t *arena, void *ptr, bool synch, void *drcontex
         }
     }
 
-    if (synch)
+    /* i#948: small chunks of the default arena go to this thread's cache w/o
+     * the lock.  The var-size bucket is never cached.
+     */
+    cache = thread_cache_get(drcontext, arena, synch);
+    if (cache != NULL &&
+        (TESTANY(CHUNK_MMAP | CHUNK_PRE_US, head->flags) ||
+         head->alloc_size >= free_list_sizes[NUM_FREE_LISTS - 1]))
+        cache = NULL;
+    if (synch && cache == NULL) {
         app_heap_lock(drcontext, arena->lock);
+        locked = true;
+    }
 
     check_type_match(ptr, head, free_type, mc, caller);
 
@@ -970,32 +1828,28 @@ replace_free_common(arena_header_t *arena, void *ptr, bool synch, void *drcontex
     if (!TESTANY(CHUNK_MMAP | CHUNK_PRE_US, head->flags)) {
         cur = (free_header_t *) head;
         /* our buckets guarantee that all allocs in that bucket have at least that size */
-        for (bucket = NUM_FREE_LISTS - 1; head->alloc_size < free_list_sizes[bucket];
-             bucket--)
-            ; /* nothing */
-        ASSERT(head->alloc_size >= free_list_sizes[bucket], "bucket invariant violated");
+        bucket = free_list_bucket_for_free(head->alloc_size);
         LOG(2, "\treplace_free_common "PFX" == request=%d, alloc=%d\n",
             ptr, head->request_size, head->alloc_size);
+        STATS_SHARD_ADD(arena_bytes_freed, head->alloc_size);
 
-        /* add to the end for delayed free FIFO */
-        cur->next = NULL;
-        if (arena->free_list->last[bucket] == NULL) {
-            ASSERT(arena->free_list->front[bucket] == NULL, "inconsistent free list");
-            arena->free_list->front[bucket] = cur;
-        } else
-            arena->free_list->last[bucket]->next = cur;
-        arena->free_list->last[bucket] = cur;
-        LOG(3, "arena "PFX" bucket %d free front="PFX" last="PFX"\n",
-            arena, bucket, arena->free_list->front[bucket],
-            arena->free_list->last[bucket]);
+        if (cache != NULL) {
+            /* queued in FIFO order and appended to the shared lists in a batch */
+            thread_cache_add_pending(cache, cur, bucket);
+        } else {
+            /* add to the end for delayed free FIFO */
+            free_list_add(arena->free_list, cur, bucket);
+            LOG(3, "arena "PFX" bucket %d free front="PFX" last="PFX"\n",
+                arena, bucket, arena->free_list->front[bucket],
+                arena->free_list->last[bucket]);
 
-        delayed_chunks++;
-        delayed_bytes += head->alloc_size;
+            delayed_chunks++;
+            delayed_bytes += head->alloc_size;
+        }
 
-        /* XXX i#948: could add more sophisticated features like coalescing adjacent
-         * free entries which we may actually need for apps with corner-case
-         * alloc patterns.  We may also want to implement negative sbrk to
-         * give memory back.
+        /* XXX i#948: adjacent free entries are coalesced once they leave the
+         * delay queue (see arena_coalesce()), but we may also want to implement
+         * negative sbrk to give memory back.
          */
     }
 
@@ -1034,13 +1888,113 @@ replace_free_common(arena_header_t *arena, void *ptr, bool synch, void *drcontex
             ASSERT(false, "munmap failed");
     }
 
-    STATS_INC(num_frees);
+    STATS_SHARD_INC(num_frees);
 
-    if (synch)
+    if (locked)
         app_heap_unlock(drcontext, arena->lock);
+    else if (cache != NULL) {
+        if (cache->pending_chunks >= alloc_ops.thread_cache_batch) {
+            app_heap_lock(drcontext, arena->lock);
+            thread_cache_flush_pending(arena, cache);
+            app_heap_unlock(drcontext, arena->lock);
+        } else
+            STATS_SHARD_INC(heap_lock_avoided);
+    }
     return true;
 }
 
+/* Grows the live chunk at ptr to size without copying its contents: a large
+ * alloc is remapped (moving it only if allow_move), while the final chunk in an
+ * arena is extended into the arena's uncarved space.  Returns the possibly-moved
+ * base, or NULL if the caller must fall back to allocating a new chunk.
+ */
+static byte *
+replace_realloc_grow(arena_header_t *arena, byte *ptr, chunk_header_t *head,
+                     size_t size, bool lock, bool zeroed, bool allow_move,
+                     void *drcontext, dr_mcontext_t *mc)
+{
+    byte *res = NULL;
+    size_t old_request = head->request_size;
+    heapsz_t aligned_size;
+    ASSERT(size > head->alloc_size && !TEST(CHUNK_PRE_US, head->flags),
+           "only grows our own chunks");
+    /* leave reporting of too-large requests to replace_alloc_common() */
+    if (size > UINT_MAX || ALIGN_FORWARD(size, PAGE_SIZE) < size)
+        return NULL;
+    aligned_size = ALIGN_FORWARD(size, CHUNK_ALIGNMENT);
+
+    if (lock)
+        app_heap_lock(drcontext, arena->lock);
+    if (TEST(CHUNK_MMAP, head->flags)) {
+#ifdef LINUX
+        byte *map = ptr - alloc_ops.redzone_size - header_beyond_redzone;
+        size_t map_size = head->alloc_size + alloc_ops.redzone_size*2 +
+            header_beyond_redzone;
+        size_t new_map_size = (size_t)
+            ALIGN_FORWARD(aligned_size + alloc_ops.redzone_size*2 +
+                          header_beyond_redzone, PAGE_SIZE);
+        byte *new_map;
+        if (allow_move)
+            new_map = os_large_remap(map, map_size, new_map_size);
+        else {
+            new_map = os_large_alloc_extend(map, map_size, new_map_size) ?
+                map : NULL;
+        }
+        if (new_map != NULL) {
+            /* the header and redzones moved along with the data */
+            res = new_map + (ptr - map);
+            head = header_from_ptr(res);
+            ASSERT(head->magic == HEADER_MAGIC, "corrupted header");
+            head->alloc_size = new_map_size - alloc_ops.redzone_size*2 -
+                header_beyond_redzone;
+            LOG(2, "\tlarge realloc %d => %d mremap @"PFX" => "PFX"\n",
+                old_request, size, map, new_map);
+            if (new_map == map)
+                heap_region_adjust(map, map + new_map_size);
+            else {
+                heap_region_remove(map, map + map_size, mc);
+                heap_region_add(new_map, new_map + new_map_size, HEAP_MMAP, mc);
+            }
+            STATS_SHARD_INC(realloc_remapped);
+        }
+#endif
+    } else if (aligned_size + HEADER_SIZE < CHUNK_MIN_MMAP) {
+        /* we keep larger sizes as mmaps so they can be remapped later */
+        byte *chunk_end = ptr + head->alloc_size + alloc_ops.redzone_size +
+            header_beyond_redzone;
+        heapsz_t add_size = aligned_size - head->alloc_size;
+        arena_header_t *a = arena_containing(arena, ptr);
+        if (a != NULL && chunk_end == a->next_chunk &&
+            (a->next_chunk + add_size <= a->commit_end ||
+             arena_extend_in_place(a, a->next_chunk + add_size - a->commit_end))) {
+            LOG(2, "\trealloc %d => %d extending final chunk "PFX" in-place\n",
+                old_request, size, ptr);
+            head->alloc_size = aligned_size;
+            a->next_chunk += add_size;
+            res = ptr;
+            STATS_SHARD_INC(realloc_grown_in_place);
+            STATS_SHARD_ADD(arena_bytes_alloced, add_size);
+        }
+    }
+
+    if (res != NULL) {
+        /* the shadow for the old contents is moved in bulk */
+        client_handle_realloc(drcontext, ptr, old_request, res, size,
+                              /* XXX: real_base is regular base for us => no pattern */
+                              res, mc);
+        if (old_request >= LARGE_MALLOC_MIN_SIZE)
+            malloc_large_remove(ptr);
+        if (zeroed)
+            memset(res + old_request, 0, size - old_request);
+        head->request_size = size;
+        if (head->request_size >= LARGE_MALLOC_MIN_SIZE)
+            malloc_large_add(res, head->request_size);
+    }
+    if (lock)
+        app_heap_unlock(drcontext, arena->lock);
+    return res;
+}
+
 static byte *
 replace_realloc_common(arena_header_t *arena, byte *ptr, size_t size,
                        bool lock, bool zeroed, bool in_place_only, bool allow_null,
@@ -1094,16 +2048,21 @@ replace_realloc_common(arena_header_t *arena, byte *ptr, size_t size,
         if (head->request_size >= LARGE_MALLOC_MIN_SIZE)
             malloc_large_add(ptr, head->request_size);
         res = ptr;
-    } else if (!in_place_only) {
-        /* XXX: use mremap for mmapped alloc! */
-        /* XXX: if final chunk in arena, extend in-place */
-        res = (void *) replace_alloc_common(arena, size, lock, zeroed,
-                                            true/*realloc*/, drcontext, mc, caller,
-                                            MALLOC_ALLOCATOR_MALLOC);
-        if (res != NULL) {
-            memcpy(res, ptr, head->request_size);
-            replace_free_common(arena, ptr, lock, drcontext, mc, caller,
-                                MALLOC_ALLOCATOR_MALLOC);
+    } else {
+        if (!TEST(CHUNK_PRE_US, head->flags)) {
+            res = replace_realloc_grow(arena, ptr, head, size, lock, zeroed,
+                                       !in_place_only, drcontext, mc);
+        }
+        if (res == NULL && !in_place_only) {
+            res = (void *) replace_alloc_common(arena, size, lock, zeroed,
+                                                true/*realloc*/, drcontext, mc, caller,
+                                                MALLOC_ALLOCATOR_MALLOC);
+            if (res != NULL) {
+                memcpy(res, ptr, head->request_size);
+                replace_free_common(arena, ptr, lock, drcontext, mc, caller,
+                                    MALLOC_ALLOCATOR_MALLOC);
+                STATS_SHARD_INC(realloc_copied);
+            }
         }
     }
     return res;
@@ -2004,6 +2963,63 @@ alloc_replace_in_cur_arena(byte *addr)
     return (addr >= (byte *)cur_arena && addr < cur_arena->reserve_end);
 }
 
+#ifdef STATISTICS
+static void
+search_hist_print(file_t f, const char *name, uint *hist)
+{
+    uint bin;
+    dr_fprintf(f, "%s:", name);
+    for (bin = 0; bin < SEARCH_HIST_BINS; bin++) {
+        if (bin == 0)
+            dr_fprintf(f, " 0:%u", hist[bin]);
+        else if (bin == SEARCH_HIST_BINS - 1)
+            dr_fprintf(f, " %u+:%u", 1 << (bin - 1), hist[bin]);
+        else
+            dr_fprintf(f, " %u-%u:%u", 1 << (bin - 1), (1 << bin) - 1, hist[bin]);
+    }
+    dr_fprintf(f, "\n");
+}
+
+typedef struct _arena_footprint_t {
+    size_t committed;
+    size_t carved;
+} arena_footprint_t;
+
+static bool
+arena_footprint_iter(byte *start, byte *end, uint flags
+                     _IF_WINDOWS(HANDLE heap), void *iter_data)
+{
+    arena_footprint_t *fp = (arena_footprint_t *) iter_data;
+    if (TEST(HEAP_ARENA, flags) && !TEST(HEAP_PRE_US, flags)) {
+        arena_header_t *arena = (arena_header_t *) start;
+        fp->committed += arena->commit_end - start;
+        fp->carved += arena->next_chunk - arena->start_chunk;
+    }
+    return true;
+}
+
+void
+alloc_replace_dump_stats(file_t f)
+{
+    arena_footprint_t fp = {0, 0};
+    ASSERT(alloc_ops.replace_malloc, "shouldn't call");
+    heap_region_iterate(arena_footprint_iter, &fp);
+    dr_fprintf(f, "arena bytes: %10"UINT64_FORMAT_CODE" committed, %10"UINT64_FORMAT_CODE
+               " carved, %10"UINT64_FORMAT_CODE" live\n",
+               (uint64) fp.committed, (uint64) fp.carved,
+               STATS_SHARD_SUM(arena_bytes_alloced) - STATS_SHARD_SUM(arena_bytes_freed));
+    dr_fprintf(f, "coalescing: %6u passes, %8u chunks evicted, %8u absorbed\n",
+               coalesce_passes, coalesce_evicted, coalesce_absorbed);
+    dr_fprintf(f, "coalescing: %10"UINT64_FORMAT_CODE" bytes returned to arenas, %10"
+               UINT64_FORMAT_CODE" reset\n",
+               STATS_SHARD_SUM(coalesce_tail_bytes),
+               STATS_SHARD_SUM(coalesce_reset_bytes));
+    dr_fprintf(f, "free list chunks examined per search\n");
+    search_hist_print(f, "  fixed-size", fixed_search_hist);
+    search_hist_print(f, "  var-size", large_search_hist);
+}
+#endif
+
 bool
 alloc_entering_replace_routine(app_pc pc)
 {
@@ -2377,6 +3393,12 @@ alloc_replace_init(void)
 
     ASSERT(ALIGNED(alloc_ops.redzone_size, CHUNK_ALIGNMENT), "redzone alignment off");
 
+    ASSERT(NUM_FREE_LISTS <= sizeof(((free_lists_t *)0)->nonempty) * 8 &&
+           free_list_sizes[VAR_FREE_LIST - 1] == MAX_FIXED_FREE_SIZE &&
+           sizeof(large_free_header_t) - sizeof(chunk_header_t) <=
+           free_list_sizes[VAR_FREE_LIST], "free list buckets misconfigured");
+    free_list_bucket_init();
+
     if (alloc_ops.redzone_size < HEADER_SIZE) {
         header_beyond_redzone = HEADER_SIZE - alloc_ops.redzone_size;
         redzone_beyond_header = 0;
@@ -2388,6 +3410,15 @@ alloc_replace_init(void)
 
     hashtable_init(&pre_us_table, PRE_US_TABLE_HASH_BITS, HASH_INTPTR, false/*!strdup*/);
 
+    /* XXX i#879: external headers would need the cache to track chunk pointers */
+    if (alloc_ops.thread_cache_batch > 0 && !alloc_ops.external_headers) {
+        tls_idx_alloc_replace = drmgr_register_tls_field();
+        ASSERT(tls_idx_alloc_replace > -1, "unable to reserve TLS slot");
+        if (!drmgr_register_thread_init_event(event_thread_init) ||
+            !drmgr_register_thread_exit_event(event_thread_exit))
+            ASSERT(false, "drmgr registration failed");
+    }
+
 #ifdef LINUX
     /* we waste pre-brk space of pre-us allocator, and we assume we're
      * now completely replacing the pre-us allocator.
@@ -2466,6 +3497,11 @@ void
 alloc_replace_exit(void)
 {
     uint i;
+    if (tls_idx_alloc_replace != -1) {
+        drmgr_unregister_thread_init_event(event_thread_init);
+        drmgr_unregister_thread_exit_event(event_thread_exit);
+        drmgr_unregister_tls_field(tls_idx_alloc_replace);
+    }
     alloc_iterate(free_user_data_at_exit, NULL, false/*free too*/);
     /* XXX: should add hashtable_iterate() to drcontainers */
     for (i = 0; i < HASHTABLE_SIZE(pre_us_table.table_bits); i++) {
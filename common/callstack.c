@@ -67,11 +67,7 @@ static uint op_callstack_dump_stack;
 #define LINE_PREFIX "    "
 
 #ifdef STATISTICS
-uint find_next_fp_scans;
 uint symbol_names_truncated;
-uint cstack_is_retaddr;
-uint cstack_is_retaddr_backdecode;
-uint cstack_is_retaddr_unreadable;
 #endif
 
 typedef struct _tls_callstack_t {
@@ -79,6 +75,19 @@ typedef struct _tls_callstack_t {
     size_t errbufsz;
     byte *page_buf; /* buffer for app stack safe read */
     app_pc stack_lowest_frame; /* optimization for recording callstacks */
+    /* The module map this thread is reading, which writers must not free */
+    struct _module_map_t * volatile map_hazard;
+    /* Last module hit and last non-module page, valid while mod_cache_gen
+     * matches module_map_gen
+     */
+    uint mod_cache_gen;
+    app_pc mod_cache_start;
+    app_pc mod_cache_end;
+    struct _modname_info_t *mod_cache_name;
+    app_pc mod_cache_miss;
+    /* List of all threads, for scanning hazards.  Protected by modtree_lock. */
+    struct _tls_callstack_t *next;
+    struct _tls_callstack_t *prev;
 } tls_callstack_t;
 
 static int tls_idx_callstack = -1;
@@ -137,6 +146,8 @@ typedef struct _modname_info_t {
     bool hide_modname;
     /* Avoid repeated warnings about symbols */
     bool warned_no_syms;
+    /* Bumped each time the path is loaded again, to invalidate addr_sym_table */
+    uint load_count;
 } modname_info_t;
 
 /* When the number of modules hits the max for our 8-bit index we
@@ -201,6 +212,40 @@ static uint modname_array_end = 1;
  */
 static uint modname_unique_id = 1;
 
+#ifdef USE_DRSYMS
+/* Results of drsym_lookup_address() keyed by module and offset.  Callstacks
+ * share most of their frames (leak reports in particular), so without this
+ * we would look up the same address over and over.  Filled in on demand and
+ * in bulk by packed_callstack_batch_symbolize().
+ */
+# define ADDR_SYM_TABLE_HASH_BITS 10
+typedef struct _addr_sym_key_t {
+    modname_info_t *name_info;
+    size_t modoffs;
+} addr_sym_key_t;
+
+typedef struct _addr_sym_t {
+    addr_sym_key_t key;
+    /* name_info->load_count at lookup time */
+    uint load_count;
+    bool found;
+    bool has_symbols;
+    bool has_line;
+    const char *func; /* strdup-ed; NULL if !found */
+    size_t start_offs;
+    const char *fname; /* strdup-ed; NULL if !has_line */
+    uint64 line;
+    size_t line_offs;
+} addr_sym_t;
+
+static hashtable_t addr_sym_table;
+
+# ifdef STATISTICS
+uint symbol_address_cache_hits;
+uint symbol_address_batched;
+# endif
+#endif
+
 /* PR 473640: our own module region tree */
 static rb_tree_t *module_tree;
 static void *modtree_lock;
@@ -209,13 +254,35 @@ static void *modtree_lock;
  */
 static app_pc modtree_min_start;
 static app_pc modtree_max_end;
-/* cached values for module_lookup */
-static app_pc modtree_last_start;
-static size_t modtree_last_size;
-static modname_info_t *modtree_last_name_info;
-/* cached values for is_in_module() */
-static app_pc modtree_last_hit;
-static app_pc modtree_last_miss;
+
+/* Every callstack frame candidate is looked up, from every thread, so lookups
+ * must not take a lock.  We publish a sorted copy of module_tree on every
+ * module load or unload.  Readers announce the copy they are reading in a
+ * per-thread hazard pointer, and writers only free a retired copy once no
+ * thread announces it.  Threads without tls_callstack_t (client threads)
+ * hold modtree_lock instead.
+ */
+typedef struct _module_entry_t {
+    app_pc start;
+    app_pc end;
+    modname_info_t *name_info;
+} module_entry_t;
+
+typedef struct _module_map_t {
+    uint num;
+    struct _module_map_t *next_retired;
+    module_entry_t entries[1]; /* variable-length */
+} module_map_t;
+
+#define MODULE_MAP_SIZE(num) \
+    (sizeof(module_map_t) + ((num) == 0 ? 0 : (num) - 1) * sizeof(module_entry_t))
+
+static module_map_t * volatile module_map;
+/* Bumped after each publication, to invalidate the per-thread caches */
+static volatile uint module_map_gen;
+/* These are protected by modtree_lock */
+static module_map_t *module_map_retired;
+static tls_callstack_t *callstack_threads;
 
 /****************************************************************************
  * Symbolized callstacks for comparing to suppressions.
@@ -254,12 +321,26 @@ struct _symbolized_frame_t {
 static bool
 module_lookup(byte *pc, app_pc *start OUT, size_t *size OUT, modname_info_t **name OUT);
 
+static void
+module_map_publish(void);
+
 static void
 modname_info_free(void *p);
 
 static void
 warn_no_symbols(modname_info_t *name_info);
 
+#ifdef USE_DRSYMS
+static uint
+addr_sym_hash(void *key);
+
+static bool
+addr_sym_cmp(void *key1, void *key2);
+
+static void
+addr_sym_free(void *p);
+#endif
+
 /***************************************************************************/
 
 size_t
@@ -312,20 +393,43 @@ callstack_init(uint callstack_max_frames, uint stack_swap_threshold,
     modname_table_initialized = true;
     modtree_lock = dr_mutex_create();
     module_tree = rb_tree_create(NULL);
+    dr_mutex_lock(modtree_lock);
+    module_map_publish();
+    dr_mutex_unlock(modtree_lock);
 
 #ifdef USE_DRSYMS
     IF_WINDOWS(ASSERT(using_private_peb(), "private peb not preserved"));
     /* we rely on drsym_init() being called in utils_init() */
+    hashtable_init_ex(&addr_sym_table, ADDR_SYM_TABLE_HASH_BITS, HASH_CUSTOM,
+                      false/*!str_dup*/, false/*!synch*/, addr_sym_free,
+                      addr_sym_hash, addr_sym_cmp);
 #endif
 }
 
 void
 callstack_exit(void)
 {
+#ifdef USE_DRSYMS
+    hashtable_delete(&addr_sym_table);
+#endif
     hashtable_delete(&modname_table);
 
     dr_mutex_lock(modtree_lock);
     rb_tree_destroy(module_tree);
+    /* other threads are gone so no hazards remain */
+    ASSERT(callstack_threads == NULL || callstack_threads->next == NULL,
+           "threads still registered");
+    if (module_map != NULL) {
+        module_map->next_retired = module_map_retired;
+        module_map_retired = module_map;
+        module_map = NULL;
+    }
+    while (module_map_retired != NULL) {
+        module_map_t *next = module_map_retired->next_retired;
+        global_free(module_map_retired, MODULE_MAP_SIZE(module_map_retired->num),
+                    HEAPSTAT_MISC);
+        module_map_retired = next;
+    }
     dr_mutex_unlock(modtree_lock);
     dr_mutex_destroy(modtree_lock);
 
@@ -356,6 +460,16 @@ callstack_thread_init(void *drcontext)
     } else
 #endif
         pt->stack_lowest_frame = NULL;
+    pt->map_hazard = NULL;
+    /* module_map_gen starts at 1 so this is invalid */
+    pt->mod_cache_gen = 0;
+    dr_mutex_lock(modtree_lock);
+    pt->prev = NULL;
+    pt->next = callstack_threads;
+    if (callstack_threads != NULL)
+        callstack_threads->prev = pt;
+    callstack_threads = pt;
+    dr_mutex_unlock(modtree_lock);
 }
 
 void
@@ -363,6 +477,14 @@ callstack_thread_exit(void *drcontext)
 {
     tls_callstack_t *pt = (tls_callstack_t *)
         drmgr_get_tls_field(drcontext, tls_idx_callstack);
+    dr_mutex_lock(modtree_lock);
+    if (pt->prev == NULL)
+        callstack_threads = pt->next;
+    else
+        pt->prev->next = pt->next;
+    if (pt->next != NULL)
+        pt->next->prev = pt->prev;
+    dr_mutex_unlock(modtree_lock);
     thread_free(drcontext, (void *) pt->errbuf, pt->errbufsz, HEAPSTAT_CALLSTACK);
     thread_free(drcontext, (void *) pt->page_buf, PAGE_SIZE, HEAPSTAT_CALLSTACK);
     drmgr_set_tls_field(drcontext, tls_idx_callstack, NULL);
@@ -391,15 +513,46 @@ init_symbolized_frame(symbolized_frame_t *frame OUT, uint frame_num)
 }
 
 #ifdef USE_DRSYMS
-/* Symbol lookup: i#44/PR 243532 */
+static uint
+addr_sym_hash(void *key)
+{
+    addr_sym_key_t *k = (addr_sym_key_t *) key;
+    return (uint)(ptr_uint_t)k->name_info ^ (uint)(k->modoffs << 3) ^
+        (uint)(k->modoffs >> 13);
+}
+
+static bool
+addr_sym_cmp(void *key1, void *key2)
+{
+    addr_sym_key_t *k1 = (addr_sym_key_t *) key1;
+    addr_sym_key_t *k2 = (addr_sym_key_t *) key2;
+    return k1->name_info == k2->name_info && k1->modoffs == k2->modoffs;
+}
+
 static void
-lookup_func_and_line(symbolized_frame_t *frame OUT,
-                     modname_info_t *name_info IN, size_t modoffs)
+addr_sym_free(void *p)
+{
+    addr_sym_t *entry = (addr_sym_t *) p;
+    if (entry->func != NULL)
+        global_free((void *)entry->func, strlen(entry->func) + 1, HEAPSTAT_CALLSTACK);
+    if (entry->fname != NULL)
+        global_free((void *)entry->fname, strlen(entry->fname) + 1, HEAPSTAT_CALLSTACK);
+    global_free(entry, sizeof(*entry), HEAPSTAT_CALLSTACK);
+}
+
+/* Symbol lookup: i#44/PR 243532 */
+static addr_sym_t *
+addr_sym_create(modname_info_t *name_info, size_t modoffs)
 {
     drsym_error_t symres;
     drsym_info_t *sym;
     const char *modpath = name_info->path;
     char sbuf[sizeof(*sym) + MAX_FUNC_LEN];
+    addr_sym_t *entry = (addr_sym_t *) global_alloc(sizeof(*entry), HEAPSTAT_CALLSTACK);
+    memset(entry, 0, sizeof(*entry));
+    entry->key.name_info = name_info;
+    entry->key.modoffs = modoffs;
+    entry->load_count = name_info->load_count;
     sym = (drsym_info_t *) sbuf;
     sym->struct_size = sizeof(*sym);
     sym->name_size = MAX_FUNC_LEN;
@@ -417,21 +570,80 @@ lookup_func_and_line(symbolized_frame_t *frame OUT,
             });
             STATS_INC(symbol_names_truncated);
         }
-        frame->has_symbols = TEST(DRSYM_SYMBOLS, sym->debug_kind);
-        dr_snprintf(frame->func, MAX_FUNC_LEN, sym->name);
+        entry->found = true;
+        entry->has_symbols = TEST(DRSYM_SYMBOLS, sym->debug_kind);
+        entry->func = drmem_strdup(sym->name, HEAPSTAT_CALLSTACK);
+        entry->start_offs = sym->start_offs;
+        if (symres == DRSYM_SUCCESS) {
+            entry->has_line = true;
+            entry->fname = drmem_strdup(sym->file == NULL ? "" : sym->file,
+                                        HEAPSTAT_CALLSTACK);
+            entry->line = sym->line;
+            entry->line_offs = sym->line_offs;
+        }
+    }
+    return entry;
+}
+
+/* Returns the addr_sym_table entry for name_info+modoffs, looking it up if
+ * necessary.  The caller must hold the table lock, which may be dropped and
+ * re-acquired across the lookup.
+ */
+static addr_sym_t *
+addr_sym_lookup(modname_info_t *name_info, size_t modoffs)
+{
+    addr_sym_key_t key;
+    addr_sym_t *entry, *existing;
+    key.name_info = name_info;
+    key.modoffs = modoffs;
+    entry = (addr_sym_t *) hashtable_lookup(&addr_sym_table, (void *)&key);
+    if (entry != NULL && entry->load_count == name_info->load_count) {
+        STATS_INC(symbol_address_cache_hits);
+        return entry;
+    }
+    /* Don't hold the table lock across drsyms, which can take a while to load
+     * debug info.  Another thread may beat us to it, in which case we keep its
+     * result.
+     */
+    hashtable_unlock(&addr_sym_table);
+    entry = addr_sym_create(name_info, modoffs);
+    hashtable_lock(&addr_sym_table);
+    existing = (addr_sym_t *) hashtable_lookup(&addr_sym_table, (void *)&key);
+    if (existing != NULL && existing->load_count == entry->load_count) {
+        addr_sym_free(entry);
+        return existing;
+    }
+    existing = (addr_sym_t *)
+        hashtable_add_replace(&addr_sym_table, (void *)&entry->key, (void *)entry);
+    if (existing != NULL)
+        addr_sym_free(existing);
+    return entry;
+}
+
+static void
+lookup_func_and_line(symbolized_frame_t *frame OUT,
+                     modname_info_t *name_info IN, size_t modoffs)
+{
+    addr_sym_t *entry;
+    hashtable_lock(&addr_sym_table);
+    entry = addr_sym_lookup(name_info, modoffs);
+    if (entry->found) {
+        frame->has_symbols = entry->has_symbols;
+        dr_snprintf(frame->func, MAX_FUNC_LEN, "%s", entry->func);
         NULL_TERMINATE_BUFFER(frame->func);
-        frame->funcoffs = (modoffs - sym->start_offs);
-        if (symres == DRSYM_ERROR_LINE_NOT_AVAILABLE) {
+        frame->funcoffs = (modoffs - entry->start_offs);
+        if (!entry->has_line) {
             frame->fname[0] = '\0';
             frame->line = 0;
             frame->lineoffs = 0;
         } else {
-            dr_snprintf(frame->fname, MAX_FILENAME_LEN, sym->file);
+            dr_snprintf(frame->fname, MAX_FILENAME_LEN, "%s", entry->fname);
             NULL_TERMINATE_BUFFER(frame->fname);
-            frame->line = sym->line;
-            frame->lineoffs = sym->line_offs;
+            frame->line = entry->line;
+            frame->lineoffs = entry->line_offs;
         }
     }
+    hashtable_unlock(&addr_sym_table);
 
     if (!frame->has_symbols) {
         warn_no_symbols(name_info);
@@ -837,7 +1049,7 @@ is_retaddr(byte *pc)
      * match +rx anyway, and rare for global var to have what looks like a call prior
      * to it.
      */
-    STATS_INC(cstack_is_retaddr);
+    STATS_SHARD_INC(cstack_is_retaddr);
     if (!is_in_module(pc))
         return false;
     if (!TEST(FP_SEARCH_DO_NOT_DISASM, op_fp_flags)) {
@@ -846,7 +1058,7 @@ is_retaddr(byte *pc)
          */
         /* more efficient to read 3 dwords than safe_read 6 into a buffer */
         bool match;
-        STATS_INC(cstack_is_retaddr_backdecode);
+        STATS_SHARD_INC(cstack_is_retaddr_backdecode);
         DR_TRY_EXCEPT(dr_get_current_drcontext(), {
             match = (*(pc - 5) == OP_CALL_DIR ||
                      (*(pc - 2) == OP_CALL_IND &&
@@ -869,7 +1081,7 @@ is_retaddr(byte *pc)
              * frequent/recent or switch to +rx instead of whole module
              */
             LOG(3, "is_retaddr: can't read "PFX"\n", pc);
-            STATS_INC(cstack_is_retaddr_unreadable);
+            STATS_SHARD_INC(cstack_is_retaddr_unreadable);
         });
 #ifdef USE_DRSYMS
         DOLOG(5, {
@@ -938,7 +1150,7 @@ find_next_fp(tls_callstack_t *pt, app_pc fp, bool top_frame, app_pc *retaddr/*OU
             stop = (app_pc)teb->StackBase;
 #endif
         /* Scan one page worth and look for potential fp,retaddr pair */
-        STATS_INC(find_next_fp_scans);
+        STATS_SHARD_INC(find_next_fp_scans);
         /* We only look at fp if TEST(FP_SEARCH_REQUIRE_FP, op_fp_flags) */
         for (sp = tos; sp < stop; sp+=sizeof(app_pc)) {
             match = false;
@@ -1025,10 +1237,14 @@ find_next_fp(tls_callstack_t *pt, app_pc fp, bool top_frame, app_pc *retaddr/*OU
     return NULL;
 }
 
-void
-print_callstack(char *buf, size_t bufsz, size_t *sofar, dr_mcontext_t *mc, 
-                bool print_fps, packed_callstack_t *pcs, int num_frames_printed,
-                bool for_log)
+/* Walks the callstack and either prints it to buf, packs it into pcs, or,
+ * if raw != NULL, records just the return addresses into raw without any
+ * module lookups beyond the first frame (i#75).
+ */
+static void
+walk_callstack(char *buf, size_t bufsz, size_t *sofar, dr_mcontext_t *mc,
+               bool print_fps, packed_callstack_t *pcs, app_pc *raw, uint *num_raw,
+               int num_frames_printed, bool for_log)
 {
     void *drcontext = dr_get_current_drcontext();
     tls_callstack_t *pt = (tls_callstack_t *)
@@ -1049,14 +1265,17 @@ print_callstack(char *buf, size_t bufsz, size_t *sofar, dr_mcontext_t *mc,
     bool last_frame = false;
 
     ASSERT(num == 0 || num == 1, "only 1 frame can already be printed");
-    ASSERT((buf != NULL && sofar != NULL && pcs == NULL) ||
-           (buf == NULL && sofar == NULL && pcs != NULL),
+    ASSERT((buf != NULL && sofar != NULL && pcs == NULL && raw == NULL) ||
+           (buf == NULL && sofar == NULL && (pcs == NULL) != (raw == NULL)),
            "print_callstack: can't pass buf and pcs");
+    ASSERT(raw == NULL || (num_raw != NULL && *num_raw == (uint)num),
+           "raw frame count mismatch");
 
 #ifdef DEBUG
     if (mc != NULL && op_callstack_dump_stack > 0)
         dump_app_stack(drcontext, pt, mc, op_callstack_dump_stack,
-                       (pcs == NULL ? NULL : PCS_FRAME_LOC(pcs, 0).addr));
+                       (pcs != NULL ? PCS_FRAME_LOC(pcs, 0).addr :
+                        ((raw != NULL && num > 0) ? raw[0] : NULL)));
 #endif
 
     if (mc != NULL) {
@@ -1128,12 +1347,22 @@ print_callstack(char *buf, size_t bufsz, size_t *sofar, dr_mcontext_t *mc,
          * for the call and not for the next source code line, but only for
          * symbol lookup so we still display a valid instr addr.
          */
-        if (pcs != NULL && first_iter && num == 1 &&
-            PCS_FRAME_LOC(pcs, 0).addr == appdata.retaddr) {
+        if (first_iter && num == 1 &&
+            ((pcs != NULL && PCS_FRAME_LOC(pcs, 0).addr == appdata.retaddr) ||
+             (raw != NULL && raw[0] == appdata.retaddr))) {
             /* caller already added this frame */
             if (buf != NULL) /* undo the fp= print */
                 *sofar = prev_sofar;
-        } else if ((pcs == NULL &&
+        } else if (raw != NULL &&
+                   /* we still need the module check on the first frame to
+                    * detect a misleading ebp (i#521); the rest are filtered
+                    * when the frames are resolved
+                    */
+                   (!first_iter || TEST(FP_SHOW_NON_MODULE_FRAMES, op_fp_flags) ||
+                    is_in_module(appdata.retaddr))) {
+            raw[(*num_raw)++] = appdata.retaddr;
+            num++;
+        } else if ((pcs == NULL && raw == NULL &&
                     print_address_common(buf, bufsz, sofar, appdata.retaddr, NULL,
                                          !TEST(FP_SHOW_NON_MODULE_FRAMES, op_fp_flags),
                                          true, for_log, &last_frame, num)) ||
@@ -1163,7 +1392,8 @@ print_callstack(char *buf, size_t bufsz, size_t *sofar, dr_mcontext_t *mc,
         }
         first_iter = false;
         /* pcs->num_frames could be larger if frames were printed before this routine */
-        if (num >= op_max_frames || (pcs != NULL && pcs->num_frames >= op_max_frames)) {
+        if (num >= op_max_frames || (pcs != NULL && pcs->num_frames >= op_max_frames) ||
+            (raw != NULL && *num_raw >= op_max_frames)) {
             if (buf != NULL)
                 BUFPRINT(buf, bufsz, *sofar, len, FP_PREFIX"..."NL);
             LOG(4, "truncating callstack: hit max frames %d %d\n", 
@@ -1251,6 +1481,15 @@ print_callstack(char *buf, size_t bufsz, size_t *sofar, dr_mcontext_t *mc,
     }
 }
 
+void
+print_callstack(char *buf, size_t bufsz, size_t *sofar, dr_mcontext_t *mc, 
+                bool print_fps, packed_callstack_t *pcs, int num_frames_printed,
+                bool for_log)
+{
+    walk_callstack(buf, bufsz, sofar, mc, print_fps, pcs, NULL, NULL,
+                   num_frames_printed, for_log);
+}
+
 void
 print_buffer(file_t f, char *buf)
 {
@@ -1317,18 +1556,11 @@ print_callstack_to_file(void *drcontext, dr_mcontext_t *mc, app_pc pc, file_t f)
  * Binary callstacks for storing callstacks of allocation sites.
  */
 
-/* Used for standalone allocation, rather than printing as part of an error report.
- * Caller must call free_callstack() to free buf_out.
- */
-void
-packed_callstack_record(packed_callstack_t **pcs_out/*out*/, dr_mcontext_t *mc,
-                        app_loc_t *loc)
+static packed_callstack_t *
+packed_callstack_alloc(void)
 {
     packed_callstack_t *pcs = (packed_callstack_t *)
         global_alloc(sizeof(*pcs), HEAPSTAT_CALLSTACK);
-    size_t sz_out;
-    int num_frames_printed = 0;
-    ASSERT(pcs_out != NULL, "invalid args");
     memset(pcs, 0, sizeof(*pcs));
     pcs->refcount = 1;
     if (modname_array_end < MAX_MODNAMES_STORED) {
@@ -1340,6 +1572,51 @@ packed_callstack_record(packed_callstack_t **pcs_out/*out*/, dr_mcontext_t *mc,
         pcs->frames.full = (full_frame_t *)
             global_alloc(sizeof(*pcs->frames.full) * op_max_frames, HEAPSTAT_CALLSTACK);
     }
+    return pcs;
+}
+
+/* Shrinks the max-sized frame array from packed_callstack_alloc() to fit */
+static void
+packed_callstack_shrink(packed_callstack_t *pcs)
+{
+    size_t sz_out;
+    if (pcs->is_packed) {
+        packed_frame_t *frames_out;
+        sz_out = sizeof(*pcs->frames.packed) * pcs->num_frames;
+        if (sz_out == 0)
+            frames_out = NULL;
+        else {
+            frames_out = (packed_frame_t *) global_alloc(sz_out, HEAPSTAT_CALLSTACK);
+            memcpy(frames_out, pcs->frames.packed, sz_out);
+        }
+        global_free(pcs->frames.packed, sizeof(*pcs->frames.packed) * op_max_frames,
+                    HEAPSTAT_CALLSTACK);
+        pcs->frames.packed = frames_out;
+    } else {
+        full_frame_t *frames_out;
+        sz_out = sizeof(*pcs->frames.full) * pcs->num_frames;
+        if (sz_out == 0)
+            frames_out = NULL;
+        else {
+            frames_out = (full_frame_t *) global_alloc(sz_out, HEAPSTAT_CALLSTACK);
+            memcpy(frames_out, pcs->frames.full, sz_out);
+        }
+        global_free(pcs->frames.full, sizeof(*pcs->frames.full) * op_max_frames,
+                    HEAPSTAT_CALLSTACK);
+        pcs->frames.full = frames_out;
+    }
+}
+
+/* Used for standalone allocation, rather than printing as part of an error report.
+ * Caller must call free_callstack() to free buf_out.
+ */
+void
+packed_callstack_record(packed_callstack_t **pcs_out/*out*/, dr_mcontext_t *mc,
+                        app_loc_t *loc)
+{
+    packed_callstack_t *pcs = packed_callstack_alloc();
+    int num_frames_printed = 0;
+    ASSERT(pcs_out != NULL, "invalid args");
     if (loc != NULL) {
         if (loc->type == APP_LOC_SYSCALL) {
             /* For syscalls, we use index 0 and store the syscall # in modoffs */
@@ -1367,31 +1644,43 @@ packed_callstack_record(packed_callstack_t **pcs_out/*out*/, dr_mcontext_t *mc,
         num_frames_printed = 1;
     }
     print_callstack(NULL, 0, NULL, mc, false, pcs, num_frames_printed, false);
-    if (pcs->is_packed) {
-        packed_frame_t *frames_out;
-        sz_out = sizeof(*pcs->frames.packed) * pcs->num_frames;
-        if (sz_out == 0)
-            frames_out = NULL;
-        else {
-            frames_out = (packed_frame_t *) global_alloc(sz_out, HEAPSTAT_CALLSTACK);
-            memcpy(frames_out, pcs->frames.packed, sz_out);
-        }
-        global_free(pcs->frames.packed, sizeof(*pcs->frames.packed) * op_max_frames,
-                    HEAPSTAT_CALLSTACK);
-        pcs->frames.packed = frames_out;
-    } else {
-        full_frame_t *frames_out;
-        sz_out = sizeof(*pcs->frames.full) * pcs->num_frames;
-        if (sz_out == 0)
-            frames_out = NULL;
-        else {
-            frames_out = (full_frame_t *) global_alloc(sz_out, HEAPSTAT_CALLSTACK);
-            memcpy(frames_out, pcs->frames.full, sz_out);
-        }
-        global_free(pcs->frames.full, sizeof(*pcs->frames.full) * op_max_frames,
-                    HEAPSTAT_CALLSTACK);
-        pcs->frames.full = frames_out;
+    packed_callstack_shrink(pcs);
+    *pcs_out = pcs;
+}
+
+/* i#75: records just the return addresses of the callstack, with top_pc as
+ * the first entry, into the caller's array of callstack_max_frames entries.
+ * Returns the number of entries written.  The module lookups are deferred
+ * to packed_callstack_from_raw(), which must be called before any of the
+ * recorded modules is unloaded.
+ */
+uint
+callstack_record_raw(app_pc *raw OUT, dr_mcontext_t *mc, app_pc top_pc)
+{
+    uint num = 0;
+    ASSERT(raw != NULL && op_max_frames > 0, "invalid args");
+    raw[num++] = top_pc;
+    walk_callstack(NULL, 0, NULL, mc, false, NULL, raw, &num, 1, false);
+    return num;
+}
+
+/* Builds a packed callstack equivalent to what packed_callstack_record() would
+ * have produced from the frames captured by callstack_record_raw().
+ */
+void
+packed_callstack_from_raw(packed_callstack_t **pcs_out/*out*/, app_pc *raw, uint num)
+{
+    packed_callstack_t *pcs = packed_callstack_alloc();
+    uint i;
+    ASSERT(pcs_out != NULL && raw != NULL && num > 0 && num <= op_max_frames,
+           "invalid args");
+    address_to_frame(NULL, pcs, raw[0], NULL, false, false, 0);
+    for (i = 1; i < num && pcs->num_frames < op_max_frames; i++) {
+        address_to_frame(NULL, pcs, raw[i], NULL,
+                         !TEST(FP_SHOW_NON_MODULE_FRAMES, op_fp_flags),
+                         true, pcs->num_frames);
     }
+    packed_callstack_shrink(pcs);
     *pcs_out = pcs;
 }
 
@@ -1553,6 +1842,96 @@ packed_callstack_to_symbolized(packed_callstack_t *pcs IN,
     }
 }
 
+#if defined(USE_DRSYMS) && defined(TOOL_DR_MEMORY)
+static inline bool
+addr_sym_key_less(addr_sym_key_t *k1, addr_sym_key_t *k2)
+{
+    if (k1->name_info != k2->name_info)
+        return k1->name_info->id < k2->name_info->id;
+    return k1->modoffs < k2->modoffs;
+}
+
+static void
+addr_sym_key_sift_down(addr_sym_key_t *keys, uint root, uint num)
+{
+    while (root * 2 + 1 < num) {
+        uint child = root * 2 + 1;
+        addr_sym_key_t tmp;
+        if (child + 1 < num && addr_sym_key_less(&keys[child], &keys[child + 1]))
+            child++;
+        if (!addr_sym_key_less(&keys[root], &keys[child]))
+            return;
+        tmp = keys[root];
+        keys[root] = keys[child];
+        keys[child] = tmp;
+        root = child;
+    }
+}
+
+static void
+addr_sym_key_sort(addr_sym_key_t *keys, uint num)
+{
+    uint i;
+    if (num < 2)
+        return;
+    for (i = num / 2; i > 0; i--)
+        addr_sym_key_sift_down(keys, i - 1, num);
+    for (i = num - 1; i > 0; i--) {
+        addr_sym_key_t tmp = keys[0];
+        keys[0] = keys[i];
+        keys[i] = tmp;
+        addr_sym_key_sift_down(keys, 0, i);
+    }
+}
+#endif
+
+/* Resolves the symbols for every frame of every callstack in pcs into the
+ * address cache so that printing them afterward does no drsyms queries.
+ * Each unique address is looked up once, grouped by module and in offset
+ * order, which keeps each module's debug info hot in drsyms.
+ */
+void
+packed_callstack_batch_symbolize(packed_callstack_t **pcs, uint num_pcs)
+{
+#if defined(USE_DRSYMS) && defined(TOOL_DR_MEMORY)
+    uint i, j, num = 0, max = 0;
+    addr_sym_key_t *keys;
+    for (i = 0; i < num_pcs; i++) {
+        if (pcs[i] != NULL)
+            max += pcs[i]->num_frames;
+    }
+    if (max == 0)
+        return;
+    keys = (addr_sym_key_t *) global_alloc(max * sizeof(*keys), HEAPSTAT_CALLSTACK);
+    for (i = 0; i < num_pcs; i++) {
+        if (pcs[i] == NULL)
+            continue;
+        for (j = 0; j < pcs[i]->num_frames; j++) {
+            modname_info_t *info = NULL;
+            size_t offs;
+            if (!packed_callstack_frame_modinfo(pcs[i], j, &info, &offs) || info == NULL)
+                continue;
+            /* must match the retaddr adjustment in packed_frame_to_symbolized() */
+            keys[num].name_info = info;
+            keys[num].modoffs = (j == 0 && !pcs[i]->first_is_retaddr) ? offs : offs-1;
+            num++;
+        }
+    }
+    addr_sym_key_sort(keys, num);
+    LOG(2, "batch symbolizing %u frames from %u callstacks\n", num, num_pcs);
+    hashtable_lock(&addr_sym_table);
+    for (i = 0; i < num; i++) {
+        if (i > 0 && keys[i].name_info == keys[i - 1].name_info &&
+            keys[i].modoffs == keys[i - 1].modoffs)
+            continue;
+        STATS_INC(symbol_address_batched);
+        addr_sym_lookup(keys[i].name_info, keys[i].modoffs);
+    }
+    hashtable_unlock(&addr_sym_table);
+    global_free(keys, max * sizeof(*keys), HEAPSTAT_CALLSTACK);
+#endif
+}
+
 #ifdef DEBUG
 void
 packed_callstack_log(packed_callstack_t *pcs, file_t f)
@@ -1713,6 +2092,18 @@ packed_callstack_num_frames(packed_callstack_t *pcs)
     return pcs->num_frames;
 }
 
+/* Returns the pc or retaddr for the given frame, or NULL for a system call frame */
+app_pc
+packed_callstack_frame_pc(packed_callstack_t *pcs, uint frame)
+{
+    modname_info_t *info;
+    size_t offs;
+    ASSERT(frame < pcs->num_frames, "invalid frame index");
+    if (!packed_callstack_frame_modinfo(pcs, frame, &info, &offs))
+        return NULL;
+    return PCS_FRAME_LOC(pcs, frame).addr;
+}
+
 /***************************************************************************
  * SYMBOLIZED CALLSTACKS
  */
@@ -1827,6 +2218,7 @@ add_new_module(void *drcontext, const module_data_t *info)
             (op_modname_hide != NULL &&
              text_matches_any_pattern(name_info->name, op_modname_hide, IGNORE_FILE_CASE));
         name_info->warned_no_syms = false;
+        name_info->load_count = 0;
         hashtable_add(&modname_table, (void*)name_info->path, (void*)name_info);
         /* We need an entry for every 16M of module size */
         sz = info->end - info->start;
@@ -1849,6 +2241,9 @@ add_new_module(void *drcontext, const module_data_t *info)
                 break;
             sz -= MAX_MODOFFS_STORED;
         }
+    } else {
+        /* The file at this path may have changed since we cached its symbols */
+        name_info->load_count++;
     }
 
     /* i#446: Log module load events with a full path and unique id for
@@ -1872,6 +2267,91 @@ modname_info_free(void *p)
     global_free((void *)info, sizeof(*info), HEAPSTAT_HASHTABLE);
 }
 
+static bool
+module_map_count_cb(rb_node_t *node, void *iter_data)
+{
+    (*(uint *)iter_data)++;
+    return true;
+}
+
+static bool
+module_map_fill_cb(rb_node_t *node, void *iter_data)
+{
+    module_map_t *map = (module_map_t *) iter_data;
+    app_pc start;
+    size_t size;
+    rb_node_fields(node, &start, &size, (void **) &map->entries[map->num].name_info);
+    map->entries[map->num].start = start;
+    map->entries[map->num].end = start + size;
+    map->num++;
+    return true;
+}
+
+/* Frees retired maps that no thread is reading.  Caller must hold modtree_lock. */
+static void
+module_map_reclaim(void)
+{
+    module_map_t *map, *next, *keep = NULL;
+    /* Order our publication of the new map before our reads of the hazards:
+     * any reader that announces an old map after this will re-read
+     * module_map and retry.
+     */
+    MEMORY_BARRIER();
+    for (map = module_map_retired; map != NULL; map = next) {
+        tls_callstack_t *pt;
+        next = map->next_retired;
+        for (pt = callstack_threads; pt != NULL; pt = pt->next) {
+            if (pt->map_hazard == map)
+                break;
+        }
+        if (pt == NULL)
+            global_free(map, MODULE_MAP_SIZE(map->num), HEAPSTAT_MISC);
+        else {
+            map->next_retired = keep;
+            keep = map;
+        }
+    }
+    module_map_retired = keep;
+}
+
+/* Publishes a new copy of module_tree.  Caller must hold modtree_lock. */
+static void
+module_map_publish(void)
+{
+    uint num = 0;
+    module_map_t *map, *old = module_map;
+    rb_iterate(module_tree, module_map_count_cb, (void *) &num);
+    map = (module_map_t *) global_alloc(MODULE_MAP_SIZE(num), HEAPSTAT_MISC);
+    map->num = 0;
+    map->next_retired = NULL;
+    /* in-order so the entries are sorted */
+    rb_iterate(module_tree, module_map_fill_cb, (void *) map);
+    ASSERT(map->num == num, "module tree changed under lock");
+    module_map = map;
+    module_map_gen++;
+    if (old != NULL) {
+        old->next_retired = module_map_retired;
+        module_map_retired = old;
+    }
+    module_map_reclaim();
+}
+
+static module_entry_t *
+module_map_find(module_map_t *map, app_pc pc)
+{
+    uint lo = 0, hi = map->num;
+    while (lo < hi) {
+        uint mid = lo + (hi - lo) / 2;
+        if (pc < map->entries[mid].start)
+            hi = mid;
+        else if (pc >= map->entries[mid].end)
+            lo = mid + 1;
+        else
+            return &map->entries[mid];
+    }
+    return NULL;
+}
+
 /* Caller must hold modtree_lock */
 static void
 callstack_module_add_region(app_pc start, app_pc end, modname_info_t *info)
@@ -1936,9 +2416,7 @@ callstack_module_load(void *drcontext, const module_data_t *info, bool loaded)
         callstack_module_add_region(seg_base, info->segments[i - 1].end, name_info);
     }
 #endif
-    /* update cached values */
-    modtree_last_hit = NULL;
-    modtree_last_miss = NULL;
+    module_map_publish();
     dr_mutex_unlock(modtree_lock);
 }
 
@@ -1992,79 +2470,124 @@ callstack_module_unload(void *drcontext, const module_data_t *info)
         modtree_min_start = node_start;
     } else
         modtree_min_start = NULL;
-    modtree_last_start = NULL;
-    modtree_last_hit = NULL;
-    modtree_last_miss = NULL;
+    module_map_publish();
 
     dr_mutex_unlock(modtree_lock);
 }
 
+static tls_callstack_t *
+module_lookup_tls(void)
+{
+    void *drcontext = dr_get_current_drcontext();
+    return (tls_callstack_t *)
+        ((drcontext == NULL) ? NULL : drmgr_get_tls_field(drcontext, tls_idx_callstack));
+}
+
+/* Looks up pc in the current module map.  If pc is not in a module and
+ * pt is non-NULL, caches pc's page as a miss.
+ */
 static bool
-module_lookup(byte *pc, app_pc *start OUT, size_t *size OUT, modname_info_t **name)
+module_map_lookup(tls_callstack_t *pt, byte *pc, app_pc *start OUT, app_pc *end OUT,
+                  modname_info_t **name OUT)
 {
-    rb_node_t *node;
+    module_map_t *map;
+    module_entry_t *entry;
+    uint gen;
     bool res = false;
-    dr_mutex_lock(modtree_lock);
-    /* We cache to avoid the rb_in_node cost */
-    if (modtree_last_start != NULL &&
-        pc >= modtree_last_start && pc < modtree_last_start + modtree_last_size) {
-        /* use cached values */
-        res = true;
-        LOG(5, "module_lookup: using cached "PFX"\n", modtree_last_start);
-    } else {
-        LOG(5, "module_lookup: "PFX" doesn't match cached "PFX"\n",
-            pc, modtree_last_start);
-        node = rb_in_node(module_tree, pc);
-        if (node != NULL) {
+    if (pt == NULL) {
+        /* no hazard pointer, so we hold the lock to keep the map alive */
+        dr_mutex_lock(modtree_lock);
+        entry = module_map_find(module_map, pc);
+        if (entry != NULL) {
             res = true;
-            rb_node_fields(node, &modtree_last_start, &modtree_last_size,
-                           (void **) &modtree_last_name_info);
+            *start = entry->start;
+            *end = entry->end;
+            *name = entry->name_info;
         }
+        dr_mutex_unlock(modtree_lock);
+        return res;
     }
-    if (res) {
-        if (start != NULL)
-            *start = modtree_last_start;
-        if (size != NULL)
-            *size = modtree_last_size;
-        if (name != NULL)
-            *name = modtree_last_name_info;
+    /* read the generation first so a concurrent publication can only make our
+     * cache look stale, never current
+     */
+    gen = module_map_gen;
+    do {
+        map = module_map;
+        pt->map_hazard = map;
+        /* order the announcement before the re-read of module_map */
+        MEMORY_BARRIER();
+    } while (map != module_map);
+    entry = module_map_find(map, pc);
+    if (entry != NULL) {
+        res = true;
+        *start = entry->start;
+        *end = entry->end;
+        *name = entry->name_info;
     }
-    dr_mutex_unlock(modtree_lock);
+    COMPILER_BARRIER();
+    pt->map_hazard = NULL;
+    if (pt->mod_cache_gen != gen) {
+        pt->mod_cache_gen = gen;
+        pt->mod_cache_start = NULL;
+        pt->mod_cache_end = NULL;
+        pt->mod_cache_miss = NULL;
+    }
+    if (res) {
+        pt->mod_cache_start = *start;
+        pt->mod_cache_end = *end;
+        pt->mod_cache_name = *name;
+    } else
+        pt->mod_cache_miss = (app_pc) ALIGN_BACKWARD(pc, PAGE_SIZE);
     return res;
 }
 
+static bool
+module_lookup(byte *pc, app_pc *start OUT, size_t *size OUT, modname_info_t **name)
+{
+    tls_callstack_t *pt = module_lookup_tls();
+    app_pc mod_start, mod_end;
+    modname_info_t *name_info;
+    /* We cache per thread to avoid even the binary search */
+    if (pt != NULL && pt->mod_cache_gen == module_map_gen &&
+        pc >= pt->mod_cache_start && pc < pt->mod_cache_end) {
+        LOG(5, "module_lookup: using cached "PFX"\n", pt->mod_cache_start);
+        mod_start = pt->mod_cache_start;
+        mod_end = pt->mod_cache_end;
+        name_info = pt->mod_cache_name;
+    } else if (!module_map_lookup(pt, pc, &mod_start, &mod_end, &name_info))
+        return false;
+    if (start != NULL)
+        *start = mod_start;
+    if (size != NULL)
+        *size = mod_end - mod_start;
+    if (name != NULL)
+        *name = name_info;
+    return true;
+}
+
 /* this is exported for PR 570839 for is_image() */
 bool
 is_in_module(byte *pc)
 {
-    /* We cache the last page queried for performance */
-    bool res = false;
-    /* This is a perf bottleneck so we use caching.
-     * We read these values w/o a lock, assuming they are written
-     * atomically (since aligned they won't cross cache lines).
+    tls_callstack_t *pt;
+    app_pc mod_start, mod_end;
+    modname_info_t *name_info;
+    /* This is a perf bottleneck so we check the bounds and the per-thread
+     * caches before the map.  We read the bounds w/o a lock, assuming they are
+     * written atomically (since aligned they won't cross cache lines).
      */
     if (pc < modtree_min_start || pc >= modtree_max_end)
-        res = false;
-    else if ((app_pc) ALIGN_BACKWARD(pc, PAGE_SIZE) == modtree_last_miss)
-        res = false;
-    else if ((app_pc) ALIGN_BACKWARD(pc, PAGE_SIZE) == modtree_last_hit)
-        res = true;
-    else {
-        dr_mutex_lock(modtree_lock);
-        LOG(5, "is_in_module: "PFX" missed cached "PFX"-"PFX", miss="PFX", hit="PFX"\n",
-            pc, modtree_min_start, modtree_max_end, modtree_last_miss, modtree_last_hit);
-        res = (rb_in_node(module_tree, pc) != NULL);
-        /* XXX: we could cache the range on a hit, and the range from prev lower
-         * to next higher on a miss: but going to wait for this to show up
-         * in pclookup.
-         */
-        if (res)
-            modtree_last_hit = (app_pc) ALIGN_BACKWARD(pc, PAGE_SIZE);
-        else
-            modtree_last_miss = (app_pc) ALIGN_BACKWARD(pc, PAGE_SIZE);
-        dr_mutex_unlock(modtree_lock);
+        return false;
+    pt = module_lookup_tls();
+    if (pt != NULL && pt->mod_cache_gen == module_map_gen) {
+        if (pc >= pt->mod_cache_start && pc < pt->mod_cache_end)
+            return true;
+        if ((app_pc) ALIGN_BACKWARD(pc, PAGE_SIZE) == pt->mod_cache_miss)
+            return false;
     }
-    return res;
+    LOG(5, "is_in_module: "PFX" missed cache: bounds "PFX"-"PFX"\n",
+        pc, modtree_min_start, modtree_max_end);
+    return module_map_lookup(pt, pc, &mod_start, &mod_end, &name_info);
 }
 
 const char *
@@ -177,11 +177,11 @@ enum {
 #define MAX_ERROR_INITIAL_LINES 512
 
 #ifdef STATISTICS
-extern uint find_next_fp_scans;
 extern uint symbol_names_truncated;
-extern uint cstack_is_retaddr;
-extern uint cstack_is_retaddr_backdecode;
-extern uint cstack_is_retaddr_unreadable;
+# ifdef USE_DRSYMS
+extern uint symbol_address_cache_hits;
+extern uint symbol_address_batched;
+# endif
 #endif
 
 void
@@ -223,6 +223,12 @@ packed_callstack_record(packed_callstack_t **pcs_out/*out*/, dr_mcontext_t *mc,
 void
 packed_callstack_first_frame_retaddr(packed_callstack_t *pcs);
 
+uint
+callstack_record_raw(app_pc *raw OUT, dr_mcontext_t *mc, app_pc top_pc);
+
+void
+packed_callstack_from_raw(packed_callstack_t **pcs_out/*out*/, app_pc *raw, uint num);
+
 void
 packed_callstack_print(packed_callstack_t *pcs, uint num_frames,
                        char *buf, size_t bufsz, size_t *sofar, const char *prefix);
@@ -256,6 +262,9 @@ packed_callstack_crc32(packed_callstack_t *pcs, uint crc[2]);
 uint
 packed_callstack_num_frames(packed_callstack_t *pcs);
 
+app_pc
+packed_callstack_frame_pc(packed_callstack_t *pcs, uint frame);
+
 /* The user must call this from a DR dr_register_module_load_event() event */
 void
 callstack_module_load(void *drcontext, const module_data_t *info, bool loaded);
@@ -308,6 +317,12 @@ void
 packed_callstack_to_symbolized(packed_callstack_t *pcs IN,
                                symbolized_callstack_t *scs OUT);
 
+/* Looks up the symbols for all frames of the given callstacks in one sorted
+ * pass, caching the results for subsequent printing or symbolizing.
+ */
+void
+packed_callstack_batch_symbolize(packed_callstack_t **pcs, uint num_pcs);
+
 void
 symbolized_callstack_print(const symbolized_callstack_t *scs IN,
                            char *buf, size_t bufsz, size_t *sofar,
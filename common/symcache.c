@@ -58,6 +58,11 @@
  *   of wildcard symcache entries.  i#722 added
  *   "std::_DebugHeapDelete<*>" whose matches are stored as
  *   "std::_DebugHeapDelete<>" duplicates.
+ * - We write a binary file that is mapped and queried in place, to avoid
+ *   parsing and building a hashtable for every module at every startup.
+ *   We still read the original text format, so text files from older
+ *   versions or created by other tools continue to work.  A binary file
+ *   takes precedence over a text file for the same module.
  */
 
 #define SYMCACHE_FILE_HEADER "Dr. Memory symbol cache version"
@@ -85,6 +90,43 @@
 
 #define SYMCACHE_MAX_TMP_TRIES 1000
 
+/* Binary file layout.  All offsets are from the start of the file:
+ *   symcache_bin_header_t
+ *   symcache_bin_symbol_t[num_symbols], sorted by strcmp of the name
+ *   uint64[num_offsets], with each symbol's offsets contiguous,
+ *     starting at an 8-byte-aligned file offset
+ *   char[strings_size] holding the null-terminated names
+ * The layout is the same for 32-bit and 64-bit.  We store
+ * SYMCACHE_VERSION in the header, so bumping it invalidates both formats.
+ */
+#define SYMCACHE_BIN_MAGIC "DrMemSC"  /* 8 bytes with the null */
+
+typedef struct _symcache_bin_header_t {
+    char magic[8];
+    uint version;
+    uint has_debug_info;
+    uint64 file_size;
+    /* Module consistency fields: the Windows-only ones are 0 elsewhere */
+    uint64 module_file_size;
+    uint64 file_version;
+    uint64 product_version;
+    uint64 module_internal_size;
+    uint checksum;
+    uint timestamp;
+    uint num_symbols;
+    uint num_offsets;
+    uint symbols_start;
+    uint offsets_start;
+    uint strings_start;
+    uint strings_size;
+} symcache_bin_header_t;
+
+typedef struct _symcache_bin_symbol_t {
+    uint name;  /* offset into the strings */
+    uint first; /* index into the offsets */
+    uint num;
+} symcache_bin_symbol_t;
+
 /* We key on full path to reduce chance of duplicate name (i#729).
  * If we do have duplicate preferred name, though, note that only one can
  * have a symcache file b/c our file namespace does not have versions
@@ -105,6 +147,12 @@ typedef struct _mod_cache_t {
     bool appended; /* added to since read from file? */
     /* Table of offset_list_t entries */
     hashtable_t table;
+    /* Read-only mapping of a binary cache file.  A symbol in table takes
+     * precedence: we copy a symbol into table before adding to it.
+     */
+    byte *bin_map;
+    size_t bin_map_size;
+    bool from_bin; /* from_file and it was binary */
     /* Values for consistency that we cache until ready to write to file */
     uint64 module_file_size;
 #ifdef WINDOWS
@@ -135,6 +183,8 @@ symcache_free_entry(void *v)
     /* caller holds symcache_lock, or exit time */
     mod_cache_t *modcache = (mod_cache_t *) v;
     if (modcache != NULL) {
+        if (modcache->bin_map != NULL)
+            dr_unmap_file(modcache->bin_map, modcache->bin_map_size);
         hashtable_delete(&modcache->table);
         if (modcache->modname != NULL) {
             global_free((void *)modcache->modname, strlen(modcache->modname) + 1,
@@ -144,13 +194,66 @@ symcache_free_entry(void *v)
     }
 }
 
+/* ext is "txt" or "bin" */
 static void
-symcache_get_filename(const char *modname, char *symfile, size_t symfile_count)
+symcache_get_filename(const char *modname, const char *ext,
+                      char *symfile, size_t symfile_count)
 {
-    dr_snprintf(symfile, symfile_count, "%s/%s.txt", symcache_dir, modname);
+    dr_snprintf(symfile, symfile_count, "%s/%s.%s", symcache_dir, modname, ext);
     symfile[symfile_count-1] = '\0';
 }
 
+static inline const symcache_bin_header_t *
+symcache_bin_header(mod_cache_t *modcache)
+{
+    return (const symcache_bin_header_t *) modcache->bin_map;
+}
+
+static inline const symcache_bin_symbol_t *
+symcache_bin_symbols(mod_cache_t *modcache)
+{
+    return (const symcache_bin_symbol_t *)
+        (modcache->bin_map + symcache_bin_header(modcache)->symbols_start);
+}
+
+static inline const uint64 *
+symcache_bin_offsets(mod_cache_t *modcache)
+{
+    return (const uint64 *)
+        (modcache->bin_map + symcache_bin_header(modcache)->offsets_start);
+}
+
+static inline const char *
+symcache_bin_name(mod_cache_t *modcache, const symcache_bin_symbol_t *sym)
+{
+    return (const char *)
+        (modcache->bin_map + symcache_bin_header(modcache)->strings_start + sym->name);
+}
+
+/* Binary search of the sorted symbol table.  Caller must hold symcache_lock. */
+static const symcache_bin_symbol_t *
+symcache_bin_lookup(mod_cache_t *modcache, const char *symbol)
+{
+    const symcache_bin_symbol_t *syms;
+    uint lo, hi;
+    if (modcache->bin_map == NULL)
+        return NULL;
+    syms = symcache_bin_symbols(modcache);
+    lo = 0;
+    hi = symcache_bin_header(modcache)->num_symbols;
+    while (lo < hi) {
+        uint mid = lo + (hi - lo) / 2;
+        int cmp = strcmp(symbol, symcache_bin_name(modcache, &syms[mid]));
+        if (cmp == 0)
+            return &syms[mid];
+        if (cmp < 0)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return NULL;
+}
+
 /* If an entry already exists and is 0, replaces it; else adds a new
  * offset for that symbol.
  *
@@ -193,32 +296,181 @@ symcache_symbol_add(const char *modname, hashtable_t *symtable,
     return true;
 }
 
-/* caller must hold symcache_lock */
+/* Copies symbol's entries from the binary file into the table, so the
+ * table entry supersedes them.  Caller must hold symcache_lock.
+ */
 static void
-symcache_write_symfile(const char *modname, mod_cache_t *modcache)
+symcache_bin_copy_symbol(mod_cache_t *modcache, const symcache_bin_symbol_t *sym)
 {
+    const uint64 *offsets = symcache_bin_offsets(modcache);
+    const char *name = symcache_bin_name(modcache, sym);
     uint i;
+    for (i = 0; i < sym->num; i++) {
+        symcache_symbol_add(modcache->modname, &modcache->table, name,
+                            (size_t) offsets[sym->first + i]);
+    }
+}
+
+#ifdef WINDOWS
+/* Unmaps the binary file, first copying its entries into the table if
+ * materialize is set.  Caller must hold symcache_lock.
+ */
+static void
+symcache_bin_release(mod_cache_t *modcache, bool materialize)
+{
+    uint i;
+    if (modcache->bin_map == NULL)
+        return;
+    if (materialize) {
+        const symcache_bin_symbol_t *syms = symcache_bin_symbols(modcache);
+        for (i = 0; i < symcache_bin_header(modcache)->num_symbols; i++) {
+            if (hashtable_lookup(&modcache->table,
+                                 (void *)symcache_bin_name(modcache, &syms[i])) == NULL)
+                symcache_bin_copy_symbol(modcache, &syms[i]);
+        }
+    }
+    dr_unmap_file(modcache->bin_map, modcache->bin_map_size);
+    modcache->bin_map = NULL;
+    modcache->bin_map_size = 0;
+}
+#endif
+
+/* One symbol to write out: from the table if olist is set, else from the
+ * binary file
+ */
+typedef struct _symcache_write_entry_t {
+    const char *name;
+    offset_list_t *olist;
+    const symcache_bin_symbol_t *bin;
+} symcache_write_entry_t;
+
+static void
+symcache_sort_entries(symcache_write_entry_t *entries, uint num)
+{
+    /* Shell sort: we have no qsort on all platforms */
+    uint gap, i, j;
+    for (gap = num / 2; gap > 0; gap /= 2) {
+        for (i = gap; i < num; i++) {
+            symcache_write_entry_t tmp = entries[i];
+            for (j = i; j >= gap && strcmp(entries[j - gap].name, tmp.name) > 0;
+                 j -= gap)
+                entries[j] = entries[j - gap];
+            entries[j] = tmp;
+        }
+    }
+}
+
+static bool
+symcache_write_buffered(file_t f, char *buf, size_t bufsz, size_t *sofar,
+                        const void *data, size_t size)
+{
+    const char *src = (const char *) data;
+    while (size > 0) {
+        size_t chunk = MIN(size, bufsz - *sofar);
+        memcpy(buf + *sofar, src, chunk);
+        *sofar += chunk;
+        src += chunk;
+        size -= chunk;
+        if (*sofar == bufsz) {
+            if (dr_write_file(f, buf, bufsz) != (ssize_t) bufsz)
+                return false;
+            *sofar = 0;
+        }
+    }
+    return true;
+}
+
+/* Writes the binary cache file for modcache.  If keep is set the caller
+ * will keep using modcache.  Caller must hold symcache_lock.
+ */
+static void
+symcache_write_symfile(const char *modname, mod_cache_t *modcache, bool keep)
+{
+    uint i, num_entries, num_offsets, strings_size;
     file_t f;
     hashtable_t *symtable = &modcache->table;
     char buf[SYMCACHE_BUFFER_SIZE];
     size_t sofar = 0;
-    ssize_t len;
-    size_t bsz = BUFFER_SIZE_ELEMENTS(buf);
-    size_t filesz_loc;
     char symfile[MAXIMUM_PATH];
     char symfile_tmp[MAXIMUM_PATH];
-    int64 file_size;
+    symcache_write_entry_t *entries;
+    uint max_entries;
+    symcache_bin_header_t header;
+    static const char zeroes[sizeof(uint64)];
+    bool ok;
 
     /* if from file, we assume it's a waste of time to re-write file:
      * the version matched after all, unless we appended to it.
+     * A text file is converted to binary.
      */
-    if (modcache->from_file && !modcache->appended)
+    if (modcache->from_bin && !modcache->appended)
         return;
-    if (symtable->entries == 0)
+    max_entries = symtable->entries;
+    if (modcache->bin_map != NULL)
+        max_entries += symcache_bin_header(modcache)->num_symbols;
+    if (max_entries == 0)
         return; /* nothing to write */
 
+    /* Gather and sort all the symbols, which also sizes each section */
+    entries = (symcache_write_entry_t *)
+        global_alloc(max_entries * sizeof(*entries), HEAPSTAT_HASHTABLE);
+    num_entries = 0;
+    num_offsets = 0;
+    strings_size = 0;
+    for (i = 0; i < HASHTABLE_SIZE(symtable->table_bits); i++) {
+        hash_entry_t *he;
+        for (he = symtable->table[i]; he != NULL; he = he->next) {
+            offset_list_t *olist = (offset_list_t *) he->payload;
+            if (olist == NULL)
+                continue;
+            entries[num_entries].name = (const char *) he->key;
+            entries[num_entries].olist = olist;
+            entries[num_entries].bin = NULL;
+            num_entries++;
+            num_offsets += olist->num;
+            strings_size += (uint) strlen((const char *) he->key) + 1;
+        }
+    }
+    if (modcache->bin_map != NULL) {
+        const symcache_bin_symbol_t *syms = symcache_bin_symbols(modcache);
+        for (i = 0; i < symcache_bin_header(modcache)->num_symbols; i++) {
+            const char *name = symcache_bin_name(modcache, &syms[i]);
+            if (hashtable_lookup(symtable, (void *)name) != NULL)
+                continue; /* superseded */
+            entries[num_entries].name = name;
+            entries[num_entries].olist = NULL;
+            entries[num_entries].bin = &syms[i];
+            num_entries++;
+            num_offsets += syms[i].num;
+            strings_size += (uint) strlen(name) + 1;
+        }
+    }
+    symcache_sort_entries(entries, num_entries);
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SYMCACHE_BIN_MAGIC, sizeof(header.magic));
+    header.version = SYMCACHE_VERSION;
+    header.has_debug_info = modcache->has_debug_info;
+    header.module_file_size = modcache->module_file_size;
+#ifdef WINDOWS
+    header.file_version = modcache->file_version.version;
+    header.product_version = modcache->product_version.version;
+    header.module_internal_size = modcache->module_internal_size;
+    header.checksum = modcache->checksum;
+    header.timestamp = modcache->timestamp;
+#endif
+    header.num_symbols = num_entries;
+    header.num_offsets = num_offsets;
+    header.symbols_start = sizeof(header);
+    header.offsets_start = (uint)
+        ALIGN_FORWARD(header.symbols_start + num_entries * sizeof(symcache_bin_symbol_t),
+                      sizeof(uint64));
+    header.strings_start = header.offsets_start + num_offsets * sizeof(uint64);
+    header.strings_size = strings_size;
+    header.file_size = header.strings_start + strings_size;
+
     /* Open the temp symcache that we will rename.  */
-    symcache_get_filename(modname, symfile, BUFFER_SIZE_ELEMENTS(symfile));
+    symcache_get_filename(modname, "bin", symfile, BUFFER_SIZE_ELEMENTS(symfile));
     f = INVALID_FILE;
     i = 0;
     while (f == INVALID_FILE && i < SYMCACHE_MAX_TMP_TRIES) {
@@ -230,65 +482,185 @@ symcache_write_symfile(const char *modname, mod_cache_t *modcache)
     }
     if (f == INVALID_FILE) {
         NOTIFY_ERROR("Unable to create temp file for symfile %s"NL, symfile);
+        global_free(entries, max_entries * sizeof(*entries), HEAPSTAT_HASHTABLE);
         return;
     }
 
-    BUFFERED_WRITE(f, buf, bsz, sofar, len, "%s %d\n",
-                   SYMCACHE_FILE_HEADER, SYMCACHE_VERSION);
-    /* Leave room for file size for self-consistency check */
-    filesz_loc = sofar;  /* XXX: Assumes that the buffer hasn't been flushed. */
-    BUFFERED_WRITE(f, buf, bsz, sofar, len,
-                   "%"STRINGIFY(SYMCACHE_SIZE_DIGITS)"u,", 0);
-#ifdef WINDOWS
-    BUFFERED_WRITE(f, buf, bsz, sofar, len,
-                   UINT64_FORMAT_STRING","UINT64_FORMAT_STRING","
-                   UINT64_FORMAT_STRING",%u,%u,%lu\n",
-                   modcache->module_file_size, modcache->file_version.version,
-                   modcache->product_version.version,
-                   modcache->checksum, modcache->timestamp,
-                   modcache->module_internal_size);
-#else
-    BUFFERED_WRITE(f, buf, bsz, sofar, len, UINT64_FORMAT_STRING"\n",
-                   modcache->module_file_size);
-#endif
-    BUFFERED_WRITE(f, buf, bsz, sofar, len, "%u\n", modcache->has_debug_info);
-    for (i = 0; i < HASHTABLE_SIZE(symtable->table_bits); i++) {
-        hash_entry_t *he;
-        for (he = symtable->table[i]; he != NULL; he = he->next) {
-            offset_list_t *olist = (offset_list_t *) he->payload;
-            if (olist == NULL)
-                continue;
-            /* skip symbol in dup entries to save space */
-            BUFFERED_WRITE(f, buf, bsz, sofar, len, "%s", he->key);
-            while (olist != NULL) {
-                BUFFERED_WRITE(f, buf, bsz, sofar, len, ",0x%x\n", olist->offs);
-                olist = olist->next;
+    ok = symcache_write_buffered(f, buf, BUFFER_SIZE_ELEMENTS(buf), &sofar,
+                                 &header, sizeof(header));
+    num_offsets = 0;
+    strings_size = 0;
+    for (i = 0; ok && i < num_entries; i++) {
+        symcache_bin_symbol_t sym;
+        sym.name = strings_size;
+        sym.first = num_offsets;
+        sym.num = (entries[i].olist != NULL) ? entries[i].olist->num :
+            entries[i].bin->num;
+        ok = symcache_write_buffered(f, buf, BUFFER_SIZE_ELEMENTS(buf), &sofar,
+                                     &sym, sizeof(sym));
+        num_offsets += sym.num;
+        strings_size += (uint) strlen(entries[i].name) + 1;
+    }
+    if (ok) {
+        ok = symcache_write_buffered
+            (f, buf, BUFFER_SIZE_ELEMENTS(buf), &sofar, zeroes,
+             header.offsets_start - header.symbols_start -
+             num_entries * sizeof(symcache_bin_symbol_t));
+    }
+    for (i = 0; ok && i < num_entries; i++) {
+        if (entries[i].olist != NULL) {
+            offset_list_t *olist;
+            for (olist = entries[i].olist; ok && olist != NULL; olist = olist->next) {
+                uint64 offs = olist->offs;
+                ok = symcache_write_buffered(f, buf, BUFFER_SIZE_ELEMENTS(buf),
+                                             &sofar, &offs, sizeof(offs));
             }
+        } else {
+            ok = symcache_write_buffered
+                (f, buf, BUFFER_SIZE_ELEMENTS(buf), &sofar,
+                 symcache_bin_offsets(modcache) + entries[i].bin->first,
+                 entries[i].bin->num * sizeof(uint64));
         }
     }
-
-    /* now update size */
-    FLUSH_BUFFER(f, buf, sofar);
-    if ((file_size = dr_file_tell(f)) < 0 ||
-        dr_snprintf(buf, BUFFER_SIZE_ELEMENTS(buf),
-                    "%"STRINGIFY(SYMCACHE_SIZE_DIGITS)"u", file_size) < 0 ||
-        !dr_file_seek(f, filesz_loc, DR_SEEK_SET) ||
-        dr_write_file(f, buf, SYMCACHE_SIZE_DIGITS) != SYMCACHE_SIZE_DIGITS) {
-        /* If any steps fail, warn and give up. */
-        NOTIFY_ERROR("WARNING: Unable to write symcache file size."NL);
-        dr_close_file(f);
+    for (i = 0; ok && i < num_entries; i++) {
+        ok = symcache_write_buffered(f, buf, BUFFER_SIZE_ELEMENTS(buf), &sofar,
+                                     entries[i].name, strlen(entries[i].name) + 1);
+    }
+    if (ok && sofar > 0)
+        ok = (dr_write_file(f, buf, sofar) == (ssize_t) sofar);
+    global_free(entries, max_entries * sizeof(*entries), HEAPSTAT_HASHTABLE);
+    dr_close_file(f);
+    if (!ok) {
+        NOTIFY_ERROR("WARNING: Unable to write symcache file %s"NL, symfile);
         dr_delete_file(symfile_tmp);
         return;
     }
 
-    dr_close_file(f);
-
+#ifdef WINDOWS
+    /* A mapped file cannot be replaced */
+    symcache_bin_release(modcache, keep);
+#endif
+    /* The rename is atomic so readers never see a partial file */
     if (!dr_rename_file(symfile_tmp, symfile, /*replace*/true)) {
         NOTIFY_ERROR("WARNING: Failed to rename the symcache file."NL);
         dr_delete_file(symfile_tmp);
     }
 }
 
+/* Sets modcache->has_debug_info and returns true if the cache's record of
+ * debug info is still valid
+ */
+static bool
+symcache_check_debug_info(const module_data_t *mod, const char *modname,
+                          mod_cache_t *modcache, bool has_debug_info)
+{
+    if (has_debug_info) {
+        /* We assume that the current availability of debug info doesn't matter */
+        modcache->has_debug_info = true;
+    } else {
+        /* We delay the costly check for symbols until we've read the symcache
+         * b/c if its entry indicates symbols we don't need to look
+         */
+        if (module_has_debug_info(mod)) {
+            LOG(1, "module now has debug info: %s symbol cache is stale\n", modname);
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Maps the binary cache file and validates it, leaving it mapped in
+ * modcache->bin_map.  Sets modcache->has_debug_info.
+ */
+static bool
+symcache_read_binfile(const module_data_t *mod, const char *modname,
+                      mod_cache_t *modcache)
+{
+    const symcache_bin_header_t *header;
+    const symcache_bin_symbol_t *syms;
+    uint64 map_size;
+    size_t actual_size;
+    byte *map = NULL;
+    char symfile[MAXIMUM_PATH];
+    file_t f;
+    uint i;
+
+    symcache_get_filename(modname, "bin", symfile, BUFFER_SIZE_ELEMENTS(symfile));
+    f = dr_open_file(symfile, DR_FILE_READ);
+    if (f == INVALID_FILE)
+        return false;
+    LOG(2, "mapping binary symbol cache file for %s\n", modname);
+    if (!dr_file_size(f, &map_size) || map_size < sizeof(*header) ||
+        map_size > UINT_MAX) {
+        WARN("WARNING: %s binary symbol cache file is corrupted\n", modname);
+        dr_close_file(f);
+        return false;
+    }
+    actual_size = (size_t) map_size;
+    map = dr_map_file(f, &actual_size, 0, NULL, DR_MEMPROT_READ, 0);
+    /* the mapping remains valid after the file is closed */
+    dr_close_file(f);
+    if (map == NULL || actual_size < map_size) {
+        NOTIFY_ERROR("Error mapping symcache file for %s"NL, modname);
+        if (map != NULL)
+            dr_unmap_file(map, actual_size);
+        return false;
+    }
+    header = (const symcache_bin_header_t *) map;
+    if (memcmp(header->magic, SYMCACHE_BIN_MAGIC, sizeof(header->magic)) != 0 ||
+        /* neither forward nor backward compatible */
+        header->version != SYMCACHE_VERSION) {
+        WARN("WARNING: %s binary symbol cache file has wrong version\n", modname);
+        goto symcache_read_binfile_error;
+    }
+    /* Self-consistency: bound every section so lookups need no checks
+     * beyond the per-symbol ones below
+     */
+    if (header->file_size != map_size ||
+        header->symbols_start < sizeof(*header) ||
+        header->symbols_start + (uint64)header->num_symbols *
+        sizeof(symcache_bin_symbol_t) > header->offsets_start ||
+        !ALIGNED(header->offsets_start, sizeof(uint64)) ||
+        header->offsets_start + (uint64)header->num_offsets * sizeof(uint64) >
+        header->strings_start ||
+        header->strings_start + (uint64)header->strings_size != map_size ||
+        (header->strings_size > 0 && map[map_size - 1] != '\0')) {
+        WARN("WARNING: %s binary symbol cache file is corrupted\n", modname);
+        goto symcache_read_binfile_error;
+    }
+    syms = (const symcache_bin_symbol_t *) (map + header->symbols_start);
+    for (i = 0; i < header->num_symbols; i++) {
+        if (syms[i].name >= header->strings_size ||
+            syms[i].first + (uint64)syms[i].num > header->num_offsets) {
+            WARN("WARNING: %s binary symbol cache file is corrupted\n", modname);
+            goto symcache_read_binfile_error;
+        }
+    }
+    /* Module consistency checks */
+    if (header->module_file_size != modcache->module_file_size
+#ifdef WINDOWS
+        || header->file_version != modcache->file_version.version ||
+        header->product_version != modcache->product_version.version ||
+        header->checksum != modcache->checksum ||
+        header->timestamp != modcache->timestamp ||
+        header->module_internal_size != modcache->module_internal_size
+#endif
+        ) {
+        LOG(1, "module version mismatch: %s symbol cache file is stale\n", modname);
+        goto symcache_read_binfile_error;
+    }
+    if (!symcache_check_debug_info(mod, modname, modcache,
+                                   header->has_debug_info != 0))
+        goto symcache_read_binfile_error;
+    modcache->bin_map = map;
+    modcache->bin_map_size = actual_size;
+    return true;
+
+ symcache_read_binfile_error:
+    dr_unmap_file(map, actual_size);
+    return false;
+}
+
 #define MAX_SYMLEN 256
 /* sscanf will add a null beyond this */
 #define MAX_SYMLEN_MINUS_1 255
@@ -302,7 +674,8 @@ symcache_read_symfile(const module_data_t *mod, const char *modname, mod_cache_t
     bool res = false;
     const char *line, *next_line;
     char symbol[MAX_SYMLEN];
-    size_t offs;
+    uint offs;
+    uint version;
     uint64 map_size;
     size_t actual_size;
     bool ok;
@@ -310,7 +683,7 @@ symcache_read_symfile(const module_data_t *mod, const char *modname, mod_cache_t
     char symfile[MAXIMUM_PATH];
     file_t f;
 
-    symcache_get_filename(modname, symfile, BUFFER_SIZE_ELEMENTS(symfile));
+    symcache_get_filename(modname, "txt", symfile, BUFFER_SIZE_ELEMENTS(symfile));
     f = dr_open_file(symfile, DR_FILE_READ);
     if (f == INVALID_FILE)
         goto symcache_read_symfile_done;
@@ -330,9 +703,9 @@ symcache_read_symfile(const module_data_t *mod, const char *modname, mod_cache_t
         WARN("WARNING: symbol cache file is corrupted\n");
         goto symcache_read_symfile_done;
     }
-    if (sscanf((char *)map + strlen(SYMCACHE_FILE_HEADER) + 1, "%d", (uint *)&offs) != 1 ||
+    if (sscanf((char *)map + strlen(SYMCACHE_FILE_HEADER) + 1, "%u", &version) != 1 ||
         /* neither forward nor backward compatible */
-        offs != SYMCACHE_VERSION) {
+        version != SYMCACHE_VERSION) {
         WARN("WARNING: symbol cache file has wrong version\n");
         goto symcache_read_symfile_done;
     }
@@ -403,18 +776,8 @@ symcache_read_symfile(const module_data_t *mod, const char *modname, mod_cache_t
             WARN("WARNING: %s symbol cache file has bad consistency header\n", modname);
             goto symcache_read_symfile_done;
         }
-        if (has_debug_info) {
-            /* We assume that the current availability of debug info doesn't matter */
-            modcache->has_debug_info = true;
-        } else {
-            /* We delay the costly check for symbols until we've read the symcache
-             * b/c if its entry indicates symbols we don't need to look
-             */
-            if (module_has_debug_info(mod)) {
-                LOG(1, "module now has debug info: %s symbol cache is stale\n", modname);
-                goto symcache_read_symfile_done;
-            }
-        }
+        if (!symcache_check_debug_info(mod, modname, modcache, has_debug_info != 0))
+            goto symcache_read_symfile_done;
     }
     line = strchr(line, '\n');
     if (line != NULL)
@@ -428,10 +791,10 @@ symcache_read_symfile(const module_data_t *mod, const char *modname, mod_cache_t
         } else {
             next_line = newline + 1;
         }
-        if (sscanf(line, "%"MAX_SYMLEN_MINUS_1_STR"[^,],0x%x", symbol,
-                   (uint *)&offs) == 2) {
+        /* %x writes a uint, so we can't pass a pointer to size_t */
+        if (sscanf(line, "%"MAX_SYMLEN_MINUS_1_STR"[^,],0x%x", symbol, &offs) == 2) {
             symcache_symbol_add(modname, symtable, symbol, offs);
-        } else if (symbol[0] != '\0' && sscanf(line, ",0x%x", (uint *)&offs) == 1) {
+        } else if (symbol[0] != '\0' && sscanf(line, ",0x%x", &offs) == 1) {
             /* duplicate entries are allowed to not list the symbol, to save
              * space in the file (mainly for post-call caching i#669)
              */
@@ -499,7 +862,7 @@ symcache_exit(void)
         hash_entry_t *he;
         for (he = symcache_table.table[i]; he != NULL; he = he->next) {
             mod_cache_t *modcache = (mod_cache_t *) he->payload;
-            symcache_write_symfile(modcache->modname, modcache);
+            symcache_write_symfile(modcache->modname, modcache, false/*!keep*/);
         }
     }
     hashtable_delete(&symcache_table);
@@ -571,7 +934,11 @@ symcache_module_load(void *drcontext, const module_data_t *mod, bool loaded)
 #endif
 
     modcache->modname = drmem_strdup(modname, HEAPSTAT_HASHTABLE);
-    modcache->from_file = symcache_read_symfile(mod, modname, modcache);
+    modcache->from_bin = symcache_read_binfile(mod, modname, modcache);
+    if (modcache->from_bin)
+        modcache->from_file = true;
+    else
+        modcache->from_file = symcache_read_symfile(mod, modname, modcache);
 
     dr_mutex_lock(symcache_lock);
     if (!hashtable_add(&symcache_table, (void *)mod->full_path, (void *)modcache)) {
@@ -597,7 +964,7 @@ symcache_module_save_common(const module_data_t *mod, bool remove)
     dr_mutex_lock(symcache_lock);
     modcache = (mod_cache_t *) hashtable_lookup(&symcache_table, (void *)mod->full_path);
     if (modcache != NULL) {
-        symcache_write_symfile(modname, modcache);
+        symcache_write_symfile(modname, modcache, !remove);
         if (remove)
             hashtable_remove(&symcache_table, (void *)mod->full_path);
     }
@@ -628,8 +995,12 @@ symcache_module_has_data(const module_data_t *mod, bool require_syms)
     ASSERT(initialized, "symcache was not initialized");
     dr_mutex_lock(symcache_lock);
     modcache = (mod_cache_t *) hashtable_lookup(&symcache_table, (void *)mod->full_path);
-    if (modcache != NULL)
-        res = (modcache->table.entries > 0 && (!require_syms || modcache->has_debug_info));
+    if (modcache != NULL) {
+        res = ((modcache->table.entries > 0 ||
+                (modcache->bin_map != NULL &&
+                 symcache_bin_header(modcache)->num_symbols > 0)) &&
+               (!require_syms || modcache->has_debug_info));
+    }
     dr_mutex_unlock(symcache_lock);
     return res;
 }
@@ -664,6 +1035,11 @@ symcache_add(const module_data_t *mod, const char *symbol, size_t offs)
         dr_mutex_unlock(symcache_lock);
         return false;
     }
+    if (hashtable_lookup(&modcache->table, (void *)symbol) == NULL) {
+        const symcache_bin_symbol_t *sym = symcache_bin_lookup(modcache, symbol);
+        if (sym != NULL)
+            symcache_bin_copy_symbol(modcache, sym);
+    }
     if (symcache_symbol_add(modname, &modcache->table, symbol, offs) &&
         modcache->from_file)
         modcache->appended = true;
@@ -703,8 +1079,20 @@ symcache_lookup(const module_data_t *mod, const char *symbol, uint idx,
     }
     olist = (offset_list_t *) hashtable_lookup(&modcache->table, (void *)symbol);
     if (olist == NULL) {
+        const symcache_bin_symbol_t *sym = symcache_bin_lookup(modcache, symbol);
+        if (sym == NULL) {
+            dr_mutex_unlock(symcache_lock);
+            return false;
+        }
+        *num = sym->num;
+        if (idx < sym->num)
+            *offs = (size_t) symcache_bin_offsets(modcache)[sym->first + idx];
+        else
+            *offs = 0;
         dr_mutex_unlock(symcache_lock);
-        return false;
+        LOG(2, "sym lookup of %s in %s => binary symcache hit "PIFX"\n",
+            symbol, mod->full_path, *offs);
+        return true;
     }
     *num = olist->num;
     for (i = 0; i < idx && olist != NULL; i++, olist = olist->next)
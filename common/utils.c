@@ -1318,6 +1318,114 @@ hashwrap_assert_fail(const char *msg)
     ASSERT(false, msg);
 }
 
+#ifdef STATISTICS
+/***************************************************************************
+ * SHARDED STATISTICS
+ */
+
+static const char * const stats_shard_name[] = {
+# define STATS_SHARD_NAME(name) #name,
+    STATS_SHARD_LIST(STATS_SHARD_NAME)
+};
+
+/* Protects stats_shard_head and stats_shard_retired */
+static void *stats_shard_lock;
+static tls_util_t *stats_shard_head;
+/* Counts from exited threads and from threads with no tls_util_t */
+static uint64 stats_shard_retired[STAT_SHARD_NUM];
+
+void
+stats_shard_add_global(uint id, uint64 val)
+{
+    ASSERT(id < STAT_SHARD_NUM, "invalid stat id");
+    dr_mutex_lock(stats_shard_lock);
+    stats_shard_retired[id] += val;
+    dr_mutex_unlock(stats_shard_lock);
+}
+
+/* Caller must hold stats_shard_lock */
+static void
+stats_shard_link(tls_util_t *pt)
+{
+    pt->stats_prev = NULL;
+    pt->stats_next = stats_shard_head;
+    if (stats_shard_head != NULL)
+        stats_shard_head->stats_prev = pt;
+    stats_shard_head = pt;
+}
+
+/* Caller must hold stats_shard_lock */
+static void
+stats_shard_retire(tls_util_t *pt)
+{
+    uint i;
+    for (i = 0; i < STAT_SHARD_NUM; i++)
+        stats_shard_retired[i] += pt->stats[i];
+}
+
+uint64
+stats_shard_sum(uint id)
+{
+    uint64 sum;
+    tls_util_t *pt;
+    ASSERT(id < STAT_SHARD_NUM, "invalid stat id");
+    dr_mutex_lock(stats_shard_lock);
+    sum = stats_shard_retired[id];
+    /* Other threads keep incrementing w/o synchronization: the result is
+     * approximate (and on 32-bit a read can tear), which is fine for stats.
+     */
+    for (pt = stats_shard_head; pt != NULL; pt = pt->stats_next)
+        sum += pt->stats[id];
+    dr_mutex_unlock(stats_shard_lock);
+    return sum;
+}
+
+void
+stats_shard_print_series_header(file_t f)
+{
+    uint i;
+    dr_fprintf(f, "timestamp");
+    for (i = 0; i < STAT_SHARD_NUM; i++)
+        dr_fprintf(f, ",%s", stats_shard_name[i]);
+    dr_fprintf(f, "\n");
+}
+
+void
+stats_shard_print_series(file_t f, uint64 timestamp)
+{
+    uint i;
+    /* Each line is built up front to keep concurrent dumps from interleaving */
+    char buf[STAT_SHARD_NUM * 22 + 32];
+    size_t sofar = 0;
+    ssize_t len;
+    BUFPRINT(buf, BUFFER_SIZE_ELEMENTS(buf), sofar, len,
+             UINT64_FORMAT_STRING, timestamp);
+    for (i = 0; i < STAT_SHARD_NUM; i++) {
+        BUFPRINT(buf, BUFFER_SIZE_ELEMENTS(buf), sofar, len,
+                 ","UINT64_FORMAT_STRING, stats_shard_sum(i));
+    }
+    BUFPRINT(buf, BUFFER_SIZE_ELEMENTS(buf), sofar, len, "\n");
+    dr_write_file(f, buf, sofar);
+}
+
+void
+stats_shard_fork_init(void *drcontext)
+{
+    tls_util_t *pt, *next;
+    tls_util_t *mine = (tls_util_t *) drmgr_get_tls_field(drcontext, tls_idx_util);
+    dr_mutex_lock(stats_shard_lock);
+    for (pt = stats_shard_head; pt != NULL; pt = next) {
+        next = pt->stats_next;
+        if (pt != mine)
+            stats_shard_retire(pt);
+    }
+    stats_shard_head = NULL;
+    if (mine != NULL)
+        stats_shard_link(mine);
+    dr_mutex_unlock(stats_shard_lock);
+}
+#endif /* STATISTICS */
+
 /***************************************************************************
  * INIT/EXIT
  */
@@ -1327,6 +1435,9 @@ utils_init(void)
 {
     tls_idx_util = drmgr_register_tls_field();
     ASSERT(tls_idx_util > -1, "failed to obtain TLS slot");
+#ifdef STATISTICS
+    stats_shard_lock = dr_mutex_create();
+#endif
 
 #ifdef WINDOWS
     if (os_version.version == 0)
@@ -1359,6 +1470,9 @@ utils_exit(void)
     }
 #endif
     drmgr_unregister_tls_field(tls_idx_util);
+#ifdef STATISTICS
+    dr_mutex_destroy(stats_shard_lock);
+#endif
 }
 
 void
@@ -1367,6 +1481,11 @@ utils_thread_init(void *drcontext)
     tls_util_t *pt = (tls_util_t *) thread_alloc(drcontext, sizeof(*pt), HEAPSTAT_MISC);
     memset(pt, 0, sizeof(*pt));
     drmgr_set_tls_field(drcontext, tls_idx_util, (void *) pt);
+#ifdef STATISTICS
+    dr_mutex_lock(stats_shard_lock);
+    stats_shard_link(pt);
+    dr_mutex_unlock(stats_shard_lock);
+#endif
 }
 
 void
@@ -1377,6 +1496,17 @@ utils_thread_exit(void *drcontext)
      * that we've cleaned up the per-thread data
      */
     drmgr_set_tls_field(drcontext, tls_idx_util, NULL);
+#ifdef STATISTICS
+    dr_mutex_lock(stats_shard_lock);
+    stats_shard_retire(pt);
+    if (pt->stats_prev != NULL)
+        pt->stats_prev->stats_next = pt->stats_next;
+    else
+        stats_shard_head = pt->stats_next;
+    if (pt->stats_next != NULL)
+        pt->stats_next->stats_prev = pt->stats_prev;
+    dr_mutex_unlock(stats_shard_lock);
+#endif
     thread_free(drcontext, pt, sizeof(*pt), HEAPSTAT_MISC);
 }
 
@@ -261,9 +261,52 @@ print_prefix_to_console(void);
  * for warning/error reporting to logfile
  */
 
+#ifdef STATISTICS
+/* Statistics bumped by every thread on hot paths are kept in per-thread
+ * 64-bit counters rather than in a shared global, to avoid cache line
+ * contention and wraparound on long runs.  They are summed on demand by
+ * stats_shard_sum().  To add one, list it here and use STATS_SHARD_INC/ADD.
+ */
+# define STATS_SHARD_LIST(X) \
+    X(slowpath_executions) \
+    X(medpath_executions) \
+    X(read_slowpath) \
+    X(write_slowpath) \
+    X(push_slowpath) \
+    X(pop_slowpath) \
+    X(adjust_esp_executions) \
+    X(num_mallocs) \
+    X(num_frees) \
+    X(heap_lock_acquires) \
+    X(heap_lock_avoided) \
+    X(realloc_grown_in_place) \
+    X(realloc_remapped) \
+    X(realloc_copied) \
+    X(arena_bytes_alloced) \
+    X(arena_bytes_freed) \
+    X(coalesce_tail_bytes) \
+    X(coalesce_reset_bytes) \
+    X(find_next_fp_scans) \
+    X(cstack_is_retaddr) \
+    X(cstack_is_retaddr_backdecode) \
+    X(cstack_is_retaddr_unreadable)
+
+# define STATS_SHARD_ENUM(name) STAT_SHARD_##name,
+enum {
+    STATS_SHARD_LIST(STATS_SHARD_ENUM)
+    STAT_SHARD_NUM
+};
+#endif
+
 /* Per-thread data shared across callbacks and all modules */
 typedef struct _tls_util_t {
     file_t f;  /* logfile */
+#ifdef STATISTICS
+    uint64 stats[STAT_SHARD_NUM];
+    /* list of live threads' counters, protected by stats_shard_lock */
+    struct _tls_util_t *stats_next;
+    struct _tls_util_t *stats_prev;
+#endif
 } tls_util_t;
 
 extern int tls_idx_util;
@@ -402,11 +445,20 @@ extern int tls_idx_util;
 # define STATS_DEC(stat) ATOMIC_DEC32(stat)
 # define STATS_ADD(stat, val) ATOMIC_ADD32(stat, val)
 # define DOSTATS(x) x
+/* For the counters in STATS_SHARD_LIST */
+# define STATS_SHARD_INC(stat) stats_shard_add(STAT_SHARD_##stat, 1)
+# define STATS_SHARD_ADD(stat, val) stats_shard_add(STAT_SHARD_##stat, val)
+/* The calling thread's count */
+# define STATS_SHARD_LOCAL(stat) stats_shard_local(STAT_SHARD_##stat)
+/* The process-wide count: takes a lock, so avoid on hot paths */
+# define STATS_SHARD_SUM(stat) stats_shard_sum(STAT_SHARD_##stat)
 #else
 # define STATS_INC(stat) /* nothing */
 # define STATS_DEC(stat) /* nothing */
 # define STATS_ADD(stat, val) /* nothing */
 # define DOSTATS(x) /* nothing */
+# define STATS_SHARD_INC(stat) /* nothing */
+# define STATS_SHARD_ADD(stat, val) /* nothing */
 #endif
 
 #define PRE instrlist_meta_preinsert
@@ -479,6 +531,10 @@ atomic_add32_return_sum(volatile int *x, int val)
                          : "1" (val) : "memory");
     return (cur + val);
 }
+/* Full fence: needed only to order a store before a later load */
+# define MEMORY_BARRIER() __asm__ __volatile__("mfence" : : : "memory")
+/* Prevents the compiler from moving memory accesses across it */
+# define COMPILER_BARRIER() __asm__ __volatile__("" : : : "memory")
 #else
 # define ATOMIC_INC32(x) _InterlockedIncrement((volatile LONG *)&(x))
 # define ATOMIC_DEC32(x) _InterlockedDecrement((volatile LONG *)&(x))
@@ -489,6 +545,11 @@ atomic_add32_return_sum(volatile int *x, int val)
 {
     return (ATOMIC_ADD32(*x, val) + val);
 }
+# define MEMORY_BARRIER() do {                           \
+    volatile LONG barrier_;                              \
+    _InterlockedExchange((volatile LONG *)&barrier_, 0); \
+} while (0)
+# define COMPILER_BARRIER() _ReadWriteBarrier()
 #endif
 
 /* racy: should be used only for diagnostics */
@@ -754,4 +815,50 @@ utils_thread_exit(void *drcontext);
 void
 utils_thread_set_file(void *drcontext, file_t f);
 
+#ifdef STATISTICS
+/***************************************************************************
+ * SHARDED STATISTICS
+ */
+
+/* Used when the calling thread has no tls_util_t */
+void
+stats_shard_add_global(uint id, uint64 val);
+
+static inline void
+stats_shard_add(uint id, uint64 val)
+{
+    tls_util_t *pt = PT_LOOKUP();
+    if (pt != NULL)
+        pt->stats[id] += val;
+    else
+        stats_shard_add_global(id, val);
+}
+
+static inline uint64
+stats_shard_local(uint id)
+{
+    tls_util_t *pt = PT_LOOKUP();
+    return (pt == NULL) ? 0 : pt->stats[id];
+}
+
+uint64
+stats_shard_sum(uint id);
+
+/* Writes the names of the sharded counters as a comma-separated header line */
+void
+stats_shard_print_series_header(file_t f);
+
+/* Writes timestamp followed by the sum of each sharded counter as one
+ * comma-separated line
+ */
+void
+stats_shard_print_series(file_t f, uint64 timestamp);
+
+/* Called in the child: folds the counters of the threads that did not
+ * survive the fork into the global totals
+ */
+void
+stats_shard_fork_init(void *drcontext);
+#endif /* STATISTICS */
+
 #endif /* _UTILS_H_ */
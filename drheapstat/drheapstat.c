@@ -1102,6 +1102,12 @@ client_found_leak(app_pc start, app_pc end, size_t indirect_bytes,
     release_buffer(drcontext, buf, bufsz);
 }
 
+void
+client_leaks_pre_report(void **client_data, uint num)
+{
+    /* XXX i#926: nothing to batch until we symbolize leak callstacks online */
+}
+
 /***************************************************************************
  * INSTRUMENTATION
  */
@@ -1406,8 +1412,10 @@ dump_statistics(void)
 {
     int i;
     dr_fprintf(f_global, "Statistics:\n");
-    dr_fprintf(f_global, "app mallocs: %8u, frees: %8u, large mallocs; %6u\n",
-               num_mallocs, num_frees, num_large_mallocs);
+    dr_fprintf(f_global, "app mallocs: %8"UINT64_FORMAT_CODE", frees: %8"
+               UINT64_FORMAT_CODE", large mallocs; %6u\n",
+               STATS_SHARD_SUM(num_mallocs), STATS_SHARD_SUM(num_frees),
+               num_large_mallocs);
     dr_fprintf(f_global, "unique malloc stacks: %8u\n", alloc_stack_count);
     dr_fprintf(f_global, "app heap regions: %8u\n", heap_regions);
     dr_fprintf(f_global, "peaks detected: %8u, skipped: %8u\n",
@@ -2223,6 +2231,8 @@ dr_init(client_id_t client_id)
     alloc_ops.cache_postcall = false;
     alloc_ops.intercept_operators = false;
     alloc_ops.conservative = options.conservative;
+    /* our callbacks and snapshots rely on the malloc lock serializing them */
+    alloc_ops.malloc_table_stripes = 1;
     alloc_init(&alloc_ops, sizeof(alloc_ops));
 
     hashtable_init_ex(&alloc_stack_table, ASTACK_TABLE_HASH_BITS, HASH_CUSTOM,
@@ -2274,6 +2284,8 @@ dr_init(client_id_t client_id)
                   options.midchunk_string_ok,
                   options.midchunk_size_ok,
                   options.show_reachable,
+                  1/*single-threaded scan*/,
+                  false/*!incremental*/,
                   IF_WINDOWS_(options.check_encoded_pointers)
                   NULL, NULL, NULL);
     }
@@ -36,8 +36,6 @@ extern file_t f_snapshot;
 extern file_t f_staleness;
 
 #ifdef STATISTICS
-extern uint num_mallocs;
-extern uint num_frees;
 extern uint alloc_stack_count;
 extern uint heap_regions;
 #endif /* STATISTICS */
@@ -40,14 +40,18 @@
 # include "stack.h"
 #endif
 #include "pattern.h"
+#include <stddef.h> /* for offsetof */
 
 /* PR 465174: share allocation site callstacks.
  * This table should only be accessed while holding the lock for
  * malloc_table (via malloc_lock()), which makes the coordinated
  * operations with malloc_table atomic.
  *
- * FIXME i#949: for -replace_malloc a global lock is not always held
- * so we need our own locks
+ * For -replace_malloc a global lock is not always held (i#949), the
+ * per-thread free list caches (i#948) invoke our callbacks w/o any heap
+ * lock, and when wrapping only one stripe of malloc_table is locked, so the
+ * lookup-or-add and the final-reference removal are done while holding the
+ * table's own lock.
  */
 #define ASTACK_TABLE_HASH_BITS 8
 static hashtable_t alloc_stack_table;
@@ -64,8 +68,59 @@ static void *mmap_tree_lock; /* maybe rbtree should support internal synch */
 
 #ifdef STATISTICS
 uint alloc_stack_count;
+uint alloc_stack_deferred;
+uint alloc_stack_deferred_resolved;
+uint alloc_stack_defer_ring_full;
 #endif
 
+/* i#75, i#246: with -defer_callstacks, the client data of a heap chunk is
+ * either a shared packed_callstack_t or, tagged with DEFERRED_TAG in its low
+ * bit, a deferred_callstack_t holding just the raw return addresses.  The
+ * module lookups and the alloc_stack_table insert only happen if the
+ * callstack is needed: for a report, at leak scan time, or when a module it
+ * refers to is unloaded.  Allocations freed before then never pay for them.
+ *
+ * Each thread owns a ring of records that it claims in order, skipping any
+ * whose allocation is still live.  Only the owner marks a record live, which
+ * it does without a lock.  Any thread may free or resolve a live record, and
+ * does so while holding the ring's lock.  Since live records cannot be moved,
+ * the ring of an exited thread is adopted by the next new thread.
+ */
+#define DEFERRED_TAG 0x1
+#define IS_DEFERRED(data) TEST(DEFERRED_TAG, (ptr_uint_t)(data))
+#define DEFERRED_RECORD(data) \
+    ((deferred_callstack_t *)((ptr_uint_t)(data) & ~DEFERRED_TAG))
+/* How many live records to skip before resolving the callstack right away */
+#define DEFER_RING_PROBE 4
+
+typedef struct _deferred_callstack_t {
+    struct _defer_ring_t *ring;
+    /* Resolved on first use.  Holds one reference on the shared callstack. */
+    packed_callstack_t *resolved;
+    volatile bool live;
+    uint num_frames;
+    app_pc frames[1]; /* really options.callstack_max_frames entries */
+} deferred_callstack_t;
+
+typedef struct _defer_ring_t {
+    void *lock;
+    byte *slots;
+    size_t slot_size;
+    /* Only accessed by the owning thread */
+    uint next;
+    /* Protected by defer_rings_lock */
+    bool orphaned;
+    struct _defer_ring_t *next_ring;
+} defer_ring_t;
+
+static bool defer_callstacks;
+static int tls_idx_alloc = -1;
+/* Protects the list of rings and their orphaned fields.  Acquire before any
+ * ring lock.
+ */
+static void *defer_rings_lock;
+static defer_ring_t *defer_rings;
+
 #ifdef WINDOWS
 app_pc addr_RtlLeaveCrit; /* for i#689 */
 #endif
@@ -151,6 +206,9 @@ uint delayed_free_bytes; /* includes redzones */
 static void
 alloc_callstack_free(void *p);
 
+static void
+defer_ring_free(defer_ring_t *ring);
+
 static byte *
 next_defined_dword(byte *start, byte *end);
 
@@ -187,23 +245,34 @@ alloc_drmem_init(void)
      */
     alloc_ops.intercept_operators = INSTRUMENT_MEMREFS();
     alloc_ops.conservative = options.conservative;
+    alloc_ops.malloc_table_stripes = options.malloc_table_stripes;
     /* replace vs wrap */
     alloc_ops.replace_malloc = options.replace_malloc;
     alloc_ops.external_headers = (options.pattern != 0);
     alloc_ops.delay_frees = options.delay_frees;
     alloc_ops.delay_frees_maxsz = options.delay_frees_maxsz;
+    alloc_ops.thread_cache_batch = options.thread_cache_batch;
 #ifdef WINDOWS
     alloc_ops.skip_msvc_importers = options.skip_msvc_importers;
 #endif
     alloc_init(&alloc_ops, sizeof(alloc_ops));
 
     hashtable_init_ex(&alloc_stack_table, ASTACK_TABLE_HASH_BITS, HASH_CUSTOM,
-                      false/*!str_dup*/, true/* synch (higher-level synch covered
-                                              * by malloc_table's lock) */,
+                      false/*!str_dup*/, false/* !synch: we hold the table
+                                               * lock across compound ops */,
                       alloc_callstack_free,
                       (uint (*)(void*)) packed_callstack_hash,
                       (bool (*)(void*, void*)) packed_callstack_cmp);
 
+    defer_callstacks = (options.defer_callstacks > 0 &&
+                        options.callstack_max_frames > 0 &&
+                        (options.count_leaks || options.track_origins_unaddr));
+    if (defer_callstacks) {
+        tls_idx_alloc = drmgr_register_tls_field();
+        ASSERT(tls_idx_alloc > -1, "unable to reserve TLS slot");
+        defer_rings_lock = dr_mutex_create();
+    }
+
 #ifdef LINUX
     hashtable_init(&sighand_table, SIGHAND_HASH_BITS, HASH_INTPTR, false/*!strdup*/);
     mmap_tree = rb_tree_create(NULL);
@@ -217,6 +286,8 @@ alloc_drmem_init(void)
               options.midchunk_string_ok,
               options.midchunk_size_ok,
               options.show_reachable,
+              options.leak_scan_threads,
+              options.leak_scan_incremental,
               IF_WINDOWS_(options.check_encoded_pointers)
               next_defined_dword,
               end_of_defined_region,
@@ -239,6 +310,16 @@ alloc_drmem_exit(void)
 {
     leak_exit();
     alloc_exit(); /* must be before deleting alloc_stack_table */
+    if (defer_callstacks) {
+        /* alloc_exit() freed the records of all remaining allocations */
+        while (defer_rings != NULL) {
+            defer_ring_t *next = defer_rings->next_ring;
+            defer_ring_free(defer_rings);
+            defer_rings = next;
+        }
+        dr_mutex_destroy(defer_rings_lock);
+        drmgr_unregister_tls_field(tls_idx_alloc);
+    }
     hashtable_delete_with_stats(&alloc_stack_table, "alloc stack table");
 #ifdef LINUX
     hashtable_delete(&sighand_table);
@@ -346,6 +427,10 @@ shared_callstack_free(packed_callstack_t *pcs)
     uint count;
     if (pcs == NULL)
         return;
+    /* the decrement must be inside the lock to avoid racing w/ a lookup
+     * in get_shared_callstack() that is about to add a ref
+     */
+    hashtable_lock(&alloc_stack_table);
     count = packed_callstack_free(pcs);
     ASSERT(count != 0, "refcount should not hit 0 in malloc_table");
     if (count == 1) {
@@ -355,47 +440,30 @@ shared_callstack_free(packed_callstack_t *pcs)
          */
         hashtable_remove(&alloc_stack_table, (void *)pcs);
     }
+    hashtable_unlock(&alloc_stack_table);
 }
 
+static void
+deferred_callstack_free(deferred_callstack_t *dc);
+
 void
 client_malloc_data_free(void *data)
 {
-    packed_callstack_t *pcs = (packed_callstack_t *) data;
-    ASSERT(pcs != NULL || !options.count_leaks, "malloc data must exist");
-    shared_callstack_free(pcs);
+    ASSERT(data != NULL || !options.count_leaks, "malloc data must exist");
+    if (IS_DEFERRED(data))
+        deferred_callstack_free(DEFERRED_RECORD(data));
+    else
+        shared_callstack_free((packed_callstack_t *) data);
 }
 
+/* Returns the shared equivalent of pcs with a reference added for the caller.
+ * If pcs is not already shared it is consumed.
+ */
 static packed_callstack_t *
-get_shared_callstack(packed_callstack_t *existing_data, dr_mcontext_t *mc,
-                     app_pc post_call)
+intern_callstack(packed_callstack_t *pcs, bool is_shared)
 {
-    /* XXX i#75: when the app has a ton of mallocs that are quickly freed,
-     * we spend a lot of time building and tearing down callstacks
-     * (xref my original setup of not showing leak callstacks by default
-     * which was for this reason and to save space: but for usability
-     * it's better to have leak callstacks by default).
-     * We could just record addresses and not modules, and only on
-     * module unload or app exit walk the malloc table and fill
-     * in the module info (and if too many unloads, switch to the
-     * every-alloc scheme).
-     */
-    packed_callstack_t *pcs;
     packed_callstack_t *existing;
-    if (existing_data != NULL)
-        pcs = (packed_callstack_t *) existing_data;
-    else {
-        app_loc_t loc;
-        pc_to_loc(&loc, post_call);
-        packed_callstack_record(&pcs, mc, &loc);
-        /* our malloc and free callstacks use post-call as the top frame when wrapping */
-        if (!options.replace_malloc)
-            packed_callstack_first_frame_retaddr(pcs);
-    }
-    /* XXX i#246: store last malloc callstack outside of hashtable,
-     * and only add to hashtable on next malloc, so that if freed
-     * right away we avoid the hashtable lookup+cmp+insert+remove
-     * costs
-     */ 
+    hashtable_lock(&alloc_stack_table);
     existing = hashtable_lookup(&alloc_stack_table, (void *)pcs);
     if (existing == NULL) {
         /* avoid calling lookup twice by not calling hashtable_add() */
@@ -409,7 +477,7 @@ get_shared_callstack(packed_callstack_t *existing_data, dr_mcontext_t *mc,
         STATS_INC(alloc_stack_count);
     } else {
         IF_DEBUG(uint count;)
-        if (existing_data == NULL) {    /* PR 533755 */
+        if (!is_shared) {    /* PR 533755 */
             IF_DEBUG(count = )
                 packed_callstack_free(pcs);
             ASSERT(count == 0, "refcount should be 0");
@@ -423,15 +491,237 @@ get_shared_callstack(packed_callstack_t *existing_data, dr_mcontext_t *mc,
      * and the refcount hits 1 we remove from alloc_stack_table.
      */
     packed_callstack_add_ref(pcs);
+    hashtable_unlock(&alloc_stack_table);
+    return pcs;
+}
+
+static packed_callstack_t *
+get_shared_callstack(packed_callstack_t *existing_data, dr_mcontext_t *mc,
+                     app_pc post_call)
+{
+    /* XXX i#75: when the app has a ton of mallocs that are quickly freed,
+     * we spend a lot of time building and tearing down callstacks
+     * (xref my original setup of not showing leak callstacks by default
+     * which was for this reason and to save space: but for usability
+     * it's better to have leak callstacks by default).
+     * -defer_callstacks records just the addresses and fills in the
+     * module info when needed: see deferred_callstack_record().
+     */
+    packed_callstack_t *pcs;
+    if (existing_data != NULL)
+        pcs = (packed_callstack_t *) existing_data;
+    else {
+        app_loc_t loc;
+        pc_to_loc(&loc, post_call);
+        packed_callstack_record(&pcs, mc, &loc);
+        /* our malloc and free callstacks use post-call as the top frame when wrapping */
+        if (!options.replace_malloc)
+            packed_callstack_first_frame_retaddr(pcs);
+    }
+    return intern_callstack(pcs, existing_data != NULL);
+}
+
+/***************************************************************************
+ * DEFERRED CALLSTACKS
+ */
+
+static inline deferred_callstack_t *
+defer_ring_slot(defer_ring_t *ring, uint idx)
+{
+    return (deferred_callstack_t *) (ring->slots + idx * ring->slot_size);
+}
+
+static defer_ring_t *
+defer_ring_create(void)
+{
+    defer_ring_t *ring = (defer_ring_t *) global_alloc(sizeof(*ring), HEAPSTAT_MISC);
+    uint i;
+    ring->lock = dr_mutex_create();
+    ring->slot_size = ALIGN_FORWARD(offsetof(deferred_callstack_t, frames) +
+                                    options.callstack_max_frames * sizeof(app_pc),
+                                    sizeof(void*));
+    ring->slots = (byte *)
+        global_alloc(options.defer_callstacks * ring->slot_size, HEAPSTAT_CALLSTACK);
+    for (i = 0; i < options.defer_callstacks; i++) {
+        deferred_callstack_t *dc = defer_ring_slot(ring, i);
+        dc->ring = ring;
+        dc->resolved = NULL;
+        dc->live = false;
+    }
+    ring->next = 0;
+    ring->orphaned = false;
+    ring->next_ring = NULL;
+    return ring;
+}
+
+static void
+defer_ring_free(defer_ring_t *ring)
+{
+    global_free(ring->slots, options.defer_callstacks * ring->slot_size,
+                HEAPSTAT_CALLSTACK);
+    dr_mutex_destroy(ring->lock);
+    global_free(ring, sizeof(*ring), HEAPSTAT_MISC);
+}
+
+void
+alloc_drmem_thread_init(void *drcontext)
+{
+    defer_ring_t *ring;
+    if (!defer_callstacks)
+        return;
+    dr_mutex_lock(defer_rings_lock);
+    for (ring = defer_rings; ring != NULL; ring = ring->next_ring) {
+        if (ring->orphaned) {
+            ring->orphaned = false;
+            break;
+        }
+    }
+    if (ring == NULL) {
+        ring = defer_ring_create();
+        ring->next_ring = defer_rings;
+        defer_rings = ring;
+    }
+    dr_mutex_unlock(defer_rings_lock);
+    drmgr_set_tls_field(drcontext, tls_idx_alloc, (void *) ring);
+}
+
+void
+alloc_drmem_thread_exit(void *drcontext)
+{
+    defer_ring_t *ring;
+    if (!defer_callstacks)
+        return;
+    ring = (defer_ring_t *) drmgr_get_tls_field(drcontext, tls_idx_alloc);
+    drmgr_set_tls_field(drcontext, tls_idx_alloc, NULL);
+    if (ring == NULL)
+        return;
+    dr_mutex_lock(defer_rings_lock);
+    ring->orphaned = true;
+    dr_mutex_unlock(defer_rings_lock);
+}
+
+/* Returns NULL if no record is available, in which case the caller should
+ * record a shared callstack instead.
+ */
+static void *
+deferred_callstack_record(dr_mcontext_t *mc, app_pc post_call)
+{
+    void *drcontext = dr_get_current_drcontext();
+    defer_ring_t *ring = (defer_ring_t *)
+        ((drcontext == NULL) ? NULL : drmgr_get_tls_field(drcontext, tls_idx_alloc));
+    uint i;
+    if (ring == NULL)
+        return NULL;
+    for (i = 0; i < DEFER_RING_PROBE; i++) {
+        deferred_callstack_t *dc = defer_ring_slot(ring, ring->next);
+        ring->next++;
+        if (ring->next == options.defer_callstacks)
+            ring->next = 0;
+        /* Only we can make it live, so once we see it free it stays free */
+        if (!dc->live) {
+            dc->resolved = NULL;
+            dc->num_frames = callstack_record_raw(dc->frames, mc, post_call);
+            /* the frames must be visible before a resolver can see it live */
+            COMPILER_BARRIER();
+            dc->live = true;
+            STATS_INC(alloc_stack_deferred);
+            return (void *) ((ptr_uint_t)dc | DEFERRED_TAG);
+        }
+    }
+    STATS_INC(alloc_stack_defer_ring_full);
+    return NULL;
+}
+
+/* Caller must hold dc->ring->lock */
+static packed_callstack_t *
+deferred_callstack_resolve_locked(deferred_callstack_t *dc)
+{
+    ASSERT(dc->live, "resolving a freed callstack");
+    if (dc->resolved == NULL) {
+        packed_callstack_t *pcs;
+        packed_callstack_from_raw(&pcs, dc->frames, dc->num_frames);
+        if (!options.replace_malloc)
+            packed_callstack_first_frame_retaddr(pcs);
+        dc->resolved = intern_callstack(pcs, false);
+        STATS_INC(alloc_stack_deferred_resolved);
+    }
+    return dc->resolved;
+}
+
+static packed_callstack_t *
+deferred_callstack_resolve(deferred_callstack_t *dc)
+{
+    packed_callstack_t *pcs;
+    dr_mutex_lock(dc->ring->lock);
+    pcs = deferred_callstack_resolve_locked(dc);
+    dr_mutex_unlock(dc->ring->lock);
     return pcs;
 }
 
+static void
+deferred_callstack_free(deferred_callstack_t *dc)
+{
+    packed_callstack_t *pcs;
+    dr_mutex_lock(dc->ring->lock);
+    ASSERT(dc->live, "double free of deferred callstack");
+    pcs = dc->resolved;
+    dc->resolved = NULL;
+    dc->live = false;
+    dr_mutex_unlock(dc->ring->lock);
+    shared_callstack_free(pcs);
+}
+
+packed_callstack_t *
+client_malloc_data_to_callstack(void *data)
+{
+    if (IS_DEFERRED(data))
+        return deferred_callstack_resolve(DEFERRED_RECORD(data));
+    return (packed_callstack_t *) data;
+}
+
+/* The module info for frames in the module is about to go away, so we
+ * resolve every unresolved record that refers to it.
+ */
+void
+alloc_drmem_module_unload(void *drcontext, const module_data_t *info)
+{
+    defer_ring_t *ring;
+    if (!defer_callstacks)
+        return;
+    dr_mutex_lock(defer_rings_lock);
+    for (ring = defer_rings; ring != NULL; ring = ring->next_ring) {
+        uint i, j;
+        dr_mutex_lock(ring->lock);
+        for (i = 0; i < options.defer_callstacks; i++) {
+            deferred_callstack_t *dc = defer_ring_slot(ring, i);
+            if (!dc->live || dc->resolved != NULL)
+                continue;
+            for (j = 0; j < dc->num_frames; j++) {
+                if (dc->frames[j] >= info->start && dc->frames[j] < info->end) {
+                    deferred_callstack_resolve_locked(dc);
+                    break;
+                }
+            }
+        }
+        dr_mutex_unlock(ring->lock);
+    }
+    dr_mutex_unlock(defer_rings_lock);
+}
+
 void *
 client_add_malloc_pre(app_pc start, app_pc end, app_pc real_end,
                       void *existing_data, dr_mcontext_t *mc, app_pc post_call)
 {
     if (!options.count_leaks && !options.track_origins_unaddr)
         return NULL;
+    /* a deferred record is owned by its chunk so we keep using it */
+    if (IS_DEFERRED(existing_data))
+        return existing_data;
+    if (existing_data == NULL && defer_callstacks) {
+        void *data = deferred_callstack_record(mc, post_call);
+        if (data != NULL)
+            return data;
+    }
     return (void *)
         get_shared_callstack((packed_callstack_t *)existing_data, mc, post_call);
 }
@@ -482,7 +772,7 @@ client_mismatched_heap(app_pc pc, app_pc target, dr_mcontext_t *mc,
      * callstacks just for this feature.  Instead we try to report the allocator and
      * free routines involved.
      */
-    pcs = (packed_callstack_t *) client_data;
+    pcs = client_malloc_data_to_callstack(client_data);
     dr_snprintf(msg, BUFFER_SIZE_ELEMENTS(msg),
                 ": allocated with %s, freed with %s",
                 alloc_routine, free_routine);
@@ -891,10 +1181,8 @@ client_handle_free(app_pc base, size_t size, app_pc real_base, size_t real_size,
 void *
 client_malloc_data_to_free_list(void *cur_data, dr_mcontext_t *mc, app_pc post_call)
 {
-    packed_callstack_t *pcs = (packed_callstack_t *) cur_data;
     ASSERT(options.replace_malloc, "should not be called");
-    ASSERT(pcs != NULL || !options.count_leaks, "malloc data must exist");
-    shared_callstack_free(pcs);
+    client_malloc_data_free(cur_data);
     /* replace malloc callstack with free callstack */
     if (options.delay_frees_stack) {
         return (void *) get_shared_callstack(NULL, mc, post_call);
@@ -2340,15 +2628,30 @@ client_found_leak(app_pc start, app_pc end, size_t indirect_bytes,
                   bool maybe_reachable, void *client_data,
                   bool count_reachable, bool show_reachable)
 {
-    packed_callstack_t *pcs = (packed_callstack_t *) client_data;
+    packed_callstack_t *pcs;
     if (!options.count_leaks) {
         ASSERT(false, "shouldn't get here");
         return;
     }
+    pcs = client_malloc_data_to_callstack(client_data);
     report_leak(true, start, end - start, indirect_bytes, pre_us, reachable,
                 maybe_reachable, SHADOW_UNKNOWN, pcs, count_reachable, show_reachable);
 }
 
+void
+client_leaks_pre_report(void **client_data, uint num)
+{
+    packed_callstack_t **pcs;
+    uint i;
+    if (!options.count_leaks)
+        return;
+    pcs = (packed_callstack_t **) global_alloc(num * sizeof(*pcs), HEAPSTAT_MISC);
+    for (i = 0; i < num; i++)
+        pcs[i] = client_malloc_data_to_callstack(client_data[i]);
+    packed_callstack_batch_symbolize(pcs, num);
+    global_free(pcs, num * sizeof(*pcs), HEAPSTAT_MISC);
+}
+
 static byte *
 next_defined_dword(byte *start, byte *end)
 {
@@ -2421,7 +2724,7 @@ malloc_iterate_cb(app_pc start, app_pc end, app_pc real_end,
         data->start     = start;
         data->end       = end;
         data->real_end  = real_end;
-        data->alloc_pcs = (packed_callstack_t *) client_data;
+        data->alloc_pcs = client_malloc_data_to_callstack(client_data);
         data->pre_us    = pre_us;
         data->found     = true;
         return false; /* stop iteration */
@@ -36,6 +36,21 @@ alloc_drmem_init(void);
 void
 alloc_drmem_exit(void);
 
+void
+alloc_drmem_thread_init(void *drcontext);
+
+void
+alloc_drmem_thread_exit(void *drcontext);
+
+void
+alloc_drmem_module_unload(void *drcontext, const module_data_t *info);
+
+/* Returns the allocation callstack stored as the client data of a heap chunk,
+ * resolving it first if it was deferred (-defer_callstacks).
+ */
+packed_callstack_t *
+client_malloc_data_to_callstack(void *data);
+
 bool
 check_unaddressable_exceptions(bool write, app_loc_t *loc, app_pc addr, uint sz,
                                bool addr_on_stack, dr_mcontext_t *mc);
@@ -163,32 +163,40 @@ uint num_nudges;
 static uint pcaches_loaded;
 static uint pcaches_mismatch;
 static uint pcaches_written;
+/* One line per dump_statistics() call, for plotting counters over time */
+static file_t f_stats_series = INVALID_FILE;
+static uint64 stats_series_start;
 
 void 
 dump_statistics(void)
 {
     int i;
+    uint64 read_slow = STATS_SHARD_SUM(read_slowpath);
+    uint64 write_slow = STATS_SHARD_SUM(write_slowpath);
+    uint64 push_slow = STATS_SHARD_SUM(push_slowpath);
+    uint64 pop_slow = STATS_SHARD_SUM(pop_slowpath);
     dr_fprintf(f_global, "Statistics:\n");
     dr_fprintf(f_global, "nudges: %d\n", num_nudges);
-    dr_fprintf(f_global, "adjust_esp:%10u slow; %10u fast\n", adjust_esp_executions,
-               adjust_esp_fastpath);
-    dr_fprintf(f_global, "slow_path invocations: %10u\n", slowpath_executions);
-    dr_fprintf(f_global, "med_path invocations: %10u, fast: %10u\n",
-               medpath_executions, movs4_med_fast);
+    dr_fprintf(f_global, "adjust_esp:%10"UINT64_FORMAT_CODE" slow; %10u fast\n",
+               STATS_SHARD_SUM(adjust_esp_executions), adjust_esp_fastpath);
+    dr_fprintf(f_global, "slow_path invocations: %10"UINT64_FORMAT_CODE"\n",
+               STATS_SHARD_SUM(slowpath_executions));
+    dr_fprintf(f_global, "med_path invocations: %10"UINT64_FORMAT_CODE", fast: %10u\n",
+               STATS_SHARD_SUM(medpath_executions), movs4_med_fast);
     dr_fprintf(f_global, "movs4: src unalign: %10u, dst unalign: %10u, src undef: %10u\n",
                movs4_src_unaligned, movs4_dst_unaligned, movs4_src_undef);
-    dr_fprintf(f_global, "reads:  slow: %8u, fast: %8u, fast4: %8u, total: %8u\n",
-               read_slowpath, read_fastpath, read4_fastpath,
-               read_slowpath+read_fastpath+read4_fastpath);
-    dr_fprintf(f_global, "writes: slow: %8u, fast: %8u, fast4: %8u, total: %8u\n",
-               write_slowpath, write_fastpath, write4_fastpath,
-               write_slowpath+write_fastpath+write4_fastpath);
-    dr_fprintf(f_global, "pushes: slow: %8u, fast: %8u, fast4: %8u, total: %8u\n",
-               push_slowpath, push_fastpath, push4_fastpath,
-               push_slowpath+push_fastpath+push4_fastpath);
-    dr_fprintf(f_global, "pops:   slow: %8u, fast: %8u, fast4: %8u, total: %8u\n",
-               pop_slowpath, pop_fastpath, pop4_fastpath,
-               pop_slowpath+pop_fastpath+pop4_fastpath);
+    dr_fprintf(f_global, "reads:  slow: %8"UINT64_FORMAT_CODE", fast: %8u, fast4: %8u,"
+               " total: %8"UINT64_FORMAT_CODE"\n", read_slow, read_fastpath,
+               read4_fastpath, read_slow+read_fastpath+read4_fastpath);
+    dr_fprintf(f_global, "writes: slow: %8"UINT64_FORMAT_CODE", fast: %8u, fast4: %8u,"
+               " total: %8"UINT64_FORMAT_CODE"\n", write_slow, write_fastpath,
+               write4_fastpath, write_slow+write_fastpath+write4_fastpath);
+    dr_fprintf(f_global, "pushes: slow: %8"UINT64_FORMAT_CODE", fast: %8u, fast4: %8u,"
+               " total: %8"UINT64_FORMAT_CODE"\n", push_slow, push_fastpath,
+               push4_fastpath, push_slow+push_fastpath+push4_fastpath);
+    dr_fprintf(f_global, "pops:   slow: %8"UINT64_FORMAT_CODE", fast: %8u, fast4: %8u,"
+               " total: %8"UINT64_FORMAT_CODE"\n", pop_slow, pop_fastpath,
+               pop4_fastpath, pop_slow+pop_fastpath+pop4_fastpath);
     dr_fprintf(f_global, "slow instead of fast: %8u, b/c unaligned: %8u, 8@border: %8u\n",
                slow_instead_of_fast, slowpath_unaligned, slowpath_8_at_border);
     dr_fprintf(f_global, "app instrs: fastpath: %7u, no dup: %7u, xl8: %7u\n",
@@ -209,25 +217,55 @@ dump_statistics(void)
                reg_spill_used_in_bb, reg_spill_unused_in_bb);
     dr_fprintf(f_global, "shadow blocks allocated: %6u, freed: %6u\n",
                shadow_block_alloc, shadow_block_free);
+    dr_fprintf(f_global, "shadow blocks retired: %6u, reinstated: %6u, sweeps: %6u\n",
+               shadow_block_retired, shadow_block_reinstated, shadow_reclaim_sweeps);
+#ifdef X64
+    dr_fprintf(f_global, "shadow tables allocated: %6u\n", shadow_table_alloc);
+#endif
     dr_fprintf(f_global, "special shadow blocks, unaddr: %6u, undef: %6u, def: %6u\n",
                num_special_unaddressable, num_special_undefined, num_special_defined);
     dr_fprintf(f_global, "faults writing to special shadow blocks: %6u\n",
                num_faults);
     dr_fprintf(f_global, "faults to transition to slowpath: %6u\n",
                num_slowpath_faults);
-    dr_fprintf(f_global, "app mallocs: %8u, frees: %8u, large mallocs: %6u\n",
-               num_mallocs, num_frees, num_large_mallocs);
+    dr_fprintf(f_global, "app mallocs: %8"UINT64_FORMAT_CODE", frees: %8"
+               UINT64_FORMAT_CODE", large mallocs: %6u\n",
+               STATS_SHARD_SUM(num_mallocs), STATS_SHARD_SUM(num_frees),
+               num_large_mallocs);
+    if (options.replace_malloc) {
+        /* acquires+avoided is what the count would be w/o -thread_cache_batch */
+        dr_fprintf(f_global, "heap lock acquires: %8"UINT64_FORMAT_CODE", avoided via"
+                   " thread cache: %8"UINT64_FORMAT_CODE"\n",
+                   STATS_SHARD_SUM(heap_lock_acquires),
+                   STATS_SHARD_SUM(heap_lock_avoided));
+        dr_fprintf(f_global, "realloc growth in-place: %8"UINT64_FORMAT_CODE
+                   ", via mremap: %8"UINT64_FORMAT_CODE", via copy: %8"
+                   UINT64_FORMAT_CODE"\n",
+                   STATS_SHARD_SUM(realloc_grown_in_place),
+                   STATS_SHARD_SUM(realloc_remapped), STATS_SHARD_SUM(realloc_copied));
+        alloc_replace_dump_stats(f_global);
+    }
     dr_fprintf(f_global, "unique malloc stacks: %8u\n", alloc_stack_count);
-    dr_fprintf(f_global, "callstack fp scans: %8u\n", find_next_fp_scans);
-    dr_fprintf(f_global, "callstack is_retaddr: %8u, backdecode: %8u, unreadable: %8u\n",
-               cstack_is_retaddr, cstack_is_retaddr_backdecode,
-               cstack_is_retaddr_unreadable);
+    if (options.defer_callstacks > 0) {
+        dr_fprintf(f_global, "deferred malloc stacks: %8u, resolved: %8u, ring full: %8u\n",
+                   alloc_stack_deferred, alloc_stack_deferred_resolved,
+                   alloc_stack_defer_ring_full);
+    }
+    dr_fprintf(f_global, "callstack fp scans: %8"UINT64_FORMAT_CODE"\n",
+               STATS_SHARD_SUM(find_next_fp_scans));
+    dr_fprintf(f_global, "callstack is_retaddr: %8"UINT64_FORMAT_CODE", backdecode: %8"
+               UINT64_FORMAT_CODE", unreadable: %8"UINT64_FORMAT_CODE"\n",
+               STATS_SHARD_SUM(cstack_is_retaddr),
+               STATS_SHARD_SUM(cstack_is_retaddr_backdecode),
+               STATS_SHARD_SUM(cstack_is_retaddr_unreadable));
     dr_fprintf(f_global, "symbol names truncated: %8u\n", symbol_names_truncated);
 #ifdef USE_DRSYMS
     dr_fprintf(f_global, "symbol lookups: %6u cached %6u, searches: %6u cached %6u\n",
                symbol_lookups, symbol_lookup_cache_hits,
                symbol_searches, symbol_search_cache_hits);
-    dr_fprintf(f_global, "symbol address lookups: %6u\n", symbol_address_lookups);
+    dr_fprintf(f_global, "symbol address lookups: %6u cached %6u, batched: %6u\n",
+               symbol_address_lookups, symbol_address_cache_hits,
+               symbol_address_batched);
 #endif
     dr_fprintf(f_global, "stack swaps: %8u, triggers: %8u\n",
                stack_swaps, stack_swap_triggers);
@@ -254,6 +292,10 @@ dump_statistics(void)
                "midchunk legit ptrs: %5u size, %5u new, %5u inheritance, %5u string\n",
                midchunk_postsize_ptrs, midchunk_postnew_ptrs,
                midchunk_postinheritance_ptrs, midchunk_string_ptrs);
+    dr_fprintf(f_global,
+               "leak scan words: "UINT64_FORMAT_STRING" in %u ms, "
+               UINT64_FORMAT_STRING" words/sec\n", leak_scan_words, leak_scan_ms,
+               (leak_scan_ms == 0) ? 0 : leak_scan_words * 1000 / leak_scan_ms);
 #ifdef WINDOWS
     if (options.check_handle_leaks)
         handlecheck_dump_statistics();
@@ -293,6 +335,11 @@ dump_statistics(void)
     dr_fprintf(f_global, "\t8-byte: %12"UINT64_FORMAT_CODE"\n", slowpath_sz8);
     dr_fprintf(f_global, "\tOther:  %12"UINT64_FORMAT_CODE"\n", slowpath_szOther);
     dr_fprintf(f_global, "\n");
+
+    if (f_stats_series != INVALID_FILE) {
+        stats_shard_print_series(f_stats_series,
+                                 dr_get_milliseconds() - stats_series_start);
+    }
 }
 #endif /* STATISTICS */
 
@@ -300,7 +347,7 @@ dump_statistics(void)
  * PERSISTENCE SUPPORT
  */
 
-#define PCACHE_VERSION 0
+#define PCACHE_VERSION 1
 
 typedef struct _persist_data_t {
     /* version number */
@@ -309,8 +356,13 @@ typedef struct _persist_data_t {
      * so we require the same base (we set a preferred base and /dynamicbase:no)
      */
     app_pc client_base;
+    /* full mode bbs pass app pcs to the slowpath as immediates, so we require
+     * that the persisted range not be rebased
+     */
+    app_pc start;
     /* options that affect what we persist */
     bool shadowing;
+    bool check_uninitialized;
 } persist_data_t;
 
 bool
@@ -319,11 +371,13 @@ persistence_supported(void)
     /* We count on DR to not persist any bbs w/ clean calls in them.
      * Both light modes and -leaks_only are all persistable so long as the drmem lib
      * is at the same base.
-     * FIXME i#769: full mode is not yet persistable b/c its lean routines have
-     * absolute return targets and they need patching
+     * i#769: full mode's lean routines normally have absolute return targets,
+     * so full mode is only persistable when we can reach them via calls that
+     * do not embed cache or gencode addresses.
      */
     return (options.persist_code &&
-            (!options.shadowing || !options.check_uninitialized));
+            (!options.shadowing || !options.check_uninitialized ||
+             lean_routines_relocatable()));
 }
 
 static size_t
@@ -337,7 +391,8 @@ event_persist_ro_size(void *drcontext, void *perscxt, size_t file_offs,
 static bool
 event_persist_ro(void *drcontext, void *perscxt, file_t fd, void *user_data)
 {
-    persist_data_t pd = {PCACHE_VERSION, client_base, options.shadowing};
+    persist_data_t pd = {PCACHE_VERSION, client_base, dr_persist_start(perscxt),
+                         options.shadowing, options.check_uninitialized};
     ASSERT(options.persist_code, "shouldn't get here");
     if (!persistence_supported())
         return false;
@@ -372,6 +427,18 @@ event_resurrect_ro(void *drcontext, void *perscxt, byte **map INOUT)
         STATS_INC(pcaches_mismatch);
         return false;
     }
+    if (pd->check_uninitialized != options.check_uninitialized) {
+        WARN("WARNING: persisted cache uninit mode does not match current mode\n");
+        STATS_INC(pcaches_mismatch);
+        return false;
+    }
+    if (options.shadowing && options.check_uninitialized &&
+        pd->start != dr_persist_start(perscxt)) {
+        WARN("WARNING: persisted start="PFX" does not match cur start="PFX"\n",
+             pd->start, dr_persist_start(perscxt));
+        STATS_INC(pcaches_mismatch);
+        return false;
+    }
     if (!instrument_resurrect_ro(drcontext, perscxt, map))
         return false;
     STATS_INC(pcaches_loaded);
@@ -446,6 +513,9 @@ event_exit(void)
     close_file(f_results);
     close_file(f_missing_symbols);
     close_file(f_suppress);
+#endif
+#ifdef STATISTICS
+    close_file(f_stats_series);
 #endif
     dr_fprintf(f_global, "LOG END\n");
     close_file(f_global);
@@ -533,6 +603,7 @@ event_thread_init(void *drcontext)
         shadow_thread_init(drcontext);
     }
     syscall_thread_init(drcontext);
+    alloc_drmem_thread_init(drcontext);
     if (!options.perturb_only)
         report_thread_init(drcontext);
     if (options.perturb)
@@ -566,6 +637,7 @@ event_thread_exit(void *drcontext)
         set_thread_tls_value(drcontext, SPILL_SLOT_1, (ptr_uint_t)teb);
     }
 #endif
+    alloc_drmem_thread_exit(drcontext);
     syscall_thread_exit(drcontext);
     if (options.shadowing)
         shadow_thread_exit(drcontext);
@@ -1307,6 +1379,11 @@ create_global_logfile(void)
      */
     f_fork = open_logfile("fork.log", false, -1);
 #endif
+#ifdef STATISTICS
+    f_stats_series = open_logfile("stats_series.csv", false, -1);
+    stats_series_start = dr_get_milliseconds();
+    stats_shard_print_series_header(f_stats_series);
+#endif
 }
 
 #ifdef LINUX
@@ -1317,6 +1394,10 @@ event_fork(void *drcontext)
 # ifndef USE_DRSYMS
     file_t f_parent_fork = f_fork;
 # endif
+#ifdef STATISTICS
+    stats_shard_fork_init(drcontext);
+    close_file(f_stats_series);
+#endif
     close_file(f_global);
     create_global_logfile();
 
@@ -1472,6 +1553,8 @@ event_module_unload(void *drcontext, const module_data_t *info)
         dr_module_preferred_name(info) == NULL ? "<null>" :
         dr_module_preferred_name(info), info->start, info->end);
     readwrite_module_unload(drcontext, info);
+    /* must be before callstack_module_unload() */
+    alloc_drmem_module_unload(drcontext, info);
     if (!options.perturb_only)
         callstack_module_unload(drcontext, info);
     if (INSTRUMENT_MEMREFS())
@@ -1569,6 +1652,9 @@ dr_init(client_id_t id)
      */
     drwrap_init();
     utils_init();
+#ifdef USE_DRSYMS
+    drsym_set_line_cache_limit((size_t)options.line_cache_mb * 1024 * 1024);
+#endif
 
     /* now that we know whether -quiet, print basic info */
 #if defined(WIN32) && defined(USE_DRSYMS)
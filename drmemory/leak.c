@@ -68,6 +68,45 @@ queue_add(pc_entry_t **head, pc_entry_t **tail, pc_entry_t *add)
     }
 }
 
+/* Caches the last memory query answer (PR 570839) */
+typedef struct _query_cache_t {
+    byte *start;
+    byte *end;
+    bool ans;
+} query_cache_t;
+
+/* A live malloc chunk, for interval lookup during a scan */
+typedef struct _chunk_entry_t {
+    byte *start;
+    byte *end;
+    /* allocated lazily: only needed for leaks, a small fraction of the total */
+    struct _unreach_entry_t *unreach;
+} chunk_entry_t;
+
+/* Sorted array of the live chunks plus a coarse pre-filter, built once per
+ * scan.  Most scanned words are not heap pointers at all, so we reject
+ * them via the bounds and the page bitmap before binary searching.
+ */
+typedef struct _chunk_index_t {
+    chunk_entry_t *chunks;
+    uint num_chunks;
+    uint capacity;
+    /* lowest chunk start and highest chunk end */
+    byte *min_start;
+    byte *max_end;
+    /* one bit per CHUNK_INDEX_PAGE_SIZE page from page_base, set if the page
+     * overlaps any chunk.  NULL if the heap is too spread out for the bitmap
+     * to be worth its size.
+     */
+    byte *page_base;
+    uint *page_bits;
+    size_t page_bits_size;
+} chunk_index_t;
+
+#define CHUNK_INDEX_PAGE_SIZE (64*1024)
+/* caps the bitmap at 128KB, covering 64GB */
+#define CHUNK_INDEX_MAX_PAGES (1024*1024)
+
 /* For passing shared data to helper routines */
 typedef struct _reachability_data_t {
     /* The primary scans find chunks whose head is reachable.
@@ -86,12 +125,75 @@ typedef struct _reachability_data_t {
      */
     pc_entry_t *midreachq_head;
     pc_entry_t *midreachq_tail;
-    /* Tree for interval lookup to find head given mid-chunk pointer */
-    rb_tree_t *alloc_tree;
+    /* For interval lookup to find head given mid-chunk pointer */
+    chunk_index_t *chunk_index;
     /* Tree for storing beyond-TOS ranges for -leaks_only */
     rb_tree_t *stack_tree;
+    /* Caches for is_text() and is_image(), private to each scanning thread */
+    query_cache_t text_cache;
+    query_cache_t image_cache;
+    /* Number of aligned words examined as potential pointers */
+    uint64 words_scanned;
+    /* For an incremental scan: a window of this thread's view of the page
+     * soft-dirty bits, a page buffer, and page counts
+     */
+    bool incremental;
+    file_t pagemap;
+    uint64 *pagemap_buf;
+    byte *pagemap_base;
+    uint pagemap_num;
+    byte *incr_buf;
+    uint pages_reused;
+    uint pages_rescanned;
+    /* For a parallel scan: the shared state, this worker's index, and the
+     * lock for reachq which other workers steal from.  NULL when serial.
+     */
+    struct _parallel_scan_t *parallel;
+    uint worker_idx;
+    void *reachq_lock;
 } reachability_data_t;
 
+/* Parallel scan state (-leak_scan_threads).  The root scan is split into
+ * pieces that workers claim in order, and the reachable-chunk queue is
+ * split into per-worker queues that idle workers steal from.  Helper
+ * threads are created at init time since thread creation is blocked
+ * while the world is suspended.
+ */
+typedef struct _parallel_scan_t {
+    uint num_workers;
+    /* worker 0 is the thread performing the scan */
+    reachability_data_t **workers;
+    pc_entry_t *roots;
+    uint num_roots;
+    volatile int next_root;
+    /* reachable chunks queued but not yet scanned, across all workers */
+    volatile int outstanding;
+} parallel_scan_t;
+
+enum {
+    SCAN_PHASE_ROOTS,
+    SCAN_PHASE_REACHQ,
+};
+
+/* root pieces are at most this big, for load balancing */
+#define LEAK_SCAN_PIECE_SIZE (1024*1024)
+/* striped locks for atomically marking chunks as reachable */
+#define LEAK_SCAN_MARK_LOCKS 64
+/* how long idle helper threads sleep between checks for work */
+#define LEAK_SCAN_IDLE_MS 10
+/* how long leak_exit() waits for the helpers to exit */
+#define LEAK_SCAN_EXIT_WAIT_MS (4*LEAK_SCAN_IDLE_MS)
+
+static void *scan_mark_lock[LEAK_SCAN_MARK_LOCKS];
+/* non-NULL while a parallel scan is in progress */
+static parallel_scan_t * volatile scan_par;
+static volatile int scan_phase;
+static volatile int scan_generation;
+static volatile int scan_helpers_running;
+static volatile int scan_helpers_done;
+static volatile bool scan_helpers_exit;
+static volatile int scan_helpers_exited;
+
 #ifdef STATISTICS
 uint midchunk_postsize_ptrs;
 uint midchunk_postnew_ptrs;
@@ -101,6 +203,8 @@ uint midchunk_string_ptrs;
 uint pointers_encoded;
 uint encoded_pointers_scanned;
 # endif
+uint64 leak_scan_words;
+uint leak_scan_ms;
 #endif
 
 /* FIXME PR 487993: switch to file-private sets of options and option parsing */ 
@@ -111,6 +215,8 @@ static bool op_midchunk_inheritance_ok;
 static bool op_midchunk_string_ok;
 static bool op_midchunk_size_ok;
 static bool op_show_reachable;
+static uint op_scan_threads;
+static bool op_scan_incremental;
 #ifdef WINDOWS
 static bool op_check_encoded_pointers;
 #endif
@@ -137,6 +243,15 @@ static void leak_wrap_pre_encode_ptr(void *wrapcxt, void OUT **user_data);
 static void leak_wrap_post_encode_ptr(void *wrapcxt, void *user_data);
 #endif
 
+static void
+leak_scan_thread(void *arg);
+
+static void
+incr_init(void);
+
+static void
+incr_exit(void);
+
 void
 leak_init(bool have_defined_info, 
           bool check_leaks_on_destroy,
@@ -145,6 +260,8 @@ leak_init(bool have_defined_info,
           bool midchunk_string_ok,
           bool midchunk_size_ok,
           bool show_reachable,
+          uint scan_threads,
+          bool scan_incremental,
           IF_WINDOWS_(bool check_encoded_pointers)
           byte *(*next_defined_dword)(byte *, byte *),
           byte *(*end_of_defined_region)(byte *, byte *),
@@ -161,9 +278,24 @@ leak_init(bool have_defined_info,
     op_midchunk_string_ok = midchunk_string_ok;
     op_midchunk_size_ok = midchunk_size_ok;
     op_show_reachable = show_reachable;
+    op_scan_threads = scan_threads;
+    op_scan_incremental = scan_incremental;
 #ifdef WINDOWS
     op_check_encoded_pointers = check_encoded_pointers;
 #endif
+    if (op_scan_threads > 1) {
+        uint i;
+        for (i = 0; i < LEAK_SCAN_MARK_LOCKS; i++)
+            scan_mark_lock[i] = dr_mutex_create();
+        for (i = 1; i < op_scan_threads; i++) {
+            if (!dr_create_client_thread(leak_scan_thread, NULL)) {
+                LOG(1, "WARNING: unable to create leak scan thread\n");
+                break;
+            }
+        }
+    }
+    if (op_scan_incremental)
+        incr_init();
     if (op_have_defined_info) {
         ASSERT(next_defined_dword != NULL, "defined info needs cbs");
         ASSERT(end_of_defined_region != NULL, "defined info needs cbs");
@@ -207,6 +339,25 @@ leak_init(bool have_defined_info,
 void
 leak_exit(void)
 {
+    if (op_scan_threads > 1) {
+        uint i, waited;
+        /* Tell the helpers to exit and join them before freeing what they use.
+         * No scan is in progress, so a running helper is between checks of
+         * scan_helpers_exit and notices within LEAK_SCAN_IDLE_MS.  At process
+         * exit DR normally stops client threads before our exit event, and a
+         * stopped helper never runs again, so we wait only so long for one.
+         */
+        scan_helpers_exit = true;
+        for (waited = 0; scan_helpers_exited < scan_helpers_running &&
+                 waited < LEAK_SCAN_EXIT_WAIT_MS; waited += LEAK_SCAN_IDLE_MS)
+            dr_sleep(LEAK_SCAN_IDLE_MS);
+        LOG(1, "%d of %d leak scan helpers exited\n",
+            scan_helpers_exited, scan_helpers_running);
+        for (i = 0; i < LEAK_SCAN_MARK_LOCKS; i++)
+            dr_mutex_destroy(scan_mark_lock[i]);
+    }
+    if (op_scan_incremental)
+        incr_exit();
 #ifdef WINDOWS
     if (op_check_encoded_pointers) {
         hashtable_delete_with_stats(&encoded_ptr_table, "encoded_ptr");
@@ -364,17 +515,174 @@ unreach_entry_alloc(void)
     return e;
 }
 
+/***************************************************************************
+ * CHUNK INDEX
+ */
+
 static bool
-rb_cleanup_entries(rb_node_t *node, void *iter_data)
+malloc_iterate_build_index_cb(app_pc start, app_pc end, app_pc real_end,
+                              bool pre_us, uint client_flags,
+                              void *client_data, void *iter_data)
 {
-    unreach_entry_t *e;
-    ASSERT(node != NULL, "invalid param");
-    rb_node_fields(node, NULL, NULL, (void*)&e);
-    if (e != NULL)
-        global_free(e, sizeof(*e), HEAPSTAT_MISC);
+    chunk_index_t *index = (chunk_index_t *) iter_data;
+    ASSERT(index != NULL, "invalid iteration data");
+    if (index->num_chunks == index->capacity) {
+        uint new_cap = (index->capacity == 0) ? 1024 : index->capacity * 2;
+        chunk_entry_t *chunks = (chunk_entry_t *)
+            global_alloc(new_cap * sizeof(*chunks), HEAPSTAT_MISC);
+        if (index->chunks != NULL) {
+            memcpy(chunks, index->chunks, index->num_chunks * sizeof(*chunks));
+            global_free(index->chunks, index->capacity * sizeof(*chunks),
+                        HEAPSTAT_MISC);
+        }
+        index->chunks = chunks;
+        index->capacity = new_cap;
+    }
+    index->chunks[index->num_chunks].start = start;
+    index->chunks[index->num_chunks].end = end;
+    index->chunks[index->num_chunks].unreach = NULL;
+    index->num_chunks++;
     return true;
 }
 
+static void
+chunk_index_sift_down(chunk_entry_t *chunks, uint root, uint num)
+{
+    while (2*root + 1 < num) {
+        uint child = 2*root + 1;
+        chunk_entry_t tmp;
+        if (child + 1 < num && chunks[child].start < chunks[child + 1].start)
+            child++;
+        if (chunks[root].start >= chunks[child].start)
+            return;
+        tmp = chunks[root];
+        chunks[root] = chunks[child];
+        chunks[child] = tmp;
+        root = child;
+    }
+}
+
+/* Heapsort by start: no recursion, and no worst case to worry about given
+ * that the malloc iteration order varies with the allocator.
+ */
+static void
+chunk_index_sort(chunk_entry_t *chunks, uint num)
+{
+    uint i;
+    if (num < 2)
+        return;
+    for (i = num / 2; i > 0; i--)
+        chunk_index_sift_down(chunks, i - 1, num);
+    for (i = num - 1; i > 0; i--) {
+        chunk_entry_t tmp = chunks[0];
+        chunks[0] = chunks[i];
+        chunks[i] = tmp;
+        chunk_index_sift_down(chunks, 0, i);
+    }
+}
+
+static void
+chunk_index_build(chunk_index_t *index)
+{
+    uint i;
+    size_t num_pages;
+    memset(index, 0, sizeof(*index));
+    malloc_iterate(malloc_iterate_build_index_cb, (void *) index);
+    if (index->num_chunks == 0)
+        return;
+    chunk_index_sort(index->chunks, index->num_chunks);
+    index->min_start = index->chunks[0].start;
+    for (i = 0; i < index->num_chunks; i++) {
+        ASSERT(i == 0 || index->chunks[i].start >= index->chunks[i-1].end,
+               "mallocs should not overlap");
+        if (index->chunks[i].end > index->max_end)
+            index->max_end = index->chunks[i].end;
+    }
+    index->page_base = (byte *) ALIGN_BACKWARD(index->min_start, CHUNK_INDEX_PAGE_SIZE);
+    num_pages = (ALIGN_FORWARD(index->max_end, CHUNK_INDEX_PAGE_SIZE) -
+                 (ptr_uint_t)index->page_base) / CHUNK_INDEX_PAGE_SIZE;
+    if (num_pages > CHUNK_INDEX_MAX_PAGES) {
+        LOG(1, "heap spans too many pages (%d) for leak scan page bitmap\n",
+            num_pages);
+        return;
+    }
+    index->page_bits_size = ALIGN_FORWARD(num_pages, 32) / 8;
+    index->page_bits = (uint *) global_alloc(index->page_bits_size, HEAPSTAT_MISC);
+    memset(index->page_bits, 0, index->page_bits_size);
+    for (i = 0; i < index->num_chunks; i++) {
+        size_t page, last;
+        if (index->chunks[i].end == index->chunks[i].start)
+            continue;
+        page = (index->chunks[i].start - index->page_base) / CHUNK_INDEX_PAGE_SIZE;
+        last = (index->chunks[i].end - 1 - index->page_base) / CHUNK_INDEX_PAGE_SIZE;
+        for (; page <= last; page++)
+            index->page_bits[page / 32] |= (1 << (page % 32));
+    }
+}
+
+static void
+chunk_index_destroy(chunk_index_t *index)
+{
+    uint i;
+    for (i = 0; i < index->num_chunks; i++) {
+        if (index->chunks[i].unreach != NULL) {
+            global_free(index->chunks[i].unreach, sizeof(*index->chunks[i].unreach),
+                        HEAPSTAT_MISC);
+        }
+    }
+    if (index->chunks != NULL) {
+        global_free(index->chunks, index->capacity * sizeof(*index->chunks),
+                    HEAPSTAT_MISC);
+    }
+    if (index->page_bits != NULL)
+        global_free(index->page_bits, index->page_bits_size, HEAPSTAT_MISC);
+}
+
+/* Returns the index of the last chunk whose start is <= addr, or -1 */
+static int
+chunk_index_search(chunk_index_t *index, byte *addr)
+{
+    uint lo = 0, hi = index->num_chunks;
+    if (hi == 0 || addr < index->chunks[0].start)
+        return -1;
+    while (hi - lo > 1) {
+        uint mid = lo + (hi - lo) / 2;
+        if (index->chunks[mid].start <= addr)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return (int) lo;
+}
+
+/* Returns the chunk containing addr, or NULL */
+static inline chunk_entry_t *
+chunk_index_lookup(chunk_index_t *index, byte *addr)
+{
+    int i;
+    if (addr < index->min_start || addr >= index->max_end)
+        return NULL;
+    if (index->page_bits != NULL) {
+        size_t page = (addr - index->page_base) / CHUNK_INDEX_PAGE_SIZE;
+        if (!TEST(1 << (page % 32), index->page_bits[page / 32]))
+            return NULL;
+    }
+    i = chunk_index_search(index, addr);
+    if (i >= 0 && addr < index->chunks[i].end)
+        return &index->chunks[i];
+    return NULL;
+}
+
+/* Returns the chunk starting at start, or NULL */
+static chunk_entry_t *
+chunk_index_find(chunk_index_t *index, byte *start)
+{
+    int i = chunk_index_search(index, start);
+    if (i >= 0 && index->chunks[i].start == start)
+        return &index->chunks[i];
+    return NULL;
+}
+
 /* 
  * Design:
  * * in top-level summary, just list total bytes (direct+indirect):
@@ -413,7 +721,7 @@ rb_cleanup_entries(rb_node_t *node, void *iter_data)
 static void
 mark_indirect(reachability_data_t *data, byte *ptr_parent, byte *ptr_child,
               byte *child_start, byte *child_end, uint flags,
-              rb_node_t *node_child/*OPTIONAL*/)
+              chunk_entry_t *entry_child/*OPTIONAL*/)
 {
     if (TEST(MALLOC_REACHABLE, flags)) {
         /* if reachable through some other parent: leave alone */
@@ -428,26 +736,22 @@ mark_indirect(reachability_data_t *data, byte *ptr_parent, byte *ptr_child,
          * every top-level direct leak, but we're not doing a
          * depth-first walk, so we must later update parents when we
          * process their children.  We also don't have any other good
-         * place to store the size so we use the rbtree.
+         * place to store the size so we use the chunk index.
          */
         unreach_entry_t *unreach_child, *unreach_parent;
-        rb_node_t *node_parent = rb_in_node(data->alloc_tree, ptr_parent);
-        ASSERT(node_parent != NULL, "unreachable must be in heap");
-        if (node_child == NULL) /* optional */
-            node_child = rb_find(data->alloc_tree, ptr_child);
-        ASSERT(node_child != NULL, "reachable object must be in rbtree");
-        rb_node_fields(node_child, NULL, NULL, (void*)&unreach_child);
-        /* rb client fields allocated lazily */
-        if (unreach_child == NULL) {
-            unreach_child = unreach_entry_alloc();
-            rb_node_set_client(node_child, (void *)unreach_child);
-        }
+        chunk_entry_t *entry_parent = chunk_index_lookup(data->chunk_index, ptr_parent);
+        ASSERT(entry_parent != NULL, "unreachable must be in heap");
+        if (entry_child == NULL) /* optional */
+            entry_child = chunk_index_find(data->chunk_index, ptr_child);
+        ASSERT(entry_child != NULL, "reachable object must be in chunk index");
+        /* allocated lazily */
+        if (entry_child->unreach == NULL)
+            entry_child->unreach = unreach_entry_alloc();
+        unreach_child = entry_child->unreach;
         /* acquire after in case child==parent */
-        rb_node_fields(node_parent, NULL, NULL, (void *)&unreach_parent);
-        if (unreach_parent == NULL) {
-            unreach_parent = unreach_entry_alloc();
-            rb_node_set_client(node_parent, (void *)unreach_parent);
-        }
+        if (entry_parent->unreach == NULL)
+            entry_parent->unreach = unreach_entry_alloc();
+        unreach_parent = entry_parent->unreach;
 
         if (TEST(MALLOC_INDIRECTLY_REACHABLE, flags)) {
             /* node is already claimed: either by another parent,
@@ -502,46 +806,41 @@ leak_safe_read_heap(void *base, void **var)
 
 /* Helper for PR 484544.  Do not export: assumes world is suspended! */
 static bool
-is_text(byte *ptr)
+is_text(byte *ptr, reachability_data_t *data)
 {
     dr_mem_info_t info;
-    /* PR 570839: avoid perf hit by caching.  World is suspended so no locks needed
-     * and no races, so the page protections remain constant throughout the scan.
+    /* PR 570839: avoid perf hit by caching.  World is suspended so the page
+     * protections remain constant throughout the scan, and the cache is
+     * private to each scanning thread so no locks are needed.
      */
-    static byte *last_start = NULL;
-    static byte *last_end = NULL;
-    static bool last_ans = false;
+    query_cache_t *cache = &data->text_cache;
     if (ptr < (byte *)PAGE_SIZE)
         return false;
-    if (ptr >= last_start && ptr < last_end)
-        return last_ans;
+    if (ptr >= cache->start && ptr < cache->end)
+        return cache->ans;
     /* FIXME i#270: DR should provide a section iterator! */
-    last_ans = (dr_query_memory_ex(ptr, &info) &&
-                info.type == DR_MEMTYPE_IMAGE &&
-                TESTALL(DR_MEMPROT_READ | DR_MEMPROT_EXEC, info.prot) &&
-                !TEST(DR_MEMPROT_WRITE, info.prot));
-    last_start = info.base_pc;
-    last_end = info.base_pc + info.size;
-    return last_ans;
+    cache->ans = (dr_query_memory_ex(ptr, &info) &&
+                  info.type == DR_MEMTYPE_IMAGE &&
+                  TESTALL(DR_MEMPROT_READ | DR_MEMPROT_EXEC, info.prot) &&
+                  !TEST(DR_MEMPROT_WRITE, info.prot));
+    cache->start = info.base_pc;
+    cache->end = info.base_pc + info.size;
+    return cache->ans;
 }
 
 /* Helper for PR 484544.  Do not export: assumes world is suspended! */
 static bool
-is_image(byte *ptr)
+is_image(byte *ptr, reachability_data_t *data)
 {
     dr_mem_info_t info;
-    /* PR 570839: avoid perf hit by caching.  World is suspended so no locks needed
-     * and no races, so the page protections remain constant throughout the scan.
-     */
-    static byte *last_start = NULL;
-    static byte *last_end = NULL;
-    static bool last_ans = false;
+    /* PR 570839: avoid perf hit by caching: see is_text() */
+    query_cache_t *cache = &data->image_cache;
     if (ptr < (byte *)PAGE_SIZE)
         return false;
-    if (ptr >= last_start && ptr < last_end) {
+    if (ptr >= cache->start && ptr < cache->end) {
         LOG(4, "is_image match "PFX": cached in "PFX"-"PFX" => %d\n",
-            ptr, last_start, last_end, last_ans);
-        return last_ans;
+            ptr, cache->start, cache->end, cache->ans);
+        return cache->ans;
     }
     /* Even w/ the caching this is too slow on spec2k gap so we use the
      * fast module check from callstack.c
@@ -549,30 +848,30 @@ is_image(byte *ptr)
     if (!is_in_module(ptr))
         return false;
     /* FIXME i#270: DR should provide a section iterator! */
-    last_ans = (dr_query_memory_ex(ptr, &info) &&
-                info.type == DR_MEMTYPE_IMAGE &&
-                /* Turns out many libraries are loaded w/ the read-only data
-                 * sections in a writable segment!  They have an rx segment and
-                 * an rw segment and no read-only segment.  So we do not check
-                 * for lack of DR_MEMPROT_WRITE.  Is it worth going to disk
-                 * for each module at load time and constructing a section map?
-                 * Xref i#270: DR-provided section iterator.
-                 */
-                TEST(DR_MEMPROT_READ, info.prot));
-    last_start = info.base_pc;
-    last_end = info.base_pc + info.size;
+    cache->ans = (dr_query_memory_ex(ptr, &info) &&
+                  info.type == DR_MEMTYPE_IMAGE &&
+                  /* Turns out many libraries are loaded w/ the read-only data
+                   * sections in a writable segment!  They have an rx segment and
+                   * an rw segment and no read-only segment.  So we do not check
+                   * for lack of DR_MEMPROT_WRITE.  Is it worth going to disk
+                   * for each module at load time and constructing a section map?
+                   * Xref i#270: DR-provided section iterator.
+                   */
+                  TEST(DR_MEMPROT_READ, info.prot));
+    cache->start = info.base_pc;
+    cache->end = info.base_pc + info.size;
     LOG(4, "is_image no match "PFX", now cached "PFX"-"PFX" => %d\n",
-        ptr, last_start, last_end, last_ans);
-    return last_ans;
+        ptr, cache->start, cache->end, cache->ans);
+    return cache->ans;
 }
 
 /* Heuristic for PR 484544 */
 static bool
-is_vtable(byte *ptr)
+is_vtable(byte *ptr, reachability_data_t *data)
 {
     if (ptr < (byte *)PAGE_SIZE)
         return false;
-    if (ALIGNED(ptr, sizeof(void*)) && is_image(ptr)) {
+    if (ALIGNED(ptr, sizeof(void*)) && is_image(ptr, data)) {
         /* We have no symbols so we use heuristics: see if looks like
          * a table of ptrs to funcs.
          * We assume has at least 2 non-NULL entries (is that always true?).
@@ -606,7 +905,7 @@ is_vtable(byte *ptr)
                 LOG(4, "\t  vtable entry @"PFX": "PFX"\n", p, val);
                 if (val == NULL)
                     continue; /* keep looking */
-                else if (is_text(val)) {
+                else if (is_text(val, data)) {
                     num_found++;
                     if (num_found >= 2)
                         break;
@@ -630,7 +929,8 @@ is_vtable(byte *ptr)
  * or any redzone from Dr. Memory
  */
 static bool
-is_midchunk_pointer_legitimate(byte *pointer, byte *chunk_start, byte *chunk_end)
+is_midchunk_pointer_legitimate(byte *pointer, byte *chunk_start, byte *chunk_end,
+                               reachability_data_t *data)
 {
     /* PR 484544: remove new[] from possible-leak category.  Mid-chunk
      * pointers happen legitimately for C++ arrays, since if have
@@ -671,9 +971,9 @@ is_midchunk_pointer_legitimate(byte *pointer, byte *chunk_start, byte *chunk_end
                 /* risky perhaps but v4: */ *(byte **)pointer, *(byte **)chunk_start);
             if (leak_safe_read_heap(pointer, (void **) &val1) &&
             /* PR 570839: check for non-addresses to avoid call cost */
-                val1 > (byte *)PAGE_SIZE && is_vtable(val1)) {
+                val1 > (byte *)PAGE_SIZE && is_vtable(val1, data)) {
                 if (leak_safe_read_heap(chunk_start, (void **) &val2) &&
-                    val2 > (byte *)PAGE_SIZE && is_vtable(val2)) {
+                    val2 > (byte *)PAGE_SIZE && is_vtable(val2, data)) {
                     LOG(3, "\tmid-chunk "PFX" is multi-inheritance parent ptr => ok\n",
                         pointer);
                     STATS_INC(midchunk_postinheritance_ptrs);
@@ -743,6 +1043,30 @@ is_midchunk_pointer_legitimate(byte *pointer, byte *chunk_start, byte *chunk_end
     return false;
 }
 
+/* For a parallel scan, atomically tests and sets the reachability flag,
+ * repeating the flag checks of check_reachability_pointer().  Returns false
+ * if this or another worker already claimed the chunk.
+ */
+static bool
+parallel_mark_chunk(byte *chunk_start, uint mark)
+{
+    void *lock = scan_mark_lock[((ptr_uint_t)chunk_start >> 3) % LEAK_SCAN_MARK_LOCKS];
+    uint flags;
+    bool claimed = false;
+    dr_mutex_lock(lock);
+    flags = malloc_get_client_flags(chunk_start);
+    if (mark == MALLOC_REACHABLE ? !TEST(MALLOC_REACHABLE, flags) :
+        !TESTANY(MALLOC_MAYBE_REACHABLE | MALLOC_REACHABLE |
+                 MALLOC_INDIRECTLY_REACHABLE, flags)) {
+        IF_DEBUG(bool found =)
+            malloc_set_client_flag(chunk_start, mark);
+        ASSERT(found, "malloc chunk must be in hashtable");
+        claimed = true;
+    }
+    dr_mutex_unlock(lock);
+    return claimed;
+}
+
 static void
 check_reachability_pointer(byte *pointer, byte *ptr_addr, reachability_data_t *data)
 {
@@ -751,7 +1075,7 @@ check_reachability_pointer(byte *pointer, byte *ptr_addr, reachability_data_t *d
     bool add_reachable = false, add_maybe_reachable = false;
     uint flags = 0;
     bool reachable = false;
-    rb_node_t *node = NULL;
+    chunk_entry_t *entry = NULL;
 
     if (pointer == NULL)
         return;
@@ -777,11 +1101,15 @@ check_reachability_pointer(byte *pointer, byte *ptr_addr, reachability_data_t *d
     }
 #endif
 
-    /* We look in rbtree first since likely to miss both so why do hash lookup */
-    node = rb_in_node(data->alloc_tree, pointer);
-    if (node != NULL) {
-        chunk_end = malloc_end(pointer);
-        if (chunk_end != NULL) {
+    /* We look in the chunk index first since likely to miss both so why do
+     * hash lookup
+     */
+    entry = chunk_index_lookup(data->chunk_index, pointer);
+    if (entry != NULL) {
+        /* the index has the bounds, so no need for a malloc table lookup */
+        chunk_start = entry->start;
+        chunk_end = entry->end;
+        if (pointer == chunk_start) {
             if (ptr_addr >= pointer && ptr_addr < chunk_end) {
                 LOG(3, "\t("PFX" points to start of its own chunk "PFX"-"PFX")\n",
                     ptr_addr, pointer, chunk_end);
@@ -789,13 +1117,9 @@ check_reachability_pointer(byte *pointer, byte *ptr_addr, reachability_data_t *d
                 flags = malloc_get_client_flags(pointer);
                 LOG(3, "\t"PFX" points to chunk "PFX"-"PFX"\n",
                     ptr_addr, pointer, chunk_end);
-                chunk_start = pointer;
                 reachable = true;
             }
         } else {
-            size_t chunk_size;
-            rb_node_fields(node, &chunk_start, &chunk_size, NULL);
-            chunk_end = chunk_start + chunk_size;
             ASSERT(is_in_heap_region(pointer), "heap data struct inconsistency");
             if (ptr_addr >= chunk_start && ptr_addr < chunk_end) {
                 LOG(3, "\t("PFX" points to middle "PFX" of its own chunk "PFX"-"PFX")\n",
@@ -808,7 +1132,8 @@ check_reachability_pointer(byte *pointer, byte *ptr_addr, reachability_data_t *d
                 LOG(3, "\t("PFX" points to mid-chunk "PFX" in "PFX"-"PFX")\n",
                     ptr_addr, pointer, chunk_start, chunk_end);
                 flags = malloc_get_client_flags(chunk_start);
-                if (is_midchunk_pointer_legitimate(pointer, chunk_start, chunk_end)) {
+                if (is_midchunk_pointer_legitimate(pointer, chunk_start, chunk_end,
+                                                   data)) {
                     /* We could split these out as "probably reachable" but that would
                      * require a new chunk queue and flags and extra logic for
                      * whether reached initially by which: not worth it since the
@@ -858,7 +1183,7 @@ check_reachability_pointer(byte *pointer, byte *ptr_addr, reachability_data_t *d
              * the secondary scan
              */
         } else {
-            mark_indirect(data, ptr_addr, pointer, chunk_start, chunk_end, flags, node);
+            mark_indirect(data, ptr_addr, pointer, chunk_start, chunk_end, flags, entry);
         }
     }
     if (add_reachable || add_maybe_reachable) {
@@ -866,20 +1191,518 @@ check_reachability_pointer(byte *pointer, byte *ptr_addr, reachability_data_t *d
          * the queue of chunks to scan for further pointers.
          */
         pc_entry_t *add;
-        IF_DEBUG(bool found =)
-            malloc_set_client_flag(chunk_start,
-                                   add_reachable ? MALLOC_REACHABLE :
-                                   MALLOC_MAYBE_REACHABLE);
-        ASSERT(found, "malloc chunk must be in hashtable");
+        uint mark = add_reachable ? MALLOC_REACHABLE : MALLOC_MAYBE_REACHABLE;
         ASSERT(!add_reachable || data->primary_scan, "only add reachable in primary");
+        if (data->parallel != NULL) {
+            /* another worker may have marked it since we read the flags */
+            if (!parallel_mark_chunk(chunk_start, mark))
+                return;
+        } else {
+            IF_DEBUG(bool found =)
+                malloc_set_client_flag(chunk_start, mark);
+            ASSERT(found, "malloc chunk must be in hashtable");
+        }
         /* Add to queue of chunks to scan */
         add = (pc_entry_t *) global_alloc(sizeof(*add), HEAPSTAT_MISC);
         add->start = chunk_start;
         add->end = chunk_end;
         add->next = NULL;
-        queue_add(add_reachable ? &data->reachq_head : &data->midreachq_head,
-                  add_reachable ? &data->reachq_tail : &data->midreachq_tail,
-                  add);
+        if (add_reachable && data->parallel != NULL) {
+            /* count it before other workers can see it */
+            ATOMIC_INC32(data->parallel->outstanding);
+            dr_mutex_lock(data->reachq_lock);
+            queue_add(&data->reachq_head, &data->reachq_tail, add);
+            dr_mutex_unlock(data->reachq_lock);
+        } else {
+            queue_add(add_reachable ? &data->reachq_head : &data->midreachq_head,
+                      add_reachable ? &data->reachq_tail : &data->midreachq_tail,
+                      add);
+        }
+    }
+}
+
+/* Returns whether the region containing pc, as returned by dr_query_memory_ex(),
+ * should not be scanned for roots.
+ */
+static bool
+skip_region_for_scan(byte *pc, dr_mem_info_t *info)
+{
+#ifdef WINDOWS
+    MEMORY_BASIC_INFORMATION mbi = {0};
+    /* We need to avoid touching guard pages on Windows
+     * We could not call dr_query_memory_ex() and convert the mbi fields,
+     * but simpler this way even if takes extra syscall.
+     */
+    if (dr_virtual_query(pc, &mbi, sizeof(mbi)) == sizeof(mbi) &&
+        TEST(PAGE_GUARD, mbi.Protect))
+        info->prot = DR_MEMPROT_NONE;
+#endif
+    return (!TEST(DR_MEMPROT_READ, info->prot) ||
+            /* we skip r-x regions.  FIXME PR 475518: if we have info on
+             * what's been modified since it was loaded we can avoid
+             * potential false negatives here if the r-x was restored.
+             */
+            (TESTALL(DR_MEMPROT_READ|DR_MEMPROT_EXEC, info->prot) &&
+             !TEST(DR_MEMPROT_WRITE, info->prot)) ||
+#ifdef WINDOWS
+            /* FIXME PR 475518: this could result in false negatives: should
+             * track whether unmodified since load.  I'm only doing this
+             * by default w/o PR 475518 impl to avoid .pdata sections so our
+             * unit tests will pass deterministically (PR 485354).
+             */
+            (TEST(DR_MEMPROT_READ, info->prot) &&
+             !TEST(DR_MEMPROT_WRITE, info->prot) &&
+             info->type == DR_MEMTYPE_IMAGE) ||
+# ifdef USE_DRSYMS
+            /* skip private heap: here we assume it's a single segment */
+            (pc == (byte *) get_private_heap_handle()) ||
+# endif
+#endif
+            /* don't count references in DR data */
+            dr_memory_is_dr_internal(pc) ||
+            /* don't count references in DrMem data (e.g., report.c's
+             * page_buf holds a page's worth of old stack data)
+             */
+            dr_memory_is_in_client(pc));
+}
+
+/* Checks each aligned word in [start, end) as a potential heap pointer */
+static void
+check_reachability_words(byte *start, byte *end, bool skip_heap,
+                         reachability_data_t *data)
+{
+    byte *pc, *chunk_end, *pointer;
+    /* For 64-bit we'll need to change _dword and this 4 */
+    for (pc = (byte *)ALIGN_FORWARD(start, 4); pc < end && pc + 4 <= end; pc += 4) {
+        if (skip_heap) {
+            /* Skip heap regions */
+            if (heap_region_bounds(pc, NULL, &chunk_end, NULL) &&
+                chunk_end != NULL) {
+                pc = chunk_end - 4; /* let loop inc bump by 4 */
+                ASSERT(ALIGNED(pc, 4), "heap region end not aligned to 4!");
+                continue;
+            }
+        }
+        /* Now pc points to an aligned and defined (non-heap) 4 bytes */
+        data->words_scanned++;
+        /* FIXME PR 475518: improve performance of all these reads and table
+         * lookups: this scan is where the noticeable pause at exit comes
+         * from, not the identification of defined regions.
+         */
+#ifdef VMX86_SERVER /* really should be !HAVE_PROC_MAPS */
+        if (!op_have_defined_info) {
+            /* memory query is unreliable, and we don't have definedness
+             * info, so we can and have crashed here
+             */
+            if (safe_read(pc, sizeof(pointer), &pointer))
+                check_reachability_pointer(pointer, pc, data);
+        } else  {
+#endif
+            /* Threads are suspended and we checked readability so safe to deref */
+            pointer = *((app_pc*)pc);
+            check_reachability_pointer(pointer, pc, data);
+#ifdef VMX86_SERVER /* really should be !HAVE_PROC_MAPS */
+        }
+#endif
+    }
+}
+
+/***************************************************************************
+ * INCREMENTAL SCAN
+ *
+ * With -leak_scan_incremental we remember, for each page scanned, which of
+ * its words point into the heap.  A later nudge reuses that list for any
+ * page that has not been written since the prior scan, rather than looking
+ * up every word again.  We track writes with the kernel's soft-dirty page
+ * bits (/proc/self/clear_refs and /proc/self/pagemap), which require no
+ * changes to the app's page protections.
+ *
+ * Every failure mode errs on the side of rescanning: if the bits cannot be
+ * read the page is treated as dirty, and if they cannot be cleared they
+ * just accumulate.
+ */
+
+#ifdef LINUX
+# define PAGEMAP_SOFT_DIRTY (1ULL << 55)
+# define PAGEMAP_BATCH 512
+#endif
+/* heap bounds are rounded to this so that modest heap growth does not
+ * invalidate every page's candidate list
+ */
+#define INCR_HEAP_SLACK (4*1024*1024)
+#define INCR_PAGE_TABLE_HASH_BITS 12
+
+typedef struct _incr_range_t {
+    byte *start;
+    byte *end;
+} incr_range_t;
+
+typedef struct _incr_heap_t {
+    incr_range_t *ranges;
+    uint num;
+    uint capacity;
+} incr_heap_t;
+
+/* Followed in memory by num vals and then num offs */
+typedef struct _incr_page_t {
+    /* The incr_scan_count of the scan that last built the list or found the
+     * page unchanged
+     */
+    uint scan;
+    uint num;
+    /* The values of the words that point into incr_heap, and their page offsets
+     * in increasing order
+     */
+    byte **vals;
+    ushort *offs;
+} incr_page_t;
+
+/* Set once we have verified that soft-dirty bits work */
+static bool incr_enabled;
+static hashtable_t incr_page_table;
+/* protects incr_page_table for a parallel scan */
+static void *incr_lock;
+static uint incr_scan_count;
+/* The heap bounds, padded by INCR_HEAP_SLACK, that all cached candidate
+ * lists were built against.  Sorted and non-overlapping.
+ */
+static incr_heap_t incr_heap;
+
+static void
+incr_page_free(void *p)
+{
+    incr_page_t *entry = (incr_page_t *) p;
+    global_free(entry, sizeof(*entry) + entry->num * (sizeof(byte *) + sizeof(ushort)),
+                HEAPSTAT_MISC);
+}
+
+#ifdef LINUX
+static bool
+incr_clear_soft_dirty(void)
+{
+    file_t f = dr_open_file("/proc/self/clear_refs", DR_FILE_WRITE_APPEND);
+    bool ok;
+    if (f == INVALID_FILE)
+        return false;
+    ok = (dr_write_file(f, "4", 1) == 1);
+    dr_close_file(f);
+    return ok;
+}
+#endif
+
+/* Returns whether page was written since the last clear, or if unknown */
+static bool
+incr_page_dirty(byte *page, reachability_data_t *data)
+{
+#ifdef LINUX
+    ssize_t len;
+    if (data->pagemap_buf == NULL) {
+        data->pagemap = dr_open_file("/proc/self/pagemap", DR_FILE_READ);
+        data->pagemap_buf = (uint64 *)
+            global_alloc(PAGEMAP_BATCH * sizeof(uint64), HEAPSTAT_MISC);
+        data->pagemap_num = 0;
+    }
+    if (data->pagemap == INVALID_FILE)
+        return true;
+    if (page < data->pagemap_base ||
+        page >= data->pagemap_base + data->pagemap_num * PAGE_SIZE) {
+        data->pagemap_base = page;
+        data->pagemap_num = 0;
+        if (!dr_file_seek(data->pagemap,
+                          (int64)((ptr_uint_t)page / PAGE_SIZE) * sizeof(uint64),
+                          DR_SEEK_SET))
+            return true;
+        len = dr_read_file(data->pagemap, data->pagemap_buf,
+                           PAGEMAP_BATCH * sizeof(uint64));
+        if (len < (ssize_t) sizeof(uint64))
+            return true;
+        data->pagemap_num = (uint)(len / sizeof(uint64));
+    }
+    return TEST(PAGEMAP_SOFT_DIRTY,
+                data->pagemap_buf[(page - data->pagemap_base) / PAGE_SIZE]);
+#else
+    return true;
+#endif
+}
+
+static void
+incr_data_cleanup(reachability_data_t *data)
+{
+#ifdef LINUX
+    if (data->pagemap_buf != NULL) {
+        if (data->pagemap != INVALID_FILE)
+            dr_close_file(data->pagemap);
+        global_free(data->pagemap_buf, PAGEMAP_BATCH * sizeof(uint64), HEAPSTAT_MISC);
+        data->pagemap_buf = NULL;
+    }
+#endif
+    if (data->incr_buf != NULL) {
+        global_free(data->incr_buf, PAGE_SIZE, HEAPSTAT_MISC);
+        data->incr_buf = NULL;
+    }
+}
+
+static inline bool
+incr_in_heap(byte *val)
+{
+    incr_range_t *ranges = incr_heap.ranges;
+    uint lo = 0, hi = incr_heap.num;
+    if (hi == 0 || val < ranges[0].start || val >= ranges[hi - 1].end)
+        return false;
+    while (hi - lo > 1) {
+        uint mid = lo + (hi - lo) / 2;
+        if (ranges[mid].start <= val)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return val < ranges[lo].end;
+}
+
+static void
+incr_heap_free(incr_heap_t *heap)
+{
+    if (heap->ranges != NULL)
+        global_free(heap->ranges, heap->capacity * sizeof(*heap->ranges), HEAPSTAT_MISC);
+    memset(heap, 0, sizeof(*heap));
+}
+
+static bool
+incr_heap_region_cb(byte *start, byte *end, uint flags
+                    _IF_WINDOWS(HANDLE heap), void *iter_data)
+{
+    incr_heap_t *bounds = (incr_heap_t *) iter_data;
+    start = (byte *) ALIGN_BACKWARD(start, INCR_HEAP_SLACK);
+    end = (byte *) ALIGN_FORWARD(end, INCR_HEAP_SLACK);
+    /* regions come in increasing order so we need only merge with the last */
+    if (bounds->num > 0 && start <= bounds->ranges[bounds->num - 1].end) {
+        if (end > bounds->ranges[bounds->num - 1].end)
+            bounds->ranges[bounds->num - 1].end = end;
+        return true;
+    }
+    if (bounds->num == bounds->capacity) {
+        uint new_cap = (bounds->capacity == 0) ? 64 : bounds->capacity * 2;
+        incr_range_t *grown = (incr_range_t *)
+            global_alloc(new_cap * sizeof(*grown), HEAPSTAT_MISC);
+        if (bounds->ranges != NULL) {
+            memcpy(grown, bounds->ranges, bounds->num * sizeof(*grown));
+            global_free(bounds->ranges, bounds->capacity * sizeof(*grown),
+                        HEAPSTAT_MISC);
+        }
+        bounds->ranges = grown;
+        bounds->capacity = new_cap;
+    }
+    bounds->ranges[bounds->num].start = start;
+    bounds->ranges[bounds->num].end = end;
+    bounds->num++;
+    return true;
+}
+
+/* Verifies that the kernel tracks soft-dirty bits, via a page of our own */
+static bool
+incr_soft_dirty_works(void)
+{
+#ifdef LINUX
+    reachability_data_t probe;
+    volatile byte *page = (byte *)
+        nonheap_alloc(PAGE_SIZE, DR_MEMPROT_READ | DR_MEMPROT_WRITE, HEAPSTAT_MISC);
+    bool clean_after_clear, dirty_after_write = false;
+    memset(&probe, 0, sizeof(probe));
+    *page = 1;
+    clean_after_clear = (incr_clear_soft_dirty() &&
+                         !incr_page_dirty((byte *)page, &probe));
+    if (clean_after_clear) {
+        *page = 2;
+        /* force a re-read of the bits */
+        probe.pagemap_num = 0;
+        dirty_after_write = incr_page_dirty((byte *)page, &probe);
+    }
+    incr_data_cleanup(&probe);
+    nonheap_free((byte *)page, PAGE_SIZE, HEAPSTAT_MISC);
+    return clean_after_clear && dirty_after_write;
+#else
+    return false;
+#endif
+}
+
+static void
+incr_init(void)
+{
+    if (!incr_soft_dirty_works()) {
+        NOTIFY("WARNING: kernel does not support soft-dirty page tracking: "
+               "leak scans will not be incremental"NL);
+        return;
+    }
+    hashtable_init_ex(&incr_page_table, INCR_PAGE_TABLE_HASH_BITS, HASH_INTPTR,
+                      false/*!strdup*/, false/*!synch*/, incr_page_free, NULL, NULL);
+    incr_lock = dr_mutex_create();
+    incr_enabled = true;
+}
+
+static void
+incr_exit(void)
+{
+    if (!incr_enabled)
+        return;
+    hashtable_delete(&incr_page_table);
+    incr_heap_free(&incr_heap);
+    dr_mutex_destroy(incr_lock);
+}
+
+/* Called with the world suspended prior to an incremental scan.  Discards
+ * every cached list if the heap has grown beyond the bounds they were
+ * built against, as a word skipped then might now point into the heap.
+ */
+static void
+incr_scan_start(void)
+{
+    incr_heap_t cur;
+    uint i, j;
+    bool contained = true;
+    memset(&cur, 0, sizeof(cur));
+    heap_region_iterate(incr_heap_region_cb, (void *) &cur);
+    for (i = 0, j = 0; i < cur.num && contained; i++) {
+        while (j < incr_heap.num && incr_heap.ranges[j].end <= cur.ranges[i].start)
+            j++;
+        contained = (j < incr_heap.num &&
+                     incr_heap.ranges[j].start <= cur.ranges[i].start &&
+                     cur.ranges[i].end <= incr_heap.ranges[j].end);
+    }
+    if (contained) {
+        incr_heap_free(&cur);
+        return;
+    }
+    LOG(1, "heap grew: discarding %d cached leak scan pages\n", incr_page_table.entries);
+    hashtable_clear(&incr_page_table);
+    incr_heap_free(&incr_heap);
+    incr_heap = cur;
+}
+
+/* Called with the world still suspended after an incremental scan, once we
+ * are done writing to app memory (the chunk flags can live in the heap).
+ */
+static void
+incr_scan_end(void)
+{
+    uint i;
+    /* Drop pages we did not visit: we are about to lose their dirty bits. */
+    for (i = 0; i < HASHTABLE_SIZE(incr_page_table.table_bits); i++) {
+        hash_entry_t *he, *next;
+        for (he = incr_page_table.table[i]; he != NULL; he = next) {
+            incr_page_t *entry = (incr_page_t *) he->payload;
+            next = he->next;
+            if (entry->scan != incr_scan_count)
+                hashtable_remove(&incr_page_table, he->key);
+        }
+    }
+#ifdef LINUX
+    if (!incr_clear_soft_dirty())
+        LOG(1, "WARNING: unable to clear soft-dirty bits\n");
+#endif
+    incr_scan_count++;
+}
+
+/* Returns a new candidate list for page, or NULL if the page is unreadable */
+static incr_page_t *
+incr_page_build(byte *page, reachability_data_t *data)
+{
+    incr_page_t *entry;
+    uint off, num = 0;
+    if (data->incr_buf == NULL)
+        data->incr_buf = (byte *) global_alloc(PAGE_SIZE, HEAPSTAT_MISC);
+    /* a chunk may only partially cover its first and last pages */
+    if (!safe_read(page, PAGE_SIZE, data->incr_buf))
+        return NULL;
+    /* For 64-bit we'll need to change this 4, as in check_reachability_words() */
+    for (off = 0; off + sizeof(void*) <= PAGE_SIZE; off += 4) {
+        if (incr_in_heap(*(byte **)(data->incr_buf + off)))
+            num++;
+    }
+    entry = (incr_page_t *) global_alloc(sizeof(*entry) +
+                                         num * (sizeof(byte *) + sizeof(ushort)),
+                                         HEAPSTAT_MISC);
+    entry->num = num;
+    entry->vals = (byte **) (entry + 1);
+    entry->offs = (ushort *) (entry->vals + num);
+    num = 0;
+    for (off = 0; off + sizeof(void*) <= PAGE_SIZE; off += 4) {
+        byte *val = *(byte **)(data->incr_buf + off);
+        if (incr_in_heap(val)) {
+            entry->vals[num] = val;
+            entry->offs[num] = (ushort) off;
+            num++;
+        }
+    }
+    return entry;
+}
+
+/* Returns the candidate list for page, building it if it is missing or
+ * stale.  The result remains valid until the end of the scan.
+ */
+static incr_page_t *
+incr_page_get(byte *page, reachability_data_t *data)
+{
+    incr_page_t *entry, *fresh;
+    bool dirty = incr_page_dirty(page, data);
+    dr_mutex_lock(incr_lock);
+    entry = (incr_page_t *) hashtable_lookup(&incr_page_table, page);
+    if (entry != NULL &&
+        (entry->scan == incr_scan_count ||
+         (entry->scan + 1 == incr_scan_count && !dirty))) {
+        entry->scan = incr_scan_count;
+        dr_mutex_unlock(incr_lock);
+        data->pages_reused++;
+        return entry;
+    }
+    dr_mutex_unlock(incr_lock);
+    fresh = incr_page_build(page, data);
+    if (fresh == NULL)
+        return NULL;
+    fresh->scan = incr_scan_count;
+    data->pages_rescanned++;
+    dr_mutex_lock(incr_lock);
+    entry = (incr_page_t *) hashtable_lookup(&incr_page_table, page);
+    if (entry != NULL && entry->scan == incr_scan_count) {
+        /* another worker rebuilt it first, and may be using it */
+        incr_page_free(fresh);
+        fresh = entry;
+    } else {
+        entry = (incr_page_t *) hashtable_add_replace(&incr_page_table, page, fresh);
+        if (entry != NULL)
+            incr_page_free(entry);
+    }
+    dr_mutex_unlock(incr_lock);
+    return fresh;
+}
+
+/* Incremental counterpart of check_reachability_words() */
+static void
+incr_check_reachability_words(byte *start, byte *end, bool skip_heap,
+                              reachability_data_t *data)
+{
+    byte *page, *lo, *hi, *chunk_end;
+    for (page = (byte *) ALIGN_BACKWARD(start, PAGE_SIZE); page < end;
+         page += PAGE_SIZE) {
+        incr_page_t *entry = incr_page_get(page, data);
+        uint i;
+        lo = (start > page) ? start : page;
+        hi = (end < page + PAGE_SIZE) ? end : page + PAGE_SIZE;
+        if (entry == NULL) {
+            check_reachability_words(lo, hi, skip_heap, data);
+            continue;
+        }
+        for (i = 0; i < entry->num; i++) {
+            byte *addr = page + entry->offs[i];
+            if (addr < lo)
+                continue;
+            if (addr + 4 > hi)
+                break;
+            if (skip_heap && heap_region_bounds(addr, NULL, &chunk_end, NULL) &&
+                chunk_end != NULL)
+                continue;
+            check_reachability_pointer(entry->vals[i], addr, data);
+        }
+        data->words_scanned += (hi - lo) / 4;
     }
 }
 
@@ -887,11 +1710,8 @@ static void
 check_reachability_helper(byte *start, byte *end, bool skip_heap,
                           reachability_data_t *data)
 {
-    byte *pc, *defined_end, *chunk_end, *pointer, *iter_end, *query_end = NULL;
+    byte *pc, *defined_end, *iter_end, *query_end = NULL;
     dr_mem_info_t info;
-#ifdef WINDOWS
-    MEMORY_BASIC_INFORMATION mbi = {0};
-#endif
     ASSERT(data != NULL, "invalid args");
     LOG(4, "\nchecking reachability of "PFX"-"PFX"\n", start, end);
     pc = start;
@@ -909,46 +1729,11 @@ check_reachability_helper(byte *start, byte *end, bool skip_heap,
                 IF_X64(ASSERT(false, "update windows max query"));
                 return;
             }
-#ifdef WINDOWS
-            /* We need to avoid touching guard pages on Windows
-             * We could not call dr_query_memory_ex() and convert the mbi fields,
-             * but simpler this way even if takes extra syscall.
-             */
-            if (dr_virtual_query(pc, &mbi, sizeof(mbi)) == sizeof(mbi) &&
-                TEST(PAGE_GUARD, mbi.Protect))
-                info.prot = DR_MEMPROT_NONE;
-#endif
             /* PR 483063: bounds should be page-aligned, but be paranoid */
             query_end = (byte *) ALIGN_FORWARD(info.base_pc + info.size, PAGE_SIZE);
             LOG(4, "query "PFX"-"PFX" prot=%x\n",
                 info.base_pc, query_end, info.prot);
-            if (!TEST(DR_MEMPROT_READ, info.prot) ||
-                /* we skip r-x regions.  FIXME PR 475518: if we have info on
-                 * what's been modified since it was loaded we can avoid
-                 * potential false negatives here if the r-x was restored.
-                 */
-                (TESTALL(DR_MEMPROT_READ|DR_MEMPROT_EXEC, info.prot) &&
-                 !TEST(DR_MEMPROT_WRITE, info.prot)) ||
-#ifdef WINDOWS
-                /* FIXME PR 475518: this could result in false negatives: should
-                 * track whether unmodified since load.  I'm only doing this
-                 * by default w/o PR 475518 impl to avoid .pdata sections so our
-                 * unit tests will pass deterministically (PR 485354).
-                 */
-                (TEST(DR_MEMPROT_READ, info.prot) &&
-                 !TEST(DR_MEMPROT_WRITE, info.prot) &&
-                 info.type == DR_MEMTYPE_IMAGE) ||
-# ifdef USE_DRSYMS
-                /* skip private heap: here we assume it's a single segment */
-                (pc == (byte *) get_private_heap_handle()) ||
-# endif
-#endif
-                /* don't count references in DR data */
-                dr_memory_is_dr_internal(pc) ||
-                /* don't count references in DrMem data (e.g., report.c's
-                 * page_buf holds a page's worth of old stack data)
-                 */
-                dr_memory_is_in_client(pc)) {
+            if (skip_region_for_scan(pc, &info)) {
                 if (query_end < pc) /* overflow */
                     break;
                 pc = query_end;
@@ -981,39 +1766,10 @@ check_reachability_helper(byte *start, byte *end, bool skip_heap,
         }
         LOG(3, "defined range "PFX"-"PFX"\n", pc, defined_end);
 
-        /* For 64-bit we'll need to change _dword and this 4 */
-        for (pc = (byte *)ALIGN_FORWARD(pc, 4);
-             pc < defined_end && pc + 4 <= defined_end; pc += 4) {
-            if (skip_heap) {
-                /* Skip heap regions */
-                if (heap_region_bounds(pc, NULL, &chunk_end, NULL) &&
-                    chunk_end != NULL) {
-                    pc = chunk_end - 4; /* let loop inc bump by 4 */
-                    ASSERT(ALIGNED(pc, 4), "heap region end not aligned to 4!");
-                    continue;
-                }
-            }
-            /* Now pc points to an aligned and defined (non-heap) 4 bytes */
-            /* FIXME PR 475518: improve performance of all these reads and table
-             * lookups: this scan is where the noticeable pause at exit comes
-             * from, not the identification of defined regions.
-             */
-#ifdef VMX86_SERVER /* really should be !HAVE_PROC_MAPS */
-            if (!op_have_defined_info) {
-                /* memory query is unreliable, and we don't have definedness
-                 * info, so we can and have crashed here
-                 */
-                if (safe_read(pc, sizeof(pointer), &pointer))
-                    check_reachability_pointer(pointer, pc, data);
-            } else  {
-#endif
-                /* Threads are suspended and we checked readability so safe to deref */
-                pointer = *((app_pc*)pc);
-                check_reachability_pointer(pointer, pc, data);
-#ifdef VMX86_SERVER /* really should be !HAVE_PROC_MAPS */
-            }
-#endif
-        }
+        if (data->incremental)
+            incr_check_reachability_words(pc, defined_end, skip_heap, data);
+        else
+            check_reachability_words(pc, defined_end, skip_heap, data);
         pc = (byte *) ALIGN_FORWARD(defined_end, 4);
     }
 }
@@ -1085,10 +1841,10 @@ malloc_iterate_cb(app_pc start, app_pc end, app_pc real_end,
     if (!TESTANY(MALLOC_IGNORE_LEAK | MALLOC_INDIRECTLY_REACHABLE, client_flags) &&
         /* for 2nd pass only report reachable */
         (!data->last_of_2_iters || TEST(MALLOC_REACHABLE, client_flags))) {
-        rb_node_t *node = rb_find(data->alloc_tree, start);
+        chunk_entry_t *entry = chunk_index_find(data->chunk_index, start);
         unreach_entry_t *unreach;
-        ASSERT(node != NULL, "must be in rbtree");
-        rb_node_fields(node, NULL, NULL, (void *)&unreach);
+        ASSERT(entry != NULL, "must be in chunk index");
+        unreach = entry->unreach;
         client_found_leak(start, end, 
                           (unreach == NULL) ? 0 : unreach->indirect_bytes, 
                           pre_us,
@@ -1106,24 +1862,44 @@ malloc_iterate_cb(app_pc start, app_pc end, app_pc real_end,
     return true;
 }
 
+typedef struct _pre_report_data_t {
+    void **client_data;
+    uint num;
+    uint capacity;
+} pre_report_data_t;
+
+/* Collects the client data of the chunks malloc_iterate_cb will report on */
 static bool
-malloc_iterate_build_tree_cb(app_pc start, app_pc end, app_pc real_end,
+malloc_iterate_pre_report_cb(app_pc start, app_pc end, app_pc real_end,
                              bool pre_us, uint client_flags,
                              void *client_data, void *iter_data)
 {
-    rb_tree_t *alloc_tree = (rb_tree_t *) iter_data;
-    IF_DEBUG(rb_node_t *node;)
-    ASSERT(alloc_tree != NULL, "invalid iteration data");
-    /* We use NULL for client b/c we only need unreach_entry_t for the
-     * leaks, a small fraction (for most apps!) of the total and thus
-     * best allocated lazily
-     */
-    IF_DEBUG(node = )
-        rb_insert(alloc_tree, start, (end - start), NULL);
-    ASSERT(node == NULL, "mallocs should not overlap");
+    pre_report_data_t *data = (pre_report_data_t *) iter_data;
+    if (!TESTANY(MALLOC_IGNORE_LEAK | MALLOC_INDIRECTLY_REACHABLE, client_flags) &&
+        (op_show_reachable || !TEST(MALLOC_REACHABLE, client_flags)) &&
+        data->num < data->capacity)
+        data->client_data[data->num++] = client_data;
     return true;
 }
 
+static void
+leak_pre_report(chunk_index_t *index)
+{
+    pre_report_data_t data;
+    if (index->num_chunks == 0)
+        return;
+    data.capacity = index->num_chunks;
+    data.num = 0;
+    data.client_data = (void **)
+        global_alloc(data.capacity * sizeof(*data.client_data), HEAPSTAT_MISC);
+    malloc_iterate(malloc_iterate_pre_report_cb, &data);
+    LOG(2, "%s: %u of %u chunks to report\n", __FUNCTION__, data.num, data.capacity);
+    if (data.num > 0)
+        client_leaks_pre_report(data.client_data, data.num);
+    global_free(data.client_data, data.capacity * sizeof(*data.client_data),
+                HEAPSTAT_MISC);
+}
+
 static void
 prepare_thread_for_scan(void *drcontext, bool *was_app_state OUT)
 {
@@ -1176,6 +1952,267 @@ restore_thread_after_scan(void *drcontext, bool was_app_state)
 #endif
 }
 
+/***************************************************************************
+ * PARALLEL SCAN
+ */
+
+static bool
+parallel_heap_region_cb(byte *start, byte *end, uint flags
+                        _IF_WINDOWS(HANDLE heap), void *iter_data)
+{
+    rb_insert((rb_tree_t *) iter_data, start, end - start, NULL);
+    return true;
+}
+
+/* Splits the non-heap root regions that check_reachability_helper() would
+ * visit into pieces of at most LEAK_SCAN_PIECE_SIZE.
+ */
+static void
+parallel_scan_add_root(parallel_scan_t *par, uint *capacity, byte *start, byte *end)
+{
+    while (start < end) {
+        byte *piece_end = (end - start > LEAK_SCAN_PIECE_SIZE) ?
+            start + LEAK_SCAN_PIECE_SIZE : end;
+        if (par->num_roots == *capacity) {
+            uint new_cap = (*capacity == 0) ? 256 : *capacity * 2;
+            pc_entry_t *roots = (pc_entry_t *)
+                global_alloc(new_cap * sizeof(*roots), HEAPSTAT_MISC);
+            if (par->roots != NULL) {
+                memcpy(roots, par->roots, par->num_roots * sizeof(*roots));
+                global_free(par->roots, *capacity * sizeof(*roots), HEAPSTAT_MISC);
+            }
+            par->roots = roots;
+            *capacity = new_cap;
+        }
+        par->roots[par->num_roots].start = start;
+        par->roots[par->num_roots].end = piece_end;
+        par->roots[par->num_roots].next = NULL;
+        par->num_roots++;
+        start = piece_end;
+    }
+}
+
+static uint
+parallel_scan_find_roots(parallel_scan_t *par)
+{
+    rb_tree_t *heap_tree = rb_tree_create(NULL);
+    byte *pc = NULL, *cur, *query_end, *end;
+    dr_mem_info_t info;
+    uint capacity = 0;
+    heap_region_iterate(parallel_heap_region_cb, (void *) heap_tree);
+    while (dr_query_memory_ex(pc, &info)) {
+        query_end = (byte *) ALIGN_FORWARD(info.base_pc + info.size, PAGE_SIZE);
+        if (!skip_region_for_scan(pc, &info)) {
+            /* carve out the heap, which is scanned via the reachable queue */
+            cur = pc;
+            while (cur < query_end) {
+                rb_node_t *node = rb_in_node(heap_tree, cur);
+                byte *base;
+                size_t size;
+                if (node != NULL) {
+                    rb_node_fields(node, &base, &size, NULL);
+                    cur = base + size;
+                    continue;
+                }
+                node = rb_next_higher_node(heap_tree, cur + 1);
+                end = query_end;
+                if (node != NULL) {
+                    rb_node_fields(node, &base, &size, NULL);
+                    if (base > cur && base < end)
+                        end = base;
+                }
+                parallel_scan_add_root(par, &capacity, cur, end);
+                cur = end;
+            }
+        }
+        if (query_end <= pc) /* overflow */
+            break;
+        pc = query_end;
+    }
+    rb_tree_destroy(heap_tree);
+    return capacity;
+}
+
+/* Pops a reachable chunk from this worker's queue, or steals one from another
+ * worker's queue if ours is empty.
+ */
+static pc_entry_t *
+parallel_reachq_pop(parallel_scan_t *par, reachability_data_t *data)
+{
+    uint i;
+    for (i = 0; i < par->num_workers; i++) {
+        reachability_data_t *victim =
+            par->workers[(data->worker_idx + i) % par->num_workers];
+        pc_entry_t *e;
+        if (victim->reachq_head == NULL) /* racy peek to avoid the lock */
+            continue;
+        dr_mutex_lock(victim->reachq_lock);
+        e = victim->reachq_head;
+        if (e != NULL) {
+            victim->reachq_head = e->next;
+            if (victim->reachq_head == NULL)
+                victim->reachq_tail = NULL;
+        }
+        dr_mutex_unlock(victim->reachq_lock);
+        if (e != NULL)
+            return e;
+    }
+    return NULL;
+}
+
+static void
+parallel_scan_phase(parallel_scan_t *par, reachability_data_t *data, int phase)
+{
+    if (phase == SCAN_PHASE_ROOTS) {
+        int idx;
+        while ((idx = atomic_add32_return_sum(&par->next_root, 1) - 1) <
+               (int) par->num_roots) {
+            check_reachability_helper(par->roots[idx].start, par->roots[idx].end,
+                                      false, data);
+        }
+    } else {
+        ASSERT(phase == SCAN_PHASE_REACHQ, "invalid scan phase");
+        while (true) {
+            pc_entry_t *e = parallel_reachq_pop(par, data);
+            if (e == NULL) {
+                /* Entries are counted before they are queued, so once nothing
+                 * is outstanding nobody can add more.
+                 */
+                if (par->outstanding == 0)
+                    break;
+                dr_thread_yield();
+                continue;
+            }
+            check_reachability_helper(e->start, e->end, false, data);
+            global_free(e, sizeof(*e), HEAPSTAT_MISC);
+            ATOMIC_DEC32(par->outstanding);
+        }
+    }
+}
+
+/* Runs one phase on the current thread as worker 0 and on the helpers */
+static void
+parallel_scan_run_phase(parallel_scan_t *par, int phase)
+{
+    scan_helpers_done = 0;
+    scan_phase = phase;
+    scan_par = par;
+    ATOMIC_INC32(scan_generation);
+    parallel_scan_phase(par, par->workers[0], phase);
+    while (scan_helpers_done < (int) par->num_workers - 1)
+        dr_thread_yield();
+}
+
+static void
+leak_scan_thread(void *arg)
+{
+    int seen = scan_generation;
+    uint idx;
+    /* We must keep running while the world is suspended for the scan.
+     * We touch no app state outside of a scan.
+     */
+    dr_client_thread_set_suspendable(false);
+    idx = (uint) atomic_add32_return_sum(&scan_helpers_running, 1);
+    while (!scan_helpers_exit) {
+        parallel_scan_t *par;
+        if (scan_generation == seen) {
+            /* nothing new: sleep if idle, else wait for the next phase */
+            if (scan_par == NULL)
+                dr_sleep(LEAK_SCAN_IDLE_MS);
+            else
+                dr_thread_yield();
+            continue;
+        }
+        /* scan_par and scan_phase are set before the generation is bumped */
+        seen = scan_generation;
+        par = scan_par;
+        /* a helper that started after the scan began sits it out */
+        if (par != NULL && idx < par->num_workers) {
+            parallel_scan_phase(par, par->workers[idx], scan_phase);
+            ATOMIC_INC32(scan_helpers_done);
+        }
+    }
+    ATOMIC_INC32(scan_helpers_exited);
+}
+
+/* Scans the roots and the reachable chunks using the helper threads.
+ * Upon return the maybe-reachable queues of all workers have been
+ * appended to data's and *time_roots holds the time the root scan finished.
+ */
+static void
+parallel_scan_for_leaks(reachability_data_t *data, dr_mcontext_t *mc,
+                        void **drcontexts, uint num_threads, void *my_drcontext,
+                        uint64 *time_roots OUT)
+{
+    parallel_scan_t par;
+    uint i, capacity;
+    memset(&par, 0, sizeof(par));
+    par.num_workers = scan_helpers_running + 1;
+    par.workers = (reachability_data_t **)
+        global_alloc(par.num_workers * sizeof(*par.workers), HEAPSTAT_MISC);
+    par.workers[0] = data;
+    for (i = 0; i < par.num_workers; i++) {
+        reachability_data_t *w = data;
+        if (i > 0) {
+            w = (reachability_data_t *) global_alloc(sizeof(*w), HEAPSTAT_MISC);
+            memset(w, 0, sizeof(*w));
+            w->primary_scan = true;
+            /* both trees are read-only during the scan */
+            w->chunk_index = data->chunk_index;
+            w->stack_tree = data->stack_tree;
+            w->incremental = data->incremental;
+            par.workers[i] = w;
+        }
+        w->parallel = &par;
+        w->worker_idx = i;
+        w->reachq_lock = dr_mutex_create();
+    }
+
+    /* Registers first so that the stack tree is complete before the roots */
+    for (i = 0; i < num_threads; i++) {
+        LOG(3, "\nwalking registers of thread %d\n", dr_get_thread_id(drcontexts[i]));
+        dr_get_mcontext(drcontexts[i], mc);
+        check_reachability_regs(drcontexts[i], mc, data);
+    }
+    LOG(3, "\nwalking registers of thread %d\n", dr_get_thread_id(my_drcontext));
+    dr_get_mcontext(my_drcontext, mc);
+    check_reachability_regs(my_drcontext, mc, data);
+
+    capacity = parallel_scan_find_roots(&par);
+    LOG(2, "parallel leak scan: %d workers, %d root pieces\n",
+        par.num_workers, par.num_roots);
+    parallel_scan_run_phase(&par, SCAN_PHASE_ROOTS);
+    *time_roots = dr_get_milliseconds();
+    parallel_scan_run_phase(&par, SCAN_PHASE_REACHQ);
+    scan_par = NULL;
+    ASSERT(par.outstanding == 0, "reachable queue not drained");
+
+    for (i = 0; i < par.num_workers; i++) {
+        reachability_data_t *w = par.workers[i];
+        ASSERT(w->reachq_head == NULL, "reachable queue not drained");
+        dr_mutex_destroy(w->reachq_lock);
+        w->reachq_lock = NULL;
+        w->parallel = NULL;
+        if (i > 0) {
+            data->words_scanned += w->words_scanned;
+            data->pages_reused += w->pages_reused;
+            data->pages_rescanned += w->pages_rescanned;
+            incr_data_cleanup(w);
+            if (w->midreachq_head != NULL) {
+                if (data->midreachq_tail == NULL)
+                    data->midreachq_head = w->midreachq_head;
+                else
+                    data->midreachq_tail->next = w->midreachq_head;
+                data->midreachq_tail = w->midreachq_tail;
+            }
+            global_free(w, sizeof(*w), HEAPSTAT_MISC);
+        }
+    }
+    global_free(par.workers, par.num_workers * sizeof(*par.workers), HEAPSTAT_MISC);
+    if (par.roots != NULL)
+        global_free(par.roots, capacity * sizeof(*par.roots), HEAPSTAT_MISC);
+}
+
 void
 leak_scan_for_leaks(bool at_exit)
 {
@@ -1185,7 +2222,12 @@ leak_scan_for_leaks(bool at_exit)
     uint num_threads = 0, i;
     dr_mcontext_t mc; /* do not init whole thing: memset is expensive */
     reachability_data_t data;
+    chunk_index_t chunk_index;
     void *my_drcontext = dr_get_current_drcontext();
+    /* thread creation is blocked during suspend-all so helpers pre-exist */
+    bool parallel = !at_exit && op_scan_threads > 1 && scan_helpers_running > 0;
+    uint64 time_start, time_tree, time_roots, time_reachq, time_secondary, time_end;
+    uint64 words_per_sec;
 #ifdef DEBUG
     static bool called_at_exit;
     if (at_exit) {
@@ -1202,6 +2244,7 @@ leak_scan_for_leaks(bool at_exit)
      * which should be the case regardless of whether at exit or a nudge.
      */
     ASSERT(!dr_using_app_state(my_drcontext), "state error");
+    time_start = dr_get_milliseconds();
 
     /* Strategy: First walk non-heap memory that is defined to find reachable
      * heap blocks.  (Ideally we would skip memory that has not been modified
@@ -1238,18 +2281,28 @@ leak_scan_for_leaks(bool at_exit)
 
     memset(&data, 0, sizeof(data));
     data.primary_scan = true;
-    data.alloc_tree = rb_tree_create(NULL);
+    /* The soft-dirty bits are only meaningful if nothing runs between the
+     * scan and our clearing them
+     */
+    data.incremental = incr_enabled && !at_exit && drcontexts != NULL;
+    data.chunk_index = &chunk_index;
     data.stack_tree = rb_tree_create(NULL);
 
-    /* Build tree for interval lookup for mid-chunk pointers (PR 476482).
-     * Since doing this just once, we could use an array, but tree may be
-     * useful later on.  I have measured the cost of having the malloc
-     * hashtable be an rbtree instead, avoiding this creation, but the extra
-     * overhead shows up on heap-intensive bmarks (PR 535568).
+    /* Build the index for interval lookup for mid-chunk pointers (PR 476482).
+     * I have measured the cost of having the malloc hashtable be an rbtree
+     * instead, avoiding this creation, but the extra overhead shows up on
+     * heap-intensive bmarks (PR 535568).  Since we build it once per scan
+     * and only query it afterward, a sorted array beats a tree.
      */
-    malloc_iterate(malloc_iterate_build_tree_cb, (void *) data.alloc_tree);
-
-    if (!at_exit || !op_have_defined_info) {
+    chunk_index_build(&chunk_index);
+    if (data.incremental)
+        incr_scan_start();
+    time_tree = dr_get_milliseconds();
+
+    if (parallel) {
+        parallel_scan_for_leaks(&data, &mc, drcontexts, num_threads, my_drcontext,
+                                &time_roots);
+    } else if (!at_exit || !op_have_defined_info) {
         /* Walk the thread's registers.  We rely on mcontext field ordering here. */
         for (i = 0; i < num_threads; i++) {
             LOG(3, "\nwalking registers of thread %d\n", dr_get_thread_id(drcontexts[i]));
@@ -1261,13 +2314,17 @@ leak_scan_for_leaks(bool at_exit)
         check_reachability_regs(my_drcontext, &mc, &data);
     }
 
-    check_reachability_helper(NULL, (app_pc)POINTER_MAX, true/*skip heap*/, &data);
-    LOG(3, "\nwalking reachable-chunk queue\n");
-    for (e = data.reachq_head; e != NULL; e = next_e) {
-        check_reachability_helper(e->start, e->end, false, &data);
-        next_e = e->next;
-        global_free(e, sizeof(*e), HEAPSTAT_MISC);
+    if (!parallel) {
+        check_reachability_helper(NULL, (app_pc)POINTER_MAX, true/*skip heap*/, &data);
+        time_roots = dr_get_milliseconds();
+        LOG(3, "\nwalking reachable-chunk queue\n");
+        for (e = data.reachq_head; e != NULL; e = next_e) {
+            check_reachability_helper(e->start, e->end, false, &data);
+            next_e = e->next;
+            global_free(e, sizeof(*e), HEAPSTAT_MISC);
+        }
     }
+    time_reachq = dr_get_milliseconds();
     data.primary_scan = false;
 
     /* now split direct from indirect leaks, and perhaps find new maybe-reachable.
@@ -1295,6 +2352,8 @@ leak_scan_for_leaks(bool at_exit)
         global_free(e, sizeof(*e), HEAPSTAT_MISC);
     }
 
+    time_secondary = dr_get_milliseconds();
+
     /* we must restore prior to any symbol lookup (i#324) */
     if (drcontexts != NULL) {
         /* Back to private PEB and TEB fields (i#248) */
@@ -1308,6 +2367,9 @@ leak_scan_for_leaks(bool at_exit)
 
     /* up to caller to call report_leak_stats_{checkpoint,revert} if desired */
 
+    /* let the client resolve all the leak callstacks in one batch */
+    leak_pre_report(&chunk_index);
+
     /* in order to separate reachable from real leaks we do two passes */
     if (op_show_reachable)
         data.first_of_2_iters = true;
@@ -1317,17 +2379,41 @@ leak_scan_for_leaks(bool at_exit)
         data.last_of_2_iters = true;
         malloc_iterate(malloc_iterate_cb, &data);
     }
+    if (data.incremental)
+        incr_scan_end();
 
     if (drcontexts != NULL) {
         IF_DEBUG(bool ok =)
             dr_resume_all_other_threads(drcontexts, num_threads);
         ASSERT(ok, "failed to resume after leak scan");
     }
+    time_end = dr_get_milliseconds();
+    ELOGF(1, f_global, "leak scan with %d thread(s): "UINT64_FORMAT_STRING" ms total: "
+          "tree "UINT64_FORMAT_STRING", roots "UINT64_FORMAT_STRING", reachable "
+          UINT64_FORMAT_STRING", unreachable "UINT64_FORMAT_STRING", report "
+          UINT64_FORMAT_STRING"\n", parallel ? scan_helpers_running + 1 : 1,
+          time_end - time_start, time_tree - time_start, time_roots - time_tree,
+          time_reachq - time_roots, time_secondary - time_reachq,
+          time_end - time_secondary);
+    /* the rate covers all pointer checks, i.e., everything but tree and report */
+    words_per_sec = (time_secondary > time_tree) ?
+        data.words_scanned * 1000 / (time_secondary - time_tree) : 0;
+    ELOGF(1, f_global, "leak scan: "UINT64_FORMAT_STRING" words scanned over %d chunks, "
+          UINT64_FORMAT_STRING" words/sec\n", data.words_scanned,
+          chunk_index.num_chunks, words_per_sec);
+    if (data.incremental) {
+        ELOGF(1, f_global, "leak scan: %d pages reused, %d pages rescanned\n",
+              data.pages_reused, data.pages_rescanned);
+    }
+#ifdef STATISTICS
+    leak_scan_words += data.words_scanned;
+    leak_scan_ms += (uint)(time_secondary - time_tree);
+#endif
 
-    /* We do not maintain the tree throughout execution: we make a new one for
+    /* We do not maintain the index throughout execution: we make a new one for
      * each reachability scan.
      */
-    rb_iterate(data.alloc_tree, rb_cleanup_entries, NULL);
-    rb_tree_destroy(data.alloc_tree);
+    chunk_index_destroy(&chunk_index);
     rb_tree_destroy(data.stack_tree);
+    incr_data_cleanup(&data);
 }
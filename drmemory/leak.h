@@ -38,6 +38,8 @@ extern uint midchunk_string_ptrs;
 extern uint pointers_encoded;
 extern uint encoded_pointers_scanned;
 # endif
+extern uint64 leak_scan_words;
+extern uint leak_scan_ms;
 #endif
 
 /**************************/
@@ -49,6 +51,13 @@ client_found_leak(app_pc start, app_pc end, size_t indirect_bytes,
                   bool maybe_reachable, void *client_data,
                   bool count_reachable, bool show_reachable);
 
+/* Called prior to the client_found_leak() calls of a leak scan with the
+ * client data of every chunk that may be reported, so the client can do
+ * batch work such as symbolizing all of their callstacks at once.
+ */
+void
+client_leaks_pre_report(void **client_data, uint num);
+
 /**************************/
 /* Must be called by client */
 
@@ -60,6 +69,8 @@ leak_init(bool have_defined_info,
           bool midchunk_string_ok,
           bool midchunk_size_ok,
           bool show_reachable,
+          uint scan_threads,
+          bool scan_incremental,
           IF_WINDOWS_(bool check_encoded_pointers)
           byte *(*next_defined_dword)(byte *, byte *),
           byte *(*end_of_defined_region)(byte *, byte *),
@@ -346,6 +346,12 @@ OPTION_CLIENT_SCOPE(drmemscope, report_leak_max, int, 10000, -1, INT_MAX,
 OPTION_CLIENT_BOOL(drmemscope, show_duplicates, false,
                    "Print details on each duplicate error",
                    "Print details on each duplicate error rather than only showing unique error details")
+OPTION_CLIENT_BOOL(drmemscope, dup_filter, true,
+                   "Identify duplicate errors before walking the callstack",
+                   "Identify repeated errors from the error type, pc, access size, and a peek at the frame pointer chain, and count them as duplicates without walking the callstack.  Only applies once a full walk has shown the frame pointer chain to be complete.  Not used with -show_duplicates.")
+OPTION_CLIENT_SCOPE(drmemscope, dup_filter_verify, uint, 64, 0, UINT_MAX,
+                    "Verify every Nth duplicate found by -dup_filter (0=never)",
+                    "Every Nth duplicate found by -dup_filter is verified by walking the callstack.  On a mismatch, that filter entry stops being used.  0 disables verification.")
 #ifdef USE_DRSYMS
 OPTION_CLIENT_BOOL(drmemscope, batch, false,
                    "Do not invoke notepad at the end",
@@ -365,6 +371,9 @@ OPTION_CLIENT(client, symcache_minsize, uint, 1000, 0, UINT_MAX,
 OPTION_CLIENT_BOOL(drmemscope, use_symcache_postcall, true,
                    "Cache post-call sites to speed up future runs",
                    "Cache post-call sites to speed up future runs.  Requires -use_symcache to be true.")
+OPTION_CLIENT(internal, line_cache_mb, uint, 16, 0, 4096,
+              "Megabytes of decoded DWARF line tables to keep cached",
+              "Line number lookups decode and sort the DWARF line table of the compilation unit being queried.  Up to this many megabytes of decoded tables, across all modules, are kept so that further lookups in the same compilation unit are fast.  The least recently used tables are freed first.")
 # ifdef WINDOWS
 OPTION_CLIENT_BOOL(drmemscope, preload_symbols, false,
                    "Preload debug symbols on module load",
@@ -476,7 +485,7 @@ OPTION_CLIENT_SCOPE(drmemscope, pattern, uint, 0, 0, USHRT_MAX,
                     "Use sentinels to detect accesses on unaddressable regions around allocated heap objects.  When this option is enabled, checks for uninitialized read errors will be disabled.")
 OPTION_CLIENT_BOOL(drmemscope, persist_code, false,
                    "Cache instrumented code to speed up future runs",
-                   "Cache instrumented code to speed up future runs.  For short-running applications, this can provide a performance boost.  It may not be worth enabling for long-running applications.")
+                   "Cache instrumented code to speed up future runs.  For short-running applications, this can provide a performance boost.  It may not be worth enabling for long-running applications.  When checking for uninitialized reads, this is only supported for 32-bit applications.")
 OPTION_CLIENT_STRING(drmemscope, persist_dir, "<install>/logs/codecache",
                      "Directory for code cache files",
                      "Destination for code cache files.  When using a unique log directory for each run, symbols will not be shared across runs because the default cache location is inside the log directory.  Use this option to set a shared directory.")
@@ -549,7 +558,7 @@ OPTION_CLIENT_BOOL(internal, statistics, false,
                    "Calculate stats in the fastpath")
 OPTION_CLIENT(internal, stats_dump_interval, uint, 500000, 1, UINT_MAX,
               "How often to dump statistics, in units of slowpath executions",
-              "How often to dump statistics, in units of slowpath executions")
+              "How often to dump statistics, in units of slowpath executions.  Each dump also appends a line of counter values to stats_series.csv in the log directory.")
 OPTION_CLIENT_BOOL(internal, define_unknown_regions, true,
                    "Mark unknown regions as defined",
                    "Handle memory allocated by other processes (or that we miss due to unknown system calls or other problems) by treating as fully defined.  Xref PR 464106.")
@@ -589,6 +598,12 @@ OPTION_CLIENT(internal, share_xl8_max_diff, uint, 2048, 0, SHADOW_REDZONE_SIZE*4
 OPTION_CLIENT(internal, share_xl8_max_flushes, uint, 64, 0, UINT_MAX,
               "How many flushes before abandoning sharing altogether",
               "How many flushes before abandoning sharing altogether")
+OPTION_CLIENT_BOOL(internal, reclaim_shadow, true,
+                   "Free shadow blocks that become unaddressable again",
+                   "When a 64K unit's private shadow block becomes entirely unaddressable again (e.g., after a large free or munmap) and is not near a thread stack, swap the shared special block back in, and free the private block once every thread has passed a point where it holds no shadow translations.")
+OPTION_CLIENT(internal, reclaim_shadow_mb, uint, 256, 1, UINT_MAX/1024,
+              "Sweep for uniform shadow blocks every this many MB marked unaddressable",
+              "Each time this many megabytes of memory have been marked unaddressable, free retired shadow blocks that no thread can still be using and scan for private blocks that have become entirely unaddressable.  Only relevant with -reclaim_shadow.")
 OPTION_CLIENT_BOOL(internal, check_memset_unaddr, true,
                    "Check for in-heap unaddr in memset",
                    "Check for in-heap unaddr in memset")
@@ -619,12 +634,27 @@ OPTION_CLIENT_BOOL(internal, leave_uninit, false,
 OPTION_CLIENT_BOOL(client, leak_scan, true,
                    "Perform leak scan",
                    "Whether to perform the leak scan.  For performance measurement purposes only.")
+OPTION_CLIENT(client, leak_scan_threads, uint, 1, 1, 64,
+              "Number of threads to use for leak scans requested mid-run",
+              "The number of threads to use when scanning for leaks in response to a nudge.  Values above 1 create that many minus one helper threads at startup, which split up the scan of the roots and of the reachable heap.  The scan at process exit is always single-threaded.")
+OPTION_CLIENT_BOOL(client, leak_scan_incremental, false,
+                   "Only rescan memory written since the prior leak scan",
+                   "For leak scans requested via nudge, remember which words of each scanned page point into the heap, and reuse that for pages that have not been written since the prior scan.  This makes repeated nudges cost roughly proportional to the memory written in between.  Requires the Linux kernel's soft-dirty page tracking, which adds a minor fault on the first write to each page after a scan.  The cache costs memory proportional to the number of pointers into the heap.  Not supported on Windows.")
 OPTION_CLIENT_BOOL(internal, pattern_use_malloc_tree, false,
                    "Use red-black tree for tracking malloc/free",
                    "Use red-black tree for tracking malloc/free to reduce the overhead of maintaining the malloc tree on every memory allocation and free, but we have to do expensive hashtable walk to check if an address is in the redzone.")
 OPTION_CLIENT_BOOL(internal, replace_malloc, false,
                    "Replace malloc rather than wrapping existing routines",
                    "Replace malloc with custom routines rather than wrapping existing routines.  Replacing is more efficient but can be less transparent.")
+OPTION_CLIENT_SCOPE(internal, thread_cache_batch, uint, 32, 0, 4096,
+                    "With -replace_malloc, small frees to cache per thread before returning them to the shared free lists",
+                    "With -replace_malloc, each thread caches this many small freed chunks before returning them in one batch to the shared free lists, and takes up to this many re-usable chunks at once, so that most malloc and free calls do not need the heap lock.  0 disables the per-thread caches.")
+OPTION_CLIENT_SCOPE(internal, malloc_table_stripes, uint, 16, 1, 64,
+                    "Number of independently locked stripes of the malloc table",
+                    "When wrapping malloc, the table of live mallocs is split by address into this many stripes (rounded down to a power of 2), each with its own lock, so that threads operating on different mallocs do not contend.  Operations that need the whole table, such as a leak scan, lock every stripe.  1 uses a single lock.")
+OPTION_CLIENT_SCOPE(internal, defer_callstacks, uint, 0, 0, 64*1024,
+                    "Entries in the per-thread ring of unresolved allocation callstacks",
+                    "If non-zero, allocation callstacks are recorded as raw return addresses in a per-thread ring of this many entries.  Module lookups and sharing of identical callstacks are deferred until the callstack is needed for a report, a leak scan, or the unload of a module it refers to, so allocations that are freed quickly never pay for them.  When the ring is full, callstacks are resolved immediately.  0 resolves every callstack at allocation time.")
 OPTION_CLIENT_SCOPE(internal, pattern_max_2byte_faults, int, 0x1000, -1, INT_MAX,
                     "The max number of faults caused by 2-byte pattern checks we could tolerate before switching to 4-byte checks only",
                     "The max number of faults caused by 2-byte pattern checks we could tolerate before switching to 4-byte checks only. 0 means do not use 2-byte checks, and negative value means always use 2-byte checks")
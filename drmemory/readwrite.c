@@ -92,19 +92,15 @@ uint64 slowpath_sz8;
 uint64 slowpath_szOther;
 
 /* PR 423757: periodic stats dump */
-uint next_stats_dump;
+uint64 next_stats_dump;
+/* Upper bound on per-thread slowpath executions between dump checks */
+#define STATS_DUMP_CHECK_INTERVAL 1024
 
 uint num_faults;
 uint num_slowpath_faults;
 #endif
 
 #ifdef STATISTICS
-uint slowpath_executions;
-uint medpath_executions;
-uint read_slowpath;
-uint write_slowpath;
-uint push_slowpath;
-uint pop_slowpath;
 uint read_fastpath;
 uint write_fastpath;
 uint push_fastpath;
@@ -243,6 +239,8 @@ byte *shared_slowpath_entry_local[SPILL_REG_NUM][SPILL_REG_NUM][SPILL_REG3_NUM][
 byte *shared_slowpath_entry_global[SPILL_REG_NUM][SPILL_REG_NUM][SPILL_REG_NUM];
 byte *shared_slowpath_region;
 byte *shared_slowpath_entry;
+/* For lean_routines_relocatable(): pops the pushed return address into slot2 */
+byte *shared_slowpath_entry_call;
 /* adjust_esp's shared fast and slow paths pointers are below */
 
 /* Indirection to allow us to switch which TLS slots we use for spill slots */
@@ -1990,7 +1988,7 @@ medium_path_movs4(app_loc_t *loc, dr_mcontext_t *mc)
         shadow_get_byte((app_pc)mc->xsi+3) != SHADOW_DEFINED)
         STATS_INC(movs4_src_undef);
 #endif
-    STATS_INC(medpath_executions);
+    STATS_SHARD_INC(medpath_executions);
 
     if (!options.check_uninitialized) {
         if ((!options.check_alignment ||
@@ -2162,16 +2160,27 @@ slow_path_with_mc(void *drcontext, app_pc pc, app_pc decode_pc, dr_mcontext_t *m
     /* PR 423757: periodic stats dump, both for server apps that don't
      * close cleanly and to get stats out prior to overflow.
      */
-    int execs = atomic_add32_return_sum((volatile int *)&slowpath_executions, 1);
-    if (execs == next_stats_dump) {
-        /* still racy: could skip a dump, but that's ok */
-        ATOMIC_ADD32(next_stats_dump, options.stats_dump_interval);
+    STATS_SHARD_INC(slowpath_executions);
+    /* Summing the per-thread counts takes a lock so we only check every
+     * STATS_DUMP_CHECK_INTERVAL executions on each thread.
+     */
+    if (STATS_SHARD_LOCAL(slowpath_executions) %
+        MIN(options.stats_dump_interval, STATS_DUMP_CHECK_INTERVAL) == 0 &&
+        STATS_SHARD_SUM(slowpath_executions) >= next_stats_dump) {
+        /* still racy: could dump twice, but that's ok */
+        next_stats_dump += options.stats_dump_interval;
         dr_fprintf(f_global, "\n**** per-%dK-slowpath stats dump:\n",
                    options.stats_dump_interval/1000);
         dump_statistics();
     }
 #endif
 
+    /* no shadow translation is held across slowpath entry: any shared one
+     * is reset on the way out
+     */
+    if (options.shadowing)
+        shadow_thread_quiescent(drcontext, (app_pc)mc->xsp);
+
     pc_to_loc(&loc, pc);
 
     /* Locally-spilled and whole-bb-spilled (PR 489221) registers have
@@ -2676,24 +2685,29 @@ instrument_slowpath(void *drcontext, instrlist_t *bb, instr_t *inst,
                 INSTR_CREATE_mov_imm(drcontext,
                                      spill_slot_opnd(drcontext, SPILL_SLOT_1),
                                      decode_pc_opnd));
-            /* FIXME: this hardcoded address will be wrong if this
-             * fragment is shifted, or copied into a trace is created =>
-             * requires -disable_traces (or registering for trace event)
-             * and shared caches (since they're not shifted: but what if
-             * this particular fragment is thread-private?!?)
-             */
-            PRE(bb, inst,
-                INSTR_CREATE_mov_imm(drcontext,
-                                     spill_slot_opnd(drcontext, SPILL_SLOT_2),
-                                     opnd_create_instr(appinst)));
-            PRE(bb, inst,
-                INSTR_CREATE_jmp(drcontext, opnd_create_pc(shared_slowpath_entry)));
+            if (lean_routines_relocatable()) {
+                insert_lean_routine_call(drcontext, bb, inst,
+                                         &shared_slowpath_entry_call);
+            } else {
+                /* FIXME: this hardcoded address will be wrong if this
+                 * fragment is shifted, or copied into a trace is created =>
+                 * requires -disable_traces (or registering for trace event)
+                 * and shared caches (since they're not shifted: but what if
+                 * this particular fragment is thread-private?!?)
+                 */
+                PRE(bb, inst,
+                    INSTR_CREATE_mov_imm(drcontext,
+                                         spill_slot_opnd(drcontext, SPILL_SLOT_2),
+                                         opnd_create_instr(appinst)));
+                PRE(bb, inst,
+                    INSTR_CREATE_jmp(drcontext, opnd_create_pc(shared_slowpath_entry)));
+            }
         } else {
             /* Don't restore, and put consts into registers if we can, to save space */
             scratch_reg_info_t *s1, *s2, *s3;
             int r1, r2, r3, ef = 0;
             bool spill_eax;
-            byte *tgt;
+            byte **tgt;
             s1 = &mi->reg1;
             s2 = &mi->reg2;
             s3 = &mi->reg3;
@@ -2736,9 +2750,9 @@ instrument_slowpath(void *drcontext, instrlist_t *bb, instr_t *inst,
             ASSERT(r1 >= 0 && r1 < SPILL_REG_NUM, "shared slowpath index error");
             ASSERT(r2 >= 0 && r2 < SPILL_REG_NUM, "shared slowpath index error");
             tgt = (whole_bb_spills_enabled() ?
-                   shared_slowpath_entry_global[r1][r2][r3]:
-                   shared_slowpath_entry_local[r1][r2][r3][ef]);
-            ASSERT(tgt != NULL, "targeting un-generated slowpath");
+                   &shared_slowpath_entry_global[r1][r2][r3]:
+                   &shared_slowpath_entry_local[r1][r2][r3][ef]);
+            ASSERT(*tgt != NULL, "targeting un-generated slowpath");
             if (options.single_arg_slowpath) {
                 /* for jmp-to-slowpath optimization: we point at app instr, or a
                  * clone of it, for pc to decode from (PR 494769), as the
@@ -2752,7 +2766,7 @@ instrument_slowpath(void *drcontext, instrlist_t *bb, instr_t *inst,
                                          opnd_create_reg(s2->reg),
                                          opnd_create_instr(mi->appclone));
                 PRE(bb, inst, mi->slow_store_retaddr);
-                mi->slow_jmp = INSTR_CREATE_jmp(drcontext, opnd_create_pc(tgt));
+                mi->slow_jmp = INSTR_CREATE_jmp(drcontext, opnd_create_pc(*tgt));
                 PRE(bb, inst, mi->slow_jmp);
                 instr_set_ok_to_mangle(mi->appclone, false);
                 instr_set_translation(mi->appclone, NULL);
@@ -2764,13 +2778,17 @@ instrument_slowpath(void *drcontext, instrlist_t *bb, instr_t *inst,
                                          spill_slot_opnd(drcontext, SPILL_SLOT_1) :
                                          opnd_create_reg(s1->reg),
                                          decode_pc_opnd));
-                PRE(bb, inst,
-                    INSTR_CREATE_mov_imm(drcontext, 
-                                         (r2 == SPILL_REG_NONE) ?
-                                         spill_slot_opnd(drcontext, SPILL_SLOT_2) :
-                                         opnd_create_reg(s2->reg),
-                                         opnd_create_instr(appinst)));
-                PRE(bb, inst, INSTR_CREATE_jmp(drcontext, opnd_create_pc(tgt)));
+                if (lean_routines_relocatable())
+                    insert_lean_routine_call(drcontext, bb, inst, tgt);
+                else {
+                    PRE(bb, inst,
+                        INSTR_CREATE_mov_imm(drcontext, 
+                                             (r2 == SPILL_REG_NONE) ?
+                                             spill_slot_opnd(drcontext, SPILL_SLOT_2) :
+                                             opnd_create_reg(s2->reg),
+                                             opnd_create_instr(appinst)));
+                    PRE(bb, inst, INSTR_CREATE_jmp(drcontext, opnd_create_pc(*tgt)));
+                }
             }
         }
         PRE(bb, inst, appinst);
@@ -2799,6 +2817,49 @@ is_in_gencode(byte *pc)
             pc < shared_slowpath_region + SHARED_SLOWPATH_SIZE);
 }
 
+/* i#769: full-mode bbs normally reach the shared lean routines via a direct jmp
+ * after storing an absolute cache pc to return to, neither of which survives
+ * persisting the bb.  When we're persisting, we instead have the bb call through
+ * the routine's entry pointer, which lives in our library and so is at a fixed
+ * address given that we require the same library base on resurrection, and each
+ * routine entry pops the return address into wherever it used to be placed.
+ * The push uses the app stack slot just beyond TOS, which the app cannot rely on.
+ * XXX: for x64 we'd have to skip the red zone and would need a reachable entry
+ * pointer, so we only support 32-bit for now.
+ */
+bool
+lean_routines_relocatable(void)
+{
+#ifdef X64
+    return false;
+#else
+    return (options.persist_code && options.shadowing && options.check_uninitialized &&
+            options.shared_slowpath &&
+            /* the jmp-to-slowpath optimization points the retaddr at the jmp */
+            !options.single_arg_slowpath);
+#endif
+}
+
+/* Inserts a transfer to the lean routine whose entry is stored at *entry that
+ * returns to the instruction following the transfer.
+ */
+void
+insert_lean_routine_call(void *drcontext, instrlist_t *bb, instr_t *inst, byte **entry)
+{
+    ASSERT(lean_routines_relocatable(), "only needed for relocatable routines");
+    ASSERT(*entry != NULL, "targeting un-generated lean routine");
+    PRE(bb, inst,
+        INSTR_CREATE_call_ind(drcontext, OPND_CREATE_ABSMEM(entry, OPSZ_PTR)));
+}
+
+/* Counterpart to insert_lean_routine_call(), placed at the routine entry */
+void
+insert_lean_routine_entry(void *drcontext, instrlist_t *ilist, opnd_t retaddr_dst)
+{
+    if (lean_routines_relocatable())
+        PRE(ilist, NULL, INSTR_CREATE_pop(drcontext, retaddr_dst));
+}
+
 static void
 shared_slowpath_spill(void *drcontext, instrlist_t *ilist, int type, int slot)
 {
@@ -2831,6 +2892,13 @@ generate_shared_slowpath(void *drcontext, instrlist_t *ilist, byte *pc)
      * slots, we do a clean call, which redirects afterward and so
      * does not return.
      */
+    if (lean_routines_relocatable()) {
+        shared_slowpath_entry_call = pc;
+        insert_lean_routine_entry(drcontext, ilist,
+                                  spill_slot_opnd(drcontext, SPILL_SLOT_2));
+        pc = instrlist_encode(drcontext, ilist, pc, false);
+        instrlist_clear(drcontext, ilist);
+    }
     shared_slowpath_entry = pc;
     dr_insert_clean_call(drcontext, ilist, NULL,
                          (void *) slow_path, false, 2,
@@ -2853,6 +2921,14 @@ generate_shared_slowpath(void *drcontext, instrlist_t *ilist, byte *pc)
                 for (ef = 0; ef < (whole_bb_spills_enabled() ? 1 : SPILL_EFLAGS_NUM);
                      ef++) {
                     instr_t *return_point = NULL;
+                    /* the return pc goes where a jmp-based call site puts it */
+                    insert_lean_routine_entry
+                        (drcontext, ilist,
+                         (r2 >= SPILL_REG_EAX && r2 <= SPILL_REG_EBX) ?
+                         opnd_create_reg(DR_REG_XAX + (r2 - SPILL_REG_EAX)) :
+                         ((r2 >= SPILL_REG_EAX_DEAD && r2 <= SPILL_REG_EBX_DEAD) ?
+                          opnd_create_reg(DR_REG_XAX + (r2 - SPILL_REG_EAX_DEAD)) :
+                          spill_slot_opnd(drcontext, SPILL_SLOT_2)));
                     if (whole_bb_spills_enabled()) {
                         return_point = INSTR_CREATE_label(drcontext);
                     } else if (ef != SPILL_EFLAGS_NOSPILL) {
@@ -3635,17 +3711,31 @@ handle_mem_ref(uint flags, app_loc_t *loc, app_pc addr, size_t sz, dr_mcontext_t
 #ifdef STATISTICS
     if (TEST(MEMREF_WRITE, flags)) {
         if (TEST(MEMREF_PUSHPOP, flags))
-            STATS_INC(push_slowpath);
+            STATS_SHARD_INC(push_slowpath);
         else
-            STATS_INC(write_slowpath);
+            STATS_SHARD_INC(write_slowpath);
     } else {
         if (TEST(MEMREF_PUSHPOP, flags))
-            STATS_INC(pop_slowpath);
+            STATS_SHARD_INC(pop_slowpath);
         else
-            STATS_INC(read_slowpath);
+            STATS_SHARD_INC(read_slowpath);
     }
 #endif
-    for (i = 0; i < sz; i++) {
+    i = 0;
+    if (!TESTANY(MEMREF_PUSHPOP | MEMREF_USE_VALUES | MEMREF_MOVS, flags)) {
+        /* Skip the leading bytes that need no action in bulk: reads of defined
+         * memory, stores of defined over defined, and addressability checks of
+         * anything but unaddressable.  The loop below then starts at the first
+         * byte needing attention, which for large syscall buffers and string
+         * ops is often the end.
+         */
+        if (TEST(MEMREF_CHECK_ADDRESSABLE, flags))
+            i = (uint) shadow_prefix_matching(addr, sz, SHADOW_UNADDRESSABLE, true);
+        else
+            i = (uint) shadow_prefix_matching(addr, sz, SHADOW_DEFINED, false);
+        LOG(4, "memref: skipped "PIFX" leading bytes\n", i);
+    }
+    for (; i < sz; i++) {
         uint shadow = shadow_get_byte(addr + i);
         ASSERT(shadow <= 3, "internal error");
         if (shadow == SHADOW_UNADDRESSABLE) {
@@ -37,7 +37,10 @@
  * onto 2 pages by not emitting SPILL_REG_NONE.
  * -no_single_arg_slowpath needs only 10 pages.
  */
-#define SHARED_SLOWPATH_SIZE (whole_bb_spills_enabled() ? PAGE_SIZE*11 : PAGE_SIZE*7)
+#define SHARED_SLOWPATH_SIZE \
+    ((whole_bb_spills_enabled() ? PAGE_SIZE*11 : PAGE_SIZE*7) + \
+     /* room for the pops of pushed return addresses */ \
+     (lean_routines_relocatable() ? PAGE_SIZE : 0))
 
 void
 instrument_init(void);
@@ -91,12 +94,6 @@ extern uint64 slowpath_sz4;
 extern uint64 slowpath_sz8;
 extern uint64 slowpath_szOther;
 /* FIXME: make generalized stats infrastructure */
-extern uint slowpath_executions;
-extern uint medpath_executions;
-extern uint read_slowpath;
-extern uint write_slowpath;
-extern uint push_slowpath;
-extern uint pop_slowpath;
 extern uint read_fastpath;
 extern uint write_fastpath;
 extern uint push_fastpath;
@@ -142,6 +139,9 @@ extern uint xl8_shared_slowpath_count;
 extern uint slowpath_unaligned;
 extern uint slowpath_8_at_border;
 extern uint alloc_stack_count;
+extern uint alloc_stack_deferred;
+extern uint alloc_stack_deferred_resolved;
+extern uint alloc_stack_defer_ring_full;
 extern uint delayed_free_bytes;
 extern uint app_instrs_fastpath;
 extern uint app_instrs_no_dup;
@@ -180,6 +180,15 @@ check_register_defined(void *drcontext, reg_id_t reg, app_loc_t *loc, size_t sz,
 bool
 is_in_gencode(byte *pc);
 
+bool
+lean_routines_relocatable(void);
+
+void
+insert_lean_routine_call(void *drcontext, instrlist_t *bb, instr_t *inst, byte **entry);
+
+void
+insert_lean_routine_entry(void *drcontext, instrlist_t *ilist, opnd_t retaddr_dst);
+
 bool
 event_restore_state(void *drcontext, bool restore_memory, dr_restore_state_info_t *info);
 
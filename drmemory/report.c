@@ -252,6 +252,153 @@ stored_error_cmp(stored_error_t *err1, stored_error_t *err2)
     return (packed_callstack_cmp(err1->pcs, err2->pcs));
 }
 
+/***************************************************************************
+ * DUPLICATE FILTER
+ */
+
+/* A few errors can fire millions of times, and each occurrence would otherwise
+ * walk the callstack only to find the error already in error_table.  Once an
+ * error has been recorded and classified we remember it under a cheap key: the
+ * error type, pc, access size, and the retaddrs found by following the frame
+ * pointer chain with no scanning.  We only add an entry when the walked
+ * callstack is a prefix of that chain, so the key is at least as specific as
+ * the callstack.  Since a walk can scan past a frame the chain would follow,
+ * every -dup_filter_verify-th hit takes the full path and checks that the key
+ * still yields the same error.
+ * Protected by error_lock.
+ */
+#define DUP_FILTER_HASH_BITS 8
+#define DUP_FILTER_MAX_FRAMES 20
+#define DUP_FILTER_MAX_ENTRIES 16384
+
+typedef struct _dup_filter_entry_t {
+    uint errtype;
+    app_pc pc;
+    size_t sz;
+    uint num_frames;
+    app_pc frames[DUP_FILTER_MAX_FRAMES];
+    /* NULL once verification found a different error for this key */
+    stored_error_t *err;
+    uint hits;
+} dup_filter_entry_t;
+
+static hashtable_t dup_filter_table;
+static uint dup_filter_entries;
+static uint num_dup_filter_hits;
+static uint num_dup_filter_mismatches;
+
+static uint
+dup_filter_hash(dup_filter_entry_t *entry)
+{
+    uint i;
+    uint hash = entry->errtype ^ (uint)(ptr_uint_t) entry->pc ^ (uint) entry->sz;
+    for (i = 0; i < entry->num_frames; i++)
+        hash ^= (uint)(ptr_uint_t) entry->frames[i] << (i % 8);
+    return hash;
+}
+
+static bool
+dup_filter_cmp(dup_filter_entry_t *entry1, dup_filter_entry_t *entry2)
+{
+    return (entry1->errtype == entry2->errtype &&
+            entry1->pc == entry2->pc &&
+            entry1->sz == entry2->sz &&
+            entry1->num_frames == entry2->num_frames &&
+            memcmp(entry1->frames, entry2->frames,
+                   entry1->num_frames * sizeof(entry1->frames[0])) == 0);
+}
+
+static void
+dup_filter_entry_free(dup_filter_entry_t *entry)
+{
+    global_free(entry, sizeof(*entry), HEAPSTAT_REPORT);
+}
+
+/* Fills in the filter key for this error.  Returns false if the error
+ * cannot use the filter.
+ */
+static bool
+dup_filter_key(error_toprint_t *etp, dr_mcontext_t *mc, dup_filter_entry_t *key OUT)
+{
+    byte *fp;
+    uint max_frames;
+    if (!options.dup_filter || options.show_duplicates || mc == NULL ||
+        etp->loc == NULL || etp->loc->type != APP_LOC_PC ||
+        options.callstack_max_frames == 0)
+        return false;
+    max_frames = MIN(options.callstack_max_frames - 1, DUP_FILTER_MAX_FRAMES);
+    key->errtype = etp->errtype;
+    key->pc = loc_to_pc(etp->loc);
+    key->sz = etp->sz;
+    key->num_frames = 0;
+    key->err = NULL;
+    key->hits = 0;
+    fp = (byte *) mc->xbp;
+    while (key->num_frames < max_frames) {
+        app_pc frame[2]; /* saved fp and retaddr */
+        if (fp < (byte *) mc->xsp || !safe_read(fp, sizeof(frame), frame) ||
+            frame[1] == NULL)
+            break;
+        key->frames[key->num_frames++] = frame[1];
+        if ((byte *) frame[0] <= fp)
+            break;
+        fp = (byte *) frame[0];
+    }
+    return true;
+}
+
+/* Returns the error previously recorded for key, or NULL if the caller should
+ * walk the callstack.  Caller must hold error_lock.
+ */
+static stored_error_t *
+dup_filter_lookup(dup_filter_entry_t *key)
+{
+    dup_filter_entry_t *entry = (dup_filter_entry_t *)
+        hashtable_lookup(&dup_filter_table, (void *)key);
+    if (entry == NULL || entry->err == NULL)
+        return NULL;
+    entry->hits++;
+    if (options.dup_filter_verify > 0 && entry->hits % options.dup_filter_verify == 0)
+        return NULL;
+    return entry->err;
+}
+
+/* Called once err, recorded by a full walk, has been classified.
+ * Caller must hold error_lock.
+ */
+static void
+dup_filter_add(dup_filter_entry_t *key, stored_error_t *err)
+{
+    dup_filter_entry_t *entry = (dup_filter_entry_t *)
+        hashtable_lookup(&dup_filter_table, (void *)key);
+    uint i, num_frames;
+    if (entry != NULL) {
+        if (entry->err != NULL && entry->err != err) {
+            LOG(2, "dup filter: key for "PFX" no longer matches error #%d\n",
+                key->pc, entry->err->id);
+            entry->err = NULL;
+            num_dup_filter_mismatches++;
+        }
+        return;
+    }
+    if (dup_filter_entries >= DUP_FILTER_MAX_ENTRIES)
+        return;
+    /* all retaddrs in the callstack must have come from the frame chain */
+    num_frames = packed_callstack_num_frames(err->pcs);
+    if (num_frames == 0 || num_frames - 1 > key->num_frames ||
+        packed_callstack_frame_pc(err->pcs, 0) != key->pc)
+        return;
+    for (i = 1; i < num_frames; i++) {
+        if (packed_callstack_frame_pc(err->pcs, i) != key->frames[i - 1])
+            return;
+    }
+    entry = (dup_filter_entry_t *) global_alloc(sizeof(*entry), HEAPSTAT_REPORT);
+    *entry = *key;
+    entry->err = err;
+    hashtable_add(&dup_filter_table, (void *)entry, (void *)entry);
+    dup_filter_entries++;
+}
+
 /* A prefix for supplying additional info on a reported error beyond
  * the primary line, timestamp line, and callstack itself (from PR 535568)
  */
@@ -294,6 +441,8 @@ typedef struct _suppress_frame_t {
     char *modname;
     char *modoffs; /* string b/c we allow wildcards in it */
     char *func;
+    /* identical frames share an id, so matches can be memoized across specs */
+    uint pattern_id;
     struct _suppress_frame_t *next;
 } suppress_frame_t;
 
@@ -316,6 +465,11 @@ struct _suppress_spec_t {
      * list.
      */
     struct _suppress_spec_t *next;
+    /* position in supp_list, counting from the tail, and the link for the
+     * index chain this spec belongs to
+     */
+    uint seq;
+    struct _suppress_spec_t *index_next;
 };
 
 /* We suppress error type separately (PR 507837) */
@@ -323,6 +477,41 @@ static suppress_spec_t *supp_list[ERROR_MAX_VAL];
 static uint supp_num[ERROR_MAX_VAL];
 static bool have_module_wildcard;
 
+/* Rather than match each new error against every suppression of its type, we
+ * index the suppressions by their top frame, which must match the error's top
+ * frame.  A wildcard-free "mod!func" or non-module frame is keyed by its full
+ * name, "*!func" by func, and any other frame naming a module (including
+ * whole-module "mod!*") by that module.  The remaining specs, such as those
+ * starting with "..." or "*", are candidates for every error.  Each chain is
+ * linked via index_next in supp_list order, so merging a callstack's candidate
+ * chains by seq picks the same match as walking supp_list.
+ */
+enum {
+    SUPP_INDEX_TOP,
+    SUPP_INDEX_FUNC,
+    SUPP_INDEX_MOD,
+    SUPP_INDEX_NUM,
+};
+#define SUPP_INDEX_HASH_BITS 6
+static hashtable_t supp_index[ERROR_MAX_VAL][SUPP_INDEX_NUM];
+static suppress_spec_t *supp_index_wild[ERROR_MAX_VAL];
+
+/* Interns suppression frames, to assign pattern_id */
+#define SUPP_PATTERN_HASH_BITS 10
+static hashtable_t supp_pattern_table;
+static uint supp_pattern_count;
+
+/* Frame-vs-pattern results while matching one callstack.  This is a
+ * direct-mapped cache: a collision simply evicts the older result.
+ */
+#define SUPP_MEMO_BITS 7
+#define SUPP_MEMO_SIZE (1 << SUPP_MEMO_BITS)
+#define SUPP_MEMO_MAX_FRAME 256
+typedef struct _supp_memo_t {
+    uint key[SUPP_MEMO_SIZE];
+    bool match[SUPP_MEMO_SIZE];
+} supp_memo_t;
+
 #ifdef USE_DRSYMS
 static void *suppress_file_lock;
 #endif
@@ -394,6 +583,8 @@ suppress_spec_create(int type, bool is_default)
     spec->frames = NULL;
     spec->last_frame = NULL;
     spec->next = NULL;
+    spec->seq = 0;
+    spec->index_next = NULL;
     return spec;
 }
 
@@ -463,6 +654,127 @@ is_module_wildcard(suppress_spec_t *spec)
             spec->frames[0].func[1] == '\0');
 }
 
+static bool
+text_has_wildcard(const char *text)
+{
+    return (strchr(text, '*') != NULL || strchr(text, '?') != NULL);
+}
+
+/* Returns the index key for a frame, in buf, or NULL if it has none.
+ * For error frames, modname is NULL for non-module frames; func may be NULL.
+ */
+static const char *
+supp_index_key(int kind, const char *modname, const char *func,
+               char *buf, size_t bufsz)
+{
+    int len;
+    if (kind == SUPP_INDEX_MOD)
+        return modname;
+    if (kind == SUPP_INDEX_FUNC)
+        return (modname == NULL) ? NULL : func;
+    if (func == NULL)
+        return NULL;
+    if (modname == NULL)
+        return func;
+    len = dr_snprintf(buf, bufsz, "%s!%s", modname, func);
+    /* if it doesn't fit the spec side won't have fit either */
+    if (len < 0 || (size_t)len >= bufsz)
+        return NULL;
+    return buf;
+}
+
+/* Returns which index a spec belongs in, or SUPP_INDEX_NUM for none */
+static int
+supp_index_kind(const suppress_spec_t *spec)
+{
+    const suppress_frame_t *top = spec->frames;
+    if (top->is_star || (top->is_ellipsis && !top->is_module))
+        return SUPP_INDEX_NUM;
+    if (!top->is_module)
+        return text_has_wildcard(top->func) ? SUPP_INDEX_NUM : SUPP_INDEX_TOP;
+    if (!text_has_wildcard(top->modname)) {
+        if (top->func != NULL && !top->is_ellipsis && !text_has_wildcard(top->func))
+            return SUPP_INDEX_TOP;
+        return SUPP_INDEX_MOD;
+    }
+    if (strcmp(top->modname, "*") == 0 && top->func != NULL && !top->is_ellipsis &&
+        !text_has_wildcard(top->func))
+        return SUPP_INDEX_FUNC;
+    return SUPP_INDEX_NUM;
+}
+
+static void
+supp_index_add(suppress_spec_t *spec)
+{
+    char buf[MAX_SYMBOL_LEN];
+    const char *key = NULL;
+    int kind = supp_index_kind(spec);
+    if (kind != SUPP_INDEX_NUM) {
+        key = supp_index_key(kind, spec->frames->is_module ? spec->frames->modname : NULL,
+                             spec->frames->func, buf, BUFFER_SIZE_ELEMENTS(buf));
+    }
+    if (key == NULL) {
+        spec->index_next = supp_index_wild[spec->type];
+        supp_index_wild[spec->type] = spec;
+    } else {
+        hashtable_t *table = &supp_index[spec->type][kind];
+        spec->index_next = (suppress_spec_t *) hashtable_lookup(table, (void *)key);
+        hashtable_add_replace(table, (void *)key, spec);
+    }
+}
+
+/* Fills in the heads of the index chains that can match ecs, with the
+ * always-checked chain at SUPP_INDEX_NUM.
+ */
+static void
+supp_index_candidates(uint type, error_callstack_t *ecs,
+                      suppress_spec_t *cand[SUPP_INDEX_NUM + 1])
+{
+    char buf[MAX_SYMBOL_LEN];
+    int kind;
+    const char *modname = NULL, *func = NULL;
+    if (ecs->scs.num_frames > 0) {
+        if (symbolized_callstack_frame_is_module(&ecs->scs, 0))
+            modname = symbolized_callstack_frame_modname(&ecs->scs, 0);
+        func = symbolized_callstack_frame_func(&ecs->scs, 0);
+    }
+    for (kind = 0; kind < SUPP_INDEX_NUM; kind++) {
+        const char *key = NULL;
+        if (ecs->scs.num_frames > 0)
+            key = supp_index_key(kind, modname, func, buf, BUFFER_SIZE_ELEMENTS(buf));
+        cand[kind] = (key == NULL) ? NULL : (suppress_spec_t *)
+            hashtable_lookup(&supp_index[type][kind], (void *)key);
+    }
+    cand[SUPP_INDEX_NUM] = supp_index_wild[type];
+}
+
+static void
+suppress_frame_intern(suppress_frame_t *frame)
+{
+    /* all fields consulted by top_frame_matches_suppression_frame() */
+    size_t sz = 4/*flags*/ + 3/*separators*/ + 1/*null*/ +
+        ((frame->modname == NULL) ? 0 : strlen(frame->modname)) +
+        ((frame->modoffs == NULL) ? 0 : strlen(frame->modoffs)) +
+        ((frame->func == NULL) ? 0 : strlen(frame->func));
+    char *key = (char *) global_alloc(sz, HEAPSTAT_REPORT);
+    void *id;
+    dr_snprintf(key, sz, "%c%c%c%c|%s|%s|%s",
+                frame->is_ellipsis ? 'E' : '-', frame->is_star ? 'S' : '-',
+                frame->is_module ? 'M' : '-', (frame->func == NULL) ? '-' : 'F',
+                (frame->modname == NULL) ? "" : frame->modname,
+                (frame->modoffs == NULL) ? "" : frame->modoffs,
+                (frame->func == NULL) ? "" : frame->func);
+    key[sz - 1] = '\0';
+    id = hashtable_lookup(&supp_pattern_table, key);
+    if (id == NULL) {
+        /* 0 is reserved for empty memo entries */
+        id = (void *)(ptr_uint_t) ++supp_pattern_count;
+        hashtable_add(&supp_pattern_table, key, id);
+    }
+    frame->pattern_id = (uint)(ptr_uint_t) id;
+    global_free(key, sz, HEAPSTAT_REPORT);
+}
+
 static suppress_spec_t *
 suppress_spec_finish(suppress_spec_t *spec,
                      const char *orig_start,
@@ -483,7 +795,9 @@ suppress_spec_finish(suppress_spec_t *spec,
     /* insert into list */
     spec->next = supp_list[spec->type];
     supp_list[spec->type] = spec;
+    spec->seq = supp_num[spec->type];
     supp_num[spec->type]++;
+    supp_index_add(spec);
     num_suppressions++;
     if (is_module_wildcard(spec)) {
         have_module_wildcard = true;
@@ -696,6 +1010,8 @@ suppress_spec_add_frame(suppress_spec_t *spec, const char *cstack_start,
          suppress_frame_print(LOGFILE_LOOKUP(), frame, "  added suppression frame");
      });
 
+    suppress_frame_intern(frame);
+
     /* insert */
     if (spec->last_frame != NULL)
         spec->last_frame->next = frame;
@@ -974,8 +1290,36 @@ top_frame_matches_suppression_frame(const error_callstack_t *ecs,
     }
 }
 
+/* Memoized top_frame_matches_suppression_frame(), or frame_matches_modname()
+ * if modname_only.
+ */
 static bool
-stack_matches_suppression(const error_callstack_t *ecs, const suppress_spec_t *spec)
+frame_matches_suppression_memo(const error_callstack_t *ecs, uint idx,
+                               const suppress_frame_t *supp, bool modname_only,
+                               supp_memo_t *memo)
+{
+    uint key, slot;
+    bool match;
+    if (idx >= SUPP_MEMO_MAX_FRAME ||
+        supp->pattern_id >= UINT_MAX / SUPP_MEMO_MAX_FRAME / 2) {
+        return (modname_only ? frame_matches_modname(ecs, idx, supp) :
+                top_frame_matches_suppression_frame(ecs, idx, supp));
+    }
+    key = ((supp->pattern_id * SUPP_MEMO_MAX_FRAME + idx) << 1) | (modname_only ? 1 : 0);
+    /* multiplicative hash: pattern ids and frame indices are both small */
+    slot = (key * 2654435761U) >> (32 - SUPP_MEMO_BITS);
+    if (memo->key[slot] == key)
+        return memo->match[slot];
+    match = (modname_only ? frame_matches_modname(ecs, idx, supp) :
+             top_frame_matches_suppression_frame(ecs, idx, supp));
+    memo->key[slot] = key;
+    memo->match[slot] = match;
+    return match;
+}
+
+static bool
+stack_matches_suppression(const error_callstack_t *ecs, const suppress_spec_t *spec,
+                          supp_memo_t *memo)
 {
     uint i;
     int scs_last_ellipsis = -1;
@@ -998,7 +1342,7 @@ stack_matches_suppression(const error_callstack_t *ecs, const suppress_spec_t *s
              * suppression has matched the top of the stack.
              */
             return true;
-        } else if (top_frame_matches_suppression_frame(ecs, i, supp)) {
+        } else if (frame_matches_suppression_memo(ecs, i, supp, false, memo)) {
             if (supp->is_ellipsis) {
                 cur_ellipsis_supp = supp;
                 supp = supp->next;
@@ -1011,7 +1355,8 @@ stack_matches_suppression(const error_callstack_t *ecs, const suppress_spec_t *s
             }
         } else if (scs_last_ellipsis > -1 &&
                    (!cur_ellipsis_supp->is_module ||
-                    frame_matches_modname(ecs, i, cur_ellipsis_supp))) {
+                    frame_matches_suppression_memo(ecs, i, cur_ellipsis_supp,
+                                                   true/*modname*/, memo))) {
             /* We didn't match the next suppression frame, but we did match to
              * the current open ellipsis.
              */
@@ -1026,17 +1371,29 @@ stack_matches_suppression(const error_callstack_t *ecs, const suppress_spec_t *s
 }
 
 static bool
-on_suppression_list_helper(uint type, error_callstack_t *ecs,
+on_suppression_list_helper(uint type, error_callstack_t *ecs, supp_memo_t *memo,
                            suppress_spec_t **matched OUT)
 {
     suppress_spec_t *spec;
+    suppress_spec_t *cand[SUPP_INDEX_NUM + 1];
     ASSERT(type >= 0 && type < ERROR_MAX_VAL, "invalid error type");
-    for (spec = supp_list[type]; spec != NULL; spec = spec->next) {
+    supp_index_candidates(type, ecs, cand);
+    while (true) {
+        /* take the candidate that comes first in supp_list */
+        int i, best = -1;
+        for (i = 0; i < BUFFER_SIZE_ELEMENTS(cand); i++) {
+            if (cand[i] != NULL && (best == -1 || cand[i]->seq > cand[best]->seq))
+                best = i;
+        }
+        if (best == -1)
+            break;
+        spec = cand[best];
+        cand[best] = spec->index_next;
         DOLOG(3, {
             suppress_frame_print(LOGFILE_LOOKUP(), spec->frames,
                                  "supp: comparing error to suppression pattern");
         });
-        if (stack_matches_suppression(ecs, spec)) {
+        if (stack_matches_suppression(ecs, spec, memo)) {
             LOG(3, "matched suppression %s\n",
                 (spec->name == NULL) ? "<no name>" : spec->name);
             if (matched != NULL)
@@ -1053,12 +1410,14 @@ on_suppression_list_helper(uint type, error_callstack_t *ecs,
 static bool
 on_suppression_list(uint type, error_callstack_t *ecs, suppress_spec_t **matched OUT)
 {
+    supp_memo_t memo;
     ASSERT(type >= 0 && type < ERROR_MAX_VAL, "invalid error type");
-    if (on_suppression_list_helper(type, ecs, matched))
+    memset(memo.key, 0, sizeof(memo.key));
+    if (on_suppression_list_helper(type, ecs, &memo, matched))
         return true;
     /* POSSIBLE LEAK reports should be checked against LEAK suppressions */
     if (type == ERROR_POSSIBLE_LEAK) {
-        if (on_suppression_list_helper(ERROR_LEAK, ecs, matched))
+        if (on_suppression_list_helper(ERROR_LEAK, ecs, &memo, matched))
             return true;
     }
     LOG(3, "supp: no match\n");
@@ -1072,6 +1431,8 @@ static bool
 report_in_suppressed_module(uint type, app_loc_t *loc, const char *instruction)
 {
     suppress_spec_t *spec;
+    suppress_spec_t *chains[2];
+    uint i;
     bool suppressed = false;
     const char *preferred_name;
 
@@ -1091,30 +1452,37 @@ report_in_suppressed_module(uint type, app_loc_t *loc, const char *instruction)
         return false;
 
     /* We could hook module load and maintain an rb interval tree of which
-     * regions were suppressed to avoid this extra supp_list iteration.
+     * regions were suppressed to avoid this extra lookup.
+     * Whole-module suppressions are either in the module index or, if the
+     * module name has wildcards, in the wildcard chain.
      */
-    for (spec = supp_list[type]; spec != NULL; spec = spec->next) {
-        if (is_module_wildcard(spec) &&
-            text_matches_pattern(preferred_name, spec->frames[0].modname,
-                                 /*ignore_case=*/IF_WINDOWS_ELSE(true, false)) &&
-            (spec->instruction == NULL ||
-             text_matches_pattern(instruction, spec->instruction,
-                                  /*ignore_case=*/false))) {
-            suppressed = true;
-            dr_mutex_lock(error_lock);
-            if (spec->is_default)
-                num_suppressions_matched_default++;
-            else
-                num_suppressions_matched_user++;
-            /* spec->count_used and num_unique is supposed to count *unique*
-             * callstacks matching the suppression.  Without taking a callstack,
-             * we can't count that, so we overestimate and assume they are all
-             * unique.
-             */
-            spec->count_used++;
-            dr_mutex_unlock(error_lock);
-            LOG(3, "matched whole module suppression %s\n", spec->name);
-       }
+    chains[0] = (suppress_spec_t *)
+        hashtable_lookup(&supp_index[type][SUPP_INDEX_MOD], (void *)preferred_name);
+    chains[1] = supp_index_wild[type];
+    for (i = 0; i < BUFFER_SIZE_ELEMENTS(chains); i++) {
+        for (spec = chains[i]; spec != NULL; spec = spec->index_next) {
+            if (is_module_wildcard(spec) &&
+                text_matches_pattern(preferred_name, spec->frames[0].modname,
+                                     /*ignore_case=*/IF_WINDOWS_ELSE(true, false)) &&
+                (spec->instruction == NULL ||
+                 text_matches_pattern(instruction, spec->instruction,
+                                      /*ignore_case=*/false))) {
+                suppressed = true;
+                dr_mutex_lock(error_lock);
+                if (spec->is_default)
+                    num_suppressions_matched_default++;
+                else
+                    num_suppressions_matched_user++;
+                /* spec->count_used and num_unique is supposed to count *unique*
+                 * callstacks matching the suppression.  Without taking a callstack,
+                 * we can't count that, so we overestimate and assume they are all
+                 * unique.
+                 */
+                spec->count_used++;
+                dr_mutex_unlock(error_lock);
+                LOG(3, "matched whole module suppression %s\n", spec->name);
+            }
+        }
     }
     return suppressed;
 }
@@ -1204,6 +1572,7 @@ void
 report_init(void)
 {
     char *c;
+    uint i, j;
 
     timestamp_start = dr_get_milliseconds();
     print_timestamp(f_global, timestamp_start, "start time");
@@ -1218,6 +1587,11 @@ report_init(void)
                       (void (*)(void*)) stored_error_free,
                       (uint (*)(void*)) stored_error_hash,
                       (bool (*)(void*, void*)) stored_error_cmp);
+    hashtable_init_ex(&dup_filter_table, DUP_FILTER_HASH_BITS, HASH_CUSTOM,
+                      false/*!str_dup*/, false/*using error_lock*/,
+                      (void (*)(void*)) dup_filter_entry_free,
+                      (uint (*)(void*)) dup_filter_hash,
+                      (bool (*)(void*, void*)) dup_filter_cmp);
 
 #ifdef USE_DRSYMS
     /* callstack.c wants these as null-separated, double-null-terminated */
@@ -1299,6 +1673,19 @@ report_init(void)
          dr_get_process_id(), dr_get_application_name());
 #endif
 
+    for (i = 0; i < ERROR_MAX_VAL; i++) {
+        for (j = 0; j < SUPP_INDEX_NUM; j++) {
+            /* module names are case-insensitive on Windows, so we just get extra
+             * candidates there from functions differing only in case
+             */
+            hashtable_init(&supp_index[i][j], SUPP_INDEX_HASH_BITS,
+                           IF_WINDOWS_ELSE(HASH_STRING_NOCASE, HASH_STRING),
+                           true/*strdup*/);
+        }
+    }
+    hashtable_init(&supp_pattern_table, SUPP_PATTERN_HASH_BITS, HASH_STRING,
+                   true/*strdup*/);
+
     if (options.default_suppress) {
         /* the default suppression file must be located at
          *   dr_get_client_path()/../suppress-default.txt
@@ -1379,6 +1766,11 @@ report_fork_init(void)
     num_suppressions_matched_default = 0;
     num_suppressed_leaks_default = 0;
     num_reachable_leaks = 0;
+    /* the filter points at error_table payloads */
+    hashtable_clear(&dup_filter_table);
+    dup_filter_entries = 0;
+    num_dup_filter_hits = 0;
+    num_dup_filter_mismatches = 0;
     hashtable_clear(&error_table);
     /* Be sure to reset the error list (xref PR 519222)
      * The error list points at hashtable payloads so nothing to free 
@@ -1516,6 +1908,12 @@ report_summary_to_file(file_t f, bool stderr_too, bool print_full_stats)
         NOTIFY_COND(notify, f, "  %5d leak(s) beyond -report_leak_max"NL,
                     num_throttled_leaks);
     }
+    if (print_full_stats && options.dup_filter) {
+        /* Not sending to stderr */
+        dr_fprintf(f, "  %5d duplicate(s) identified before walking the callstack,"
+                   " %d filter mismatch(es)"NL,
+                   num_dup_filter_hits, num_dup_filter_mismatches);
+    }
     NOTIFY_COND(notify, f, "Details: %s/results.txt"NL, logsubdir);
 }
 
@@ -1532,13 +1930,14 @@ report_summary(void)
 void
 report_exit(void)
 {
-    uint i;
+    uint i, j;
 #ifdef USE_DRSYMS
     LOGF(0, f_results, NL"==========================================================================="NL"FINAL SUMMARY:"NL);
     dr_mutex_destroy(suppress_file_lock);
 #endif
     report_summary();
 
+    hashtable_delete(&dup_filter_table);
     hashtable_delete(&error_table);
     dr_mutex_destroy(error_lock);
 
@@ -1546,11 +1945,14 @@ report_exit(void)
 
     for (i = 0; i < ERROR_MAX_VAL; i++) {
         suppress_spec_t *spec, *next;
+        for (j = 0; j < SUPP_INDEX_NUM; j++)
+            hashtable_delete(&supp_index[i][j]);
         for (spec = supp_list[i]; spec != NULL; spec = next) {
             next = spec->next;
             suppress_spec_free(spec);
         }
     }
+    hashtable_delete(&supp_pattern_table);
 
     if (options.show_threads && !options.show_all_threads) {
         hashtable_delete(&thread_table);
@@ -2076,6 +2478,8 @@ report_error(error_toprint_t *etp, dr_mcontext_t *mc, packed_callstack_t *pcs)
     error_callstack_t ecs;
     char  *errbuf;
     size_t errbufsz;
+    dup_filter_entry_t filter_key;
+    bool use_filter;
 
 #ifdef USE_DRSYMS
     /* we do not want to use dbghelp at init time b/c that's too early so we
@@ -2147,8 +2551,33 @@ report_error(error_toprint_t *etp, dr_mcontext_t *mc, packed_callstack_t *pcs)
         }
     }
 
+    use_filter = (pcs == NULL && dup_filter_key(etp, mc, &filter_key));
+    if (use_filter) {
+        dr_mutex_lock(error_lock);
+        err = dup_filter_lookup(&filter_key);
+        if (err != NULL) {
+            /* same accounting as for a duplicate from record_error() */
+            err->count++;
+            num_dup_filter_hits++;
+            if (err->suppressed) {
+                if (err->suppressed_by_default)
+                    num_suppressions_matched_default++;
+                else
+                    num_suppressions_matched_user++;
+            } else {
+                num_total[etp->errtype]++;
+                reporting = true;
+            }
+            dr_mutex_unlock(error_lock);
+            goto report_error_done;
+        }
+        dr_mutex_unlock(error_lock);
+    }
+
     err = record_error(etp->errtype, pcs, etp->loc, mc, false/*no lock */);
     if (err->count > 1) {
+        if (use_filter)
+            dup_filter_add(&filter_key, err);
         if (err->suppressed) {
             if (err->suppressed_by_default)
                 num_suppressions_matched_default++;
@@ -2192,6 +2621,8 @@ report_error(error_toprint_t *etp, dr_mcontext_t *mc, packed_callstack_t *pcs)
             report_error_suppression(etp->errtype, &ecs, err->id);
             num_reported_errors++;
         }
+        if (use_filter)
+            dup_filter_add(&filter_key, err);
     }
     dr_mutex_unlock(error_lock);
 
@@ -2635,7 +3066,7 @@ report_leak(bool known_malloc, app_pc addr, size_t size, size_t indirect_size,
         if (!early && pcs == NULL) {
             locked_malloc = true;
             malloc_lock(); /* unlocked below */
-            pcs = malloc_get_client_data(addr);
+            pcs = client_malloc_data_to_callstack(malloc_get_client_data(addr));
         }
 
         /* We check dups only for real and possible leaks.
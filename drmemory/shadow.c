@@ -184,12 +184,41 @@ typedef uint shadow_block_t[BITMAPx2_IDX(ALLOC_UNIT)];
  * routines in fastpath.c.
  */
 #define TABLE_ENTRIES (1 << (32 - (SHADOW_SPLIT_BITS)))
+#define TABLE_IDX(addr) (((ptr_uint_t)(addr) & 0xffff0000) >> (SHADOW_SPLIT_BITS))
+#define ADDR_OF_BASE(table_idx) ((ptr_uint_t)(table_idx) << (SHADOW_SPLIT_BITS))
+
+#ifdef X64
+/* i#111: a flat table for a 48-bit address space would need 2^32 entries, so
+ * for 64-bit we add a directory level on top of the 32-bit table.  Each
+ * directory slot covers 4GB with a TABLE_ENTRIES-sized table of its own.  The
+ * displacements stored in each table are relative to the low 32 bits of the
+ * address, which lets every 4GB region that has never been written share one
+ * read-only all-unaddressable table: only regions we actually touch pay for a
+ * private table.  Lookups remain two dependent loads with no tag checks.
+ *
+ * We index the directory by bits 32..47 alone so that any address, even a
+ * non-canonical one, stays inside the directory.  Kernel addresses have bit
+ * 47 set and so use the upper half of the slots, which no user-space address
+ * shares.  Other non-canonical addresses can alias a user-space slot's
+ * shadow, but the app faults on them whatever their shadow says.
+ */
+# define DIR_ENTRIES (1 << 16)
+# define DIR_IDX(addr) (((ptr_uint_t)(addr) >> 32) & (DIR_ENTRIES - 1))
+# define ADDR_OF_DIR_BASE(dir_idx) ((ptr_uint_t)(dir_idx) << 32)
+# define SHADOW_TABLE_ALLOC_SZ (TABLE_ENTRIES * sizeof(ptr_int_t))
+/* The directory must be reachable via a 32-bit displacement from the code
+ * cache: we rely on the client library's preferred base for that, just like
+ * the 32-bit table.
+ */
+ptr_int_t *shadow_dir[DIR_ENTRIES];
+/* shared by all 4GB regions that are entirely unaddressable */
+static ptr_int_t *shadow_table_unaddr;
+#else
 /* We store the displacement (shadow minus app) from the base to
  * shrink instrumentation size (PR 553724)
  */
 ptr_int_t shadow_table[TABLE_ENTRIES];
-#define TABLE_IDX(addr) (((ptr_uint_t)(addr) & 0xffff0000) >> (SHADOW_SPLIT_BITS))
-#define ADDR_OF_BASE(table_idx) ((ptr_uint_t)(table_idx) << (SHADOW_SPLIT_BITS))
+#endif
 
 static void *shadow_lock;
 
@@ -203,7 +232,10 @@ static shadow_block_t *special_bitlevel;
 
 #ifdef STATISTICS
 uint shadow_block_alloc;
-/* b/c of PR 580017 we no longer free any non-specials so this is always 0 */
+# ifdef X64
+uint shadow_table_alloc;
+# endif
+/* b/c of PR 580017 we only free non-specials after a grace period */
 uint shadow_block_free;
 uint num_special_unaddressable;
 uint num_special_undefined;
@@ -286,11 +318,46 @@ create_special_block(uint dwordval)
     return block;
 }
 
+#ifdef X64
+/* Returns the table covering addr's 4GB region, replacing the shared
+ * all-unaddressable table with a private copy first if for_write.
+ * If for_write and past init, caller must hold shadow_lock.
+ */
+static ptr_int_t *
+get_shadow_dir_table(app_pc addr, bool for_write)
+{
+    uint dir_idx = DIR_IDX(addr);
+    ptr_int_t *table = shadow_dir[dir_idx];
+    if (for_write && table == shadow_table_unaddr) {
+        table = (ptr_int_t *)
+            nonheap_alloc(SHADOW_TABLE_ALLOC_SZ, DR_MEMPROT_READ|DR_MEMPROT_WRITE,
+                          HEAPSTAT_SHADOW);
+        /* displacements are region-relative so they can be copied as-is */
+        memcpy(table, shadow_table_unaddr, SHADOW_TABLE_ALLOC_SZ);
+        STATS_INC(shadow_table_alloc);
+        LOG(2, "new shadow table "PFX" for region "PFX"\n",
+            table, ADDR_OF_DIR_BASE(dir_idx));
+        /* publish only once filled in, for lock-free readers */
+        shadow_dir[dir_idx] = table;
+    }
+    return table;
+}
+#endif
+
 /* FIXME: share w/ staleness.c */
 /* if past init, caller must hold shadow_lock */
 static void
-set_shadow_table(uint idx, shadow_block_t *block)
-{
+set_shadow_table(app_pc addr, shadow_block_t *block)
+{
+    uint idx = TABLE_IDX(addr);
+#ifdef X64
+    ptr_int_t *shadow_table;
+    /* avoid privatizing the shared table for a nop */
+    if (block == special_unaddressable &&
+        shadow_dir[DIR_IDX(addr)] == shadow_table_unaddr)
+        return;
+    shadow_table = get_shadow_dir_table(addr, true/*write*/);
+#endif
     /* We store the displacement (shadow minus app) (PR 553724) */
     shadow_table[idx] = ((ptr_int_t)block) - (ADDR_OF_BASE(idx) / SHADOW_GRANULARITY);
     LOG(3, "setting shadow table idx %d for block "PFX" to "PFX"\n",
@@ -298,8 +365,10 @@ set_shadow_table(uint idx, shadow_block_t *block)
 }
 
 static shadow_block_t *
-get_shadow_table(uint idx)
+get_shadow_table(app_pc addr)
 {
+    uint idx = TABLE_IDX(addr);
+    IF_X64(ptr_int_t *shadow_table = get_shadow_dir_table(addr, false/*read*/);)
     /* We store the displacement (shadow minus app) (PR 553724) */
     ASSERT(options.shadowing, "shadowing disabled");
     return (shadow_block_t *)
@@ -330,23 +399,63 @@ shadow_table_init(void)
     special_undefined = create_special_block(SHADOW_DWORD_UNDEFINED);
     special_defined = create_special_block(SHADOW_DWORD_DEFINED);
     special_bitlevel = create_special_block(SHADOW_DWORD_BITLEVEL);
+#ifdef X64
+    {
+        IF_DEBUG(bool ok;)
+        shadow_table_unaddr = (ptr_int_t *)
+            nonheap_alloc(SHADOW_TABLE_ALLOC_SZ, DR_MEMPROT_READ|DR_MEMPROT_WRITE,
+                          HEAPSTAT_SHADOW);
+        for (i = 0; i < TABLE_ENTRIES; i++) {
+            shadow_table_unaddr[i] = ((ptr_int_t)special_unaddressable) -
+                (ADDR_OF_BASE(i) / SHADOW_GRANULARITY);
+        }
+        IF_DEBUG(ok = )
+            dr_memory_protect(shadow_table_unaddr, SHADOW_TABLE_ALLOC_SZ,
+                              DR_MEMPROT_READ);
+        ASSERT(ok, "-w failed: will have inconsistencies in shadow data");
+        for (i = 0; i < DIR_ENTRIES; i++)
+            shadow_dir[i] = shadow_table_unaddr;
+    }
+#else
     for (i = 0; i < TABLE_ENTRIES; i++)
-        set_shadow_table(i, special_unaddressable);
+        set_shadow_table((app_pc)ADDR_OF_BASE(i), special_unaddressable);
+#endif
     shadow_lock = dr_mutex_create();
 }
 
+static void
+shadow_free_retired(bool exiting);
+
 static void
 shadow_table_exit(void)
 {
     uint i;
     shadow_block_t *block;
+    shadow_free_retired(true);
+#ifdef X64
+    uint j;
+    for (j = 0; j < DIR_ENTRIES; j++) {
+        if (shadow_dir[j] == shadow_table_unaddr)
+            continue;
+        for (i = 0; i < TABLE_ENTRIES; i++) {
+            block = get_shadow_table((app_pc)(ADDR_OF_DIR_BASE(j) + ADDR_OF_BASE(i)));
+            if (!block_is_special(block)) {
+                global_free(((byte*)block) - SHADOW_REDZONE_SIZE,
+                            SHADOW_BLOCK_ALLOC_SZ, HEAPSTAT_SHADOW);
+            }
+        }
+        nonheap_free(shadow_dir[j], SHADOW_TABLE_ALLOC_SZ, HEAPSTAT_SHADOW);
+    }
+    nonheap_free(shadow_table_unaddr, SHADOW_TABLE_ALLOC_SZ, HEAPSTAT_SHADOW);
+#else
     for (i = 0; i < TABLE_ENTRIES; i++) {
-        block = get_shadow_table(i);
+        block = get_shadow_table((app_pc)ADDR_OF_BASE(i));
         if (!block_is_special(block)) {
             global_free(((byte*)block) - SHADOW_REDZONE_SIZE,
                         SHADOW_BLOCK_ALLOC_SZ, HEAPSTAT_SHADOW);
         }
     }
+#endif
     nonheap_free(((byte*)special_unaddressable) - SHADOW_REDZONE_SIZE,
                  SHADOW_BLOCK_ALLOC_SZ, HEAPSTAT_SHADOW);
     nonheap_free(((byte*)special_undefined) - SHADOW_REDZONE_SIZE,
@@ -367,7 +476,7 @@ get_shadow_block_size(void)
 bool
 shadow_get_special(app_pc addr, uint *val)
 {
-    shadow_block_t *block = get_shadow_table(TABLE_IDX(addr));
+    shadow_block_t *block = get_shadow_table(addr);
     if (val != NULL)
         *val = shadow_get_byte(addr);
     return block_is_special(block);
@@ -393,9 +502,9 @@ shadow_set_special(app_pc addr, uint val)
     bool res = false;
     /* grab lock to synch w/ special-to-non-special transition */
     dr_mutex_lock(shadow_lock);
-    block = get_shadow_table(TABLE_IDX(addr));
+    block = get_shadow_table(addr);
     if (block_is_special(block)) {
-        set_shadow_table(TABLE_IDX(addr), val_to_special(val));
+        set_shadow_table(addr, val_to_special(val));
         res = true;
 #ifdef STATISTICS
         if (val == SHADOW_UNADDRESSABLE)
@@ -415,7 +524,7 @@ shadow_set_special(app_pc addr, uint val)
 uint
 shadow_get_byte(app_pc addr)
 {
-    shadow_block_t *block = get_shadow_table(TABLE_IDX(addr));
+    shadow_block_t *block = get_shadow_table(addr);
     ptr_uint_t idx = ((ptr_uint_t)addr) % ALLOC_UNIT;
     if (!MAP_4B_TO_1B)
         return bitmapx2_get(*block, idx);
@@ -426,7 +535,7 @@ shadow_get_byte(app_pc addr)
 uint
 shadow_get_dword(app_pc addr)
 {
-    shadow_block_t *block = get_shadow_table(TABLE_IDX(addr));
+    shadow_block_t *block = get_shadow_table(addr);
     ptr_uint_t idx = ((ptr_uint_t)ALIGN_BACKWARD(addr, 4)) % ALLOC_UNIT;
     if (!MAP_4B_TO_1B)
         return bitmapx2_byte(*block, idx);
@@ -438,7 +547,7 @@ shadow_get_dword(app_pc addr)
 void
 shadow_set_byte(app_pc addr, uint val)
 {
-    shadow_block_t *block = get_shadow_table(TABLE_IDX(addr));
+    shadow_block_t *block = get_shadow_table(addr);
     ASSERT(val <= 4, "invalid shadow value");
     /* Note that we can come here for SHADOW_SPECIAL_DEFINED, for mmap
      * regions used for calloc (we mark headers as unaddressable), etc.
@@ -452,12 +561,12 @@ shadow_set_byte(app_pc addr, uint val)
             return;
         }
         /* check again with lock.  we only need synch on the special-to-non-special
-         * transition (we never go the other way).
+         * transition (the other way, shadow_retire_block, also holds the lock).
          *  can still have races between app access and shadow update,
          * but if race between thread shadow updates there's a race in the app.
          */
         dr_mutex_lock(shadow_lock);
-        block = get_shadow_table(TABLE_IDX(addr));
+        block = get_shadow_table(addr);
         if (block_is_special(block)) {
             ASSERT(val_to_special(blockval) == block, "internal error");
             LOG(2, "replacing shadow special "PFX" block for write @"PFX" %d\n",
@@ -475,7 +584,7 @@ shadow_set_byte(app_pc addr, uint val)
             ASSERT(ALIGNED(block, 4), "esp fastpath assumes block aligned to 4");
             STATS_INC(shadow_block_alloc);
             memset(block, dwordval, sizeof(*block));
-            set_shadow_table(TABLE_IDX(addr), block);
+            set_shadow_table(addr, block);
         }
         dr_mutex_unlock(shadow_lock);
     }
@@ -489,7 +598,7 @@ shadow_set_byte(app_pc addr, uint val)
 byte *
 shadow_translation_addr(app_pc addr)
 {
-    shadow_block_t *block = get_shadow_table(TABLE_IDX(addr));
+    shadow_block_t *block = get_shadow_table(addr);
     size_t mod = ((ptr_uint_t)addr) % ALLOC_UNIT;
     return ((byte *)(*block)) + BLOCK_AS_BYTE_ARRAY_IDX(mod);
 }
@@ -497,7 +606,7 @@ shadow_translation_addr(app_pc addr)
 byte *
 shadow_translation_addr_using_offset(app_pc addr, byte *target)
 {
-    shadow_block_t *block = get_shadow_table(TABLE_IDX(addr));
+    shadow_block_t *block = get_shadow_table(addr);
     LOG(2, "for addr="PFX" target="PFX" => block "PFX" offs "PFX"\n",
         addr, target, block,
         (((ptr_uint_t)target) & ((ALLOC_UNIT -1) * sizeof(uint) / BITMAPx2_UNIT)));
@@ -522,10 +631,342 @@ shadow_replace_special(app_pc addr)
     /* kind of a hack to get shadow_set_byte to replace, since it won't re-instate */
     shadow_set_byte(addr, (val == SHADOW_DEFINED) ? SHADOW_UNDEFINED : SHADOW_DEFINED);
     shadow_set_byte(addr, val);
-    block = get_shadow_table(TABLE_IDX(addr));
+    block = get_shadow_table(addr);
     return ((byte *)(*block)) + BLOCK_AS_BYTE_ARRAY_IDX(mod);
 }
 
+/***************************************************************************
+ * RECLAIMING UNIFORM BLOCKS
+ *
+ * A private block that has become entirely unaddressable (after a large free
+ * or munmap) is swapped back to the shared special block, either right away
+ * when shadow_set_range covers its whole unit or by a periodic sweep that
+ * catches units cleared piecemeal.  PR 580017: we can't free a block right
+ * away, as inline instrumentation (and translations shared within a bb for
+ * -share_xl8) may have looked up its address and not yet used it, and a
+ * thread can be preempted in between.  A retired block is only freed once
+ * every thread has since passed a quiescent point, where it holds no
+ * translation: entry to the slowpath (which re-translates and resets any
+ * shared translation) or a syscall.  A thread blocked in a syscall counts as
+ * quiescent throughout, unless the syscall may not return to the post-syscall
+ * event.
+ *
+ * The inline esp fastpath writes shadow for stack beyond TOS, which is
+ * unaddressable, so we leave alone units in or just below each thread's
+ * stack.  Otherwise the app only writes unaddressable shadow via the
+ * slowpath or client code, which re-check the table after writing (see
+ * shadow_set_range).  As a last resort, a retired block that is no longer
+ * uniform when freed is put back if its unit is still special.
+ */
+
+typedef struct _retired_block_t {
+    shadow_block_t *block;
+    app_pc base;
+    uint val;
+    uint epoch;
+    struct _retired_block_t *next;
+} retired_block_t;
+
+/* Per-thread quiescence state, readable by the sweeping thread */
+typedef struct _reclaim_thread_t {
+    /* reclaim_epoch as of this thread's last quiescent point */
+    volatile uint epoch;
+    /* blocked in a syscall that returns to the post-syscall event */
+    volatile bool in_syscall;
+    /* app stack pointer as of the last quiescent point, or NULL if unknown */
+    volatile app_pc sp;
+    struct _reclaim_thread_t *next;
+    struct _reclaim_thread_t *prev;
+} reclaim_thread_t;
+
+/* all protected by shadow_lock */
+static retired_block_t *retired_blocks;
+static reclaim_thread_t *reclaim_threads;
+/* written under shadow_lock, read racily at quiescent points */
+static volatile uint reclaim_epoch;
+
+static int tls_idx_reclaim = -1;
+
+/* KB marked unaddressable since the last sweep */
+static volatile int reclaim_unaddr_kb;
+
+#ifdef STATISTICS
+uint shadow_block_retired;
+uint shadow_block_reinstated;
+uint shadow_reclaim_sweeps;
+#endif
+
+static void
+shadow_reclaim_thread_init(void *drcontext)
+{
+    reclaim_thread_t *rt;
+    if (!options.reclaim_shadow)
+        return;
+    rt = (reclaim_thread_t *) global_alloc(sizeof(*rt), HEAPSTAT_SHADOW);
+    rt->in_syscall = false;
+    rt->sp = NULL;
+    rt->prev = NULL;
+    dr_mutex_lock(shadow_lock);
+    /* a new thread holds no translations */
+    rt->epoch = reclaim_epoch;
+    rt->next = reclaim_threads;
+    if (reclaim_threads != NULL)
+        reclaim_threads->prev = rt;
+    reclaim_threads = rt;
+    dr_mutex_unlock(shadow_lock);
+    drmgr_set_tls_field(drcontext, tls_idx_reclaim, (void *) rt);
+}
+
+static void
+shadow_reclaim_thread_exit(void *drcontext)
+{
+    reclaim_thread_t *rt;
+    if (!options.reclaim_shadow)
+        return;
+    rt = (reclaim_thread_t *) drmgr_get_tls_field(drcontext, tls_idx_reclaim);
+    if (rt == NULL)
+        return;
+    dr_mutex_lock(shadow_lock);
+    if (rt->prev == NULL)
+        reclaim_threads = rt->next;
+    else
+        rt->prev->next = rt->next;
+    if (rt->next != NULL)
+        rt->next->prev = rt->prev;
+    dr_mutex_unlock(shadow_lock);
+    drmgr_set_tls_field(drcontext, tls_idx_reclaim, NULL);
+    global_free(rt, sizeof(*rt), HEAPSTAT_SHADOW);
+}
+
+void
+shadow_thread_quiescent(void *drcontext, app_pc sp)
+{
+    reclaim_thread_t *rt;
+    if (!options.reclaim_shadow)
+        return;
+    rt = (reclaim_thread_t *) drmgr_get_tls_field(drcontext, tls_idx_reclaim);
+    if (rt == NULL)
+        return;
+    rt->sp = sp;
+    rt->epoch = reclaim_epoch;
+}
+
+void
+shadow_thread_in_syscall(void *drcontext, bool in_syscall)
+{
+    reclaim_thread_t *rt;
+    if (!options.reclaim_shadow)
+        return;
+    rt = (reclaim_thread_t *) drmgr_get_tls_field(drcontext, tls_idx_reclaim);
+    if (rt == NULL)
+        return;
+    rt->in_syscall = in_syscall;
+    if (!in_syscall) {
+        /* the sweeper must not see the stale flag once we translate again */
+        MEMORY_BARRIER();
+        rt->epoch = reclaim_epoch;
+    }
+}
+
+/* Returns the oldest epoch any thread may still hold a translation from:
+ * blocks retired before it can be freed.  Caller must hold shadow_lock.
+ */
+static uint
+reclaim_safe_epoch(void)
+{
+    reclaim_thread_t *rt;
+    uint safe = reclaim_epoch;
+    for (rt = reclaim_threads; rt != NULL; rt = rt->next) {
+        uint epoch = rt->epoch;
+        if (!rt->in_syscall && (int)(epoch - safe) < 0)
+            safe = epoch;
+    }
+    return safe;
+}
+
+/* Returns whether base's unit is in, or is the unit just below, the stack
+ * of some thread, or whether some thread's stack is not yet known.
+ * Caller must hold shadow_lock.
+ */
+static bool
+reclaim_unit_near_stack(app_pc base)
+{
+    reclaim_thread_t *rt;
+    for (rt = reclaim_threads; rt != NULL; rt = rt->next) {
+        byte *stack_base;
+        size_t stack_size;
+        app_pc sp = rt->sp;
+        if (sp == NULL)
+            return true;
+        if (!dr_query_memory(sp, &stack_base, &stack_size, NULL))
+            return true;
+        /* the extra unit covers stack growth the esp fastpath writes into */
+        if (base + ALLOC_UNIT + ALLOC_UNIT > stack_base &&
+            base < stack_base + stack_size)
+            return true;
+    }
+    return false;
+}
+
+/* Returns whether every shadow value in block is the same, and which */
+static bool
+block_is_uniform(shadow_block_t *block, uint *val)
+{
+    uint first = (*block)[0];
+    uint i, v;
+    for (v = 0; v < 4; v++) {
+        if (first == val_to_dqword[v])
+            break;
+    }
+    if (v == 4)
+        return false;
+    for (i = 1; i < BITMAPx2_IDX(ALLOC_UNIT); i++) {
+        if ((*block)[i] != first)
+            return false;
+    }
+    *val = v;
+    return true;
+}
+
+/* Swaps the special block for val in for block, the private block for the
+ * unit at base, and queues block to be freed once all threads have quiesced.
+ * Returns false and leaves block in place if a concurrent write made it
+ * non-uniform.  Caller must hold shadow_lock.
+ */
+static bool
+shadow_retire_block(app_pc base, shadow_block_t *block, uint val)
+{
+    retired_block_t *retired;
+    uint now_val;
+    ASSERT(dr_mutex_self_owns(shadow_lock), "caller must hold shadow lock");
+    ASSERT(get_shadow_table(base) == block && !block_is_special(block),
+           "can only retire a private block");
+    set_shadow_table(base, val_to_special(val));
+    /* pairs with the barrier in shadow_set_range's writers */
+    MEMORY_BARRIER();
+    if (!block_is_uniform(block, &now_val) || now_val != val) {
+        LOG(2, "shadow block "PFX" for "PFX" written during reclaim: keeping\n",
+            block, base);
+        set_shadow_table(base, block);
+        return false;
+    }
+    LOG(2, "retiring uniform %s shadow block "PFX" for "PFX"\n",
+        shadow_name[val], block, base);
+    retired = (retired_block_t *) global_alloc(sizeof(*retired), HEAPSTAT_SHADOW);
+    retired->block = block;
+    retired->base = base;
+    retired->val = val;
+    /* reclaim_epoch is bumped after this sweep's retirements are published,
+     * so a thread only reaches a later epoch after it can see them
+     */
+    retired->epoch = reclaim_epoch;
+    retired->next = retired_blocks;
+    retired_blocks = retired;
+    STATS_INC(shadow_block_retired);
+    return true;
+}
+
+/* Frees retired blocks no thread can still be using, or all of them at exit.
+ * Caller must hold shadow_lock unless exiting.
+ */
+static void
+shadow_free_retired(bool exiting)
+{
+    retired_block_t *retired, *prev = NULL, *next;
+    uint safe = exiting ? 0 : reclaim_safe_epoch();
+    uint val;
+    for (retired = retired_blocks; retired != NULL; retired = next) {
+        next = retired->next;
+        if (!exiting && (int)(retired->epoch - safe) >= 0) {
+            prev = retired;
+            continue;
+        }
+        if (prev == NULL)
+            retired_blocks = next;
+        else
+            prev->next = next;
+        if (!exiting &&
+            (!block_is_uniform(retired->block, &val) || val != retired->val)) {
+            /* a write raced with the swap: put the block back if nobody has
+             * since privatized the unit again
+             */
+            if (get_shadow_table(retired->base) == val_to_special(retired->val)) {
+                LOG(1, "reinstating shadow block "PFX" for "PFX" after a late write\n",
+                    retired->block, retired->base);
+                set_shadow_table(retired->base, retired->block);
+                STATS_INC(shadow_block_reinstated);
+                global_free(retired, sizeof(*retired), HEAPSTAT_SHADOW);
+                continue;
+            }
+            LOG(1, "WARNING: late write to retired shadow block "PFX" for "PFX" lost\n",
+                retired->block, retired->base);
+        }
+        global_free(((byte*)retired->block) - SHADOW_REDZONE_SIZE,
+                    SHADOW_BLOCK_ALLOC_SZ, HEAPSTAT_SHADOW);
+        STATS_INC(shadow_block_free);
+        global_free(retired, sizeof(*retired), HEAPSTAT_SHADOW);
+    }
+}
+
+static void
+shadow_reclaim_unit_if_unaddressable(app_pc base)
+{
+    shadow_block_t *block = get_shadow_table(base);
+    uint val;
+    if (!block_is_special(block) && block_is_uniform(block, &val) &&
+        val == SHADOW_UNADDRESSABLE && !reclaim_unit_near_stack(base))
+        shadow_retire_block(base, block, val);
+}
+
+/* Frees retired blocks that all threads have quiesced past, scans the tables
+ * for private blocks that are entirely unaddressable, and then advances the
+ * reclaim epoch.  Caller must hold shadow_lock.
+ */
+static void
+shadow_reclaim_sweep(void)
+{
+    uint i;
+    LOG(2, "sweeping shadow tables for uniform blocks\n");
+    STATS_INC(shadow_reclaim_sweeps);
+    shadow_free_retired(false);
+#ifdef X64
+    {
+        uint j;
+        for (j = 0; j < DIR_ENTRIES; j++) {
+            if (shadow_dir[j] == shadow_table_unaddr)
+                continue;
+            for (i = 0; i < TABLE_ENTRIES; i++) {
+                shadow_reclaim_unit_if_unaddressable
+                    ((app_pc)(ADDR_OF_DIR_BASE(j) + ADDR_OF_BASE(i)));
+            }
+        }
+    }
+#else
+    for (i = 0; i < TABLE_ENTRIES; i++)
+        shadow_reclaim_unit_if_unaddressable((app_pc)ADDR_OF_BASE(i));
+#endif
+    /* publish the table updates before the new epoch */
+    MEMORY_BARRIER();
+    reclaim_epoch++;
+}
+
+/* Called for ranges marked unaddressable: sweeps every -reclaim_shadow_mb */
+static void
+shadow_reclaim_note_unaddressable(size_t size)
+{
+    int kb = (int) ((size > INT_MAX/2 ? INT_MAX/2 : size) / 1024);
+    int limit = (int) options.reclaim_shadow_mb * 1024;
+    if (kb == 0 || atomic_add32_return_sum(&reclaim_unaddr_kb, kb) < limit)
+        return;
+    dr_mutex_lock(shadow_lock);
+    /* another thread may have beaten us to it */
+    if (reclaim_unaddr_kb >= limit) {
+        reclaim_unaddr_kb = 0;
+        shadow_reclaim_sweep();
+    }
+    dr_mutex_unlock(shadow_lock);
+}
+
 /* Sets the two bits for each byte in the range [start, end) */
 void
 shadow_set_range(app_pc start, app_pc end, uint val)
@@ -539,15 +980,12 @@ shadow_set_range(app_pc start, app_pc end, uint val)
             LOG(2, "WARNING: set range of very large range "PFX"-"PFX"\n", start, end);
     });
     while (pc < end && pc >= start/*overflow*/) {
-        shadow_block_t *block = get_shadow_table(TABLE_IDX(pc));
+        shadow_block_t *block = get_shadow_table(pc);
         bool is_special = block_is_special(block);
         if (is_special && ALIGNED(pc, ALLOC_UNIT) && (end - pc) >= ALLOC_UNIT) {
             if (shadow_set_special(pc, val))
                 pc += ALLOC_UNIT;
-            else {
-                /* a race and special was replaced w/ non-special: so re-do */
-                ASSERT(!shadow_get_special(pc, NULL), "non-special never reverts");
-            }
+            /* else, a race and special was replaced w/ non-special: so re-do */
         } else {
             if (!is_special && ALIGNED(pc, SHADOW_GRANULARITY)) {
                 app_pc block_end = (app_pc) ALIGN_FORWARD(pc + 1, ALLOC_UNIT);
@@ -559,9 +997,29 @@ shadow_set_range(app_pc start, app_pc end, uint val)
                             &(*block)[BITMAPx2_IDX(((ptr_uint_t)pc) % ALLOC_UNIT)];
                         byte *memset_start = ((byte *)array_start) +
                             (((ptr_uint_t)pc) % BITMAPx2_UNIT) / SHADOW_GRANULARITY;
+                        bool retired_under_us = false;
                         memset(memset_start, val_to_dword[val],
                                (set_end - pc) / SHADOW_GRANULARITY);
                         LOG(3, "\tmemset "PFX"-"PFX"\n", pc, set_end);
+                        if (options.reclaim_shadow && val == SHADOW_UNADDRESSABLE &&
+                            ALIGNED(pc, ALLOC_UNIT) && set_end - pc == ALLOC_UNIT) {
+                            /* the whole unit is unaddressable again: hand it
+                             * back now rather than waiting for a sweep
+                             */
+                            dr_mutex_lock(shadow_lock);
+                            retired_under_us = (get_shadow_table(pc) != block);
+                            if (!retired_under_us && !reclaim_unit_near_stack(pc))
+                                shadow_retire_block(pc, block, val);
+                            dr_mutex_unlock(shadow_lock);
+                        } else if (options.reclaim_shadow) {
+                            /* pairs with the barrier in shadow_retire_block */
+                            MEMORY_BARRIER();
+                            retired_under_us = (get_shadow_table(pc) != block);
+                        }
+                        if (retired_under_us) {
+                            /* our write went to a retired block: redo it */
+                            continue;
+                        }
                         pc = set_end;
                         continue;
                     }
@@ -572,6 +1030,88 @@ shadow_set_range(app_pc start, app_pc end, uint val)
             pc++;
         }
     }
+    if (options.reclaim_shadow && val == SHADOW_UNADDRESSABLE)
+        shadow_reclaim_note_unaddressable(end - start);
+}
+
+/* Copies shadow one app byte at a time, in either direction */
+static void
+shadow_copy_bytes(app_pc src, app_pc dst, size_t size, bool backward)
+{
+    size_t i;
+    for (i = 0; i < size; i++) {
+        size_t offs = backward ? size - 1 - i : i;
+        shadow_set_byte(dst + offs, shadow_get_byte(src + offs));
+    }
+}
+
+/* Copies the shadow for [src, src+size) to [dst, dst+size), where each range
+ * lies within a single shadow block.  The destination's aligned dwords are
+ * written a shadow byte at a time: a memmove when the two ranges share their
+ * sub-dword alignment and a shift-and-merge of the 2-bit values otherwise.
+ */
+static void
+shadow_copy_chunk(app_pc src, app_pc dst, size_t size, bool backward)
+{
+    app_pc dst_start = (app_pc) ALIGN_FORWARD(dst, 4);
+    app_pc dst_end = (app_pc) ALIGN_BACKWARD(dst + size, 4);
+    app_pc src_start = src + (dst_start - dst);
+    uint shift = (((ptr_uint_t)src_start) % 4) * 2;
+    size_t head, words, k;
+    byte *src_shadow, *dst_shadow;
+    uint val;
+    if (dst_end <= dst_start || (MAP_4B_TO_1B && shift != 0)) {
+        /* In 4-to-1 mode each shadow byte holds one value for the whole
+         * dword, so unequal alignment has no better answer than per-byte.
+         */
+        shadow_copy_bytes(src, dst, size, backward);
+        return;
+    }
+    head = dst_start - dst;
+    words = (dst_end - dst_start) / 4;
+    if (backward) {
+        shadow_copy_bytes(src_start + words*4, dst_end,
+                          size - head - words*4, true);
+    } else
+        shadow_copy_bytes(src, dst, head, false);
+
+    if (shadow_get_special(src_start, &val)) {
+        uint dst_val;
+        if (!shadow_get_special(dst_start, &dst_val) || dst_val != val) {
+            dst_shadow = shadow_get_special(dst_start, NULL) ?
+                shadow_replace_special(dst_start) : shadow_translation_addr(dst_start);
+            memset(dst_shadow, val_to_dword[val], words);
+        }
+    } else {
+        if (shadow_get_special(dst_start, &val) &&
+            shadow_prefix_matching(src_start, words*4, val, false) == words*4) {
+            /* nop write: leave the destination special */
+        } else {
+            dst_shadow = shadow_get_special(dst_start, NULL) ?
+                shadow_replace_special(dst_start) : shadow_translation_addr(dst_start);
+            src_shadow = shadow_translation_addr(src_start);
+            if (shift == 0)
+                memmove(dst_shadow, src_shadow, words);
+            else {
+                /* The values for each destination dword straddle two source
+                 * shadow bytes, both within src's block.  Walking in the copy
+                 * direction never reads a byte already overwritten.
+                 */
+                for (k = 0; k < words; k++) {
+                    size_t j = backward ? words - 1 - k : k;
+                    dst_shadow[j] = (byte)
+                        ((src_shadow[j] >> shift) | (src_shadow[j+1] << (8 - shift)));
+                }
+            }
+        }
+    }
+
+    if (backward)
+        shadow_copy_bytes(src, dst, head, true);
+    else {
+        shadow_copy_bytes(src_start + words*4, dst_end,
+                          size - head - words*4, false);
+    }
 }
 
 /* Copies the values for each byte in the range [old_start, old_start+end) to
@@ -580,31 +1120,44 @@ shadow_set_range(app_pc start, app_pc end, uint val)
 void
 shadow_copy_range(app_pc old_start, app_pc new_start, size_t size)
 {
-    app_pc pc = old_start;
-    app_pc new_pc;
+    /* copy from the end if the destination overlaps the source's tail */
+    bool backward = (new_start > old_start && new_start < old_start + size);
+    size_t done = 0;
     uint val;
     LOG(2, "copy range "PFX"-"PFX" to "PFX"-"PFX"\n",
          old_start, old_start+size, new_start, new_start+size);
     /* We don't check what the current value of the destination is b/c
      * it could be anything: realloc can shrink, grow, overlap, etc.
      */
-    while (pc < old_start + size) {
-        new_pc = (pc - old_start) + new_start;
-        if (ALIGNED(pc, ALLOC_UNIT) && ALIGNED(new_pc, ALLOC_UNIT) &&
-            (old_start + size - pc) >= ALLOC_UNIT &&
-            shadow_get_special(pc, &val) &&
-            shadow_get_special(new_pc, &val)) {
-            if (shadow_set_special(new_pc, val))
-                pc += ALLOC_UNIT;
-            else {
-                /* a race and special was replaced w/ non-special: so re-do */
-                ASSERT(!shadow_get_special(new_pc, NULL), "non-special never reverts");
-            }
+    while (done < size) {
+        size_t left = size - done;
+        size_t src_room, dst_room, chunk;
+        app_pc src, dst;
+        /* split at shadow block boundaries of both the source and the target */
+        if (backward) {
+            src_room = ((ptr_uint_t)(old_start + left - 1)) % ALLOC_UNIT + 1;
+            dst_room = ((ptr_uint_t)(new_start + left - 1)) % ALLOC_UNIT + 1;
         } else {
-            /* FIXME optimize: set 4 aligned bytes at a time */
-            shadow_set_byte(new_pc, shadow_get_byte(pc));
-            pc++;
+            src_room = ALLOC_UNIT - ((ptr_uint_t)(old_start + done)) % ALLOC_UNIT;
+            dst_room = ALLOC_UNIT - ((ptr_uint_t)(new_start + done)) % ALLOC_UNIT;
         }
+        chunk = left;
+        if (chunk > src_room)
+            chunk = src_room;
+        if (chunk > dst_room)
+            chunk = dst_room;
+        src = backward ? old_start + left - chunk : old_start + done;
+        dst = backward ? new_start + left - chunk : new_start + done;
+        if (chunk == ALLOC_UNIT && ALIGNED(src, ALLOC_UNIT) && ALIGNED(dst, ALLOC_UNIT) &&
+            shadow_get_special(src, &val) &&
+            shadow_get_special(dst, NULL)) {
+            if (!shadow_set_special(dst, val)) {
+                /* a race and special was replaced w/ non-special: so re-do */
+                continue;
+            }
+        } else
+            shadow_copy_chunk(src, dst, chunk, backward);
+        done += chunk;
     }
 }
 
@@ -655,6 +1208,90 @@ shadow_dqword_name(uint dqword)
     return "<mixed>";
 }
 
+/* Returns non-zero if any shadow value packed into word fails to match.
+ * Values are 2-bit fields or, in MAP_4B_TO_1B mode, bytes holding 0-3:
+ * lomask selects the low bit of each value.  When negate is set, a
+ * value matches if it differs from val.
+ */
+static inline ptr_uint_t
+shadow_word_mismatch(ptr_uint_t word, ptr_uint_t lomask, uint val, bool negate)
+{
+    ptr_uint_t lo = word & lomask;
+    ptr_uint_t hi = (word >> 1) & lomask;
+    ptr_uint_t eq = (TEST(1, val) ? lo : (~lo & lomask)) &
+        (TEST(2, val) ? hi : (~hi & lomask));
+    return negate ? eq : (eq ^ lomask);
+}
+
+/* Returns the length of the longest prefix of [start, start+size) whose
+ * shadow values all equal val, or if negate is set, all differ from val.
+ * Special blocks are skipped in one step and private blocks are scanned a
+ * pointer-sized word of shadow (16 or 32 app bytes) at a time, so callers
+ * only need per-byte handling from the first non-matching byte onward.
+ */
+size_t
+shadow_prefix_matching(app_pc start, size_t size, uint val, bool negate)
+{
+    app_pc pc = start, end = start + size;
+    ptr_uint_t lomask = MAP_4B_TO_1B ? (ptr_uint_t)0x0101010101010101ULL :
+        (ptr_uint_t)0x5555555555555555ULL;
+    ASSERT(val <= 3, "invalid shadow value");
+    ASSERT(end > start, "invalid param");
+    while (pc < end) {
+        shadow_block_t *block;
+        if (!ALIGNED(pc, 4) || end - pc < 4) {
+            uint byteval = shadow_get_byte(pc);
+            if ((byteval == val) == negate)
+                break;
+            pc++;
+            continue;
+        }
+        block = get_shadow_table(pc);
+        if (block_is_special(block)) {
+            uint blockval = shadow_get_byte(pc);
+            app_pc block_end = (app_pc) ALIGN_FORWARD(pc + 1, ALLOC_UNIT);
+            if ((blockval == val) == negate)
+                break;
+            if (block_end <= pc /* overflow */ || block_end > end)
+                block_end = end;
+            pc = block_end;
+        } else {
+            byte *base = (byte *)(*block);
+            byte *shadow = base + BLOCK_AS_BYTE_ARRAY_IDX(((ptr_uint_t)pc) % ALLOC_UNIT);
+            byte *limit = base + sizeof(*block);
+            byte *scan_start = shadow;
+            if ((size_t)(limit - shadow) > (size_t)(end - pc) / 4)
+                limit = shadow + (end - pc) / 4;
+            /* each shadow byte covers 4 app bytes in both shadow modes */
+            while (shadow < limit && !ALIGNED(shadow, sizeof(ptr_uint_t)) &&
+                   shadow_word_mismatch(*shadow, lomask & 0xff, val, negate) == 0)
+                shadow++;
+            if (ALIGNED(shadow, sizeof(ptr_uint_t))) {
+                while (shadow + sizeof(ptr_uint_t) <= limit &&
+                       shadow_word_mismatch(*(ptr_uint_t *)shadow, lomask,
+                                            val, negate) == 0)
+                    shadow += sizeof(ptr_uint_t);
+                while (shadow < limit &&
+                       shadow_word_mismatch(*shadow, lomask & 0xff, val, negate) == 0)
+                    shadow++;
+            }
+            pc += (shadow - scan_start) * 4;
+            if (shadow < limit) {
+                /* the mismatch is within these 4 app bytes */
+                uint i;
+                for (i = 0; i < 4; i++, pc++) {
+                    uint byteval = shadow_get_byte(pc);
+                    if ((byteval == val) == negate)
+                        break;
+                }
+                ASSERT(i < 4, "shadow word scan inconsistent with per-byte value");
+                break;
+            }
+        }
+    }
+    return pc - start;
+}
+
 /* Compares every byte in [start, start+size) to expect.
  * Stops and returns the pc of the first non-matching value.
  * If all bytes match, returns start+size.
@@ -671,6 +1308,9 @@ shadow_check_range(app_pc start, size_t size, uint expect,
     size_t incr;
     ASSERT(expect <= 4, "invalid shadow value");
     ASSERT(start+size > start, "invalid param");
+    /* skip the matching prefix a word of shadow at a time */
+    if (expect <= 3)
+        pc += shadow_prefix_matching(start, size, expect, false);
     while (pc < start+size) {
         if (!ALIGNED(pc, 16)) {
             val = shadow_get_byte(pc);
@@ -678,7 +1318,7 @@ shadow_check_range(app_pc start, size_t size, uint expect,
         } else if (shadow_get_special(pc, &val)) {
             incr = ALLOC_UNIT - (pc - (app_pc)ALIGN_BACKWARD(pc, ALLOC_UNIT));
         } else {
-            shadow_block_t *block = get_shadow_table(TABLE_IDX(pc));
+            shadow_block_t *block = get_shadow_table(pc);
             val = bitmapx2_dword(*block, ((ptr_uint_t)pc) % ALLOC_UNIT);
             val = dqword_to_val(val);
             if (val == UINT_MAX) {
@@ -755,7 +1395,7 @@ shadow_next_dword(app_pc start, app_pc end, uint expect)
     ASSERT(expect <= 4, "invalid shadow value");
     ASSERT(ALIGNED(start, 4), "invalid start pc");
     while (pc < end) {
-        shadow_block_t *block = get_shadow_table(TABLE_IDX(pc));
+        shadow_block_t *block = get_shadow_table(pc);
         LOG(5, "shadow_next_dword: checking "PFX"\n", pc);
         if (block_is_special(block)) {
             uint blockval = shadow_get_byte(pc);
@@ -798,7 +1438,7 @@ shadow_prev_dword(app_pc start, app_pc end, uint expect)
     ASSERT(ALIGNED(start, 4), "invalid start pc");
     ASSERT(end < start, "invalid end pc");
     while (pc > end) {
-        shadow_block_t *block = get_shadow_table(TABLE_IDX(pc));
+        shadow_block_t *block = get_shadow_table(pc);
         LOG(5, "shadow_prev_dword: checking "PFX"\n", pc);
         if (block_is_special(block)) {
             uint blockval = shadow_get_byte(pc);
@@ -830,6 +1470,11 @@ shadow_prev_dword(app_pc start, app_pc end, uint expect)
     return NULL;
 }
 
+#ifdef X64
+static opnd_t
+opnd_create_shadow_xl8_slot(opnd_size_t opsz);
+#endif
+
 /* Caller does a lea or equivalent:
  *   0x4d1cd047  8d 8e 84 00 00 00    lea    0x00000084(%esi) -> %ecx
  * And this routine adds:
@@ -838,12 +1483,57 @@ shadow_prev_dword(app_pc start, app_pc end, uint expect)
  *   0x4d1cd052  c1 e9 02             shr    $0x00000002 %ecx -> %ecx
  *   0x4d1cd055  03 0c 95 40 26 96 73 add    0x73962640(,%edx,4) %ecx -> %ecx
  * And now the shadow addr is in %ecx.
+ *
+ * For 64-bit we walk the directory, parking the app address in a TLS slot
+ * since we only have one scratch register:
+ *   mov    %rcx -> %gs:slot
+ *   mov    %rcx -> %rdx
+ *   shr    $0x20 %rdx -> %rdx
+ *   movzx  %dx -> %edx
+ *   mov    shadow_dir(,%rdx,8) -> %rdx
+ *   shr    $0x10 %ecx -> %ecx
+ *   mov    (%rdx,%rcx,8) -> %rdx
+ *   mov    %gs:slot -> %ecx
+ *   shr    $0x02 %rcx -> %rcx
+ *   add    %rdx %rcx -> %rcx
  */
 void
 shadow_gen_translation_addr(void *drcontext, instrlist_t *bb, instr_t *inst,
                             reg_id_t addr_reg, reg_id_t scratch_reg)
 {
     uint disp;
+#ifdef X64
+    reg_id_t addr_32 = reg_64_to_32(addr_reg);
+    reg_id_t scratch_32 = reg_64_to_32(scratch_reg);
+    PRE(bb, inst, INSTR_CREATE_mov_st
+        (drcontext, opnd_create_shadow_xl8_slot(OPSZ_PTR), opnd_create_reg(addr_reg)));
+    PRE(bb, inst, INSTR_CREATE_mov_ld
+        (drcontext, opnd_create_reg(scratch_reg), opnd_create_reg(addr_reg)));
+    PRE(bb, inst, INSTR_CREATE_shr
+        (drcontext, opnd_create_reg(scratch_reg), OPND_CREATE_INT8(32)));
+    /* see DIR_IDX: keeps non-canonical addresses inside the directory */
+    PRE(bb, inst, INSTR_CREATE_movzx
+        (drcontext, opnd_create_reg(scratch_32),
+         opnd_create_reg(reg_32_to_16(scratch_32))));
+    ASSERT_TRUNCATE(disp, uint, (ptr_uint_t)shadow_dir);
+    disp = (uint)(ptr_uint_t)shadow_dir;
+    PRE(bb, inst, INSTR_CREATE_mov_ld
+        (drcontext, opnd_create_reg(scratch_reg), opnd_create_base_disp
+         (REG_NULL, scratch_reg, sizeof(ptr_int_t), disp, OPSZ_PTR)));
+    /* A 32-bit shift zeroes the top half, leaving the table index */
+    PRE(bb, inst, INSTR_CREATE_shr
+        (drcontext, opnd_create_reg(addr_32), OPND_CREATE_INT8(SHADOW_SPLIT_BITS)));
+    PRE(bb, inst, INSTR_CREATE_mov_ld
+        (drcontext, opnd_create_reg(scratch_reg), opnd_create_base_disp
+         (scratch_reg, addr_reg, sizeof(ptr_int_t), 0, OPSZ_PTR)));
+    /* Displacements are relative to the low 32 bits of the address */
+    PRE(bb, inst, INSTR_CREATE_mov_ld
+        (drcontext, opnd_create_reg(addr_32), opnd_create_shadow_xl8_slot(OPSZ_4)));
+    PRE(bb, inst, INSTR_CREATE_shr
+        (drcontext, opnd_create_reg(addr_reg), OPND_CREATE_INT8(2)));
+    PRE(bb, inst, INSTR_CREATE_add
+        (drcontext, opnd_create_reg(addr_reg), opnd_create_reg(scratch_reg)));
+#else
     /* Shadow table stores displacement so we want copy of whole addr */
     PRE(bb, inst, INSTR_CREATE_mov_ld
         (drcontext, opnd_create_reg(scratch_reg), opnd_create_reg(addr_reg)));
@@ -869,6 +1559,7 @@ shadow_gen_translation_addr(void *drcontext, instrlist_t *bb, instr_t *inst,
     PRE(bb, inst, INSTR_CREATE_add
         (drcontext, opnd_create_reg(addr_reg), opnd_create_base_disp
          (REG_NULL, scratch_reg, 4, disp, OPSZ_PTR)));
+#endif
 }
 
 /***************************************************************************
@@ -1377,6 +2068,10 @@ typedef struct _shadow_registers_t {
     /* Used for PR 578892.  Should remain a very small integer so byte is fine. */
     byte in_heap_routine;
     byte padding[2];
+# ifdef X64
+    /* Holds the app address during shadow_gen_translation_addr() */
+    reg_t xl8_scratch;
+# endif
 #else
     /* Avoid empty struct.  FIXME: this is a waste of a tls slot */
     void *bogus;
@@ -1416,6 +2111,18 @@ opnd_create_shadow_eflags_slot(void)
          false, true, false);
 }
 
+#ifdef X64
+static opnd_t
+opnd_create_shadow_xl8_slot(opnd_size_t opsz)
+{
+    ASSERT(options.shadowing, "incorrectly called");
+    return opnd_create_far_base_disp_ex
+        (SEG_GS, REG_NULL, REG_NULL, 1, tls_shadow_base +
+         offsetof(shadow_registers_t, xl8_scratch), opsz,
+         false, true, false);
+}
+#endif
+
 /* Opnd to acquire in_heap_routine TLS counter. Used for PR 578892. */
 opnd_t
 opnd_create_shadow_inheap_slot(void)
@@ -1641,17 +2348,245 @@ is_shadow_register_defined(byte val)
 }
 #endif /* TOOL_DR_MEMORY */
 
+/***************************************************************************/
+#ifdef DEBUG_UNIT_TEST
+
+/* Checks shadow_copy_range against byte-at-a-time copying with memmove
+ * semantics, over every mix of source and target sub-dword alignment,
+ * overlapping in both directions or not, within and across shadow blocks.
+ */
+static void
+shadow_copy_range_unit_test(void)
+{
+    static const size_t sizes[] = { 1, 3, 4, 7, 16, 61, 256, ALLOC_UNIT + 37 };
+    static const int deltas[] = { -9, -5, -4, -3, -1, 1, 2, 3, 4, 5, 8, 9, 0 };
+    size_t region_sz = 5*ALLOC_UNIT;
+    byte *region = nonheap_alloc(region_sz, DR_MEMPROT_READ, HEAPSTAT_MISC);
+    app_pc base = (app_pc) ALIGN_FORWARD(region, ALLOC_UNIT);
+    byte *expect = global_alloc(ALLOC_UNIT * 2, HEAPSTAT_MISC);
+    uint seed = 1, val;
+    uint s, d, o;
+    size_t i;
+    if (MAP_4B_TO_1B) {
+        /* per-byte values only exist in 2-bit mode */
+        goto unit_test_done;
+    }
+
+    /* a whole special unit is propagated without allocating */
+    shadow_set_range(base, base + ALLOC_UNIT, SHADOW_UNDEFINED);
+    shadow_copy_range(base, base + 3*ALLOC_UNIT, ALLOC_UNIT);
+    if (!shadow_get_special(base + 3*ALLOC_UNIT, &val) || val != SHADOW_UNDEFINED)
+        ASSERT(false, "special unit not propagated");
+
+    for (s = 0; s < sizeof(sizes)/sizeof(sizes[0]); s++) {
+        for (o = 0; o < 8; o++) {
+            for (d = 0; d < sizeof(deltas)/sizeof(deltas[0]); d++) {
+                size_t size = sizes[s];
+                app_pc src = base + ALLOC_UNIT - 100 + o;
+                /* a delta of 0 stands for a distant, non-overlapping target */
+                app_pc dst = (deltas[d] == 0) ? base + 2*ALLOC_UNIT + 200 + o/2 :
+                    src + deltas[d];
+                uint before, after;
+                for (i = 0; i < size; i++) {
+                    seed = seed * 1103515245 + 12345;
+                    shadow_set_byte(dst + i, (seed >> 16) % 4);
+                }
+                for (i = 0; i < size; i++) {
+                    seed = seed * 1103515245 + 12345;
+                    /* mostly runs of one value, like real shadow */
+                    shadow_set_byte(src + i, (i % 32 < 16) ? SHADOW_DEFINED :
+                                    (seed >> 16) % 4);
+                }
+                for (i = 0; i < size; i++)
+                    expect[i] = (byte) shadow_get_byte(src + i);
+                before = shadow_get_byte(dst - 1);
+                after = shadow_get_byte(dst + size);
+                shadow_copy_range(src, dst, size);
+                for (i = 0; i < size; i++) {
+                    if (shadow_get_byte(dst + i) != expect[i]) {
+                        LOG(1, "shadow copy "PFX"->"PFX" size "PIFX": byte "PIFX
+                            " is %d not %d\n", src, dst, size, i,
+                            shadow_get_byte(dst + i), expect[i]);
+                        ASSERT(false, "shadow_copy_range mismatch");
+                        break;
+                    }
+                }
+                if (shadow_get_byte(dst - 1) != before ||
+                    shadow_get_byte(dst + size) != after)
+                    ASSERT(false, "shadow_copy_range wrote outside its target");
+            }
+        }
+    }
+    LOG(1, "shadow_copy_range unit test passed\n");
+
+ unit_test_done:
+    shadow_set_range(base, base + 4*ALLOC_UNIT, SHADOW_UNADDRESSABLE);
+    global_free(expect, ALLOC_UNIT * 2, HEAPSTAT_MISC);
+    nonheap_free(region, region_sz, HEAPSTAT_MISC);
+}
+
+/* Returns whether the whole unit at base is unallocated, so that we can
+ * write its shadow without clobbering the app's.
+ */
+static bool
+unit_test_unit_is_free(app_pc base)
+{
+    dr_mem_info_t info;
+    return (dr_query_memory_ex(base, &info) && info.type == DR_MEMTYPE_FREE &&
+            info.base_pc + info.size >= base + ALLOC_UNIT);
+}
+
+/* Checks the shadow table lookups for units at the same offset in several
+ * 4GB regions (on X64, in several directory tables), and times
+ * shadow_translation_addr() over them: compare a 32-bit and a 64-bit build
+ * for the cost of the directory.
+ */
+static void
+shadow_table_unit_test(void)
+{
+#define UNIT_TEST_UNITS 4
+#define UNIT_TEST_LOOKUPS (4*1024*1024)
+#ifdef X64
+    static const ptr_uint_t slots[UNIT_TEST_UNITS] = { 0x10, 0x11, 0x200, 0x7ff0 };
+    /* kernel addresses share the unaddressable table */
+    app_pc kernel = (app_pc) 0xffff800012340000;
+#endif
+    app_pc units[UNIT_TEST_UNITS];
+    uint i, j, num = 0;
+    uint64 start;
+    ptr_uint_t sum = 0;
+    for (i = 0; i < UNIT_TEST_UNITS; i++) {
+#ifdef X64
+        app_pc base = (app_pc) (ADDR_OF_DIR_BASE(slots[i]) + 0x12340000);
+#else
+        app_pc base = (app_pc) (0x12340000 + i*ALLOC_UNIT);
+#endif
+        if (unit_test_unit_is_free(base))
+            units[num++] = base;
+        else
+            LOG(1, "shadow table unit test: skipping allocated unit "PFX"\n", base);
+    }
+
+    for (i = 0; i < num; i++) {
+        if (!block_is_special(get_shadow_table(units[i])) ||
+            shadow_get_byte(units[i] + i*8) != SHADOW_UNADDRESSABLE)
+            ASSERT(false, "free unit is not unaddressable");
+        IF_X64(ASSERT(shadow_dir[DIR_IDX(units[i])] == shadow_table_unaddr,
+                      "untouched region has a private table");)
+        /* privatizes the unit (and on X64 its region's table) */
+        shadow_set_byte(units[i] + i*8, SHADOW_DEFINED);
+        IF_X64(ASSERT(shadow_dir[DIR_IDX(units[i])] != shadow_table_unaddr,
+                      "written region has no private table");)
+    }
+    for (i = 0; i < num; i++) {
+        shadow_block_t *block = get_shadow_table(units[i]);
+        ASSERT(!block_is_special(block), "written unit has no private block");
+        for (j = 0; j < num; j++) {
+            /* the other units' writes were at the same offsets in their regions */
+            uint expect = (i == j) ? SHADOW_DEFINED : SHADOW_UNADDRESSABLE;
+            byte *xl8 = shadow_translation_addr(units[i] + j*8);
+            if (shadow_get_byte(units[i] + j*8) != expect)
+                ASSERT(false, "shadow write leaked into another region");
+            if (xl8 < (byte *)block || xl8 >= (byte *)block + sizeof(*block))
+                ASSERT(false, "translation is outside the unit's block");
+        }
+    }
+#ifdef X64
+    ASSERT(shadow_dir[DIR_IDX(kernel)] == shadow_table_unaddr &&
+           shadow_get_byte(kernel) == SHADOW_UNADDRESSABLE,
+           "kernel address does not read as unaddressable");
+#endif
+
+    if (num > 0) {
+        start = dr_get_milliseconds();
+        for (i = 0; i < UNIT_TEST_LOOKUPS; i++) {
+            app_pc addr = units[i % num] + (i * 4) % ALLOC_UNIT;
+            sum += (ptr_uint_t) shadow_translation_addr(addr);
+        }
+        LOG(1, "shadow table unit test: %d lookups over %d regions in "
+            UINT64_FORMAT_STRING" ms (checksum "PIFX")\n", UNIT_TEST_LOOKUPS, num,
+            dr_get_milliseconds() - start, sum);
+    }
+    LOG(1, "shadow table unit test passed\n");
+
+    for (i = 0; i < num; i++)
+        shadow_set_range(units[i], units[i] + ALLOC_UNIT, SHADOW_UNADDRESSABLE);
+#undef UNIT_TEST_UNITS
+#undef UNIT_TEST_LOOKUPS
+}
+
+/* Fills a region with mixed shadow values, which gives each of its units a
+ * private block, and then clears it: the blocks must be retired as the
+ * region is cleared and freed by the next sweep.
+ */
+static void
+shadow_reclaim_unit_test(void)
+{
+#define UNIT_TEST_RECLAIM_UNITS 4
+    size_t region_sz = (UNIT_TEST_RECLAIM_UNITS + 1) * ALLOC_UNIT;
+    byte *region;
+    app_pc start, pc;
+    uint i;
+#ifdef STATISTICS
+    uint retired_before = shadow_block_retired;
+    uint freed_before = shadow_block_free;
+#endif
+    if (!options.reclaim_shadow)
+        return;
+    region = nonheap_alloc(region_sz, DR_MEMPROT_READ|DR_MEMPROT_WRITE, HEAPSTAT_MISC);
+    start = (app_pc) ALIGN_FORWARD(region, ALLOC_UNIT);
+    for (i = 0; i < UNIT_TEST_RECLAIM_UNITS; i++) {
+        pc = start + i*ALLOC_UNIT;
+        shadow_set_range(pc, pc + ALLOC_UNIT, SHADOW_DEFINED);
+        shadow_set_byte(pc + ALLOC_UNIT/2, SHADOW_UNDEFINED);
+        ASSERT(!block_is_special(get_shadow_table(pc)), "mixed unit is special");
+    }
+    /* clear one unit piecemeal, which only a sweep reclaims */
+    shadow_set_range(start, start + ALLOC_UNIT/2, SHADOW_UNADDRESSABLE);
+    shadow_set_range(start + ALLOC_UNIT/2, start + ALLOC_UNIT, SHADOW_UNADDRESSABLE);
+    ASSERT(!block_is_special(get_shadow_table(start)), "partial clear reclaimed");
+    shadow_set_range(start + ALLOC_UNIT, start + UNIT_TEST_RECLAIM_UNITS*ALLOC_UNIT,
+                     SHADOW_UNADDRESSABLE);
+    for (i = 1; i < UNIT_TEST_RECLAIM_UNITS; i++) {
+        ASSERT(get_shadow_table(start + i*ALLOC_UNIT) ==
+               val_to_special(SHADOW_UNADDRESSABLE), "cleared unit not reclaimed");
+    }
+
+    /* the first sweep retires the piecemeal unit and advances the epoch;
+     * with no threads registered yet, the second frees all four blocks
+     */
+    dr_mutex_lock(shadow_lock);
+    shadow_reclaim_sweep();
+    ASSERT(get_shadow_table(start) == val_to_special(SHADOW_UNADDRESSABLE),
+           "sweep did not reclaim unit");
+    shadow_reclaim_sweep();
+    ASSERT(retired_blocks == NULL, "retired blocks not freed");
+    dr_mutex_unlock(shadow_lock);
+#ifdef STATISTICS
+    ASSERT(shadow_block_retired - retired_before == UNIT_TEST_RECLAIM_UNITS &&
+           shadow_block_free - freed_before == UNIT_TEST_RECLAIM_UNITS,
+           "reclaim counters are off");
+#endif
+    LOG(1, "shadow reclaim unit test passed\n");
+    nonheap_free(region, region_sz, HEAPSTAT_MISC);
+#undef UNIT_TEST_RECLAIM_UNITS
+}
+
+#endif /* DEBUG_UNIT_TEST */
+
 /***************************************************************************/
 
 void
 shadow_thread_init(void *drcontext)
 {
     shadow_registers_thread_init(drcontext);
+    shadow_reclaim_thread_init(drcontext);
 }
 
 void
 shadow_thread_exit(void *drcontext)
 {
+    shadow_reclaim_thread_exit(drcontext);
     shadow_registers_thread_exit(drcontext);
 }
 
@@ -1661,6 +2596,15 @@ shadow_init(void)
     ASSERT(options.shadowing, "shadowing disabled");
     shadow_registers_init();
     shadow_table_init();
+    if (options.reclaim_shadow) {
+        tls_idx_reclaim = drmgr_register_tls_field();
+        ASSERT(tls_idx_reclaim > -1, "failed to reserve TLS slot");
+    }
+#ifdef DEBUG_UNIT_TEST
+    shadow_copy_range_unit_test();
+    shadow_table_unit_test();
+    shadow_reclaim_unit_test();
+#endif
 }
 
 void
@@ -1668,5 +2612,14 @@ shadow_exit(void)
 {
     shadow_registers_exit();
     shadow_table_exit();
+    if (options.reclaim_shadow) {
+        /* threads whose exit event we did not see */
+        while (reclaim_threads != NULL) {
+            reclaim_thread_t *next = reclaim_threads->next;
+            global_free(reclaim_threads, sizeof(*reclaim_threads), HEAPSTAT_SHADOW);
+            reclaim_threads = next;
+        }
+        drmgr_unregister_tls_field(tls_idx_reclaim);
+    }
 }
 
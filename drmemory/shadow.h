@@ -104,7 +104,13 @@ const char *shadow_dqword_name(uint dqword);
 
 #ifdef STATISTICS
 extern uint shadow_block_alloc;
+# ifdef X64
+extern uint shadow_table_alloc;
+# endif
 extern uint shadow_block_free;
+extern uint shadow_block_retired;
+extern uint shadow_block_reinstated;
+extern uint shadow_reclaim_sweeps;
 extern uint num_special_unaddressable;
 extern uint num_special_undefined;
 extern uint num_special_defined;
@@ -125,6 +131,19 @@ shadow_thread_init(void *drcontext);
 void
 shadow_thread_exit(void *drcontext);
 
+/* Marks a point where this thread holds no shadow translation, such as
+ * slowpath entry, so shadow blocks retired before it may be freed.
+ * sp is the app stack pointer.
+ */
+void
+shadow_thread_quiescent(void *drcontext, app_pc sp);
+
+/* Marks the thread as entering or leaving a syscall during which it is
+ * quiescent.  Only pass true for syscalls that reach the post-syscall event.
+ */
+void
+shadow_thread_in_syscall(void *drcontext, bool in_syscall);
+
 size_t
 get_shadow_block_size(void);
 
@@ -180,6 +199,13 @@ shadow_copy_range(app_pc old_start, app_pc new_start, size_t size);
 void
 shadow_set_non_matching_range(app_pc start, size_t size, uint val, uint val_not);
 
+/* Returns the length of the longest prefix of [start, start+size) whose
+ * shadow values all equal val, or if negate is set, all differ from val.
+ * Scans special blocks in one step and private blocks a word at a time.
+ */
+size_t
+shadow_prefix_matching(app_pc start, size_t size, uint val, bool negate);
+
 /* Compares every byte in [start, start+size) to expect.
  * start must be 16-byte aligned.
  * Stops and returns the pc of the first non-matching value.
@@ -35,7 +35,6 @@
 #include "alloc_drmem.h"
 
 #ifdef STATISTICS
-uint adjust_esp_executions;
 uint adjust_esp_fastpath;
 uint stack_swaps;
 uint stack_swap_triggers;
@@ -282,6 +281,10 @@ typedef enum {
 static byte *shared_esp_slowpath_shadow;
 static byte *shared_esp_slowpath_defined;
 static byte *shared_esp_slowpath_zero;
+/* For lean_routines_relocatable(): indexed by sp_action, these pop the pushed
+ * return address into edx and fall through into the entries above.
+ */
+static byte *shared_esp_slowpath_call[SP_ADJUST_ACTION_ZERO+1];
 /* Indexed by:
  * - sp_action
  * - eflags_live
@@ -346,7 +349,7 @@ handle_esp_adjust(esp_adjust_t type, reg_t val/*either relative delta, or absolu
     dr_mcontext_t mc; /* do not init whole thing: memset is expensive */
     mc.size = sizeof(mc);
     mc.flags = DR_MC_CONTROL; /* only need xsp */
-    STATS_INC(adjust_esp_executions);
+    STATS_SHARD_INC(adjust_esp_executions);
     dr_get_mcontext(drcontext, &mc);
     if (type == ESP_ADJUST_ABSOLUTE) {
         LOG(3, "esp adjust absolute esp="PFX" => "PFX"\n", mc.xsp, val);
@@ -511,15 +514,34 @@ generate_shared_esp_slowpath_helper(void *drcontext, instrlist_t *ilist, app_pc
     return pc;
 }
 
+static app_pc
+generate_shared_esp_slowpath_call(void *drcontext, instrlist_t *ilist, app_pc pc,
+                                  sp_adjust_action_t sp_action)
+{
+    if (!lean_routines_relocatable())
+        return pc;
+    shared_esp_slowpath_call[sp_action] = pc;
+    insert_lean_routine_entry(drcontext, ilist, opnd_create_reg(REG_EDX));
+    pc = instrlist_encode(drcontext, ilist, pc, false);
+    instrlist_clear(drcontext, ilist);
+    return pc;
+}
+
 app_pc
 generate_shared_esp_slowpath(void *drcontext, instrlist_t *ilist, app_pc pc)
 {
+    pc = generate_shared_esp_slowpath_call(drcontext, ilist, pc,
+                                           SP_ADJUST_ACTION_SHADOW);
     shared_esp_slowpath_shadow = pc;
     pc = generate_shared_esp_slowpath_helper(drcontext, ilist, pc,
                                              SP_ADJUST_ACTION_SHADOW);
+    pc = generate_shared_esp_slowpath_call(drcontext, ilist, pc,
+                                           SP_ADJUST_ACTION_DEFINED);
     shared_esp_slowpath_defined = pc;
     pc = generate_shared_esp_slowpath_helper(drcontext, ilist, pc,
                                              SP_ADJUST_ACTION_DEFINED);
+    pc = generate_shared_esp_slowpath_call(drcontext, ilist, pc,
+                                           SP_ADJUST_ACTION_ZERO);
     shared_esp_slowpath_zero = pc;
     pc = generate_shared_esp_slowpath_helper(drcontext, ilist, pc,
                                              SP_ADJUST_ACTION_ZERO);
@@ -709,15 +731,20 @@ instrument_esp_adjust_slowpath(void *drcontext, instrlist_t *bb, instr_t *inst,
         /* spill/xchg edx after, since if xchg can mess up arg's app values */
         insert_spill_or_restore(drcontext, bb, inst, &si2, true/*save*/, false);
         /* we don't need to negate here since handle_adjust_esp() does that */
-        PRE(bb, inst,
-            INSTR_CREATE_mov_st(drcontext, opnd_create_reg(REG_EDX),
-                                opnd_create_instr(retaddr)));
-        PRE(bb, inst, INSTR_CREATE_jmp
-            (drcontext, opnd_create_pc((sp_action == SP_ADJUST_ACTION_ZERO) ?
-                                       shared_esp_slowpath_zero :
-                                       ((sp_action == SP_ADJUST_ACTION_DEFINED) ?
-                                        shared_esp_slowpath_defined :
-                                        shared_esp_slowpath_shadow))));
+        if (lean_routines_relocatable()) {
+            insert_lean_routine_call(drcontext, bb, inst,
+                                     &shared_esp_slowpath_call[sp_action]);
+        } else {
+            PRE(bb, inst,
+                INSTR_CREATE_mov_st(drcontext, opnd_create_reg(REG_EDX),
+                                    opnd_create_instr(retaddr)));
+            PRE(bb, inst, INSTR_CREATE_jmp
+                (drcontext, opnd_create_pc((sp_action == SP_ADJUST_ACTION_ZERO) ?
+                                           shared_esp_slowpath_zero :
+                                           ((sp_action == SP_ADJUST_ACTION_DEFINED) ?
+                                            shared_esp_slowpath_defined :
+                                            shared_esp_slowpath_shadow))));
+        }
         PRE(bb, inst, retaddr);
         insert_spill_or_restore(drcontext, bb, inst, &si2, false/*restore*/, false);
         insert_spill_or_restore(drcontext, bb, inst, &si1, false/*restore*/, false);
@@ -1026,19 +1053,25 @@ instrument_esp_adjust_fastpath(void *drcontext, instrlist_t *bb, instr_t *inst,
          */
         insert_spill_or_restore(drcontext, bb, inst, &mi.reg2, true/*save*/, false);
         
-        PRE(bb, inst,
-            INSTR_CREATE_mov_st(drcontext, opnd_create_reg(REG_EDX),
-                                opnd_create_instr(retaddr)));
         ASSERT(type >= ESP_ADJUST_FAST_FIRST &&
                type <= ESP_ADJUST_FAST_LAST, "invalid type for esp fastpath");
         ASSERT(sp_action <= SP_ADJUST_ACTION_FASTPATH_MAX, "sp_action OOB");
-        PRE(bb, inst,
-            INSTR_CREATE_jmp(drcontext,
-                             opnd_create_pc(shared_esp_fastpath
-                                            [sp_action]
-                                            /* don't trust true always being 1 */
-                                            [eflags_live ? 1 : 0]
-                                            [type])));
+        if (lean_routines_relocatable()) {
+            insert_lean_routine_call(drcontext, bb, inst,
+                                     &shared_esp_fastpath[sp_action]
+                                     [eflags_live ? 1 : 0][type]);
+        } else {
+            PRE(bb, inst,
+                INSTR_CREATE_mov_st(drcontext, opnd_create_reg(REG_EDX),
+                                    opnd_create_instr(retaddr)));
+            PRE(bb, inst,
+                INSTR_CREATE_jmp(drcontext,
+                                 opnd_create_pc(shared_esp_fastpath
+                                                [sp_action]
+                                                /* don't trust true always being 1 */
+                                                [eflags_live ? 1 : 0]
+                                                [type])));
+        }
         PRE(bb, inst, retaddr);
     }
 
@@ -1614,7 +1647,8 @@ generate_shared_esp_fastpath(void *drcontext, instrlist_t *ilist, app_pc pc)
     /* PR 447537: adjust_esp's shared fastpath
      * On entry:
      *   - ecx holds the val arg
-     *   - edx holds the return address
+     *   - edx holds the return address, or for lean_routines_relocatable()
+     *     it is pushed on the stack
      * Uses slot5 and slot6.
      * We have multiple versions for {sp_action,eflags,adjust-type}.
      */
@@ -1627,6 +1661,7 @@ generate_shared_esp_fastpath(void *drcontext, instrlist_t *ilist, app_pc pc)
         for (eflags_live = 0; eflags_live < 2; eflags_live++) {
             for (type = ESP_ADJUST_FAST_FIRST; type <= ESP_ADJUST_FAST_LAST; type++) {
                 shared_esp_fastpath[sp_action][eflags_live][type] = pc;
+                insert_lean_routine_entry(drcontext, ilist, opnd_create_reg(REG_EDX));
                 generate_shared_esp_fastpath_helper
                     (drcontext, ilist, eflags_live, sp_action, type);
                 pc = instrlist_encode(drcontext, ilist, pc, true);
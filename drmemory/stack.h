@@ -30,7 +30,6 @@
 #include "fastpath.h"
 
 #ifdef STATISTICS
-extern uint adjust_esp_executions;
 extern uint adjust_esp_fastpath;
 extern uint stack_swaps;
 extern uint stack_swap_triggers;
@@ -1018,6 +1018,20 @@ get_sysinfo(int *sysnum IN OUT, cls_syscall_t *pt)
     return sysinfo;
 }
 
+/* Whether DR will call the post-syscall event for sysnum: not for syscalls
+ * that transfer control elsewhere.  Those that exit are fine either way.
+ */
+static bool
+syscall_reaches_post(int sysnum)
+{
+#ifdef LINUX
+    return !(sysnum == SYS_rt_sigreturn IF_X86_32(|| sysnum == SYS_sigreturn));
+#else
+    return !(sysnum == sysnum_continue || sysnum == sysnum_cbret ||
+             sysnum == sysnum_setcontext || sysnum == sysnum_RaiseException);
+#endif
+}
+
 static bool
 event_pre_syscall(void *drcontext, int sysnum)
 {
@@ -1029,6 +1043,8 @@ event_pre_syscall(void *drcontext, int sysnum)
     mc.size = sizeof(mc);
     mc.flags = DR_MC_CONTROL|DR_MC_INTEGER; /* don't need xmm */
     dr_get_mcontext(drcontext, &mc);
+    if (options.shadowing)
+        shadow_thread_quiescent(drcontext, (app_pc)mc.xsp);
 
 #ifdef STATISTICS
     /* XXX: we could dynamically allocate entries and separate secondary syscalls */
@@ -1123,6 +1139,9 @@ event_pre_syscall(void *drcontext, int sysnum)
         driver_pre_syscall(drcontext, sysnum);
 #endif
 
+    /* while blocked in the syscall we hold no shadow translations */
+    if (options.shadowing && res && syscall_reaches_post(sysnum))
+        shadow_thread_in_syscall(drcontext, true);
     return res;
 }
 
@@ -1134,6 +1153,8 @@ event_post_syscall(void *drcontext, int sysnum)
     mc.size = sizeof(mc);
     mc.flags = DR_MC_CONTROL|DR_MC_INTEGER; /* don't need xmm */
     dr_get_mcontext(drcontext, &mc);
+    if (options.shadowing)
+        shadow_thread_in_syscall(drcontext, false);
 
 #ifdef SYSCALL_DRIVER
     /* do this as early as possible to avoid drmem's own syscalls.
@@ -164,46 +164,81 @@ hash_free(void *ptr, size_t size)
 #define HASH_FUNC_BITS(val, num_bits) ((val) & (HASH_MASK(num_bits)))
 #define HASH_FUNC(val, mask) ((val) & (mask))
 
+/* Shared by hashtable_t and ohashtable_t: returns the full, untruncated hash */
 static uint
-hash_key(hashtable_t *table, void *key)
+hash_key_full(hash_type_t hashtype, uint (*hash_key_func)(void*), void *key)
 {
     uint hash = 0;
-    if (table->hash_key_func != NULL) {
-        hash = table->hash_key_func(key);
-    } else if (table->hashtype == HASH_STRING || table->hashtype == HASH_STRING_NOCASE) {
+    if (hash_key_func != NULL) {
+        hash = hash_key_func(key);
+    } else if (hashtype == HASH_STRING || hashtype == HASH_STRING_NOCASE) {
         const char *s = (const char *) key;
         char c;
         for (c = *s; c != '\0'; c = *(s++)) {
-            if (table->hashtype == HASH_STRING_NOCASE)
+            if (hashtype == HASH_STRING_NOCASE)
                 c = (char) tolower(c);
             hash ^= (c << (((s - (const char *)key) %4) * 8));
         }
     } else {
         /* HASH_INTPTR, or fallback for HASH_CUSTOM in release build */
-        ASSERT(table->hashtype == HASH_INTPTR,
+        ASSERT(hashtype == HASH_INTPTR,
                "hashtable.c hash_key internal error: invalid hash type");
         hash = (uint)(ptr_uint_t) key;
     }
+    return hash;
+}
+
+static uint
+hash_key(hashtable_t *table, void *key)
+{
+    uint hash = hash_key_full(table->hashtype, table->hash_key_func, key);
     return HASH_FUNC_BITS(hash, table->table_bits);
 }
 
+/* Shared by hashtable_t and ohashtable_t */
 static bool
-keys_equal(hashtable_t *table, void *key1, void *key2)
+keys_equal_full(hash_type_t hashtype, bool (*cmp_key_func)(void*, void*),
+                void *key1, void *key2)
 {
-    if (table->cmp_key_func != NULL)
-        return table->cmp_key_func(key1, key2);
-    else if (table->hashtype == HASH_STRING)
+    if (cmp_key_func != NULL)
+        return cmp_key_func(key1, key2);
+    else if (hashtype == HASH_STRING)
         return strcmp((const char *) key1, (const char *) key2) == 0;
-    else if (table->hashtype == HASH_STRING_NOCASE)
+    else if (hashtype == HASH_STRING_NOCASE)
         return stri_eq((const char *) key1, (const char *) key2);
     else {
         /* HASH_INTPTR, or fallback for HASH_CUSTOM in release build */
-        ASSERT(table->hashtype == HASH_INTPTR,
+        ASSERT(hashtype == HASH_INTPTR,
                "hashtable.c keys_equal internal error: invalid hash type");
         return key1 == key2;
     }
 }
 
+static bool
+keys_equal(hashtable_t *table, void *key1, void *key2)
+{
+    return keys_equal_full(table->hashtype, table->cmp_key_func, key1, key2);
+}
+
+static void *
+key_dup(bool str_dup, void *key)
+{
+    if (str_dup) {
+        const char *s = (const char *) key;
+        void *dup = hash_alloc(strlen(s)+1);
+        strncpy((char *)dup, s, strlen(s)+1);
+        return dup;
+    }
+    return key;
+}
+
+static void
+key_free(bool str_dup, void *key)
+{
+    if (str_dup)
+        hash_free(key, strlen((const char *)key) + 1);
+}
+
 void
 hashtable_init_ex(hashtable_t *table, uint num_bits, hash_type_t hashtype, bool str_dup,
                   bool synch, void (*free_payload_func)(void*),
@@ -230,6 +265,7 @@ hashtable_init_ex(hashtable_t *table, uint num_bits, hash_type_t hashtype, bool
     table->config.size = sizeof(table->config);
     table->config.resizable = true;
     table->config.resize_threshold = 75;
+    table->config.read_lockfree = false;
 }
 
 void
@@ -525,12 +561,23 @@ hashtable_delete(hashtable_t *table)
  */
 
 static bool
-key_in_range(hashtable_t *table, hash_entry_t *he, ptr_uint_t start, size_t size)
+key_in_range(hash_type_t hashtype, void *key, ptr_uint_t start, size_t size)
 {
-    if (table->hashtype != HASH_INTPTR || size == 0)
+    if (hashtype != HASH_INTPTR || size == 0)
         return true;
     /* avoiding overflow by subtracting one */
-    return ((ptr_uint_t)he->key >= start && (ptr_uint_t)he->key <= (start + (size - 1)));
+    return ((ptr_uint_t)key >= start && (ptr_uint_t)key <= (start + (size - 1)));
+}
+
+/* Shared by hashtable_t and ohashtable_t: whether to persist this entry */
+static bool
+key_persistable(void *drcontext, void *perscxt, hash_type_t hashtype, void *key,
+                ptr_uint_t start, size_t size, hasthable_persist_flags_t flags)
+{
+    return ((!TEST(DR_HASHPERS_ONLY_IN_RANGE, flags) ||
+             key_in_range(hashtype, key, start, size)) &&
+            (!TEST(DR_HASHPERS_ONLY_PERSISTED, flags) ||
+             dr_fragment_persistable(drcontext, perscxt, key)));
 }
 
 static bool
@@ -539,6 +586,55 @@ hash_write_file(file_t fd, void *ptr, size_t sz)
     return (dr_write_file(fd, ptr, sz) == (ssize_t)sz);
 }
 
+/* Shared by hashtable_t and ohashtable_t */
+static size_t
+persist_size_from_count(uint count, size_t entry_size, hasthable_persist_flags_t flags)
+{
+    return sizeof(count) +
+        (TEST(DR_HASHPERS_REBASE_KEY, flags) ? sizeof(ptr_uint_t) : 0) +
+        count * (entry_size + sizeof(void*));
+}
+
+/* Shared by hashtable_t and ohashtable_t: writes the header */
+static bool
+persist_header(file_t fd, uint count, void *perscxt, hasthable_persist_flags_t flags,
+               ptr_uint_t *start OUT, size_t *size OUT)
+{
+    *start = 0;
+    *size = 0;
+    if (TEST(DR_HASHPERS_REBASE_KEY, flags) && perscxt == NULL)
+        return false; /* invalid params */
+    if (perscxt != NULL) {
+        *start = (ptr_uint_t) dr_persist_start(perscxt);
+        *size = dr_persist_size(perscxt);
+    }
+    if (!hash_write_file(fd, &count, sizeof(count)))
+        return false;
+    if (TEST(DR_HASHPERS_REBASE_KEY, flags)) {
+        if (!hash_write_file(fd, start, sizeof(*start)))
+            return false;
+    }
+    return true;
+}
+
+/* Shared by hashtable_t and ohashtable_t: writes one entry */
+static bool
+persist_entry(file_t fd, void *key, void *payload, size_t entry_size,
+              hasthable_persist_flags_t flags)
+{
+    if (!hash_write_file(fd, &key, sizeof(key)))
+        return false;
+    if (TEST(DR_HASHPERS_PAYLOAD_IS_POINTER, flags)) {
+        if (!hash_write_file(fd, payload, entry_size))
+            return false;
+    } else {
+        ASSERT(entry_size <= sizeof(void*), "inlined data too large");
+        if (!hash_write_file(fd, &payload, entry_size))
+            return false;
+    }
+    return true;
+}
+
 size_t
 hashtable_persist_size(void *drcontext, hashtable_t *table, size_t entry_size,
                        void *perscxt, hasthable_persist_flags_t flags)
@@ -558,10 +654,8 @@ hashtable_persist_size(void *drcontext, hashtable_t *table, size_t entry_size,
         for (i = 0; i < HASHTABLE_SIZE(table->table_bits); i++) {
             hash_entry_t *he;
             for (he = table->table[i]; he != NULL; he = he->next) {
-                if ((!TEST(DR_HASHPERS_ONLY_IN_RANGE, flags) ||
-                     key_in_range(table, he, start, size)) &&
-                    (!TEST(DR_HASHPERS_ONLY_PERSISTED, flags) ||
-                     dr_fragment_persistable(drcontext, perscxt, he->key)))
+                if (key_persistable(drcontext, perscxt, table->hashtype, he->key,
+                                    start, size, flags))
                     count++;
             }
         }
@@ -573,9 +667,7 @@ hashtable_persist_size(void *drcontext, hashtable_t *table, size_t entry_size,
      * hashtable_persist_size().
      */
     table->persist_count = count;
-    return sizeof(count) +
-        (TEST(DR_HASHPERS_REBASE_KEY, flags) ? sizeof(ptr_uint_t) : 0) +
-        count * (entry_size + sizeof(void*));
+    return persist_size_from_count(count, entry_size, flags);
 }
 
 bool
@@ -583,40 +675,20 @@ hashtable_persist(void *drcontext, hashtable_t *table, size_t entry_size,
                   file_t fd, void *perscxt, hasthable_persist_flags_t flags)
 {
     uint i;
-    ptr_uint_t start = 0;
-    size_t size = 0;
+    ptr_uint_t start;
+    size_t size;
     IF_DEBUG(uint count_check = 0;)
-    if (TEST(DR_HASHPERS_REBASE_KEY, flags) && perscxt == NULL)
-        return false; /* invalid params */
-    if (perscxt != NULL) {
-        start = (ptr_uint_t) dr_persist_start(perscxt);
-        size = dr_persist_size(perscxt);
-    }
-    if (!hash_write_file(fd, &table->persist_count, sizeof(table->persist_count)))
+    if (!persist_header(fd, table->persist_count, perscxt, flags, &start, &size))
         return false;
-    if (TEST(DR_HASHPERS_REBASE_KEY, flags)) {
-        if (!hash_write_file(fd, &start, sizeof(start)))
-            return false;
-    }
     /* synch is already provided */
     for (i = 0; i < HASHTABLE_SIZE(table->table_bits); i++) {
         hash_entry_t *he;
         for (he = table->table[i]; he != NULL; he = he->next) {
-            if ((!TEST(DR_HASHPERS_ONLY_IN_RANGE, flags) ||
-                 key_in_range(table, he, start, size)) &&
-                (!TEST(DR_HASHPERS_ONLY_PERSISTED, flags) ||
-                 dr_fragment_persistable(drcontext, perscxt, he->key))) {
+            if (key_persistable(drcontext, perscxt, table->hashtype, he->key,
+                                start, size, flags)) {
                 IF_DEBUG(count_check++;)
-                if (!hash_write_file(fd, &he->key, sizeof(he->key)))
+                if (!persist_entry(fd, he->key, he->payload, entry_size, flags))
                     return false;
-                if (TEST(DR_HASHPERS_PAYLOAD_IS_POINTER, flags)) {
-                    if (!hash_write_file(fd, he->payload, entry_size))
-                        return false;
-                } else {
-                    ASSERT(entry_size <= sizeof(void*), "inlined data too large");
-                    if (!hash_write_file(fd, &he->payload, entry_size))
-                        return false;
-                }
             }
         }
     }
@@ -624,14 +696,16 @@ hashtable_persist(void *drcontext, hashtable_t *table, size_t entry_size,
     return true;
 }
 
-/* Loads from disk and adds to table 
+/* Loads from disk and calls add_func (or process_payload if non-NULL)
+ * on each entry.  Shared by hashtable_t and ohashtable_t.
  * Note that clone should only be false for tables that do their own payload
  * freeing and can avoid freeing a payload in the mmap.
  */
-bool
-hashtable_resurrect(void *drcontext, byte **map INOUT, hashtable_t *table,
-                    size_t entry_size, void *perscxt, hasthable_persist_flags_t flags,
-                    bool (*process_payload)(void *key, void *payload, ptr_int_t shift))
+static bool
+resurrect_entries(byte **map INOUT, void *table, size_t entry_size, void *perscxt,
+                  hasthable_persist_flags_t flags,
+                  bool (*add_func)(void *table, void *key, void *payload),
+                  bool (*process_payload)(void *key, void *payload, ptr_int_t shift))
 {
     uint i;
     ptr_uint_t stored_start = 0;
@@ -668,8 +742,538 @@ hashtable_resurrect(void *drcontext, byte **map INOUT, hashtable_t *table,
         if (process_payload != NULL) {
             if (!process_payload(key, toadd, shift_amt))
                 return false;
-        } else if (!hashtable_add(table, key, toadd))
+        } else if (!add_func(table, key, toadd))
             return false;
     }
     return true;
 }
+
+static bool
+hashtable_add_generic(void *table, void *key, void *payload)
+{
+    return hashtable_add((hashtable_t *) table, key, payload);
+}
+
+bool
+hashtable_resurrect(void *drcontext, byte **map INOUT, hashtable_t *table,
+                    size_t entry_size, void *perscxt, hasthable_persist_flags_t flags,
+                    bool (*process_payload)(void *key, void *payload, ptr_int_t shift))
+{
+    return resurrect_entries(map, table, entry_size, perscxt, flags,
+                             hashtable_add_generic, process_payload);
+}
+
+/***************************************************************************
+ * OPEN-ADDRESSED HASHTABLE
+ *
+ * Linear probing over an array of inline key/payload slots, with a NULL
+ * payload marking an empty slot.  Removal uses backward-shift deletion
+ * so there are no tombstones and a miss stops at the first empty slot.
+ *
+ * For config.read_lockfree, writers (still serialized by the lock) bump
+ * write_seq to odd before changing the table and back to even after, and
+ * readers retry if it was odd or changed across their probe.  Resizing
+ * retires rather than frees the old array, since a reader may still be
+ * probing it.  DR only targets x86, where loads are not reordered with
+ * loads nor stores with stores, so compiler barriers are sufficient.
+ */
+
+#ifdef WINDOWS
+# include <intrin.h>
+# define COMPILER_BARRIER() _ReadWriteBarrier()
+#else
+# define COMPILER_BARRIER() __asm__ __volatile__("" : : : "memory")
+#endif
+
+/* 2^32 / golden ratio, for multiplicative hashing */
+#define OHASH_MULTIPLIER 0x9e3779b9U
+
+typedef struct _ohash_retired_t {
+    ohash_slot_t *table;
+    uint table_bits;
+    struct _ohash_retired_t *next;
+} ohash_retired_t;
+
+/* Takes the top bits of a multiplicative hash, which spreads aligned keys
+ * such as heap addresses that would otherwise form long runs of adjacent
+ * slots under linear probing.
+ */
+static uint
+ohash_index(ohashtable_t *table, uint num_bits, void *key)
+{
+    uint hash = hash_key_full(table->hashtype, table->hash_key_func, key);
+    return (hash * OHASH_MULTIPLIER) >> (32 - num_bits);
+}
+
+static void
+ohash_write_begin(ohashtable_t *table)
+{
+    if (table->config.read_lockfree) {
+        table->write_seq++;
+        COMPILER_BARRIER();
+    }
+}
+
+static void
+ohash_write_end(ohashtable_t *table)
+{
+    if (table->config.read_lockfree) {
+        COMPILER_BARRIER();
+        table->write_seq++;
+    }
+}
+
+/* Returns the slot holding key, or NULL.  The caller must hold the lock or
+ * be a lock-free reader that validates the result against write_seq, which
+ * is why the probe is bounded even though a locked table always has an
+ * empty slot.
+ */
+static ohash_slot_t *
+ohash_find(ohashtable_t *table, ohash_slot_t *slots, uint num_bits, void *key)
+{
+    uint mask = HASHTABLE_SIZE(num_bits) - 1;
+    uint i = ohash_index(table, num_bits, key);
+    uint probes;
+    for (probes = 0; probes <= mask; probes++) {
+        ohash_slot_t *slot = &slots[i];
+        if (slot->payload == NULL)
+            return NULL;
+        if (keys_equal_full(table->hashtype, table->cmp_key_func, slot->key, key))
+            return slot;
+        i = (i + 1) & mask;
+    }
+    return NULL;
+}
+
+/* caller must hold lock and have checked that key is not present */
+static void
+ohash_insert(ohashtable_t *table, ohash_slot_t *slots, uint num_bits,
+             void *key, void *payload)
+{
+    uint mask = HASHTABLE_SIZE(num_bits) - 1;
+    uint i = ohash_index(table, num_bits, key);
+    while (slots[i].payload != NULL)
+        i = (i + 1) & mask;
+    slots[i].key = key;
+    COMPILER_BARRIER();
+    slots[i].payload = payload;
+}
+
+void
+ohashtable_init_ex(ohashtable_t *table, uint num_bits, hash_type_t hashtype,
+                   bool str_dup, bool synch, void (*free_payload_func)(void*),
+                   uint (*hash_key_func)(void*), bool (*cmp_key_func)(void*, void*))
+{
+    size_t sz;
+    ASSERT(num_bits > 0 && num_bits < 32, "ohashtable_init_ex: invalid size");
+    sz = (size_t)HASHTABLE_SIZE(num_bits) * sizeof(ohash_slot_t);
+    table->table = (ohash_slot_t *) hash_alloc(sz);
+    memset(table->table, 0, sz);
+    table->hashtype = hashtype;
+    table->str_dup = str_dup;
+    ASSERT(!str_dup || hashtype == HASH_STRING || hashtype == HASH_STRING_NOCASE,
+           "ohashtable_init_ex internal error: invalid hashtable type");
+    table->lock = dr_mutex_create();
+    table->table_bits = num_bits;
+    table->synch = synch;
+    table->free_payload_func = free_payload_func;
+    table->hash_key_func = hash_key_func;
+    table->cmp_key_func = cmp_key_func;
+    ASSERT(table->hashtype != HASH_CUSTOM ||
+           (table->hash_key_func != NULL && table->cmp_key_func != NULL),
+           "ohashtable_init_ex missing cmp/hash key func");
+    table->entries = 0;
+    table->config.size = sizeof(table->config);
+    table->config.resizable = true;
+    table->config.resize_threshold = 50;
+    table->config.read_lockfree = false;
+    table->persist_count = 0;
+    table->write_seq = 0;
+    table->retired = NULL;
+}
+
+void
+ohashtable_init(ohashtable_t *table, uint num_bits, hash_type_t hashtype, bool str_dup)
+{
+    ohashtable_init_ex(table, num_bits, hashtype, str_dup, true, NULL, NULL, NULL);
+}
+
+void
+ohashtable_configure(ohashtable_t *table, hashtable_config_t *config)
+{
+    ASSERT(table != NULL && config != NULL, "invalid params");
+    ASSERT(table->entries == 0, "ohashtable_configure: table in use");
+    /* Ignoring size of field: shouldn't be in between */
+    if (config->size > offsetof(hashtable_config_t, resizable))
+        table->config.resizable = config->resizable;
+    if (config->size > offsetof(hashtable_config_t, resize_threshold)) {
+        ASSERT(config->resize_threshold < 100, "ohashtable needs empty slots");
+        table->config.resize_threshold = config->resize_threshold;
+    }
+    if (config->size > offsetof(hashtable_config_t, read_lockfree)) {
+        /* other key types may dereference a key that a writer is freeing */
+        ASSERT(!config->read_lockfree || table->hashtype == HASH_INTPTR,
+               "ohashtable lock-free reads require HASH_INTPTR keys");
+        table->config.read_lockfree = config->read_lockfree &&
+            table->hashtype == HASH_INTPTR;
+    }
+}
+
+void
+ohashtable_lock(ohashtable_t *table)
+{
+    dr_mutex_lock(table->lock);
+}
+
+void
+ohashtable_unlock(ohashtable_t *table)
+{
+    dr_mutex_unlock(table->lock);
+}
+
+static void *
+ohashtable_lookup_lockfree(ohashtable_t *table, void *key)
+{
+    for (;;) {
+        void *res = NULL;
+        ohash_slot_t *slots, *slot;
+        uint num_bits;
+        uint seq = table->write_seq;
+        COMPILER_BARRIER();
+        slots = table->table;
+        num_bits = table->table_bits;
+        COMPILER_BARRIER();
+        /* re-check before probing so slots and num_bits are a matching pair */
+        if (TEST(1, seq) || table->write_seq != seq) {
+            dr_thread_yield();
+            continue;
+        }
+        slot = ohash_find(table, slots, num_bits, key);
+        if (slot != NULL)
+            res = slot->payload;
+        COMPILER_BARRIER();
+        if (table->write_seq == seq)
+            return res;
+    }
+}
+
+void *
+ohashtable_lookup(ohashtable_t *table, void *key)
+{
+    void *res = NULL;
+    ohash_slot_t *slot;
+    if (table->config.read_lockfree)
+        return ohashtable_lookup_lockfree(table, key);
+    if (table->synch)
+        dr_mutex_lock(table->lock);
+    slot = ohash_find(table, table->table, table->table_bits, key);
+    if (slot != NULL)
+        res = slot->payload;
+    if (table->synch)
+        dr_mutex_unlock(table->lock);
+    return res;
+}
+
+/* Caller must hold lock and have called ohash_write_begin().  Unlike
+ * hashtable_check_for_resize() this is called before adding, as an add
+ * must not take the last empty slot.
+ */
+static bool
+ohashtable_check_for_resize(ohashtable_t *table, uint new_entries)
+{
+    size_t capacity = (size_t) HASHTABLE_SIZE(table->table_bits);
+    if (table->config.resizable &&
+        /* avoid fp ops.  should check for overflow. */
+        new_entries * 100 > table->config.resize_threshold * capacity) {
+        ohash_slot_t *new_table;
+        size_t new_sz;
+        uint i, new_bits = table->table_bits + 1;
+        /* double the size */
+        new_sz = (size_t) HASHTABLE_SIZE(new_bits) * sizeof(ohash_slot_t);
+        new_table = (ohash_slot_t *) hash_alloc(new_sz);
+        memset(new_table, 0, new_sz);
+        /* rehash the old table into the new */
+        for (i = 0; i < capacity; i++) {
+            if (table->table[i].payload != NULL) {
+                ohash_insert(table, new_table, new_bits, table->table[i].key,
+                             table->table[i].payload);
+            }
+        }
+        if (table->config.read_lockfree) {
+            ohash_retired_t *r = (ohash_retired_t *) hash_alloc(sizeof(*r));
+            r->table = table->table;
+            r->table_bits = table->table_bits;
+            r->next = (ohash_retired_t *) table->retired;
+            table->retired = r;
+        } else
+            hash_free(table->table, capacity * sizeof(ohash_slot_t));
+        table->table = new_table;
+        table->table_bits = new_bits;
+        return true;
+    }
+    return false;
+}
+
+/* Caller must hold lock and have called ohash_write_begin().  Resizes if
+ * needed and returns whether there is room for one more entry: one slot
+ * must always stay empty to end probes.
+ */
+static bool
+ohash_make_room(ohashtable_t *table)
+{
+    ohashtable_check_for_resize(table, table->entries + 1);
+    return table->entries + 1 < HASHTABLE_SIZE(table->table_bits);
+}
+
+bool
+ohashtable_add(ohashtable_t *table, void *key, void *payload)
+{
+    bool res = false;
+    /* if payload is null can't tell from lookup miss */
+    ASSERT(payload != NULL, "ohashtable_add internal error");
+    if (table->synch)
+        dr_mutex_lock(table->lock);
+    if (ohash_find(table, table->table, table->table_bits, key) == NULL) {
+        ohash_write_begin(table);
+        if (ohash_make_room(table)) {
+            ohash_insert(table, table->table, table->table_bits,
+                         key_dup(table->str_dup, key), payload);
+            table->entries++;
+            res = true;
+        }
+        ohash_write_end(table);
+    }
+    if (table->synch)
+        dr_mutex_unlock(table->lock);
+    return res;
+}
+
+void *
+ohashtable_add_replace(ohashtable_t *table, void *key, void *payload)
+{
+    void *old_payload = NULL;
+    ohash_slot_t *slot;
+    /* if payload is null can't tell from lookup miss */
+    ASSERT(payload != NULL, "ohashtable_add_replace internal error");
+    if (table->synch)
+        dr_mutex_lock(table->lock);
+    slot = ohash_find(table, table->table, table->table_bits, key);
+    if (slot != NULL) {
+        ohash_write_begin(table);
+        key_free(table->str_dup, slot->key);
+        slot->key = key_dup(table->str_dup, key);
+        /* up to caller to free payload */
+        old_payload = slot->payload;
+        slot->payload = payload;
+        ohash_write_end(table);
+    } else {
+        ohash_write_begin(table);
+        if (ohash_make_room(table)) {
+            ohash_insert(table, table->table, table->table_bits,
+                         key_dup(table->str_dup, key), payload);
+            table->entries++;
+        } else
+            ASSERT(false, "ohashtable_add_replace: table is full");
+        ohash_write_end(table);
+    }
+    if (table->synch)
+        dr_mutex_unlock(table->lock);
+    return old_payload;
+}
+
+/* Caller must hold lock and have called ohash_write_begin().  Empties slot i
+ * and then shifts back each later entry in its run whose home slot is not
+ * between the hole and the entry, as it would otherwise be unreachable.
+ */
+static void
+ohash_remove_at(ohashtable_t *table, uint i)
+{
+    ohash_slot_t *slots = table->table;
+    uint mask = HASHTABLE_SIZE(table->table_bits) - 1;
+    uint j = i;
+    key_free(table->str_dup, slots[i].key);
+    if (table->free_payload_func != NULL)
+        (table->free_payload_func)(slots[i].payload);
+    slots[i].payload = NULL;
+    slots[i].key = NULL;
+    table->entries--;
+    for (;;) {
+        uint home;
+        j = (j + 1) & mask;
+        if (slots[j].payload == NULL)
+            break;
+        home = ohash_index(table, table->table_bits, slots[j].key);
+        /* leave it if home is cyclically in (i, j] */
+        if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+            continue;
+        slots[i] = slots[j];
+        slots[j].payload = NULL;
+        slots[j].key = NULL;
+        i = j;
+    }
+}
+
+bool
+ohashtable_remove(ohashtable_t *table, void *key)
+{
+    bool res = false;
+    ohash_slot_t *slot;
+    if (table->synch)
+        dr_mutex_lock(table->lock);
+    slot = ohash_find(table, table->table, table->table_bits, key);
+    if (slot != NULL) {
+        ohash_write_begin(table);
+        ohash_remove_at(table, (uint)(slot - table->table));
+        ohash_write_end(table);
+        res = true;
+    }
+    if (table->synch)
+        dr_mutex_unlock(table->lock);
+    return res;
+}
+
+bool
+ohashtable_remove_range(ohashtable_t *table, void *start, void *end)
+{
+    bool res = false;
+    uint i = 0;
+    if (table->synch)
+        ohashtable_lock(table);
+    ohash_write_begin(table);
+    while (i < HASHTABLE_SIZE(table->table_bits)) {
+        ohash_slot_t *slot = &table->table[i];
+        if (slot->payload != NULL && slot->key >= start && slot->key < end) {
+            /* A later entry may be shifted into slot i, so we re-examine it.
+             * Shifts only move entries into slots we have yet to visit or,
+             * after wrapping, between slots we already kept.
+             */
+            ohash_remove_at(table, i);
+            res = true;
+        } else
+            i++;
+    }
+    ohash_write_end(table);
+    if (table->synch)
+        ohashtable_unlock(table);
+    return res;
+}
+
+static void
+ohashtable_clear_internal(ohashtable_t *table)
+{
+    uint i;
+    for (i = 0; i < HASHTABLE_SIZE(table->table_bits); i++) {
+        ohash_slot_t *slot = &table->table[i];
+        if (slot->payload == NULL)
+            continue;
+        key_free(table->str_dup, slot->key);
+        if (table->free_payload_func != NULL)
+            (table->free_payload_func)(slot->payload);
+        slot->payload = NULL;
+        slot->key = NULL;
+    }
+    table->entries = 0;
+}
+
+void
+ohashtable_clear(ohashtable_t *table)
+{
+    if (table->synch)
+        dr_mutex_lock(table->lock);
+    ohash_write_begin(table);
+    ohashtable_clear_internal(table);
+    ohash_write_end(table);
+    if (table->synch)
+        dr_mutex_unlock(table->lock);
+}
+
+void
+ohashtable_delete(ohashtable_t *table)
+{
+    ohash_retired_t *r, *next_r;
+    if (table->synch)
+        dr_mutex_lock(table->lock);
+    ohashtable_clear_internal(table);
+    hash_free(table->table, (size_t)HASHTABLE_SIZE(table->table_bits) *
+              sizeof(ohash_slot_t));
+    table->table = NULL;
+    for (r = (ohash_retired_t *) table->retired; r != NULL; r = next_r) {
+        next_r = r->next;
+        hash_free(r->table, (size_t)HASHTABLE_SIZE(r->table_bits) *
+                  sizeof(ohash_slot_t));
+        hash_free(r, sizeof(*r));
+    }
+    table->retired = NULL;
+    if (table->synch)
+        dr_mutex_unlock(table->lock);
+    dr_mutex_destroy(table->lock);
+}
+
+size_t
+ohashtable_persist_size(void *drcontext, ohashtable_t *table, size_t entry_size,
+                        void *perscxt, hasthable_persist_flags_t flags)
+{
+    uint count = 0;
+    if (table->hashtype == HASH_INTPTR &&
+        TESTANY(DR_HASHPERS_ONLY_IN_RANGE | DR_HASHPERS_ONLY_PERSISTED, flags)) {
+        /* synch is already provided */
+        uint i;
+        ptr_uint_t start = 0;
+        size_t size = 0;
+        if (perscxt != NULL) {
+            start = (ptr_uint_t) dr_persist_start(perscxt);
+            size = dr_persist_size(perscxt);
+        }
+        for (i = 0; i < HASHTABLE_SIZE(table->table_bits); i++) {
+            ohash_slot_t *slot = &table->table[i];
+            if (slot->payload != NULL &&
+                key_persistable(drcontext, perscxt, table->hashtype, slot->key,
+                                start, size, flags))
+                count++;
+        }
+    } else
+        count = table->entries;
+    /* see hashtable_persist_size() on why this is not an OUT param */
+    table->persist_count = count;
+    return persist_size_from_count(count, entry_size, flags);
+}
+
+bool
+ohashtable_persist(void *drcontext, ohashtable_t *table, size_t entry_size,
+                   file_t fd, void *perscxt, hasthable_persist_flags_t flags)
+{
+    uint i;
+    ptr_uint_t start;
+    size_t size;
+    IF_DEBUG(uint count_check = 0;)
+    if (!persist_header(fd, table->persist_count, perscxt, flags, &start, &size))
+        return false;
+    /* synch is already provided */
+    for (i = 0; i < HASHTABLE_SIZE(table->table_bits); i++) {
+        ohash_slot_t *slot = &table->table[i];
+        if (slot->payload != NULL &&
+            key_persistable(drcontext, perscxt, table->hashtype, slot->key,
+                            start, size, flags)) {
+            IF_DEBUG(count_check++;)
+            if (!persist_entry(fd, slot->key, slot->payload, entry_size, flags))
+                return false;
+        }
+    }
+    ASSERT(table->persist_count == count_check, "invalid count");
+    return true;
+}
+
+static bool
+ohashtable_add_generic(void *table, void *key, void *payload)
+{
+    return ohashtable_add((ohashtable_t *) table, key, payload);
+}
+
+bool
+ohashtable_resurrect(void *drcontext, byte **map INOUT, ohashtable_t *table,
+                     size_t entry_size, void *perscxt, hasthable_persist_flags_t flags,
+                     bool (*process_payload)(void *key, void *payload, ptr_int_t shift))
+{
+    return resurrect_entries(map, table, entry_size, perscxt, flags,
+                             ohashtable_add_generic, process_payload);
+}
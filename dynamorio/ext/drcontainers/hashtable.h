@@ -80,6 +80,12 @@ typedef struct _hashtable_config_t {
     size_t size; /**< The size of the hashtable_config_t struct used */
     bool resizable; /**< Whether the table should be resized */
     uint resize_threshold; /**< Resize the table at this % full */
+    /**
+     * Only honored by ohashtable_t, and only for HASH_INTPTR keys: lets
+     * ohashtable_lookup() proceed without the table lock while writers
+     * hold it.  See ohashtable_init_ex().
+     */
+    bool read_lockfree;
 } hashtable_config_t;
 
 typedef struct _hashtable_t {
@@ -323,6 +329,168 @@ hashtable_resurrect(void *drcontext, byte **map /*INOUT*/, hashtable_t *table,
                     size_t entry_size, void *perscxt, hasthable_persist_flags_t flags,
                     bool (*process_payload)(void *key, void *payload, ptr_int_t shift));
 
+/***************************************************************************
+ * OPEN-ADDRESSED HASHTABLE
+ */
+
+/**
+ * A slot in an open-addressed hashtable.  A NULL payload marks an empty slot.
+ */
+typedef struct _ohash_slot_t {
+    void *key;
+    void *payload;
+} ohash_slot_t;
+
+/**
+ * An open-addressed hashtable with linear probing.  Keys and payloads
+ * are stored inline in a single array of slots, so a lookup that hits
+ * touches one or two adjacent cache lines and allocates nothing, unlike
+ * hashtable_t's separately allocated chain entries.  Removal shifts later
+ * entries in the probe run back rather than leaving tombstones.
+ *
+ * The slots can be walked directly via \p table and HASHTABLE_SIZE(\p
+ * table_bits), skipping those whose payload is NULL, with the lock held.
+ */
+typedef struct _ohashtable_t {
+    ohash_slot_t *table;
+    hash_type_t hashtype;
+    bool str_dup;
+    void *lock;
+    uint table_bits;
+    bool synch;
+    void (*free_payload_func)(void*);
+    uint (*hash_key_func)(void*);
+    bool (*cmp_key_func)(void*, void*);
+    uint entries;
+    hashtable_config_t config;
+    uint persist_count;
+    /* Bumped to odd before and back to even after each change when
+     * config.read_lockfree is set, so lock-free readers can retry.
+     */
+    volatile uint write_seq;
+    /* Arrays replaced by a resize while config.read_lockfree is set: a reader
+     * may still be walking one, so they are only freed by ohashtable_delete().
+     */
+    void *retired;
+} ohashtable_t;
+
+/**
+ * Initializes an open-addressed hashtable with the given size, hash type,
+ * and whether to duplicate string keys.  All operations are synchronized
+ * by default.
+ */
+void
+ohashtable_init(ohashtable_t *table, uint num_bits, hash_type_t hashtype, bool str_dup);
+
+/**
+ * Initializes an open-addressed hashtable.  The parameters are as for
+ * hashtable_init_ex(), except that \p num_bits must be at least 1.
+ * The default resize threshold is 50% full, as linear probing degrades
+ * quickly above that; a table that is not resizable cannot be filled
+ * past one empty slot.
+ *
+ * If ohashtable_configure() sets \p read_lockfree on a table with
+ * HASH_INTPTR keys, ohashtable_lookup() does not acquire the lock:
+ * it retries if a writer changed the table while it was probing.  All
+ * other operations must still be serialized, either via \p synch or via
+ * ohashtable_lock().  As with a synchronized hashtable_lookup(), the
+ * caller must itself ensure a returned payload is not freed while in use.
+ * Arrays replaced by resizing are kept until ohashtable_delete().
+ */
+void
+ohashtable_init_ex(ohashtable_t *table, uint num_bits, hash_type_t hashtype,
+                   bool str_dup, bool synch, void (*free_payload_func)(void*),
+                   uint (*hash_key_func)(void*), bool (*cmp_key_func)(void*, void*));
+
+/**
+ * Configures optional parameters of open-addressed hashtable operation.
+ * Must be called before any entries are added.
+ */
+void
+ohashtable_configure(ohashtable_t *table, hashtable_config_t *config);
+
+/** Returns the payload for the given key, or NULL if the key is not found */
+void *
+ohashtable_lookup(ohashtable_t *table, void *key);
+
+/**
+ * Adds a new entry.  Returns false if an entry for \p key already exists
+ * or if the table is not resizable and is full.
+ * \note Never use NULL as a payload as that is used for a lookup failure.
+ */
+bool
+ohashtable_add(ohashtable_t *table, void *key, void *payload);
+
+/**
+ * Adds a new entry, replacing an existing entry if any.  Returns the
+ * replaced payload, which is not passed to free_payload_func.
+ * \note Never use NULL as a payload as that is used for a lookup failure.
+ */
+void *
+ohashtable_add_replace(ohashtable_t *table, void *key, void *payload);
+
+/**
+ * Removes the entry for key.  If free_payload_func was specified calls it
+ * for the payload being removed.  Returns false if no such entry
+ * exists.
+ */
+bool
+ohashtable_remove(ohashtable_t *table, void *key);
+
+/**
+ * Removes all entries with key in [start..end).  If free_payload_func
+ * was specified calls it for each payload being removed.  Returns
+ * false if no such entry exists.
+ */
+bool
+ohashtable_remove_range(ohashtable_t *table, void *start, void *end);
+
+/**
+ * Removes all entries from the table.  If free_payload_func was specified
+ * calls it for each payload.
+ */
+void
+ohashtable_clear(ohashtable_t *table);
+
+/**
+ * Destroys all storage for the table, including all entries and the
+ * table itself.  If free_payload_func was specified calls it for each
+ * payload.
+ */
+void
+ohashtable_delete(ohashtable_t *table);
+
+/** Acquires the open-addressed hashtable lock. */
+void
+ohashtable_lock(ohashtable_t *table);
+
+/** Releases the open-addressed hashtable lock. */
+void
+ohashtable_unlock(ohashtable_t *table);
+
+/**
+ * The open-addressed equivalent of hashtable_persist_size().  The
+ * persisted format is the same, so either table type can resurrect
+ * what the other persisted.
+ */
+size_t
+ohashtable_persist_size(void *drcontext, ohashtable_t *table, size_t entry_size,
+                        void *perscxt, hasthable_persist_flags_t flags);
+
+/** The open-addressed equivalent of hashtable_persist(). */
+bool
+ohashtable_persist(void *drcontext, ohashtable_t *table, size_t entry_size,
+                   file_t fd, void *perscxt, hasthable_persist_flags_t flags);
+
+/**
+ * The open-addressed equivalent of hashtable_resurrect().  If \p
+ * process_payload is NULL, entries are added via ohashtable_add().
+ */
+bool
+ohashtable_resurrect(void *drcontext, byte **map /*INOUT*/, ohashtable_t *table,
+                     size_t entry_size, void *perscxt, hasthable_persist_flags_t flags,
+                     bool (*process_payload)(void *key, void *payload, ptr_int_t shift));
+
 /*@}*/ /* end doxygen group */
 
 #ifdef __cplusplus
@@ -490,6 +490,25 @@ DR_EXPORT
 drsym_error_t
 drsym_free_resources(const char *modpath);
 
+/** The default value for drsym_set_line_cache_limit(). */
+#define DRSYM_DEFAULT_LINE_CACHE_LIMIT (16*1024*1024)
+
+DR_EXPORT
+/**
+ * Sets the maximum number of bytes used to cache decoded DWARF line
+ * tables, across all modules.  Each table covers one compilation unit,
+ * and repeated line lookups in that unit then need only a binary search.
+ * When the limit is exceeded, the least recently used tables are freed.
+ * The most recently used table is always kept.  The default is
+ * #DRSYM_DEFAULT_LINE_CACHE_LIMIT.
+ *
+ * @param[in] max_bytes   The cache size limit in bytes.
+ *
+ * \note Has no effect on Windows PDB (DRSYM_PDB) modules.
+ */
+drsym_error_t
+drsym_set_line_cache_limit(size_t max_bytes);
+
 /*@}*/ /* end doxygen group */
 
 #ifdef __cplusplus
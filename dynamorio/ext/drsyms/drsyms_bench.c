@@ -32,8 +32,10 @@
 
 /* DRSyms benchmarking standalone app. */
 
-/* This is a standalone app for benchmarking drsyms.  Currently we just time
- * symbol enumeration of an arbitrary object file.
+/* This is a standalone app for benchmarking drsyms.  We time symbol
+ * enumeration of an arbitrary object file, and then address lookups of
+ * a sample of the symbols that were enumerated, from one thread and then
+ * split across several threads.
  */
 
 #include <stdio.h>
@@ -43,8 +45,25 @@
 #include "dr_api.h"
 #include "drsyms.h"
 
+#ifndef WINDOWS
+# include <pthread.h>
+#endif
+
 static char sym_buf[4096];
 
+/* Max number of symbol addresses we sample for the address lookup benchmark */
+#define MAX_LOOKUP_OFFS (1024*1024)
+
+/* Default number of threads for the concurrent address lookup benchmark */
+#define DEFAULT_LOOKUP_THREADS 4
+#define MAX_LOOKUP_THREADS 64
+
+typedef struct _enum_data_t {
+    uint64 count;
+    size_t *offs;
+    uint num_offs;
+} enum_data_t;
+
 static int
 usage(const char *msg)
 {
@@ -58,7 +77,7 @@ usage(const char *msg)
     if (msg != NULL && msg[0] != '\0') {
         dr_fprintf(STDERR, "%s\n", msg);
     }
-    dr_fprintf(STDERR, "usage: bench <modpath>\n");
+    dr_fprintf(STDERR, "usage: bench <modpath> [num_lookup_threads]\n");
     return 1;
 }
 
@@ -68,8 +87,11 @@ usage(const char *msg)
 static bool
 sym_callback(const char *name, size_t modoffs, void *data)
 {
-    uint64 *count = (uint64*)data;
+    enum_data_t *enum_data = (enum_data_t *)data;
+    uint64 *count = &enum_data->count;
     *count += 1;
+    if (enum_data->offs != NULL && enum_data->num_offs < MAX_LOOKUP_OFFS)
+        enum_data->offs[enum_data->num_offs++] = modoffs;
     if (*count % 50000 == 0) {
         dr_printf("{\"%s\",\n", name);
         memset(sym_buf, 0, sizeof(sym_buf));
@@ -87,15 +109,14 @@ sym_callback(const char *name, size_t modoffs, void *data)
 }
 
 static void
-enumerate_with_flags(const char *modpath, drsym_flags_t flags)
+enumerate_with_flags(const char *modpath, drsym_flags_t flags, enum_data_t *data)
 {
     uint64 start, end, time;
-    uint64 sym_count = 0;
 
     dr_printf("Beginning symbol enumeration\n");
     /* Should use clock_gettime with CLOCK_MONOTONIC instead. */
     start = dr_get_milliseconds();
-    drsym_enumerate_symbols(modpath, sym_callback, &sym_count, flags);
+    drsym_enumerate_symbols(modpath, sym_callback, data, flags);
     end = dr_get_milliseconds();
     dr_printf("Finished symbol enumeration.\n");
 
@@ -104,10 +125,123 @@ enumerate_with_flags(const char *modpath, drsym_flags_t flags)
     dr_printf("Took %d.%03d seconds.\n", (int)(time / 1000), (int)(time % 1000));
 }
 
+/* Looks up every stride-th sampled address starting at first and returns the
+ * number found.  This includes the line number lookup, if the module has line
+ * information.
+ */
+static uint
+lookup_address_range(const char *modpath, size_t *offs, uint num_offs,
+                     uint first, uint stride)
+{
+    uint i, found = 0;
+    char buf[sizeof(drsym_info_t) + 512];
+    drsym_info_t *info = (drsym_info_t *) buf;
+    for (i = first; i < num_offs; i += stride) {
+        drsym_error_t res;
+        info->struct_size = sizeof(*info);
+        info->name_size = sizeof(buf) - sizeof(*info);
+        res = drsym_lookup_address(modpath, offs[i], info, DRSYM_DEFAULT_FLAGS);
+        if ((res == DRSYM_SUCCESS || res == DRSYM_ERROR_LINE_NOT_AVAILABLE) &&
+            info->start_offs <= offs[i] && offs[i] < info->end_offs)
+            found++;
+    }
+    return found;
+}
+
+static void
+lookup_addresses(const char *modpath, size_t *offs, uint num_offs)
+{
+    uint64 start, end, time;
+    uint found;
+
+    dr_printf("Beginning %u address lookups\n", num_offs);
+    start = dr_get_milliseconds();
+    found = lookup_address_range(modpath, offs, num_offs, 0, 1);
+    end = dr_get_milliseconds();
+    /* Zero-sized symbols are not found by address */
+    dr_printf("Finished address lookups: %u found.\n", found);
+
+    time = end - start;
+
+    dr_printf("Took %d.%03d seconds.\n", (int)(time / 1000), (int)(time % 1000));
+}
+
+typedef struct _lookup_thread_t {
+    const char *modpath;
+    size_t *offs;
+    uint num_offs;
+    uint first;
+    uint stride;
+    uint found;
+} lookup_thread_t;
+
+#ifdef WINDOWS
+static DWORD WINAPI
+#else
+static void *
+#endif
+lookup_thread(void *arg)
+{
+    lookup_thread_t *t = (lookup_thread_t *) arg;
+    t->found = lookup_address_range(t->modpath, t->offs, t->num_offs,
+                                    t->first, t->stride);
+    return 0;
+}
+
+/* Splits the sampled addresses across num_threads threads to measure how
+ * well concurrent lookups scale.
+ */
+static void
+lookup_addresses_concurrently(const char *modpath, size_t *offs, uint num_offs,
+                              uint num_threads)
+{
+    uint64 start, end, time;
+    uint i, found = 0;
+    lookup_thread_t threads[MAX_LOOKUP_THREADS];
+#ifdef WINDOWS
+    HANDLE handles[MAX_LOOKUP_THREADS];
+#else
+    pthread_t handles[MAX_LOOKUP_THREADS];
+#endif
+
+    dr_printf("Beginning %u address lookups on %u threads\n", num_offs, num_threads);
+    start = dr_get_milliseconds();
+    for (i = 0; i < num_threads; i++) {
+        threads[i].modpath = modpath;
+        threads[i].offs = offs;
+        threads[i].num_offs = num_offs;
+        threads[i].first = i;
+        threads[i].stride = num_threads;
+        threads[i].found = 0;
+#ifdef WINDOWS
+        handles[i] = CreateThread(NULL, 0, lookup_thread, &threads[i], 0, NULL);
+#else
+        pthread_create(&handles[i], NULL, lookup_thread, &threads[i]);
+#endif
+    }
+    for (i = 0; i < num_threads; i++) {
+#ifdef WINDOWS
+        WaitForSingleObject(handles[i], INFINITE);
+        CloseHandle(handles[i]);
+#else
+        pthread_join(handles[i], NULL);
+#endif
+        found += threads[i].found;
+    }
+    end = dr_get_milliseconds();
+    dr_printf("Finished address lookups: %u found.\n", found);
+
+    time = end - start;
+
+    dr_printf("Took %d.%03d seconds.\n", (int)(time / 1000), (int)(time % 1000));
+}
+
 int
 main(int argc, char **argv)
 {
     const char *modpath;
+    enum_data_t data;
+    uint num_threads = DEFAULT_LOOKUP_THREADS;
 #ifdef WINDOWS
     char full_path[2048];
 #endif
@@ -115,10 +249,15 @@ main(int argc, char **argv)
     dr_standalone_init();
     drsym_init(0);
 
-    if (argc != 2) {
+    if (argc != 2 && argc != 3) {
         return usage(NULL);
     }
     modpath = argv[1];
+    if (argc == 3) {
+        num_threads = atoi(argv[2]);
+        if (num_threads == 0 || num_threads > MAX_LOOKUP_THREADS)
+            return usage("Invalid thread count.");
+    }
 #ifdef WINDOWS
     /* Work around i#289. */
     if (GetFullPathName(modpath, sizeof(full_path), full_path, NULL) == 0) {
@@ -133,8 +272,19 @@ main(int argc, char **argv)
     /* The first enumeration populates dbghelp's symbol cache.  We mostly care
      * about how long the second enumeration takes.
      */
-    enumerate_with_flags(modpath, DRSYM_DEFAULT_FLAGS);
-    enumerate_with_flags(modpath, DRSYM_DEFAULT_FLAGS);
+    memset(&data, 0, sizeof(data));
+    enumerate_with_flags(modpath, DRSYM_DEFAULT_FLAGS, &data);
+    data.count = 0;
+    data.offs = (size_t *) malloc(MAX_LOOKUP_OFFS * sizeof(*data.offs));
+    enumerate_with_flags(modpath, DRSYM_DEFAULT_FLAGS, &data);
+
+    /* As with enumeration, the first pass can include one-time setup costs */
+    if (data.offs != NULL) {
+        lookup_addresses(modpath, data.offs, data.num_offs);
+        lookup_addresses(modpath, data.offs, data.num_offs);
+        lookup_addresses_concurrently(modpath, data.offs, data.num_offs, num_threads);
+        free(data.offs);
+    }
 
     drsym_exit();
 }
@@ -42,6 +42,7 @@
 #include "libdwarf.h"
 
 #include <stdlib.h> /* qsort */
+#include <string.h>
 
 /* For debugging */
 static bool verbose = false;
@@ -52,17 +53,86 @@ static bool verbose = false;
     } \
 } while (0)
 
+/* A decoded line table entry */
+typedef struct _line_entry_t {
+    Dwarf_Addr addr;
+    Dwarf_Unsigned lineno;
+    /* We assume file comes from .debug_str and therefore lives until drsym_exit */
+    char *file;
+} line_entry_t;
+
+struct _cu_info_t;
+
+/* The line table of one CU, decoded and sorted by address.  All tables
+ * are on a single LRU list so that the memory cap applies across modules.
+ */
+typedef struct _line_table_t {
+    struct _cu_info_t *cu;
+    line_entry_t *lines;
+    uint num_lines;
+    size_t size;
+    /* Most recently used is at the head */
+    struct _line_table_t *lru_prev;
+    struct _line_table_t *lru_next;
+} line_table_t;
+
+typedef struct _cu_info_t {
+    Dwarf_Off die_offs;
+    /* Cached line table, or NULL */
+    line_table_t *table;
+    /* Address range covered by the line table, once it has been decoded.
+     * Used to skip CUs with no DW_AT_low_pc/DW_AT_high_pc or aranges
+     * when we have to search them all.
+     */
+    bool lines_known;
+    Dwarf_Addr lines_lo;
+    Dwarf_Addr lines_hi;
+} cu_info_t;
+
+/* An address range of a CU from its DIE or from .debug_aranges.  max_end is
+ * the highest end of this and all prior entries, which bounds how far back
+ * an address can be contained by an earlier range.
+ */
+typedef struct _cu_range_t {
+    Dwarf_Addr start;
+    Dwarf_Addr end;
+    Dwarf_Addr max_end;
+    uint cu_idx;
+} cu_range_t;
+
 typedef struct _dwarf_module_t {
     Dwarf_Debug dbg;
-    /* we cache the last CU we looked up */
-    Dwarf_Die lines_cu;
-    Dwarf_Line *lines;
-    Dwarf_Signed num_lines;
+    /* Serializes libdwarf's use of dbg, which is not thread-safe, and the
+     * building of the CU index.  line_cache_lock may be acquired while
+     * holding this lock, but not the other way around.
+     */
+    void *lock;
+    /* The CU index is built on the first line lookup and is read-only after
+     * that, so this is set last and checked without the lock.
+     */
+    volatile bool cu_index_built;
+    /* Sorted by die_offs */
+    cu_info_t *cus;
+    uint num_cus;
+    /* Sorted by start */
+    cu_range_t *ranges;
+    uint num_ranges;
 } dwarf_module_t;
 
+/* Address lookups can run concurrently, so the cache has its own lock.  It
+ * guards the LRU list, the size, and the table and lines_* fields of each
+ * cu_info_t, and is held while searching a table so it cannot be evicted
+ * underneath us.  Decoding a new table happens outside of it.
+ */
+static void *line_cache_lock;
+static line_table_t *lru_head;
+static line_table_t *lru_tail;
+static size_t line_cache_size;
+static size_t line_cache_limit = DRSYM_DEFAULT_LINE_CACHE_LIMIT;
+
 static bool
-search_addr2line_in_cu(dwarf_module_t *mod, Dwarf_Addr pc, Dwarf_Die cu_die,
-                       drsym_info_t *sym_info INOUT);
+search_addr2line_in_cu(dwarf_module_t *mod, Dwarf_Addr pc, cu_info_t *cu,
+                       bool check_range, drsym_info_t *sym_info INOUT);
 
 /******************************************************************************
  * DWARF parsing code.
@@ -90,97 +160,382 @@ next_die_matching_tag(Dwarf_Debug dbg, Dwarf_Tag search_tag)
     return die;
 }
 
-/* Iterate over all the CUs in the module to find the CU containing the given
- * PC.
+/******************************************************************************
+ * CU index.
  */
-static Dwarf_Die
-find_cu_die_via_iter(Dwarf_Debug dbg, Dwarf_Addr pc)
+
+static void
+cu_index_add_range(dwarf_module_t *mod, uint *capacity INOUT, Dwarf_Addr start,
+                   Dwarf_Addr end, uint cu_idx)
+{
+    if (start >= end)
+        return;
+    if (mod->num_ranges == *capacity) {
+        uint new_cap = (*capacity == 0) ? 64 : *capacity * 2;
+        cu_range_t *ranges = (cu_range_t *) dr_global_alloc(new_cap * sizeof(*ranges));
+        if (mod->ranges != NULL) {
+            memcpy(ranges, mod->ranges, mod->num_ranges * sizeof(*ranges));
+            dr_global_free(mod->ranges, *capacity * sizeof(*ranges));
+        }
+        mod->ranges = ranges;
+        *capacity = new_cap;
+    }
+    mod->ranges[mod->num_ranges].start = start;
+    mod->ranges[mod->num_ranges].end = end;
+    mod->ranges[mod->num_ranges].cu_idx = cu_idx;
+    mod->num_ranges++;
+}
+
+static int
+compare_cu_ranges(const void *a_in, const void *b_in)
+{
+    const cu_range_t *a = (const cu_range_t *)a_in;
+    const cu_range_t *b = (const cu_range_t *)b_in;
+    if (a->start > b->start)
+        return 1;
+    if (a->start < b->start)
+        return -1;
+    if (a->cu_idx > b->cu_idx)
+        return 1;
+    if (a->cu_idx < b->cu_idx)
+        return -1;
+    return 0;
+}
+
+static int
+compare_cu_offs(const void *a_in, const void *b_in)
+{
+    const cu_info_t *a = (const cu_info_t *)a_in;
+    const cu_info_t *b = (const cu_info_t *)b_in;
+    if (a->die_offs > b->die_offs)
+        return 1;
+    if (a->die_offs < b->die_offs)
+        return -1;
+    return 0;
+}
+
+/* Returns the index into mod->cus of the CU whose DIE is at die_offs, or -1 */
+static int
+cu_index_find_cu(dwarf_module_t *mod, Dwarf_Off die_offs)
+{
+    uint min = 0, max = mod->num_cus;
+    while (min < max) {
+        uint mid = min + (max - min) / 2;
+        if (mod->cus[mid].die_offs == die_offs)
+            return (int) mid;
+        if (mod->cus[mid].die_offs < die_offs)
+            min = mid + 1;
+        else
+            max = mid;
+    }
+    return -1;
+}
+
+/* Walks all the CU headers once to record each CU and its lowpc+highpc range,
+ * and adds the ranges from .debug_aranges, which cover CUs with
+ * non-contiguous code.
+ */
+static void
+cu_index_build(dwarf_module_t *mod)
 {
-    Dwarf_Die die = NULL;
     Dwarf_Unsigned cu_offset = 0;
     Dwarf_Error de = {0};
-    Dwarf_Die cu_die = NULL;
+    Dwarf_Arange *arlist;
+    Dwarf_Signed arcnt, i;
+    uint cu_cap = 0, range_cap = 0;
+    uint j;
+    Dwarf_Addr max_end = 0;
 
-    while (dwarf_next_cu_header(dbg, NULL, NULL, NULL, NULL,
+    while (dwarf_next_cu_header(mod->dbg, NULL, NULL, NULL, NULL,
                                 &cu_offset, &de) == DW_DLV_OK) {
         /* Scan forward in the tag soup for a CU DIE. */
-        die = next_die_matching_tag(dbg, DW_TAG_compile_unit);
+        Dwarf_Die die = next_die_matching_tag(mod->dbg, DW_TAG_compile_unit);
+        Dwarf_Off die_offs;
+        Dwarf_Addr lo_pc, hi_pc;
+        if (die == NULL)
+            continue;
+        if (dwarf_dieoffset(die, &die_offs, &de) != DW_DLV_OK) {
+            NOTIFY_DWARF(de);
+            continue;
+        }
+        if (mod->num_cus == cu_cap) {
+            uint new_cap = (cu_cap == 0) ? 64 : cu_cap * 2;
+            cu_info_t *cus = (cu_info_t *) dr_global_alloc(new_cap * sizeof(*cus));
+            if (mod->cus != NULL) {
+                memcpy(cus, mod->cus, mod->num_cus * sizeof(*cus));
+                dr_global_free(mod->cus, cu_cap * sizeof(*cus));
+            }
+            mod->cus = cus;
+            cu_cap = new_cap;
+        }
+        memset(&mod->cus[mod->num_cus], 0, sizeof(mod->cus[mod->num_cus]));
+        mod->cus[mod->num_cus].die_offs = die_offs;
+        /* Cygwin and MinGW gcc and clang don't always include these */
+        if (dwarf_lowpc(die, &lo_pc, &de) == DW_DLV_OK &&
+            dwarf_highpc(die, &hi_pc, &de) == DW_DLV_OK)
+            cu_index_add_range(mod, &range_cap, lo_pc, hi_pc, mod->num_cus);
+        mod->num_cus++;
+    }
+    /* CU headers are in offset order, but we don't rely on it */
+    for (j = 1; j < mod->num_cus; j++) {
+        if (mod->cus[j].die_offs < mod->cus[j - 1].die_offs) {
+            qsort(mod->cus, mod->num_cus, sizeof(*mod->cus), compare_cu_offs);
+            break;
+        }
+    }
 
-        /* We found a CU die, now check if it's the one we wanted. */
-        if (die != NULL) {
-            Dwarf_Addr lo_pc, hi_pc;
-            if (dwarf_lowpc(die, &lo_pc, &de) != DW_DLV_OK ||
-                dwarf_highpc(die, &hi_pc, &de) != DW_DLV_OK) {
+    if (dwarf_get_aranges(mod->dbg, &arlist, &arcnt, &de) == DW_DLV_OK) {
+        for (i = 0; i < arcnt; i++) {
+            Dwarf_Addr start;
+            Dwarf_Unsigned length;
+            Dwarf_Off die_offs;
+            int cu_idx;
+            if (dwarf_get_arange_info(arlist[i], &start, &length, &die_offs,
+                                      &de) != DW_DLV_OK) {
                 NOTIFY_DWARF(de);
-                break;
+                continue;
             }
+            cu_idx = cu_index_find_cu(mod, die_offs);
+            if (cu_idx >= 0)
+                cu_index_add_range(mod, &range_cap, start, start + length, cu_idx);
+        }
+    }
 
-            if (lo_pc <= pc && pc < hi_pc) {
-                cu_die = die;
-                break;
-            }
+    if (mod->num_ranges > 0) {
+        qsort(mod->ranges, mod->num_ranges, sizeof(*mod->ranges), compare_cu_ranges);
+        for (j = 0; j < mod->num_ranges; j++) {
+            if (mod->ranges[j].end > max_end)
+                max_end = mod->ranges[j].end;
+            mod->ranges[j].max_end = max_end;
+        }
+    }
+    /* Keep the exact size for the free */
+    if (mod->ranges != NULL && range_cap > mod->num_ranges) {
+        cu_range_t *ranges = NULL;
+        if (mod->num_ranges > 0) {
+            ranges = (cu_range_t *) dr_global_alloc(mod->num_ranges * sizeof(*ranges));
+            memcpy(ranges, mod->ranges, mod->num_ranges * sizeof(*ranges));
         }
+        dr_global_free(mod->ranges, range_cap * sizeof(*mod->ranges));
+        mod->ranges = ranges;
     }
+    if (mod->cus != NULL && cu_cap > mod->num_cus) {
+        cu_info_t *cus = (cu_info_t *) dr_global_alloc(mod->num_cus * sizeof(*cus));
+        memcpy(cus, mod->cus, mod->num_cus * sizeof(*cus));
+        dr_global_free(mod->cus, cu_cap * sizeof(*mod->cus));
+        mod->cus = cus;
+    }
+    NOTIFY("%s: %u CUs, %u ranges\n", __FUNCTION__, mod->num_cus, mod->num_ranges);
+    mod->cu_index_built = true;
+}
 
-    while (dwarf_next_cu_header(dbg, NULL, NULL, NULL, NULL,
-                                &cu_offset, &de) == DW_DLV_OK) {
-        /* Reset the internal CU header state. */
+/* Returns the CU whose range contains pc, or NULL */
+static cu_info_t *
+find_cu(dwarf_module_t *mod, Dwarf_Addr pc)
+{
+    uint min = 0, max;
+    int i;
+    if (!mod->cu_index_built) {
+        dr_mutex_lock(mod->lock);
+        if (!mod->cu_index_built)
+            cu_index_build(mod);
+        dr_mutex_unlock(mod->lock);
+    }
+    max = mod->num_ranges;
+    /* binary search for the first range starting beyond pc */
+    while (min < max) {
+        uint mid = min + (max - min) / 2;
+        if (mod->ranges[mid].start <= pc)
+            min = mid + 1;
+        else
+            max = mid;
+    }
+    for (i = (int)min - 1; i >= 0 && mod->ranges[i].max_end > pc; i--) {
+        if (mod->ranges[i].end > pc)
+            return &mod->cus[mod->ranges[i].cu_idx];
     }
+    return NULL;
+}
+
+/******************************************************************************
+ * Line table cache.
+ */
+
+static void
+line_table_lru_remove(line_table_t *table)
+{
+    if (table->lru_prev == NULL)
+        lru_head = table->lru_next;
+    else
+        table->lru_prev->lru_next = table->lru_next;
+    if (table->lru_next == NULL)
+        lru_tail = table->lru_prev;
+    else
+        table->lru_next->lru_prev = table->lru_prev;
+}
 
-    return cu_die;
+static void
+line_table_lru_push(line_table_t *table)
+{
+    table->lru_prev = NULL;
+    table->lru_next = lru_head;
+    if (lru_head != NULL)
+        lru_head->lru_prev = table;
+    lru_head = table;
+    if (lru_tail == NULL)
+        lru_tail = table;
 }
 
-static Dwarf_Die
-find_cu_die(Dwarf_Debug dbg, Dwarf_Addr pc)
+/* Marks table as the most recently used */
+static void
+line_table_touch(line_table_t *table)
 {
-    Dwarf_Error de = {0};
-    Dwarf_Die cu_die = NULL;
-    Dwarf_Arange *arlist;
-    Dwarf_Signed arcnt;
-    Dwarf_Arange ar;
-    Dwarf_Off die_offs;
-    if (dwarf_get_aranges(dbg, &arlist, &arcnt, &de) != DW_DLV_OK ||
-        dwarf_get_arange(arlist, arcnt, pc, &ar, &de) != DW_DLV_OK ||
-        dwarf_get_cu_die_offset(ar, &die_offs, &de) != DW_DLV_OK ||
-        dwarf_offdie(dbg, die_offs, &cu_die, &de) != DW_DLV_OK) {
-        NOTIFY_DWARF(de);
-        /* Try to find it by walking all CU's and looking at their lowpc+highpc
-         * entries, which should work if each has a single contiguous
-         * range.  Note that Cygwin and MinGW gcc don't seen to include
-         * lowpc+highpc in their CU's.
-         */
-        cu_die = find_cu_die_via_iter(dbg, pc);
+    if (table != lru_head) {
+        line_table_lru_remove(table);
+        line_table_lru_push(table);
     }
-    return cu_die;
+}
+
+static void
+line_table_free(line_table_t *table)
+{
+    line_table_lru_remove(table);
+    line_cache_size -= table->size;
+    table->cu->table = NULL;
+    if (table->lines != NULL)
+        dr_global_free(table->lines, table->num_lines * sizeof(*table->lines));
+    dr_global_free(table, sizeof(*table));
+}
+
+/* Evicts least-recently-used tables until the cache is within the limit.
+ * We always keep the most recent table so that a single CU with a line table
+ * larger than the limit still gets the benefit.
+ */
+static void
+line_cache_trim(void)
+{
+    while (line_cache_size > line_cache_limit && lru_tail != NULL &&
+           lru_tail != lru_head)
+        line_table_free(lru_tail);
 }
 
 static int
-compare_lines(const void *a_in, const void *b_in)
+compare_line_entries(const void *a_in, const void *b_in)
 {
-    const Dwarf_Line a = *(const Dwarf_Line *)a_in;
-    const Dwarf_Line b = *(const Dwarf_Line *)b_in;
-    Dwarf_Addr addr_a, addr_b;
-    Dwarf_Error de = {0};
-    if (dwarf_lineaddr(a, &addr_a, &de) != DW_DLV_OK ||
-        dwarf_lineaddr(b, &addr_b, &de) != DW_DLV_OK)
-        return 0;
-    if (addr_a > addr_b)
+    const line_entry_t *a = (const line_entry_t *)a_in;
+    const line_entry_t *b = (const line_entry_t *)b_in;
+    if (a->addr > b->addr)
         return 1;
-    if (addr_a < addr_b)
+    if (a->addr < b->addr)
         return -1;
     return 0;
 }
 
-/* Given a function DIE and a PC, fill out sym_info with line information.
+/* Decodes the line table for cu into a sorted array that we own, so later
+ * lookups in the same CU are just a binary search.  The caller must hold
+ * mod->lock.
+ */
+static line_table_t *
+line_table_decode(dwarf_module_t *mod, cu_info_t *cu)
+{
+    Dwarf_Die cu_die;
+    Dwarf_Line *lines;
+    Dwarf_Signed num_lines, i;
+    Dwarf_Error de = {0};
+    line_table_t *table;
+    uint num = 0;
+
+    if (dwarf_offdie(mod->dbg, cu->die_offs, &cu_die, &de) != DW_DLV_OK ||
+        dwarf_srclines(cu_die, &lines, &num_lines, &de) != DW_DLV_OK) {
+        NOTIFY_DWARF(de);
+        return NULL;
+    }
+    table = (line_table_t *) dr_global_alloc(sizeof(*table));
+    table->cu = cu;
+    table->lines = NULL;
+    if (num_lines > 0) {
+        table->lines = (line_entry_t *)
+            dr_global_alloc((size_t)num_lines * sizeof(*table->lines));
+    }
+    for (i = 0; i < num_lines; i++) {
+        line_entry_t *entry = &table->lines[num];
+        if (dwarf_lineaddr(lines[i], &entry->addr, &de) != DW_DLV_OK ||
+            dwarf_lineno(lines[i], &entry->lineno, &de) != DW_DLV_OK ||
+            dwarf_linesrc(lines[i], &entry->file, &de) != DW_DLV_OK) {
+            NOTIFY_DWARF(de);
+            continue;
+        }
+        num++;
+    }
+    dwarf_srclines_dealloc(mod->dbg, lines, num_lines);
+    /* Drop any entries that failed to decode */
+    if (num < (uint) num_lines) {
+        line_entry_t *shrunk = NULL;
+        if (num > 0) {
+            shrunk = (line_entry_t *) dr_global_alloc(num * sizeof(*shrunk));
+            memcpy(shrunk, table->lines, num * sizeof(*shrunk));
+        }
+        dr_global_free(table->lines, (size_t)num_lines * sizeof(*table->lines));
+        table->lines = shrunk;
+    }
+    table->num_lines = num;
+    table->size = sizeof(*table) + num * sizeof(*table->lines);
+    /* XXX: we should fix libelftc to sort as it builds the table but for now
+     * it's easier to sort here
+     */
+    qsort(table->lines, num, sizeof(*table->lines), compare_line_entries);
+    return table;
+}
+
+/* Returns the cached line table for cu, decoding it if necessary, or NULL on
+ * failure.  The caller must hold line_cache_lock, which is dropped while
+ * decoding.
+ */
+static line_table_t *
+line_table_get(dwarf_module_t *mod, cu_info_t *cu)
+{
+    line_table_t *table = cu->table;
+    if (table != NULL) {
+        line_table_touch(table);
+        return table;
+    }
+    dr_mutex_unlock(line_cache_lock);
+    dr_mutex_lock(mod->lock);
+    dr_mutex_lock(line_cache_lock);
+    /* Another thread may have decoded it while we waited.  Otherwise, no one
+     * else can set cu->table while we hold mod->lock.
+     */
+    table = cu->table;
+    if (table != NULL) {
+        line_table_touch(table);
+    } else {
+        dr_mutex_unlock(line_cache_lock);
+        table = line_table_decode(mod, cu);
+        dr_mutex_lock(line_cache_lock);
+        if (table != NULL) {
+            if (table->num_lines > 0) {
+                cu->lines_known = true;
+                cu->lines_lo = table->lines[0].addr;
+                cu->lines_hi = table->lines[table->num_lines - 1].addr;
+            }
+            cu->table = table;
+            line_table_lru_push(table);
+            line_cache_size += table->size;
+            line_cache_trim();
+        }
+    }
+    dr_mutex_unlock(mod->lock);
+    return table;
+}
+
+/* Given a PC, fill out sym_info with line information.
  */
 bool
 drsym_dwarf_search_addr2line(void *mod_in, Dwarf_Addr pc, drsym_info_t *sym_info INOUT)
 {
     dwarf_module_t *mod = (dwarf_module_t *) mod_in;
-    Dwarf_Error de = {0};
-    Dwarf_Die cu_die;
-    Dwarf_Unsigned cu_offset = 0;
-    bool success = false;
+    cu_info_t *cu;
+    uint i;
 
     /* On failure, these should be zeroed.
      */
@@ -191,119 +546,96 @@ drsym_dwarf_search_addr2line(void *mod_in, Dwarf_Addr pc, drsym_info_t *sym_info
     /* First try cutting down the search space by finding the CU (i.e., the .c
      * file) that this function belongs to.
      */
-    cu_die = find_cu_die(mod->dbg, pc);
-    if (cu_die == NULL) {
-        NOTIFY("%s: failed to find CU die for "PFX", searching all CUs\n",
-               __FUNCTION__, pc);
-    } else {
-        return search_addr2line_in_cu(mod, pc, cu_die, sym_info);
-    }
+    cu = find_cu(mod, pc);
+    if (cu != NULL)
+        return search_addr2line_in_cu(mod, pc, cu, false, sym_info);
+    NOTIFY("%s: failed to find CU die for "PFX", searching all CUs\n",
+           __FUNCTION__, pc);
 
     /* We failed to find a CU containing this PC.  Some compilers (clang) don't
      * put lo_pc hi_pc attributes on compilation units.  In this case, we
-     * iterate all the CUs and dig into the dwarf tag soup for all of them.
+     * search the line tables of all the CUs.  Once a CU's table has been
+     * decoded we know its range and can skip it without decoding it again.
      */
-    while (dwarf_next_cu_header(mod->dbg, NULL, NULL, NULL, NULL,
-                                &cu_offset, &de) == DW_DLV_OK) {
-        /* Scan forward in the tag soup for a CU DIE. */
-        cu_die = next_die_matching_tag(mod->dbg, DW_TAG_compile_unit);
-
-        /* We found a CU die, now check if it's the one we wanted. */
-        if (cu_die != NULL && search_addr2line_in_cu(mod, pc, cu_die, sym_info)) {
-            success = true;
-            break;
-        }
+    for (i = 0; i < mod->num_cus; i++) {
+        if (search_addr2line_in_cu(mod, pc, &mod->cus[i], true, sym_info))
+            return true;
     }
-
-    while (dwarf_next_cu_header(mod->dbg, NULL, NULL, NULL, NULL,
-                                &cu_offset, &de) == DW_DLV_OK) {
-        /* Reset the internal CU header state. */
-    }
-
-    return success;
+    return false;
 }
 
+/* If check_range is set, skips the CU when its decoded line table does
+ * not span pc.
+ */
 static bool
-search_addr2line_in_cu(dwarf_module_t *mod, Dwarf_Addr pc, Dwarf_Die cu_die,
-                       drsym_info_t *sym_info INOUT)
+search_addr2line_in_cu(dwarf_module_t *mod, Dwarf_Addr pc, cu_info_t *cu,
+                       bool check_range, drsym_info_t *sym_info INOUT)
 {
-    Dwarf_Line *lines;
-    Dwarf_Signed num_lines;
-    int i;
-    Dwarf_Addr lineaddr, next_lineaddr = 0;
-    Dwarf_Line dw_line;
-    bool success = false;
-    Dwarf_Error de = {0};
-
-    if (mod->lines_cu == cu_die) {
-        lines = mod->lines;
-        num_lines = mod->num_lines;
-    } else {
-        if (dwarf_srclines(cu_die, &lines, &num_lines, &de) != DW_DLV_OK) {
-            NOTIFY_DWARF(de);
-            return false;
-        }
-        /* XXX: we should fix libelftc to sort as it builds the table but for now
-         * it's easier to sort and store here
-         */
-        qsort(lines, (size_t)num_lines, sizeof(*lines), compare_lines);
-        /* Save for next query */
-        dwarf_srclines_dealloc(mod->dbg, mod->lines, mod->num_lines);
-        mod->lines_cu = cu_die;
-        mod->lines = lines;
-        mod->num_lines = num_lines;
-    }
-
-    /* We could binary search this, but we assume dwarf_srclines is the
-     * bottleneck.
+    line_table_t *table;
+    uint min, max;
+    line_entry_t *entry;
+    bool res = false;
+
+    dr_mutex_lock(line_cache_lock);
+    if (check_range && cu->lines_known && (pc < cu->lines_lo || pc > cu->lines_hi))
+        goto done;
+    table = line_table_get(mod, cu);
+    if (table == NULL || table->num_lines == 0)
+        goto done;
+    if (check_range && (pc < cu->lines_lo || pc > cu->lines_hi))
+        goto done;
+    /* binary search for the last line starting at or before pc, which is
+     * the last of any lines sharing the same address
      */
-    dw_line = NULL;
-    for (i = 0; i < num_lines - 1; i++) {
-        if (dwarf_lineaddr(lines[i], &lineaddr, &de) != DW_DLV_OK ||
-            dwarf_lineaddr(lines[i + 1], &next_lineaddr, &de) != DW_DLV_OK) {
-            NOTIFY_DWARF(de);
-            break;
-        }
-        if (lineaddr <= pc && pc < next_lineaddr) {
-            dw_line = lines[i];
-            break;
-        }
-    }
-    /* Handle the case when the PC is from the last line of the CU. */
-    if (i == num_lines - 1 && dw_line == NULL && next_lineaddr <= pc) {
-        dw_line = lines[num_lines - 1];
+    min = 0;
+    max = table->num_lines;
+    while (min < max) {
+        uint mid = min + (max - min) / 2;
+        if (table->lines[mid].addr <= pc)
+            min = mid + 1;
+        else
+            max = mid;
     }
+    if (min == 0)
+        goto done;
+    entry = &table->lines[min - 1];
+    sym_info->file = entry->file;
+    sym_info->line = entry->lineno;
+    sym_info->line_offs = (size_t) (pc - entry->addr);
+    res = true;
+ done:
+    dr_mutex_unlock(line_cache_lock);
+    return res;
+}
 
-    /* If we found dw_line, use it to fill out sym_info. */
-    if (dw_line != NULL) {
-        char *file;
-        Dwarf_Unsigned lineno;
+void
+drsym_dwarf_set_cache_limit(size_t max_bytes)
+{
+    dr_mutex_lock(line_cache_lock);
+    line_cache_limit = max_bytes;
+    line_cache_trim();
+    dr_mutex_unlock(line_cache_lock);
+}
 
-        if (dwarf_linesrc(dw_line, &file, &de) != DW_DLV_OK ||
-            dwarf_lineno(dw_line, &lineno, &de) != DW_DLV_OK ||
-            dwarf_lineaddr(dw_line, &lineaddr, &de) != DW_DLV_OK) {
-            NOTIFY_DWARF(de);
-        } else {
-            /* We assume file comes from .debug_str and therefore lives until
-             * drsym_exit.
-             */
-            sym_info->file = file;
-            sym_info->line = lineno;
-            sym_info->line_offs = (size_t) (pc - lineaddr);
-            success = true;
-        }
-    }
+void
+drsym_dwarf_global_init(void)
+{
+    line_cache_lock = dr_mutex_create();
+}
 
-    return success;
+void
+drsym_dwarf_global_exit(void)
+{
+    dr_mutex_destroy(line_cache_lock);
 }
 
 void *
 drsym_dwarf_init(Dwarf_Debug dbg)
 {
     dwarf_module_t *mod = (dwarf_module_t *) dr_global_alloc(sizeof(*mod));
+    memset(mod, 0, sizeof(*mod));
     mod->dbg = dbg;
-    mod->lines_cu = NULL;
-    mod->lines = NULL;
+    mod->lock = dr_mutex_create();
     return mod;
 }
 
@@ -311,9 +643,19 @@ void
 drsym_dwarf_exit(void *mod_in)
 {
     dwarf_module_t *mod = (dwarf_module_t *) mod_in;
-    if (mod->lines != NULL)
-        dwarf_srclines_dealloc(mod->dbg, mod->lines, mod->num_lines);
+    uint i;
+    dr_mutex_lock(line_cache_lock);
+    for (i = 0; i < mod->num_cus; i++) {
+        if (mod->cus[i].table != NULL)
+            line_table_free(mod->cus[i].table);
+    }
+    dr_mutex_unlock(line_cache_lock);
+    if (mod->cus != NULL)
+        dr_global_free(mod->cus, mod->num_cus * sizeof(*mod->cus));
+    if (mod->ranges != NULL)
+        dr_global_free(mod->ranges, mod->num_ranges * sizeof(*mod->ranges));
     dwarf_finish(mod->dbg, NULL);
+    dr_mutex_destroy(mod->lock);
     dr_global_free(mod, sizeof(*mod));
 }
 
@@ -44,6 +44,8 @@
 #include "libdwarf.h"
 
 #include <string.h>
+#include <stdlib.h> /* qsort */
+#include <limits.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <errno.h>
@@ -92,6 +94,17 @@ static bool verbose;
 # define Elf_Sym  Elf32_Sym
 #endif
 
+/* An entry in the address index of the symbol table.  max_end is the
+ * highest end of this and all prior entries, which bounds how far back
+ * an address can be contained by an overlapping symbol.
+ */
+typedef struct _addr_entry_t {
+    size_t start;
+    size_t end;
+    size_t max_end;
+    uint idx;
+} addr_entry_t;
+
 typedef struct _elf_info_t {
     Elf *elf;
     Elf_Sym *syms;
@@ -100,6 +113,9 @@ typedef struct _elf_info_t {
     byte *map_base;
     ptr_uint_t load_base;
     drsym_debug_kind_t debug_kind;
+    /* Symbols with non-zero size sorted by start offset, then by index */
+    addr_entry_t *addr_index;
+    uint addr_index_count;
 } elf_info_t;
 
 /* Looks for a section with real data, not just a section with a header */
@@ -174,6 +190,58 @@ find_load_base(Elf *elf)
     return load_base;
 }
 
+static int
+compare_addr_entries(const void *a_in, const void *b_in)
+{
+    const addr_entry_t *a = (const addr_entry_t *)a_in;
+    const addr_entry_t *b = (const addr_entry_t *)b_in;
+    if (a->start > b->start)
+        return 1;
+    if (a->start < b->start)
+        return -1;
+    if (a->idx > b->idx)
+        return 1;
+    if (a->idx < b->idx)
+        return -1;
+    return 0;
+}
+
+/* Builds the sorted address index used by drsym_obj_addrsearch_symtab().
+ * Zero-sized symbols can never contain an address so they are left out.
+ */
+static void
+build_addr_index(elf_info_t *mod)
+{
+    uint i, count = 0;
+    size_t max_end = 0;
+    if (mod->syms == NULL || mod->num_syms <= 0)
+        return;
+    for (i = 0; i < (uint)mod->num_syms; i++) {
+        if (mod->syms[i].st_size > 0)
+            count++;
+    }
+    if (count == 0)
+        return;
+    mod->addr_index = (addr_entry_t *)
+        dr_global_alloc(count * sizeof(*mod->addr_index));
+    mod->addr_index_count = 0;
+    for (i = 0; i < (uint)mod->num_syms; i++) {
+        if (mod->syms[i].st_size > 0) {
+            addr_entry_t *entry = &mod->addr_index[mod->addr_index_count++];
+            entry->start = mod->syms[i].st_value - mod->load_base;
+            entry->end = entry->start + mod->syms[i].st_size;
+            entry->idx = i;
+        }
+    }
+    qsort(mod->addr_index, mod->addr_index_count, sizeof(*mod->addr_index),
+          compare_addr_entries);
+    for (i = 0; i < mod->addr_index_count; i++) {
+        if (mod->addr_index[i].end > max_end)
+            max_end = mod->addr_index[i].end;
+        mod->addr_index[i].max_end = max_end;
+    }
+}
+
 /******************************************************************************
  * ELF interface to drsyms_unix.c
  */
@@ -242,6 +310,12 @@ drsym_obj_mod_init_post(void *mod_in)
 {
     elf_info_t *mod = (elf_info_t *) mod_in;
     mod->load_base = find_load_base(mod->elf);
+    build_addr_index(mod);
+    /* libelf reads in the string table on first use.  Do that now, as name
+     * queries from address lookups can run concurrently.
+     */
+    if (mod->syms != NULL)
+        elf_strptr(mod->elf, mod->strtab_idx, 0);
     return true;
 }
 
@@ -267,6 +341,10 @@ drsym_obj_mod_exit(void *mod_in)
         return;
     if (mod->elf != NULL)
         elf_end(mod->elf);
+    if (mod->addr_index != NULL) {
+        dr_global_free(mod->addr_index,
+                       mod->addr_index_count * sizeof(*mod->addr_index));
+    }
     dr_global_free(mod, sizeof(*mod));
 }
 
@@ -338,24 +416,41 @@ drsym_error_t
 drsym_obj_addrsearch_symtab(void *mod_in, size_t modoffs, uint *idx OUT)
 {
     elf_info_t *mod = (elf_info_t *) mod_in;
+    uint min, max;
     int i;
+    uint best = UINT_MAX;
 
-    if (mod == NULL || mod->syms == NULL || idx == NULL || mod->syms == NULL)
+    if (mod == NULL || mod->syms == NULL || idx == NULL)
         return DRSYM_ERROR;
+    if (mod->addr_index == NULL)
+        return DRSYM_ERROR_SYMBOL_NOT_FOUND;
 
     /* XXX: if a function is split into non-contiguous pieces, will it
      * have multiple entries?
      */
-    for (i = 0; i < mod->num_syms; i++) {
-        size_t lo_offs = mod->syms[i].st_value - mod->load_base;
-        size_t hi_offs = lo_offs + mod->syms[i].st_size;
-        if (lo_offs <= modoffs && modoffs < hi_offs) {
-            *idx = i;
-            return DRSYM_SUCCESS;
-        }
+    /* binary search for the first entry starting beyond modoffs */
+    min = 0;
+    max = mod->addr_index_count;
+    while (min < max) {
+        uint mid = min + (max - min) / 2;
+        if (mod->addr_index[mid].start <= modoffs)
+            min = mid + 1;
+        else
+            max = mid;
     }
-
-    return DRSYM_ERROR_SYMBOL_NOT_FOUND;
+    /* Symbols can overlap (e.g., aliases, or a local label inside a function).
+     * We return the lowest symbol index that contains modoffs, which is what
+     * a walk of the whole table in order would find.  max_end tells us when
+     * no earlier entry can reach modoffs.
+     */
+    for (i = (int)min - 1; i >= 0 && mod->addr_index[i].max_end > modoffs; i--) {
+        if (mod->addr_index[i].end > modoffs && mod->addr_index[i].idx < best)
+            best = mod->addr_index[i].idx;
+    }
+    if (best == UINT_MAX)
+        return DRSYM_ERROR_SYMBOL_NOT_FOUND;
+    *idx = best;
+    return DRSYM_SUCCESS;
 }
 
 /******************************************************************************
@@ -50,8 +50,11 @@
 #include "drsyms_private.h"
 #include "hashtable.h"
 
-/* Guards our internal state and libdwarf's modifications of mod->dbg.
- * We use a recursive lock to allow queries to be called from enumerate callbacks.
+/* Guards modtable and the per-module state built on demand.  Once loaded, the
+ * data that address lookups use is read-only, or has its own locks (the DWARF
+ * line cache), so address lookups share this lock while loading, lookups by
+ * name, enumeration, and freeing take it exclusively.  Queries from an
+ * enumeration callback already own the lock and do not acquire it again.
  */
 static void *symbol_lock;
 
@@ -71,6 +74,39 @@ static int shmid;
  * Linux lookup layer
  */
 
+/* Returns whether the lock was acquired, which is to be passed to
+ * symbol_unlock().
+ */
+static bool
+symbol_lock_exclusive(void)
+{
+    if (dr_rwlock_self_owns_write_lock(symbol_lock))
+        return false;
+    dr_rwlock_write_lock(symbol_lock);
+    return true;
+}
+
+static bool
+symbol_lock_shared(void)
+{
+    if (dr_rwlock_self_owns_write_lock(symbol_lock))
+        return false;
+    dr_rwlock_read_lock(symbol_lock);
+    return true;
+}
+
+static void
+symbol_unlock(bool locked, bool exclusive)
+{
+    if (!locked)
+        return;
+    if (exclusive)
+        dr_rwlock_write_unlock(symbol_lock);
+    else
+        dr_rwlock_read_unlock(symbol_lock);
+}
+
+/* Caller must hold symbol_lock exclusively */
 static void *
 lookup_or_load(const char *modpath)
 {
@@ -84,6 +120,31 @@ lookup_or_load(const char *modpath)
     return mod;
 }
 
+/* Acquires symbol_lock shared, loading modpath first if necessary.  Returns
+ * NULL, without the lock, if the module cannot be loaded.
+ */
+static void *
+lookup_or_load_shared(const char *modpath, bool *locked OUT)
+{
+    void *mod;
+    *locked = symbol_lock_shared();
+    if (!*locked) /* we own it exclusively */
+        return lookup_or_load(modpath);
+    mod = hashtable_lookup(&modtable, (void*)modpath);
+    if (mod == NULL) {
+        /* We could upgrade in place but DR's rwlock has no such operation */
+        symbol_unlock(true, false);
+        dr_rwlock_write_lock(symbol_lock);
+        mod = lookup_or_load(modpath);
+        dr_rwlock_write_unlock(symbol_lock);
+        if (mod == NULL)
+            return NULL;
+        /* Modules are not removed (i#880) so we don't need to re-look it up */
+        dr_rwlock_read_lock(symbol_lock);
+    }
+    return mod;
+}
+
 static drsym_error_t
 drsym_enumerate_symbols_local(const char *modpath, drsym_enumerate_cb callback,
                               void *data, uint flags)
@@ -91,21 +152,22 @@ drsym_enumerate_symbols_local(const char *modpath, drsym_enumerate_cb callback,
     void *mod;
     drsym_error_t r;
 
+    bool locked;
     if (modpath == NULL || callback == NULL)
         return DRSYM_ERROR_INVALID_PARAMETER;
 
-    dr_recurlock_lock(symbol_lock);
+    locked = symbol_lock_exclusive();
     mod = lookup_or_load(modpath);
     if (mod == NULL) {
-        dr_recurlock_unlock(symbol_lock);
+        symbol_unlock(locked, true);
         return DRSYM_ERROR_LOAD_FAILED;
     }
 
     recursive_context = true;
     r = drsym_unix_enumerate_symbols(mod, callback, data, flags);
-    recursive_context = false;
+    recursive_context = !locked;
 
-    dr_recurlock_unlock(symbol_lock);
+    symbol_unlock(locked, true);
     return r;
 }
 
@@ -116,19 +178,21 @@ drsym_lookup_symbol_local(const char *modpath, const char *symbol,
     void *mod;
     drsym_error_t r;
 
+    bool locked;
     if (modpath == NULL || symbol == NULL || modoffs == NULL)
         return DRSYM_ERROR_INVALID_PARAMETER;
 
-    dr_recurlock_lock(symbol_lock);
+    /* Exclusive as the first lookup builds the name index */
+    locked = symbol_lock_exclusive();
     mod = lookup_or_load(modpath);
     if (mod == NULL) {
-        dr_recurlock_unlock(symbol_lock);
+        symbol_unlock(locked, true);
         return DRSYM_ERROR_LOAD_FAILED;
     }
 
     r = drsym_unix_lookup_symbol(mod, symbol, modoffs, flags);
 
-    dr_recurlock_unlock(symbol_lock);
+    symbol_unlock(locked, true);
     return r;
 }
 
@@ -138,6 +202,7 @@ drsym_lookup_address_local(const char *modpath, size_t modoffs,
 {
     void *mod;
     drsym_error_t r;
+    bool locked;
 
     if (modpath == NULL || out == NULL)
         return DRSYM_ERROR_INVALID_PARAMETER;
@@ -145,16 +210,13 @@ drsym_lookup_address_local(const char *modpath, size_t modoffs,
     if (out->struct_size != sizeof(*out))
         return DRSYM_ERROR_INVALID_SIZE;
 
-    dr_recurlock_lock(symbol_lock);
-    mod = lookup_or_load(modpath);
-    if (mod == NULL) {
-        dr_recurlock_unlock(symbol_lock);
+    mod = lookup_or_load_shared(modpath, &locked);
+    if (mod == NULL)
         return DRSYM_ERROR_LOAD_FAILED;
-    }
 
     r = drsym_unix_lookup_address(mod, modoffs, out, flags);
 
-    dr_recurlock_unlock(symbol_lock);
+    symbol_unlock(locked, false);
     return r;
 }
 
@@ -169,7 +231,7 @@ drsym_init(int shmid_in)
 {
     shmid = shmid_in;
 
-    symbol_lock = dr_recurlock_create();
+    symbol_lock = dr_rwlock_create();
 
     drsym_unix_init();
 
@@ -190,12 +252,13 @@ drsym_error_t
 drsym_exit(void)
 {
     drsym_error_t res = DRSYM_SUCCESS;
-    drsym_unix_exit();
     if (IS_SIDELINE) {
         /* FIXME NYI i#446 */
     }
     hashtable_delete(&modtable);
-    dr_recurlock_destroy(symbol_lock);
+    /* after the modules, which may have DWARF line caches */
+    drsym_unix_exit();
+    dr_rwlock_destroy(symbol_lock);
     return res;
 }
 
@@ -278,14 +341,15 @@ drsym_get_module_debug_kind(const char *modpath, drsym_debug_kind_t *kind OUT)
     } else {
         void *mod;
         drsym_error_t r;
+        bool locked;
 
         if (modpath == NULL || kind == NULL)
             return DRSYM_ERROR_INVALID_PARAMETER;
 
-        dr_recurlock_lock(symbol_lock);
-        mod = lookup_or_load(modpath);
+        mod = lookup_or_load_shared(modpath, &locked);
         r = drsym_unix_get_module_debug_kind(mod, kind);
-        dr_recurlock_unlock(symbol_lock);
+        if (mod != NULL)
+            symbol_unlock(locked, false);
         return r;
     }
 }
@@ -301,6 +365,17 @@ drsym_module_has_symbols(const char *modpath)
     return r;
 }
 
+DR_EXPORT
+drsym_error_t
+drsym_set_line_cache_limit(size_t max_bytes)
+{
+    if (IS_SIDELINE)
+        return DRSYM_ERROR_NOT_IMPLEMENTED;
+    /* the line cache has its own lock */
+    drsym_unix_set_line_cache_limit(max_bytes);
+    return DRSYM_SUCCESS;
+}
+
 DR_EXPORT
 drsym_error_t
 drsym_free_resources(const char *modpath)
@@ -321,9 +396,9 @@ drsym_free_resources(const char *modpath)
         /* FIXME i#880: libdwarf code crashes on a free if unloaded
          * and reloaded later so temporarily disabling this
          */
-        dr_recurlock_lock(symbol_lock);
+        dr_rwlock_write_lock(symbol_lock);
         found = hashtable_remove(&modtable, (void *)modpath);
-        dr_recurlock_unlock(symbol_lock);
+        dr_rwlock_write_unlock(symbol_lock);
 
         return (found ? DRSYM_SUCCESS : DRSYM_ERROR);
 #else
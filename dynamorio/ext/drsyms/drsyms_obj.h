@@ -92,6 +92,12 @@ drsym_obj_debug_path(void);
  * DWARF
  */
 
+void
+drsym_dwarf_global_init(void);
+
+void
+drsym_dwarf_global_exit(void);
+
 void *
 drsym_dwarf_init(Dwarf_Debug dbg);
 
@@ -101,4 +107,7 @@ drsym_dwarf_exit(void *mod_in);
 bool
 drsym_dwarf_search_addr2line(void *mod_in, Dwarf_Addr pc, drsym_info_t *sym_info INOUT);
 
+void
+drsym_dwarf_set_cache_limit(size_t max_bytes);
+
 #endif /* DRSYMS_ARCH_H */
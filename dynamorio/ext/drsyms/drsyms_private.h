@@ -138,4 +138,7 @@ drsym_unix_expand_type(const char *modpath, uint type_id, uint levels_to_expand,
 drsym_error_t
 drsym_unix_get_module_debug_kind(void *moddata, drsym_debug_kind_t *kind OUT);
 
+void
+drsym_unix_set_line_cache_limit(size_t max_bytes);
+
 #endif /* DRSYMS_PRIVATE_H */
@@ -57,6 +57,32 @@
 /* For debugging */
 static bool verbose = false;
 
+/* Hash index over the symbol names of a module, as seen by the enumeration
+ * callback for one set of demangling flags.  A lookup for "foo" matches a
+ * symbol named "foo" or one whose name continues with a parameter list, so
+ * each symbol is entered under its full name and under every prefix that is
+ * followed by a '('.  We store only the hash and length of each key and
+ * re-derive the name to confirm a match, which keeps the index small even for
+ * symbol tables with millions of entries.
+ */
+typedef struct _name_entry_t {
+    uint hash;
+    uint key_len;
+    uint idx;   /* symbol index plus one: 0 means an empty slot */
+} name_entry_t;
+
+typedef struct _name_index_t {
+    name_entry_t *table;
+    uint capacity; /* always a power of 2 */
+    uint entries;
+} name_index_t;
+
+/* Separate indices for no demangling, DRSYM_DEMANGLE, and DRSYM_DEMANGLE_FULL */
+#define NAME_INDEX_COUNT 3
+#define NAME_INDEX_MIN_CAPACITY 1024
+/* Marks an index we could not build, so we fall back to a linear walk */
+#define NAME_INDEX_FAILED ((name_index_t *)(ptr_uint_t)1)
+
 typedef struct _dbg_module_t {
     file_t fd;
     size_t file_size;
@@ -70,6 +96,8 @@ typedef struct _dbg_module_t {
      * while the primary mod has symtab+strtab.
      */
     struct _dbg_module_t *mod_with_dwarf;
+    /* Built on the first lookup by name with the corresponding flags */
+    name_index_t *name_index[NAME_INDEX_COUNT];
 } dbg_module_t;
 
 /******************************************************************************
@@ -77,6 +105,7 @@ typedef struct _dbg_module_t {
  */
 
 static void unload_module(dbg_module_t *mod);
+static void name_index_free(name_index_t *index);
 static bool follow_debuglink(const char * modpath, dbg_module_t *mod,
                              const char *debuglink, char debug_modpath[MAXIMUM_PATH]);
 
@@ -159,6 +188,9 @@ load_module(const char *modpath)
                     /* We need both */
                     mod->mod_with_dwarf = newmod;
                     mod->debug_kind |= newmod->debug_kind;
+                    /* mod's symtab still needs its load base and address index */
+                    if (!drsym_obj_mod_init_post(mod->obj_info))
+                        goto error;
                 } else {
                     /* Debuglink is all we need */
                     unload_module(mod);
@@ -260,6 +292,7 @@ follow_debuglink(const char *modpath, dbg_module_t *mod, const char *debuglink,
 static void
 unload_module(dbg_module_t *mod)
 {
+    uint i;
     if (mod->dwarf_info != NULL)
         drsym_dwarf_exit(mod->dwarf_info);
     if (mod->obj_info != NULL)
@@ -270,6 +303,10 @@ unload_module(dbg_module_t *mod)
         dr_close_file(mod->fd);
     if (mod->mod_with_dwarf != NULL)
         unload_module(mod->mod_with_dwarf);
+    for (i = 0; i < NAME_INDEX_COUNT; i++) {
+        if (mod->name_index[i] != NULL && mod->name_index[i] != NAME_INDEX_FAILED)
+            name_index_free(mod->name_index[i]);
+    }
     dr_global_free(mod, sizeof(*mod));
 }
 
@@ -277,6 +314,34 @@ unload_module(dbg_module_t *mod)
  * Symbol table parsing
  */
 
+/* Returns the name of symbol idx as passed to enumeration callbacks for flags:
+ * demangled into *buf, which is grown as needed, or else the mangled name.
+ * Returns NULL on error.
+ */
+static const char *
+symbol_name_for_flags(dbg_module_t *mod, uint idx, uint flags,
+                      char **buf INOUT, size_t *buf_size INOUT)
+{
+    const char *mangled = drsym_obj_symbol_name(mod->obj_info, idx);
+    if (mangled == NULL)
+        return NULL;
+    if (TEST(DRSYM_DEMANGLE, flags)) {
+        size_t len;
+        /* Resize until it's big enough. */
+        while ((len = drsym_demangle_symbol(*buf, *buf_size, mangled, flags))
+               > *buf_size) {
+            dr_global_free(*buf, *buf_size);
+            *buf_size = len;
+            *buf = dr_global_alloc(*buf_size);
+        }
+        if (len != 0) {
+            /* Success. */
+            return *buf;
+        }
+    }
+    return mangled;
+}
+
 static drsym_error_t
 symsearch_symtab(dbg_module_t *mod, drsym_enumerate_cb callback, void *data,
                  uint flags)
@@ -295,32 +360,19 @@ symsearch_symtab(dbg_module_t *mod, drsym_enumerate_cb callback, void *data,
     symbol_buf = dr_global_alloc(symbol_buf_size);
 
     for (i = 0; keep_searching && i < num_syms; i++) {
-        const char *mangled = drsym_obj_symbol_name(mod->obj_info, i);
-        const char *unmangled = mangled;  /* Points at mangled or symbol_buf. */
+        /* Points at mangled name or symbol_buf. */
+        const char *unmangled = symbol_name_for_flags(mod, i, flags, &symbol_buf,
+                                                      &symbol_buf_size);
         size_t modoffs;
-        if (mangled == NULL)
-            return DRSYM_ERROR;
+        if (unmangled == NULL) {
+            res = DRSYM_ERROR;
+            break;
+        }
 
         res = drsym_obj_symbol_offs(mod->obj_info, i, &modoffs, NULL);
         if (res != DRSYM_SUCCESS)
             break;
 
-        if (TEST(DRSYM_DEMANGLE, flags)) {
-            size_t len;
-            /* Resize until it's big enough. */
-            while ((len = drsym_demangle_symbol(symbol_buf, symbol_buf_size,
-                                                mangled, flags))
-                   > symbol_buf_size) {
-                dr_global_free(symbol_buf, symbol_buf_size);
-                symbol_buf_size = len;
-                symbol_buf = dr_global_alloc(symbol_buf_size);
-            }
-            if (len != 0) {
-                /* Success. */
-                unmangled = symbol_buf;
-            }
-        }
-
         keep_searching = callback(unmangled, modoffs, data);
     }
 
@@ -329,6 +381,155 @@ symsearch_symtab(dbg_module_t *mod, drsym_enumerate_cb callback, void *data,
     return res;
 }
 
+/******************************************************************************
+ * Symbol name index
+ */
+
+static uint
+name_hash(const char *name, size_t len)
+{
+    /* FNV-1a */
+    uint hash = 2166136261U;
+    size_t i;
+    for (i = 0; i < len; i++) {
+        hash ^= (byte) name[i];
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+static void
+name_index_free(name_index_t *index)
+{
+    dr_global_free(index->table, index->capacity * sizeof(*index->table));
+    dr_global_free(index, sizeof(*index));
+}
+
+static void
+name_index_insert_entry(name_entry_t *table, uint capacity, name_entry_t *entry)
+{
+    uint slot = entry->hash & (capacity - 1);
+    while (table[slot].idx != 0)
+        slot = (slot + 1) & (capacity - 1);
+    table[slot] = *entry;
+}
+
+static void
+name_index_add(name_index_t *index, const char *name, size_t len, uint idx)
+{
+    name_entry_t entry;
+    if ((index->entries + 1) * 4 > index->capacity * 3) {
+        uint i, new_capacity = index->capacity * 2;
+        name_entry_t *new_table = dr_global_alloc(new_capacity * sizeof(*new_table));
+        memset(new_table, 0, new_capacity * sizeof(*new_table));
+        for (i = 0; i < index->capacity; i++) {
+            if (index->table[i].idx != 0)
+                name_index_insert_entry(new_table, new_capacity, &index->table[i]);
+        }
+        dr_global_free(index->table, index->capacity * sizeof(*index->table));
+        index->table = new_table;
+        index->capacity = new_capacity;
+    }
+    entry.hash = name_hash(name, len);
+    entry.key_len = (uint) len;
+    entry.idx = idx + 1;
+    name_index_insert_entry(index->table, index->capacity, &entry);
+    index->entries++;
+}
+
+static name_index_t *
+name_index_build(dbg_module_t *mod, uint flags)
+{
+    name_index_t *index;
+    int num_syms = drsym_obj_num_symbols(mod->obj_info);
+    char *symbol_buf;
+    size_t symbol_buf_size = 1024;
+    int i;
+    if (num_syms <= 0)
+        return NULL;
+    index = dr_global_alloc(sizeof(*index));
+    index->capacity = NAME_INDEX_MIN_CAPACITY;
+    while (index->capacity < (uint)num_syms * 2)
+        index->capacity *= 2;
+    index->entries = 0;
+    index->table = dr_global_alloc(index->capacity * sizeof(*index->table));
+    memset(index->table, 0, index->capacity * sizeof(*index->table));
+    symbol_buf = dr_global_alloc(symbol_buf_size);
+    for (i = 0; i < num_syms; i++) {
+        const char *name = symbol_name_for_flags(mod, i, flags, &symbol_buf,
+                                                 &symbol_buf_size);
+        const char *paren;
+        if (name == NULL) {
+            name_index_free(index);
+            index = NULL;
+            break;
+        }
+        for (paren = strchr(name, '('); paren != NULL; paren = strchr(paren + 1, '('))
+            name_index_add(index, name, paren - name, i);
+        name_index_add(index, name, strlen(name), i);
+    }
+    dr_global_free(symbol_buf, symbol_buf_size);
+    NOTIFY("%s: indexed %d symbols under %u names\n", __FUNCTION__, num_syms,
+           index == NULL ? 0 : index->entries);
+    return index;
+}
+
+/* Returns the index of the first symbol matching search_sym as sym_lookup_cb()
+ * would, or -1 if there is none.
+ */
+static int
+name_index_lookup(dbg_module_t *mod, name_index_t *index, const char *search_sym,
+                  uint flags)
+{
+    size_t len = strlen(search_sym);
+    uint hash = name_hash(search_sym, len);
+    uint last_tried = 0;
+    char *symbol_buf;
+    size_t symbol_buf_size = 1024;
+    int res = -1;
+    symbol_buf = dr_global_alloc(symbol_buf_size);
+    /* Overloads share a key, so there can be several candidates.  The symbol
+     * table order decides which one a linear walk finds, so we confirm the
+     * candidates from the lowest index up.
+     */
+    while (res == -1) {
+        uint slot = hash & (index->capacity - 1);
+        uint best = 0;
+        const char *name;
+        for (; index->table[slot].idx != 0; slot = (slot + 1) & (index->capacity - 1)) {
+            name_entry_t *entry = &index->table[slot];
+            if (entry->hash == hash && entry->key_len == len && entry->idx > last_tried &&
+                (best == 0 || entry->idx < best))
+                best = entry->idx;
+        }
+        if (best == 0)
+            break;
+        name = symbol_name_for_flags(mod, best - 1, flags, &symbol_buf,
+                                     &symbol_buf_size);
+        if (name != NULL && strncmp(name, search_sym, len) == 0 &&
+            (name[len] == '\0' || name[len] == '('))
+            res = best - 1;
+        last_tried = best;
+    }
+    dr_global_free(symbol_buf, symbol_buf_size);
+    return res;
+}
+
+static name_index_t *
+name_index_get(dbg_module_t *mod, uint flags)
+{
+    uint which = !TEST(DRSYM_DEMANGLE, flags) ? 0 :
+        (TEST(DRSYM_DEMANGLE_FULL, flags) ? 2 : 1);
+    if (mod->name_index[which] == NULL) {
+        mod->name_index[which] = name_index_build(mod, flags);
+        if (mod->name_index[which] == NULL)
+            mod->name_index[which] = NAME_INDEX_FAILED;
+    }
+    if (mod->name_index[which] == NAME_INDEX_FAILED)
+        return NULL;
+    return mod->name_index[which];
+}
+
 static drsym_error_t
 addrsearch_symtab(dbg_module_t *mod, size_t modoffs, drsym_info_t *info INOUT,
                   uint flags)
@@ -368,12 +569,19 @@ void
 drsym_unix_init(void)
 {
     drsym_obj_init();
+    drsym_dwarf_global_init();
 }
 
 void
 drsym_unix_exit(void)
 {
-    /* nothing */
+    drsym_dwarf_global_exit();
+}
+
+void
+drsym_unix_set_line_cache_limit(size_t max_bytes)
+{
+    drsym_dwarf_set_cache_limit(max_bytes);
 }
 
 void *
@@ -435,6 +643,7 @@ drsym_unix_lookup_symbol(void *mod_in, const char *symbol, size_t *modoffs OUT,
     drsym_error_t r;
     const char *sym_no_mod;
     sym_lookup_params_t params;
+    name_index_t *index;
 
     if (symbol == NULL) {
         sym_no_mod = NULL;
@@ -455,16 +664,20 @@ drsym_unix_lookup_symbol(void *mod_in, const char *symbol, size_t *modoffs OUT,
 
     *modoffs = 0;
 
-    if (!TEST(DRSYM_SYMBOLS, mod->debug_kind)) {
-        /* XXX i#883: we have no symbols and we're just looking at exports so we
-         * should do a fast hashtable lookup instead of a linear walk.
-         * DR already has the code for this, accessible via dr_get_proc_address(),
-         * except that interface will only work for online (i.e., non-standalone)
-         * use.
-         */
-    }
-
-    if (*modoffs == 0) {
+    /* We used to walk and demangle the whole symbol table for every lookup
+     * (i#883).  Now the first lookup builds a name index, unless there is
+     * nothing to find (an empty search string matches anything).
+     */
+    index = (sym_no_mod[0] == '\0') ? NULL : name_index_get(mod, flags);
+    if (index != NULL) {
+        int idx = name_index_lookup(mod, index, sym_no_mod, flags);
+        if (idx >= 0) {
+            NOTIFY("Looked up symbol: %s #%d\n", sym_no_mod, idx);
+            r = drsym_obj_symbol_offs(mod->obj_info, idx, modoffs, NULL);
+            if (r != DRSYM_SUCCESS)
+                return r;
+        }
+    } else {
         params.search_sym = sym_no_mod;
         params.search_sym_len = strlen(sym_no_mod);
         params.modoffs = modoffs;
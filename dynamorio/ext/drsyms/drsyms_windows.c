@@ -206,6 +206,8 @@ drsym_exit(void)
             res = DRSYM_ERROR;
         }
     }
+    /* after the modules, which may have DWARF line caches */
+    drsym_unix_exit();
     dr_recurlock_destroy(symbol_lock);
 
     return res;
@@ -1304,6 +1306,19 @@ drsym_module_has_symbols(const char *modpath)
     }
 }
 
+/* Only applies to DWARF modules (Cygwin and MinGW) */
+DR_EXPORT
+drsym_error_t
+drsym_set_line_cache_limit(size_t max_bytes)
+{
+    if (IS_SIDELINE)
+        return DRSYM_ERROR_NOT_IMPLEMENTED;
+    dr_recurlock_lock(symbol_lock);
+    drsym_unix_set_line_cache_limit(max_bytes);
+    dr_recurlock_unlock(symbol_lock);
+    return DRSYM_SUCCESS;
+}
+
 /* We do not want to take unlimited resources when a client queries a whole
  * bunch of libraries.  Usually the client will query at module load and
  * then not again, unless in a callstack later.  So we can save a lot of memory
@@ -0,0 +1,514 @@
+/* **********************************************************
+ * Copyright (c) 2012 Google, Inc.  All rights reserved.
+ * **********************************************************/
+
+/*
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * 
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * 
+ * * Neither the name of Google, Inc. nor the names of its contributors may be
+ *   used to endorse or promote products derived from this software without
+ *   specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL GOOGLE, INC. OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/* Tests the drcontainers extension's open-addressed ohashtable_t.
+ *
+ * With the client option "-bench" this instead times hashtable_t against
+ * ohashtable_t on the malloc table's access patterns, keyed by heap
+ * addresses: "-bench <live_entries> <operations>".
+ */
+
+#include "dr_api.h"
+#include "client_tools.h"
+#include "hashtable.h"
+#include <string.h> /* strncmp */
+
+#define CHECK(x, msg) do {               \
+    if (!(x)) {                          \
+        dr_fprintf(STDERR, "CHECK failed %s:%d: %s\n", __FILE__, __LINE__, msg); \
+        dr_abort();                      \
+    }                                    \
+} while (0);
+
+/* keys are aligned like heap addresses */
+#define KEY(i) ((void *)(ptr_uint_t)(((i) + 1) * 16))
+/* a payload must not be NULL */
+#define PAYLOAD(i) ((void *)(ptr_uint_t)((i) * 3 + 1))
+
+/* Returns the slot holding key, or -1 */
+static int
+slot_of(ohashtable_t *table, void *key)
+{
+    uint i;
+    ohashtable_lock(table);
+    for (i = 0; i < HASHTABLE_SIZE(table->table_bits); i++) {
+        if (table->table[i].payload != NULL && table->table[i].key == key) {
+            ohashtable_unlock(table);
+            return (int) i;
+        }
+    }
+    ohashtable_unlock(table);
+    return -1;
+}
+
+/* Returns a key whose first probe is slot home of the empty table,
+ * trying keys from *next on.
+ */
+static void *
+key_with_home(ohashtable_t *table, int home, uint *next)
+{
+    while (true) {
+        void *key = KEY(*next);
+        int slot;
+        (*next)++;
+        CHECK(ohashtable_add(table, key, key), "add failed");
+        slot = slot_of(table, key);
+        CHECK(ohashtable_remove(table, key), "remove failed");
+        if (slot == home)
+            return key;
+    }
+}
+
+/* Probe runs that wrap from the last slot to the first, and removals that
+ * shift entries back across the wrap.
+ */
+static void
+test_wraparound(void)
+{
+    ohashtable_t table;
+    hashtable_config_t config = {sizeof(config), false/*!resizable*/, 0, false};
+    void *k0, *k1, *k2, *k3;
+    int last;
+    uint next = 0;
+    dr_fprintf(STDERR, "ohashtable wraparound...");
+    ohashtable_init_ex(&table, 4, HASH_INTPTR, false, true, NULL, NULL, NULL);
+    ohashtable_configure(&table, &config);
+    last = (int) HASHTABLE_SIZE(table.table_bits) - 1;
+    k0 = key_with_home(&table, last, &next);
+    k1 = key_with_home(&table, last, &next);
+    k2 = key_with_home(&table, last, &next);
+    k3 = key_with_home(&table, 0, &next);
+    CHECK(table.entries == 0, "searching left entries behind");
+
+    CHECK(ohashtable_add(&table, k0, PAYLOAD(0)), "add failed");
+    CHECK(ohashtable_add(&table, k1, PAYLOAD(1)), "add failed");
+    CHECK(ohashtable_add(&table, k2, PAYLOAD(2)), "add failed");
+    CHECK(ohashtable_add(&table, k3, PAYLOAD(3)), "add failed");
+    CHECK(!ohashtable_add(&table, k2, PAYLOAD(4)), "duplicate add succeeded");
+    CHECK(slot_of(&table, k0) == last && slot_of(&table, k1) == 0 &&
+          slot_of(&table, k2) == 1 && slot_of(&table, k3) == 2, "run did not wrap");
+    CHECK(ohashtable_lookup(&table, k0) == PAYLOAD(0) &&
+          ohashtable_lookup(&table, k1) == PAYLOAD(1) &&
+          ohashtable_lookup(&table, k2) == PAYLOAD(2) &&
+          ohashtable_lookup(&table, k3) == PAYLOAD(3), "lookup failed");
+
+    /* each later entry can move back into the hole, across the wrap */
+    CHECK(ohashtable_remove(&table, k0), "remove failed");
+    CHECK(slot_of(&table, k1) == last && slot_of(&table, k2) == 0 &&
+          slot_of(&table, k3) == 1, "entries not shifted back");
+    CHECK(ohashtable_lookup(&table, k0) == NULL, "removed entry found");
+    CHECK(!ohashtable_remove(&table, k0), "removed entry removed again");
+    /* k3 moves back but not k1, which would leave its home */
+    CHECK(ohashtable_remove(&table, k2), "remove failed");
+    CHECK(slot_of(&table, k1) == last && slot_of(&table, k3) == 0,
+          "entries shifted wrongly");
+    CHECK(ohashtable_lookup(&table, k1) == PAYLOAD(1) &&
+          ohashtable_lookup(&table, k3) == PAYLOAD(3), "lookup failed");
+
+    CHECK(ohashtable_add_replace(&table, k1, PAYLOAD(5)) == PAYLOAD(1),
+          "replace returned wrong payload");
+    CHECK(ohashtable_lookup(&table, k1) == PAYLOAD(5), "replace failed");
+    CHECK(ohashtable_remove_range(&table, KEY(0), KEY(next)), "remove range failed");
+    CHECK(table.entries == 0 && ohashtable_lookup(&table, k3) == NULL,
+          "remove range left entries");
+    ohashtable_delete(&table);
+    dr_fprintf(STDERR, "passed\n");
+}
+
+#define RESIZE_ENTRIES 10000
+
+/* Growth from the smallest table while entries come and go */
+static void
+test_resize(void)
+{
+    ohashtable_t table;
+    uint i;
+    dr_fprintf(STDERR, "ohashtable resize...");
+    ohashtable_init(&table, 1, HASH_INTPTR, false);
+    for (i = 0; i < RESIZE_ENTRIES; i++) {
+        CHECK(ohashtable_add(&table, KEY(i), PAYLOAD(i)), "add failed");
+        /* remove every third entry as we go, so resizes see removals */
+        if (i % 3 == 2)
+            CHECK(ohashtable_remove(&table, KEY(i - 1)), "remove failed");
+    }
+    CHECK(table.entries == RESIZE_ENTRIES - RESIZE_ENTRIES/3, "wrong entry count");
+    /* the default threshold keeps the table at most half full */
+    CHECK(table.entries * 2 <= HASHTABLE_SIZE(table.table_bits), "table not resized");
+    for (i = 0; i < RESIZE_ENTRIES; i++) {
+        bool removed = (i % 3 == 1 && i + 1 < RESIZE_ENTRIES);
+        CHECK(ohashtable_lookup(&table, KEY(i)) == (removed ? NULL : PAYLOAD(i)),
+              "lookup after resize failed");
+        /* interior pointers are never keys */
+        CHECK(ohashtable_lookup(&table, (byte *)KEY(i) + 8) == NULL, "lookup of a miss");
+    }
+    ohashtable_clear(&table);
+    CHECK(table.entries == 0 && ohashtable_lookup(&table, KEY(0)) == NULL,
+          "clear left entries");
+    CHECK(ohashtable_add(&table, KEY(0), PAYLOAD(0)), "add after clear failed");
+    ohashtable_delete(&table);
+    dr_fprintf(STDERR, "passed\n");
+}
+
+#define NUM_READERS 2
+#define NUM_STABLE 64
+#define NUM_CHURN 4096
+#define CHURN_ROUNDS 8
+
+static ohashtable_t shared_table;
+static void *reader_lock;
+static volatile int readers_alive;
+static volatile int readers_dead;
+static volatile bool writer_done;
+static uint reader_errors[NUM_READERS];
+
+/* Looks up keys that stay in the table, and keys that are never added,
+ * while the writer adds, removes, and resizes.
+ */
+static void
+reader_thread(void *arg)
+{
+    uint idx = (uint)(ptr_uint_t) arg;
+    uint i;
+    dr_mutex_lock(reader_lock);
+    readers_alive++;
+    dr_mutex_unlock(reader_lock);
+    while (!writer_done) {
+        for (i = 0; i < NUM_STABLE; i++) {
+            if (ohashtable_lookup(&shared_table, KEY(i)) != PAYLOAD(i))
+                reader_errors[idx]++;
+            if (ohashtable_lookup(&shared_table, (byte *)KEY(i) + 8) != NULL)
+                reader_errors[idx]++;
+        }
+    }
+    dr_mutex_lock(reader_lock);
+    readers_dead++;
+    dr_mutex_unlock(reader_lock);
+}
+
+/* Lock-free lookups concurrent with adds, backward-shift removals, and
+ * resizes that retire the old arrays.
+ */
+static void
+test_concurrent_lookup(void)
+{
+    hashtable_config_t config = {sizeof(config), true/*resizable*/, 50, true};
+    uint i, round;
+    dr_fprintf(STDERR, "ohashtable concurrent lookup...");
+    reader_lock = dr_mutex_create();
+    ohashtable_init_ex(&shared_table, 2, HASH_INTPTR, false, true, NULL, NULL, NULL);
+    ohashtable_configure(&shared_table, &config);
+    for (i = 0; i < NUM_STABLE; i++)
+        CHECK(ohashtable_add(&shared_table, KEY(i), PAYLOAD(i)), "add failed");
+    for (i = 0; i < NUM_READERS; i++) {
+        CHECK(dr_create_client_thread(reader_thread, (void *)(ptr_uint_t) i),
+              "thread creation failed");
+    }
+    while (readers_alive < NUM_READERS)
+        dr_thread_yield();
+
+    for (round = 0; round < CHURN_ROUNDS; round++) {
+        /* the churn keys interleave with the stable ones in the table */
+        for (i = NUM_STABLE; i < NUM_STABLE + NUM_CHURN; i++)
+            CHECK(ohashtable_add(&shared_table, KEY(i), PAYLOAD(i)), "add failed");
+        for (i = NUM_STABLE; i < NUM_STABLE + NUM_CHURN; i++)
+            CHECK(ohashtable_remove(&shared_table, KEY(i)), "remove failed");
+    }
+    CHECK(shared_table.retired != NULL, "resizes did not retire arrays");
+
+    writer_done = true;
+    while (readers_dead < NUM_READERS)
+        dr_thread_yield();
+    for (i = 0; i < NUM_READERS; i++)
+        CHECK(reader_errors[i] == 0, "lock-free lookup failed");
+    CHECK(shared_table.entries == NUM_STABLE, "wrong entry count");
+    for (i = 0; i < NUM_STABLE; i++)
+        CHECK(ohashtable_lookup(&shared_table, KEY(i)) == PAYLOAD(i), "lookup failed");
+    ohashtable_delete(&shared_table);
+    dr_mutex_destroy(reader_lock);
+    dr_fprintf(STDERR, "passed\n");
+}
+
+#define PERSIST_ENTRIES 100
+
+/* The persisted format is shared, so both table types resurrect it */
+static void
+test_persist(void)
+{
+    void *drcontext = dr_get_current_drcontext();
+    ohashtable_t table, otable;
+    hashtable_t htable;
+    char fname[MAXIMUM_PATH];
+    file_t fd;
+    size_t size;
+    byte *buf, *map;
+    uint i;
+    dr_fprintf(STDERR, "ohashtable persist...");
+    ohashtable_init(&table, 4, HASH_INTPTR, false);
+    for (i = 0; i < PERSIST_ENTRIES; i++)
+        CHECK(ohashtable_add(&table, KEY(i), PAYLOAD(i)), "add failed");
+    size = ohashtable_persist_size(drcontext, &table, sizeof(void *), NULL, 0);
+
+    dr_snprintf(fname, BUFFER_SIZE_ELEMENTS(fname), "drcontainers-test.%d.tmp",
+                dr_get_process_id());
+    NULL_TERMINATE_BUFFER(fname);
+    fd = dr_open_file(fname, DR_FILE_WRITE_OVERWRITE);
+    CHECK(fd != INVALID_FILE, "cannot create file");
+    CHECK(ohashtable_persist(drcontext, &table, sizeof(void *), fd, NULL, 0),
+          "persist failed");
+    dr_close_file(fd);
+    buf = (byte *) dr_global_alloc(size + 1);
+    fd = dr_open_file(fname, DR_FILE_READ);
+    CHECK(fd != INVALID_FILE, "cannot open file");
+    CHECK(dr_read_file(fd, buf, size + 1) == (ssize_t) size, "wrong persisted size");
+    dr_close_file(fd);
+    dr_delete_file(fname);
+
+    ohashtable_init(&otable, 1, HASH_INTPTR, false);
+    map = buf;
+    CHECK(ohashtable_resurrect(drcontext, &map, &otable, sizeof(void *), NULL, 0,
+                               NULL), "ohashtable resurrect failed");
+    CHECK(map == buf + size, "ohashtable resurrect consumed wrong size");
+    hashtable_init(&htable, 4, HASH_INTPTR, false);
+    map = buf;
+    CHECK(hashtable_resurrect(drcontext, &map, &htable, sizeof(void *), NULL, 0,
+                              NULL), "hashtable resurrect failed");
+    CHECK(map == buf + size, "hashtable resurrect consumed wrong size");
+    CHECK(otable.entries == PERSIST_ENTRIES && htable.entries == PERSIST_ENTRIES,
+          "wrong resurrected entry count");
+    for (i = 0; i < PERSIST_ENTRIES; i++) {
+        CHECK(ohashtable_lookup(&otable, KEY(i)) == PAYLOAD(i) &&
+              hashtable_lookup(&htable, KEY(i)) == PAYLOAD(i), "resurrected wrongly");
+    }
+    dr_global_free(buf, size + 1);
+    hashtable_delete(&htable);
+    ohashtable_delete(&otable);
+    ohashtable_delete(&table);
+    dr_fprintf(STDERR, "passed\n");
+}
+
+/***************************************************************************
+ * Benchmark
+ */
+
+#define MAX_ALLOC_SIZE 256
+/* as for Dr. Memory's malloc table */
+#define MALLOC_HASH_SHIFT 5
+
+static uint
+malloc_hash(void *key)
+{
+    return (uint)((ptr_uint_t)key >> MALLOC_HASH_SHIFT);
+}
+
+static bool
+malloc_cmp(void *key1, void *key2)
+{
+    return key1 == key2;
+}
+
+typedef struct _bench_ops_t {
+    const char *name;
+    void *(*lookup)(void *table, void *key);
+    bool (*add)(void *table, void *key, void *payload);
+    bool (*remove)(void *table, void *key);
+} bench_ops_t;
+
+static void *
+chained_lookup(void *table, void *key)
+{
+    return hashtable_lookup((hashtable_t *) table, key);
+}
+
+static bool
+chained_add(void *table, void *key, void *payload)
+{
+    return hashtable_add((hashtable_t *) table, key, payload);
+}
+
+static bool
+chained_remove(void *table, void *key)
+{
+    return hashtable_remove((hashtable_t *) table, key);
+}
+
+static void *
+open_lookup(void *table, void *key)
+{
+    return ohashtable_lookup((ohashtable_t *) table, key);
+}
+
+static bool
+open_add(void *table, void *key, void *payload)
+{
+    return ohashtable_add((ohashtable_t *) table, key, payload);
+}
+
+static bool
+open_remove(void *table, void *key)
+{
+    return ohashtable_remove((ohashtable_t *) table, key);
+}
+
+static uint bench_seed;
+
+static uint
+bench_rand(uint n)
+{
+    bench_seed = bench_seed * 1103515245 + 12345;
+    return (bench_seed >> 8) % n;
+}
+
+/* Each table is run over the same sequence, regenerated from the same seed:
+ * + churn: a free (lookup and remove) followed by a malloc (add),
+ *   with a steady number of live entries;
+ * + hit:   lookups of live chunk starts, as for free, realloc, and size queries;
+ * + miss:  lookups of interior pointers, as when the leak scan or a
+ *          wild free asks whether an arbitrary address is a chunk start.
+ * The chunks are allocated from DR's heap.
+ */
+static void
+bench_run(const bench_ops_t *ops, void *table, uint num_live, uint iters)
+{
+    void **live = (void **) dr_global_alloc(num_live * sizeof(*live));
+    size_t *sizes = (size_t *) dr_global_alloc(num_live * sizeof(*sizes));
+    uint64 start, churn_ms, hit_ms, miss_ms;
+    uint i;
+    bench_seed = 42;
+    for (i = 0; i < num_live; i++) {
+        sizes[i] = 1 + bench_rand(MAX_ALLOC_SIZE);
+        live[i] = dr_global_alloc(sizes[i]);
+        CHECK(ops->add(table, live[i], live[i]), "add failed");
+    }
+
+    start = dr_get_milliseconds();
+    for (i = 0; i < iters; i++) {
+        uint victim = bench_rand(num_live);
+        CHECK(ops->lookup(table, live[victim]) == live[victim] &&
+              ops->remove(table, live[victim]), "lookup mismatch");
+        dr_global_free(live[victim], sizes[victim]);
+        sizes[victim] = 1 + bench_rand(MAX_ALLOC_SIZE);
+        live[victim] = dr_global_alloc(sizes[victim]);
+        CHECK(ops->add(table, live[victim], live[victim]), "add failed");
+    }
+    churn_ms = dr_get_milliseconds() - start;
+
+    start = dr_get_milliseconds();
+    for (i = 0; i < iters; i++) {
+        uint idx = bench_rand(num_live);
+        CHECK(ops->lookup(table, live[idx]) == live[idx], "lookup mismatch");
+    }
+    hit_ms = dr_get_milliseconds() - start;
+
+    start = dr_get_milliseconds();
+    for (i = 0; i < iters; i++) {
+        /* never a chunk start since chunks are aligned */
+        CHECK(ops->lookup(table, (byte *)live[bench_rand(num_live)] + 4) == NULL,
+              "lookup mismatch");
+    }
+    miss_ms = dr_get_milliseconds() - start;
+
+    for (i = 0; i < num_live; i++) {
+        CHECK(ops->remove(table, live[i]), "remove failed");
+        dr_global_free(live[i], sizes[i]);
+    }
+    dr_global_free(sizes, num_live * sizeof(*sizes));
+    dr_global_free(live, num_live * sizeof(*live));
+    /* no floating point: dr_fprintf does not support it on Windows */
+    dr_fprintf(STDERR, "%-28s %10u %10u %10u\n", ops->name,
+               (uint)(churn_ms * 1000000 / iters), (uint)(hit_ms * 1000000 / iters),
+               (uint)(miss_ms * 1000000 / iters));
+}
+
+/* Both tables use Dr. Memory's malloc_hash, are synchronized, and have
+ * the same number of buckets or slots, kept at most half full.
+ */
+static void
+bench(uint num_live, uint iters)
+{
+    static const bench_ops_t chained_ops =
+        { "chained hashtable_t", chained_lookup, chained_add, chained_remove };
+    static const bench_ops_t open_ops =
+        { "open-addressed ohashtable_t", open_lookup, open_add, open_remove };
+    hashtable_config_t config = {sizeof(config), false/*!resizable*/, 0, false};
+    hashtable_t htable;
+    ohashtable_t otable;
+    uint bits = 1;
+    while (HASHTABLE_SIZE(bits) < num_live * 2)
+        bits++;
+    dr_fprintf(STDERR, "%u live entries in %u buckets/slots, %u operations per phase\n",
+               num_live, HASHTABLE_SIZE(bits), iters);
+    dr_fprintf(STDERR, "%-28s %10s %10s %10s\n", "ns/op", "churn", "hit", "miss");
+
+    hashtable_init_ex(&htable, bits, HASH_CUSTOM, false, true, NULL,
+                      malloc_hash, malloc_cmp);
+    hashtable_configure(&htable, &config);
+    bench_run(&chained_ops, &htable, num_live, iters);
+    hashtable_delete(&htable);
+
+    ohashtable_init_ex(&otable, bits, HASH_CUSTOM, false, true, NULL,
+                       malloc_hash, malloc_cmp);
+    ohashtable_configure(&otable, &config);
+    bench_run(&open_ops, &otable, num_live, iters);
+    ohashtable_delete(&otable);
+}
+
+/* Parses an optional unsigned decimal argument, leaving *val alone if absent */
+static const char *
+parse_uint(const char *s, uint *val)
+{
+    while (*s == ' ')
+        s++;
+    if (*s >= '0' && *s <= '9') {
+        *val = 0;
+        for (; *s >= '0' && *s <= '9'; s++)
+            *val = *val * 10 + (*s - '0');
+    }
+    return s;
+}
+
+DR_EXPORT void
+dr_init(client_id_t id)
+{
+    const char *ops = dr_get_options(id);
+    if (strncmp(ops, "-bench", strlen("-bench")) == 0) {
+        uint num_live = 65536, iters = 4000000;
+        ops = parse_uint(ops + strlen("-bench"), &num_live);
+        parse_uint(ops, &iters);
+        if (num_live > 0 && iters > 0)
+            bench(num_live, iters);
+        return;
+    }
+    test_wraparound();
+    test_resize();
+    test_concurrent_lookup();
+    test_persist();
+}
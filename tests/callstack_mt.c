@@ -0,0 +1,102 @@
+/* **********************************************************
+ * Copyright (c) 2012 Google, Inc.  All rights reserved.
+ * **********************************************************/
+
+/* Dr. Memory: the memory debugger
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation;
+ * version 2.1 of the License, and no later version.
+
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Library General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Multithreaded callstack benchmark: N threads allocate concurrently from
+ * several call depths so that Dr. Memory records (and looks up the modules
+ * of) many callstacks in parallel.
+ *
+ * Usage: callstack_mt [threads] [iterations-per-thread]
+ * With explicit arguments the elapsed time is printed as well, which is
+ * not done by default so that the test output is deterministic.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#define DEFAULT_THREADS 8
+#define DEFAULT_ITERS 2000
+#define MAX_DEPTH 12
+
+static int num_iters = DEFAULT_ITERS;
+
+static int
+alloc_at_depth(int depth, int seed)
+{
+    int res;
+    if (depth > 0) {
+        /* not a tail call, so each level is a real frame */
+        res = alloc_at_depth(depth - 1, seed * 31 + depth);
+        return res + 1;
+    } else {
+        char *p = (char *) malloc(16 + (seed & 0xff));
+        p[0] = (char) seed;
+        res = p[0];
+        free(p);
+        return res;
+    }
+}
+
+static void *
+thread_func(void *arg)
+{
+    int i, sum = 0;
+    int id = (int)(long) arg;
+    for (i = 0; i < num_iters; i++)
+        sum += alloc_at_depth(i % MAX_DEPTH, id + i);
+    return (void *)(long) sum;
+}
+
+int
+main(int argc, char **argv)
+{
+    pthread_t *threads;
+    int num_threads = DEFAULT_THREADS, i;
+    struct timeval start, end;
+    if (argc > 1)
+        num_threads = atoi(argv[1]);
+    if (argc > 2)
+        num_iters = atoi(argv[2]);
+    threads = (pthread_t *) malloc(num_threads * sizeof(*threads));
+    gettimeofday(&start, NULL);
+    for (i = 0; i < num_threads; i++) {
+        if (pthread_create(&threads[i], NULL, thread_func, (void *)(long) i) != 0) {
+            fprintf(stderr, "cannot create thread\n");
+            return 1;
+        }
+    }
+    for (i = 0; i < num_threads; i++) {
+        if (pthread_join(threads[i], NULL) != 0) {
+            fprintf(stderr, "thread join failed\n");
+            return 1;
+        }
+    }
+    gettimeofday(&end, NULL);
+    free(threads);
+    printf("all threads finished\n");
+    if (argc > 1) {
+        double secs = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+        printf("%d threads x %d allocations: %.3f s, %.0f allocations/s\n",
+               num_threads, num_iters, secs, (num_threads * (double)num_iters) / secs);
+    }
+    return 0;
+}
@@ -0,0 +1,117 @@
+/* **********************************************************
+ * Copyright (c) 2012 Google, Inc.  All rights reserved.
+ * **********************************************************/
+
+/* Dr. Memory: the memory debugger
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation;
+ * version 2.1 of the License, and no later version.
+
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Library General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Test of -replace_malloc's coalescing of free chunks (i#948), run with a
+ * small -delay_frees so that nearly every free leaves the delay queue:
+ * + a run of differently-sized chunks freed in a fragmenting order, holes
+ *   first, must be merged to hold a request larger than any of them, and
+ *   must have been placed below a live chunk after the run;
+ * + a run freed at the end of the arena must be handed back to it, so the
+ *   next new chunk starts inside the run;
+ * + the merged memory, whose interior pages were reset, must read back
+ *   what was written, and a stale pointer into it must not be freeable.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NUM_CHUNKS 4096
+/* more than the chunks evicted by the first pass, which must be freed
+ * before the second one
+ */
+#define NUM_TAIL_CHUNKS (3*NUM_CHUNKS)
+/* larger than any freed chunk, smaller than the runs, and below the size
+ * that gets its own mmap
+ */
+#define BIG_SIZE (96*1024)
+
+static size_t
+frag_size(int i)
+{
+    return (i % 2 == 0) ? 24 : 40;
+}
+
+static int
+contents_ok(unsigned char *p, size_t size)
+{
+    size_t i;
+    for (i = 0; i < size; i++) {
+        if (p[i] != 0)
+            return 0;
+    }
+    for (i = 0; i < size; i++)
+        p[i] = (unsigned char) i;
+    for (i = 0; i < size; i++) {
+        if (p[i] != (unsigned char) i)
+            return 0;
+    }
+    return 1;
+}
+
+int
+main()
+{
+    static char *chunks[NUM_TAIL_CHUNKS];
+    char *fence, *big, *big2, *stale, *hi = NULL;
+    int i;
+
+    /* interior run: the fence keeps it off the end of the arena */
+    for (i = 0; i < NUM_CHUNKS; i++) {
+        chunks[i] = malloc(frag_size(i));
+        if (chunks[i] + frag_size(i) > hi)
+            hi = chunks[i] + frag_size(i);
+    }
+    fence = malloc(3000);
+    for (i = 1; i < NUM_CHUNKS; i += 2)
+        free(chunks[i]);
+    for (i = 0; i < NUM_CHUNKS; i += 2)
+        free(chunks[i]);
+    stale = chunks[1];
+    big = calloc(BIG_SIZE, 1);
+    printf("freed neighbors merged: %s\n", (big < hi) ? "yes" : "no");
+
+    /* tail run: freed in reverse so the newest frees, which stay delayed,
+     * are at its start
+     */
+    hi = NULL;
+    for (i = 0; i < NUM_TAIL_CHUNKS; i++) {
+        chunks[i] = malloc(frag_size(i));
+        if (chunks[i] + frag_size(i) > hi)
+            hi = chunks[i] + frag_size(i);
+    }
+    for (i = NUM_TAIL_CHUNKS - 1; i >= 0; i--)
+        free(chunks[i]);
+    big2 = calloc(BIG_SIZE, 1);
+    printf("arena tail returned: %s\n", (big2 < hi) ? "yes" : "no");
+
+    printf("contents %s\n", (contents_ok((unsigned char *)big, BIG_SIZE) &&
+                             contents_ok((unsigned char *)big2, BIG_SIZE)) ?
+           "ok" : "corrupted");
+
+    free(stale); /* error: absorbed into big */
+
+    free(big);
+    free(big2);
+    free(fence);
+    printf("all done\n");
+    return 0;
+}
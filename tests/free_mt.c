@@ -0,0 +1,76 @@
+/* **********************************************************
+ * Copyright (c) 2012 Google, Inc.  All rights reserved.
+ * **********************************************************/
+
+/* Dr. Memory: the memory debugger
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation;
+ * version 2.1 of the License, and no later version.
+
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Library General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Multithreaded invalid free test: each thread frees each of a run of
+ * adjacent allocations twice.  Delay-free keeps the first free from reaching
+ * libc, so the second is reported as an invalid heap argument and then
+ * freed for real.  Each report looks up the neighboring mallocs, which are
+ * in other stripes of Dr. Memory's malloc table, while other threads are
+ * freeing their own mallocs, which must not deadlock.
+ * The total number of frees must stay below -delay_frees.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#define NUM_THREADS 8
+#define NUM_MALLOCS 100
+#define ALLOC_SIZE 48
+
+static void *
+thread_func(void *arg)
+{
+    void *live[NUM_MALLOCS];
+    int i;
+    for (i = 0; i < NUM_MALLOCS; i++) {
+        live[i] = malloc(ALLOC_SIZE);
+        if (live[i] == NULL)
+            return (void *) -1L;
+    }
+    for (i = 0; i < NUM_MALLOCS; i++) {
+        free(live[i]);
+        free(live[i]); /* error: invalid heap arg */
+    }
+    return NULL;
+}
+
+int
+main()
+{
+    pthread_t threads[NUM_THREADS];
+    int i;
+    for (i = 0; i < NUM_THREADS; i++) {
+        if (pthread_create(&threads[i], NULL, thread_func, NULL) != 0) {
+            fprintf(stderr, "cannot create thread\n");
+            return 1;
+        }
+    }
+    for (i = 0; i < NUM_THREADS; i++) {
+        void *res;
+        if (pthread_join(threads[i], &res) != 0 || res != NULL) {
+            fprintf(stderr, "thread failed\n");
+            return 1;
+        }
+    }
+    printf("all threads finished\n");
+    return 0;
+}
@@ -101,11 +101,60 @@ foo(void)
  */
 #define MAX_ITERS_DIV_4G 20
 
+/* how long to wait for the test harness to create the file we are passed */
+#define MAX_WAIT_SECS 60
+
+/* For the incremental leak scan test: memory that is reachable at the first
+ * nudge and leaked, along with a new allocation, before the second nudge.
+ */
+static void * volatile p3;
+
+static void
+alloc_leaked_later(void)
+{
+    p3 = malloc(23);
+}
+
+static void
+leak_between_nudges(void)
+{
+    void *p1;
+
+    /* error: reachable only through p3, and the page holding it was scanned */
+    p3 = NULL;
+
+    /* error: a new leak */
+    p1 = malloc(31);
+    *((void**)p1) = NULL;
+}
+
+/* returns whether path was created before we timed out */
+static int
+wait_for_file(const char *path)
+{
+    int i;
+    for (i = 0; i < MAX_WAIT_SECS * 10; i++) {
+#ifdef LINUX
+        if (access(path, F_OK) == 0)
+            return 1;
+        usleep(100 * 1000);
+#else
+        if (GetFileAttributes(path) != INVALID_FILE_ATTRIBUTES)
+            return 1;
+        Sleep(100);
+#endif
+    }
+    return 0;
+}
+
 #define EXPANDSTR(x) #x
 #define STRINGIFY(x) EXPANDSTR(x)
 
+/* If passed a path, once the file there is created we change what is leaked:
+ * the test harness creates it between its two nudges.
+ */
 int
-main()
+main(int argc, char *argv[])
 {
 #ifdef LINUX
     intercept_signal(SIGTERM, signal_handler);
@@ -117,6 +166,8 @@ main()
 
     /* PR 428709: test leak detection via nudge */
     foo();
+    if (argc > 1)
+        alloc_leaked_later();
 
     /* indicate we're ready for the nudge: well, really we want to
      * get to the infloop, but close enough
@@ -124,6 +175,15 @@ main()
     fprintf(stderr, "starting\n");
     fflush(stderr);
 
+    if (argc > 1) {
+        if (wait_for_file(argv[1])) {
+            leak_between_nudges();
+            fprintf(stderr, "leaked more\n");
+        } else
+            fprintf(stderr, "timed out waiting for %s\n", argv[1]);
+        fflush(stderr);
+    }
+
 #ifdef LINUX
     /* test register as root: the only pointer to p2's malloc will be in eax: */
     __asm("mov %0, %%eax" : : "g"(p2) : "%eax");
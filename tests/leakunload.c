@@ -0,0 +1,78 @@
+/* **********************************************************
+ * Copyright (c) 2012 Google, Inc.  All rights reserved.
+ * **********************************************************/
+
+/* Dr. Memory: the memory debugger
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation;
+ * version 2.1 of the License, and no later version.
+
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Library General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Leak test for allocations made from a library that is then unloaded:
+ * the leak report must still symbolize the library's frame.  With
+ * -defer_callstacks this tests that unresolved callstacks are resolved
+ * before their module goes away.
+ */
+
+#include <stdio.h>
+#ifdef LINUX
+# include <dlfcn.h>
+#else
+# include <windows.h>
+#endif
+
+typedef void (*lib_alloc_t)(void);
+
+int
+main(int argc, char** argv)
+{
+    lib_alloc_t lib_alloc;
+#ifdef WINDOWS
+    HANDLE lib;
+#else /* LINUX */
+    void *lib;
+#endif
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage error: must pass in path to library to load\n");
+        return 1;
+    }
+
+#ifdef WINDOWS
+    lib = LoadLibrary(argv[1]);
+#else /* LINUX */
+    lib = dlopen(argv[1], RTLD_LAZY);
+#endif
+    if (lib == NULL) {
+        fprintf(stderr, "error loading library %s\n", argv[1]);
+        return 1;
+    }
+#ifdef WINDOWS
+    lib_alloc = (lib_alloc_t) GetProcAddress(lib, "lib_alloc");
+#else /* LINUX */
+    lib_alloc = (lib_alloc_t) dlsym(lib, "lib_alloc");
+#endif
+    if (lib_alloc == NULL) {
+        fprintf(stderr, "error finding lib_alloc\n");
+        return 1;
+    }
+    lib_alloc();
+#ifdef WINDOWS
+    FreeLibrary(lib);
+#else /* LINUX */
+    dlclose(lib);
+#endif
+    fprintf(stderr, "all done\n");
+    return 0;
+}
@@ -0,0 +1,41 @@
+/* **********************************************************
+ * Copyright (c) 2012 Google, Inc.  All rights reserved.
+ * **********************************************************/
+
+/* Dr. Memory: the memory debugger
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation;
+ * version 2.1 of the License, and no later version.
+
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Library General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Library for the leakunload test: its allocation is only pointed at from
+ * its own data, which goes away when it is unloaded.
+ */
+
+#include <stdlib.h>
+
+#ifdef WINDOWS
+#  define LIB_EXPORT __declspec(dllexport)
+#else
+#  define LIB_EXPORT __attribute__ ((visibility ("default")))
+#endif
+
+static void *lib_data;
+
+LIB_EXPORT
+void
+lib_alloc(void)
+{
+    lib_data = malloc(42);
+}
@@ -0,0 +1,164 @@
+/* **********************************************************
+ * Copyright (c) 2012 Google, Inc.  All rights reserved.
+ * **********************************************************/
+
+/* Dr. Memory: the memory debugger
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation;
+ * version 2.1 of the License, and no later version.
+
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Library General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Multithreaded malloc stress test: each thread keeps a window of live
+ * allocations and repeatedly frees, reallocs, and replaces them, checking
+ * that their contents survive, so that Dr. Memory's malloc table is
+ * updated and queried by many threads at once.
+ *
+ * Usage: malloc_mt [max_threads] [operations-per-thread]
+ * With explicit arguments the test is repeated for 1, 2, 4, ... up to
+ * max_threads threads and the throughput of each run is printed to show
+ * how it scales, which is not done by default so that the test output
+ * is deterministic.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#define DEFAULT_THREADS 8
+#define DEFAULT_OPS 20000
+#define WINDOW 64
+#define MAX_SIZE 512
+
+static int num_ops = DEFAULT_OPS;
+
+typedef struct {
+    unsigned char *ptr;
+    size_t size;
+    unsigned char fill;
+} slot_t;
+
+static int
+slot_check(slot_t *slot)
+{
+    size_t i;
+    for (i = 0; i < slot->size; i++) {
+        if (slot->ptr[i] != slot->fill)
+            return 0;
+    }
+    return 1;
+}
+
+static void *
+thread_func(void *arg)
+{
+    slot_t slots[WINDOW];
+    unsigned int seed = (unsigned int)(long) arg * 7919 + 1;
+    long errors = 0;
+    int i;
+    memset(slots, 0, sizeof(slots));
+    for (i = 0; i < num_ops; i++) {
+        slot_t *slot;
+        size_t size;
+        seed = seed * 1103515245 + 12345;
+        slot = &slots[(seed >> 8) % WINDOW];
+        size = 1 + (seed >> 16) % MAX_SIZE;
+        if (slot->ptr != NULL && !slot_check(slot))
+            errors++;
+        if (slot->ptr != NULL && (seed & 3) == 0) {
+            /* realloc keeps the old contents up to the smaller size */
+            unsigned char *p = (unsigned char *) realloc(slot->ptr, size);
+            if (p == NULL)
+                return (void *) -1L;
+            slot->ptr = p;
+            if (size > slot->size)
+                memset(p + slot->size, slot->fill, size - slot->size);
+        } else {
+            free(slot->ptr);
+            slot->ptr = (unsigned char *) malloc(size);
+            if (slot->ptr == NULL)
+                return (void *) -1L;
+            slot->fill = (unsigned char) (seed >> 24);
+            memset(slot->ptr, slot->fill, size);
+        }
+        slot->size = size;
+    }
+    for (i = 0; i < WINDOW; i++) {
+        if (slots[i].ptr != NULL && !slot_check(&slots[i]))
+            errors++;
+        free(slots[i].ptr);
+    }
+    return (void *) errors;
+}
+
+/* Returns the number of errors, or -1 on failure */
+static long
+run(int num_threads, double *secs)
+{
+    pthread_t *threads = (pthread_t *) malloc(num_threads * sizeof(*threads));
+    struct timeval start, end;
+    long errors = 0;
+    int i;
+    gettimeofday(&start, NULL);
+    for (i = 0; i < num_threads; i++) {
+        if (pthread_create(&threads[i], NULL, thread_func, (void *)(long) i) != 0) {
+            fprintf(stderr, "cannot create thread\n");
+            return -1;
+        }
+    }
+    for (i = 0; i < num_threads; i++) {
+        void *res;
+        if (pthread_join(threads[i], &res) != 0) {
+            fprintf(stderr, "thread join failed\n");
+            return -1;
+        }
+        if ((long) res < 0)
+            return -1;
+        errors += (long) res;
+    }
+    gettimeofday(&end, NULL);
+    free(threads);
+    *secs = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+    return errors;
+}
+
+int
+main(int argc, char **argv)
+{
+    int max_threads = DEFAULT_THREADS, num_threads;
+    double secs;
+    long errors;
+    if (argc > 1)
+        max_threads = atoi(argv[1]);
+    if (argc > 2)
+        num_ops = atoi(argv[2]);
+    /* by default only the full run, w/o timing */
+    for (num_threads = (argc > 1 ? 1 : max_threads); num_threads <= max_threads;
+         num_threads *= 2) {
+        errors = run(num_threads, &secs);
+        if (errors < 0) {
+            fprintf(stderr, "allocation failed\n");
+            return 1;
+        }
+        if (errors > 0)
+            printf("%ld corrupted allocations\n", errors);
+        if (argc > 1) {
+            printf("%2d threads x %d operations: %.3f s, %.0f operations/s\n",
+                   num_threads, num_ops, secs, (num_threads * (double)num_ops) / secs);
+        }
+    }
+    printf("all threads finished\n");
+    return 0;
+}
@@ -0,0 +1,129 @@
+/* **********************************************************
+ * Copyright (c) 2012 Google, Inc.  All rights reserved.
+ * **********************************************************/
+
+/* Dr. Memory: the memory debugger
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation;
+ * version 2.1 of the License, and no later version.
+
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Library General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Microbenchmark for realloc growth, meant to be run both natively and
+ * under Dr. Memory with -replace_malloc to compare the two.
+ * The first phase repeatedly grows one buffer past the large-alloc
+ * threshold, where the replacement allocator can mremap it; the second
+ * grows a small buffer in small steps with nothing allocated after it,
+ * where the replacement allocator can extend the final chunk in its arena.
+ *
+ * Usage: realloc_bench [max_MB]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef WINDOWS
+# include <windows.h>
+#else
+# include <sys/time.h>
+#endif
+
+typedef unsigned long long uint64;
+typedef unsigned int uint;
+
+#define MB (1024*1024)
+#define LARGE_START_SIZE MB
+#define LARGE_STEP (MB/2)
+#define SMALL_START_SIZE 64
+#define SMALL_STEP 64
+#define SMALL_MAX_SIZE (64*1024)
+
+static uint64
+get_usecs(void)
+{
+#ifdef WINDOWS
+    return (uint64) GetTickCount() * 1000;
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64)tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
+/* Grows a buffer from start to max bytes in step increments, writing to
+ * each new tail so the copy (if any) is of initialized data.
+ * Returns the number of reallocs, or 0 on failure.
+ */
+static uint
+grow(size_t start, size_t max, size_t step, uint *moves)
+{
+    size_t size = start;
+    uint count = 0;
+    char *buf = (char *) malloc(size);
+    if (buf == NULL)
+        return 0;
+    memset(buf, 0xab, size);
+    *moves = 0;
+    while (size + step <= max) {
+        char *newbuf = (char *) realloc(buf, size + step);
+        if (newbuf == NULL) {
+            free(buf);
+            return 0;
+        }
+        if (newbuf != buf)
+            (*moves)++;
+        buf = newbuf;
+        memset(buf + size, 0xab, step);
+        size += step;
+        count++;
+    }
+    if (buf[0] != (char)0xab || buf[size - 1] != (char)0xab) {
+        fprintf(stderr, "contents lost across realloc\n");
+        count = 0;
+    }
+    free(buf);
+    return count;
+}
+
+int
+main(int argc, char **argv)
+{
+    size_t max_mb = (argc > 1) ? (size_t) atoi(argv[1]) : 256;
+    uint64 start, large_time, small_time;
+    uint large_count, small_count, large_moves, small_moves;
+
+    if (max_mb == 0) {
+        fprintf(stderr, "usage: %s [max_MB]\n", argv[0]);
+        return 1;
+    }
+
+    start = get_usecs();
+    large_count = grow(LARGE_START_SIZE, max_mb * MB, LARGE_STEP, &large_moves);
+    large_time = get_usecs() - start;
+
+    start = get_usecs();
+    small_count = grow(SMALL_START_SIZE, SMALL_MAX_SIZE, SMALL_STEP, &small_moves);
+    small_time = get_usecs() - start;
+
+    if (large_count == 0 || small_count == 0) {
+        fprintf(stderr, "realloc failed\n");
+        return 1;
+    }
+    printf("large: %6u reallocs to %u MB, %6u moved, %10.3f us/realloc\n",
+           large_count, (uint) max_mb, large_moves,
+           (double)large_time / large_count);
+    printf("small: %6u reallocs to %u KB, %6u moved, %10.3f us/realloc\n",
+           small_count, SMALL_MAX_SIZE / 1024, small_moves,
+           (double)small_time / small_count);
+    return 0;
+}
@@ -130,6 +130,14 @@ if ("${cmd}" MATCHES "run_in_bg")
   # we must remove so we know when the background process has re-created it
   file(REMOVE "${out}")
 
+  # an arg after infloop is a file for it to wait for before changing what
+  # it leaks: we create it between the two nudges
+  string(REGEX MATCH "infloop[^;]*;[^;]+$" go_file "${cmd}")
+  string(REGEX REPLACE "^infloop[^;]*;" "" go_file "${go_file}")
+  if (NOT "${go_file}" STREQUAL "")
+    file(REMOVE "${go_file}")
+  endif ()
+
   # run in the background.  run_in_bg prints the bg pid to stdout.
   execute_process(COMMAND ${cmd}
     RESULT_VARIABLE cmd_result
@@ -190,6 +198,34 @@ if ("${cmd}" MATCHES "run_in_bg")
   if (nudge_result)
     message(FATAL_ERROR "*** ${script} failed (${nudge_result}): ${nudge_err}***\n")
   endif (nudge_result)
+  if (NOT "${go_file}" STREQUAL "")
+    # the first nudge's leak scan must be done before the app changes its leaks
+    if (TOOL_DR_HEAPSTAT)
+      set(lookfor "Received nudge")
+    else ()
+      set(lookfor "Details: ")
+    endif ()
+    file(READ "${out}" output)
+    set(iters 0)
+    while (NOT "${output}" MATCHES "${lookfor}")
+      execute_process(COMMAND ${SLEEP_SHORT})
+      file(READ "${out}" output)
+      math(EXPR iters "${iters} + 1")
+      if ("${iters}" STREQUAL "${TIMEOUT_SHORT}")
+        message(FATAL_ERROR "Timed out waiting for first nudge output")
+      endif ()
+    endwhile()
+    file(WRITE "${go_file}" "")
+    set(iters 0)
+    while (NOT "${output}" MATCHES "leaked more\n")
+      execute_process(COMMAND ${SLEEP_SHORT})
+      file(READ "${out}" output)
+      math(EXPR iters "${iters} + 1")
+      if ("${iters}" STREQUAL "${TIMEOUT_SHORT}")
+        message(FATAL_ERROR "Timed out waiting for app to leak between nudges")
+      endif ()
+    endwhile()
+  endif ()
   # do a second nudge to test accumulation of leak counts
   execute_process(COMMAND ${nudge} -nudge ${pid}
     RESULT_VARIABLE nudge_result
@@ -220,7 +256,11 @@ if ("${cmd}" MATCHES "run_in_bg")
     endif ()
   endwhile()
 
-  string(REGEX MATCHALL "/[^/]+$" exename "${cmd}")
+  string(REGEX REPLACE ";[^;]+$" "" exe_cmd "${cmd}")
+  if ("${go_file}" STREQUAL "")
+    set(exe_cmd "${cmd}")
+  endif ()
+  string(REGEX MATCHALL "/[^/]+$" exename "${exe_cmd}")
   string(REGEX REPLACE "/" "" exename "${exename}")
   if (UNIX)
     # use perl since /usr/bin/kill not on all platforms